@@ -0,0 +1,591 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * iso7816d: owns /dev/dsmart_card and serves APDUs of several processes
+ * over a Unix socket (see iso7816_ipc.h and csi_iso7816_client_*()).
+ *
+ * - The card is activated once and kept warm, clients never reset it.
+ * - Pending requests are served by priority class, oldest first within a
+ *   class, so clients of one class take turns. A request passed over
+ *   ISO7816D_MAX_SKIP times goes first, lower classes cannot starve.
+ * - BEGIN/END make the card exclusive to one client across APDUs, a
+ *   transaction idle for ISO7816D_TXN_IDLE_MS is ended by the daemon.
+ * - With -t, exchange latencies are collected and served to iso7816stat.
+ * - A failed exchange is reported to its client, which knows whether the
+ *   APDU may be sent again, and a card that stopped answering is
+ *   reactivated for the next one. -r lets the library retry up to that
+ *   step first (see csi_iso7816_set_recovery()), only safe when every
+ *   client's APDUs are idempotent: a retransmission may run one twice.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "iso7816.h"
+#include "iso7816_ipc.h"
+
+#define ISO7816D_MAX_CLIENTS	32
+#define ISO7816D_MAX_SKIP	16
+#define ISO7816D_TXN_IDLE_MS	5000
+
+struct client {
+	int fd;
+	int prio;
+	int hello;
+
+	/* request waiting for the card, 0 for none */
+	uint32_t op;
+	uint8_t *apdu;
+	size_t apdu_len;
+	uint64_t ticket;
+	int skipped;
+
+	/* error of a transaction ended by the daemon, for the next request */
+	int txn_error;
+	/* disconnected while its APDU is at the card */
+	int closing;
+
+	/* snapshot served by ISO7816_IPC_STATS, NULL until asked for */
+	csi_iso7816_stats_t *stats;
+};
+
+static struct {
+	csi_iso7816_session_t session;
+	const char *device;
+	int listen_fd;
+
+	struct client *clients[ISO7816D_MAX_CLIENTS];
+	struct client *owner;		/* holds a transaction */
+	struct client *inflight;	/* APDU at the card */
+	long long owner_idle_since;
+
+	csi_iso7816_req_t req;
+	uint8_t resp[ISO7816_EXT_LE_MAX + 2];
+	/* incoming message, c->apdu may be at the card meanwhile */
+	uint8_t msg[ISO7816_IPC_MAX_PAYLOAD];
+	uint64_t next_ticket;
+} d;
+
+static volatile sig_atomic_t quit;
+
+static long long now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static int card_activate(void)
+{
+	int ret;
+
+	ret = csi_iso7816_cold_reset(&d.session);
+	if (!ret)
+		ret = csi_iso7816_negotiate(&d.session);
+	if (!ret)
+		ret = csi_iso7816_async_start(&d.session);
+	if (ret)
+		fprintf(stderr, "iso7816d: card activation failed: %s\n", strerror(-ret));
+
+	return ret;
+}
+
+/* the card was reset, the applets selected by the transaction are gone */
+static void txn_drop(void)
+{
+	if (d.owner) {
+		d.owner->txn_error = -ECONNRESET;
+		d.owner = NULL;
+	}
+}
+
+/* the card stopped answering, reactivate it and drop the transaction */
+static void card_recover(void)
+{
+	csi_iso7816_async_stop(&d.session);
+	card_activate();
+	txn_drop();
+}
+
+static void client_reply(struct client *c, uint32_t op, int result,
+			 const void *payload, size_t len)
+{
+	struct iso7816_ipc_hdr hdr = {
+		.op = op,
+		.result = result,
+		.len = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)payload, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+
+	/* a failed reply shows up as a hangup on the next poll */
+	if (sendmsg(c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+		fprintf(stderr, "iso7816d: reply to client %d: %s\n", c->fd, strerror(errno));
+}
+
+static void client_free(struct client *c)
+{
+	free(c->stats);
+	free(c->apdu);
+	free(c);
+}
+
+static void client_drop(int slot)
+{
+	struct client *c = d.clients[slot];
+
+	d.clients[slot] = NULL;
+	if (d.owner == c)
+		d.owner = NULL;
+
+	close(c->fd);
+	c->fd = -1;
+
+	if (d.inflight == c)
+		c->closing = 1;
+	else
+		client_free(c);
+}
+
+static void client_accept(void)
+{
+	struct client *c;
+	int fd, i;
+
+	fd = accept4(d.listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0)
+		return;
+
+	for (i = 0; i < ISO7816D_MAX_CLIENTS; i++)
+		if (!d.clients[i])
+			break;
+
+	c = i < ISO7816D_MAX_CLIENTS ? calloc(1, sizeof(*c)) : NULL;
+	if (c)
+		c->apdu = malloc(ISO7816_IPC_MAX_PAYLOAD);
+	if (!c || !c->apdu) {
+		fprintf(stderr, "iso7816d: refusing client, %s\n", c ? "out of memory" : "too many clients");
+		if (c)
+			client_free(c);
+		close(fd);
+		return;
+	}
+
+	c->fd = fd;
+	d.clients[i] = c;
+}
+
+/* a before b: aged first, then higher class, then older */
+static int sched_before(const struct client *a, const struct client *b)
+{
+	int aged_a = a->skipped >= ISO7816D_MAX_SKIP, aged_b = b->skipped >= ISO7816D_MAX_SKIP;
+
+	if (aged_a != aged_b)
+		return aged_a;
+	if (!aged_a && a->prio != b->prio)
+		return a->prio < b->prio;
+
+	return a->ticket < b->ticket;
+}
+
+static struct client *sched_pick(void)
+{
+	struct client *c, *best = NULL;
+	int i;
+
+	if (d.owner)
+		return d.owner->op ? d.owner : NULL;
+
+	for (i = 0; i < ISO7816D_MAX_CLIENTS; i++) {
+		c = d.clients[i];
+		if (c && c->op && (!best || sched_before(c, best)))
+			best = c;
+	}
+
+	for (i = 0; i < ISO7816D_MAX_CLIENTS; i++) {
+		c = d.clients[i];
+		if (c && c->op && c != best)
+			c->skipped++;
+	}
+
+	return best;
+}
+
+static void schedule(void)
+{
+	struct client *c;
+	int ret;
+
+	while (!d.inflight && (c = sched_pick())) {
+		c->skipped = 0;
+
+		if (c->op == ISO7816_IPC_BEGIN) {
+			c->op = 0;
+			d.owner = c;
+			d.owner_idle_since = now_ms();
+			client_reply(c, ISO7816_IPC_BEGIN, 0, NULL, 0);
+			continue;
+		}
+
+		c->op = 0;
+		/* reactivate a card lost by an earlier recovery */
+		if (csi_iso7816_async_fd(&d.session) < 0)
+			card_activate();
+
+		d.req.apdu = c->apdu;
+		d.req.apdu_len = c->apdu_len;
+		d.req.resp = d.resp;
+		d.req.resp_size = sizeof(d.resp);
+
+		ret = csi_iso7816_submit(&d.session, &d.req);
+		if (ret) {
+			client_reply(c, ISO7816_IPC_TRANSMIT, ret, NULL, 0);
+			continue;
+		}
+		d.inflight = c;
+	}
+}
+
+static void client_stats(struct client *c, size_t len)
+{
+	uint32_t index;
+	int ret;
+
+	if (len != sizeof(index)) {
+		client_reply(c, ISO7816_IPC_STATS, -EINVAL, NULL, 0);
+		return;
+	}
+	memcpy(&index, d.msg, sizeof(index));
+
+	/* each client reads its own snapshot, others may take theirs meanwhile */
+	if (index == 0 || !c->stats) {
+		if (!c->stats)
+			c->stats = malloc(sizeof(*c->stats));
+		ret = c->stats ? csi_iso7816_trace_get(&d.session, c->stats) : -ENOMEM;
+		if (ret) {
+			free(c->stats);
+			c->stats = NULL;
+			client_reply(c, ISO7816_IPC_STATS, ret, NULL, 0);
+			return;
+		}
+	}
+
+	if (index < 256)
+		client_reply(c, ISO7816_IPC_STATS, 0, &c->stats->ins[index],
+			     sizeof(c->stats->ins[index]));
+	else if (index == ISO7816_IPC_STATS_ERRVAL)
+		client_reply(c, ISO7816_IPC_STATS, 0, c->stats->errval, sizeof(c->stats->errval));
+	else if (index == ISO7816_IPC_STATS_RECOVER)
+		client_reply(c, ISO7816_IPC_STATS, 0, c->stats->recover, sizeof(c->stats->recover));
+	else
+		client_reply(c, ISO7816_IPC_STATS, -EINVAL, NULL, 0);
+}
+
+static void client_readable(int slot)
+{
+	struct client *c = d.clients[slot];
+	struct iso7816_ipc_hdr hdr;
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = d.msg, .iov_len = sizeof(d.msg) },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+	ssize_t n;
+	uint32_t prio;
+
+	n = recvmsg(c->fd, &msg, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		client_drop(slot);
+		return;
+	}
+
+	/* not even a header, there is no op to reply to */
+	if ((size_t)n < sizeof(hdr)) {
+		client_drop(slot);
+		return;
+	}
+
+	if ((msg.msg_flags & MSG_TRUNC) || hdr.len != n - sizeof(hdr)) {
+		client_reply(c, hdr.op, -EMSGSIZE, NULL, 0);
+		return;
+	}
+
+	if (!c->hello) {
+		if (hdr.op != ISO7816_IPC_HELLO || hdr.len != sizeof(prio)) {
+			client_reply(c, hdr.op, -EPROTO, NULL, 0);
+			client_drop(slot);
+			return;
+		}
+		memcpy(&prio, d.msg, sizeof(prio));
+		if (prio >= ISO7816_PRIO_CLASSES) {
+			client_reply(c, hdr.op, -EINVAL, NULL, 0);
+			client_drop(slot);
+			return;
+		}
+		c->prio = prio;
+		c->hello = 1;
+		client_reply(c, hdr.op, 0, NULL, 0);
+		return;
+	}
+
+	if (hdr.op == ISO7816_IPC_STATS) {
+		client_stats(c, hdr.len);
+		return;
+	}
+
+	/* one request at a time, the client waits for each reply */
+	if (c->op || d.inflight == c) {
+		client_reply(c, hdr.op, -EBUSY, NULL, 0);
+		return;
+	}
+
+	if (c->txn_error) {
+		client_reply(c, hdr.op, c->txn_error, NULL, 0);
+		c->txn_error = 0;
+		return;
+	}
+
+	switch (hdr.op) {
+	case ISO7816_IPC_TRANSMIT:
+		memcpy(c->apdu, d.msg, hdr.len);
+		c->apdu_len = hdr.len;
+		break;
+	case ISO7816_IPC_BEGIN:
+		if (d.owner == c) {
+			client_reply(c, hdr.op, -EALREADY, NULL, 0);
+			return;
+		}
+		break;
+	case ISO7816_IPC_END:
+		if (d.owner != c) {
+			client_reply(c, hdr.op, -EINVAL, NULL, 0);
+			return;
+		}
+		d.owner = NULL;
+		client_reply(c, hdr.op, 0, NULL, 0);
+		schedule();
+		return;
+	default:
+		client_reply(c, hdr.op, -EPROTO, NULL, 0);
+		return;
+	}
+
+	c->op = hdr.op;
+	c->ticket = d.next_ticket++;
+	c->skipped = 0;
+	schedule();
+}
+
+static void card_completed(void)
+{
+	csi_iso7816_req_t *req;
+	struct client *c;
+	int owner;
+
+	req = csi_iso7816_reap(&d.session);
+	if (!req)
+		return;
+
+	c = d.inflight;
+	d.inflight = NULL;
+	owner = d.owner == c;
+
+	if (c->closing)
+		client_free(c);
+	else
+		client_reply(c, ISO7816_IPC_TRANSMIT, req->result, d.resp,
+			     req->result ? 0 : req->resp_len);
+
+	if (req->result == -ECONNRESET)
+		txn_drop();
+	else if (req->result == -ENODEV || req->result == -ETIMEDOUT || req->result == -EIO)
+		card_recover();
+	else if (owner)
+		d.owner_idle_since = now_ms();
+
+	schedule();
+}
+
+/* poll timeout until the transaction in progress goes idle too long */
+static int txn_timeout(void)
+{
+	long long left;
+
+	if (!d.owner || d.owner->op || d.inflight == d.owner)
+		return -1;
+
+	left = d.owner_idle_since + ISO7816D_TXN_IDLE_MS - now_ms();
+	if (left > 0)
+		return left;
+
+	fprintf(stderr, "iso7816d: ending idle transaction of client %d\n", d.owner->fd);
+	d.owner->txn_error = -ETIMEDOUT;
+	d.owner = NULL;
+	schedule();
+
+	return -1;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "iso7816d: socket path too long\n");
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) {
+		perror("iso7816d: socket");
+		return -1;
+	}
+
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    chmod(path, 0660) || listen(fd, ISO7816D_MAX_CLIENTS)) {
+		perror("iso7816d: listen");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	quit = 1;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d device] [-s socket] [-r recovery step] [-t]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	struct pollfd pfd[2 + ISO7816D_MAX_CLIENTS];
+	int slot_of[2 + ISO7816D_MAX_CLIENTS];
+	const char *path = ISO7816D_DEFAULT_SOCKET;
+	struct sigaction sa;
+	int opt, n, i, timeout, trace = 0, recovery = ISO7816_RECOVER_NONE;
+
+	while ((opt = getopt(argc, argv, "d:s:r:th")) != -1) {
+		switch (opt) {
+		case 'd':
+			d.device = optarg;
+			break;
+		case 's':
+			path = optarg;
+			break;
+		case 'r':
+			recovery = atoi(optarg);
+			break;
+		case 't':
+			trace = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (csi_iso7816_open(&d.session, d.device))
+		return 1;
+	if (csi_iso7816_set_recovery(&d.session, recovery) ||
+	    (trace && csi_iso7816_trace_start(&d.session))) {
+		csi_iso7816_close(&d.session);
+		return 1;
+	}
+	if (card_activate()) {
+		csi_iso7816_close(&d.session);
+		return 1;
+	}
+
+	d.listen_fd = listen_socket(path);
+	if (d.listen_fd < 0) {
+		csi_iso7816_close(&d.session);
+		return 1;
+	}
+
+	while (!quit) {
+		timeout = txn_timeout();
+
+		pfd[0].fd = d.listen_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = csi_iso7816_async_fd(&d.session);
+		pfd[1].events = POLLIN;
+		n = 2;
+		for (i = 0; i < ISO7816D_MAX_CLIENTS; i++) {
+			if (!d.clients[i])
+				continue;
+			pfd[n].fd = d.clients[i]->fd;
+			pfd[n].events = POLLIN;
+			slot_of[n++] = i;
+		}
+
+		if (poll(pfd, n, timeout) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("iso7816d: poll");
+			break;
+		}
+
+		if (pfd[1].revents & POLLIN)
+			card_completed();
+
+		for (i = 2; i < n; i++)
+			if (pfd[i].revents && d.clients[slot_of[i]])
+				client_readable(slot_of[i]);
+
+		if (pfd[0].revents & POLLIN)
+			client_accept();
+	}
+
+	for (i = 0; i < ISO7816D_MAX_CLIENTS; i++)
+		if (d.clients[i])
+			client_drop(i);
+
+	close(d.listen_fd);
+	unlink(path);
+	csi_iso7816_close(&d.session);
+
+	/* dropped above with its APDU at the card, never reaped */
+	if (d.inflight)
+		client_free(d.inflight);
+
+	return 0;
+}
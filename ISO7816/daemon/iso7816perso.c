@@ -0,0 +1,210 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * iso7816perso: compile APDU scripts and run them against a card.
+ *
+ *   iso7816perso -c script.txt -o script.bin    compile
+ *   iso7816perso [-d device] script.bin          run
+ *
+ * A text script given to run is compiled on the fly. Running stops at the
+ * first unexpected status word and prints the throughput.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iso7816.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s -c script -o compiled\n"
+			"       %s [-d device] [-w window] [-r recovery step] script\n",
+		name, name);
+}
+
+static int read_file(const char *path, uint8_t **data, size_t *len)
+{
+	size_t size = 4096, n;
+	uint8_t *buf = NULL, *tmp;
+	int ret = 0;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -errno;
+
+	*len = 0;
+	do {
+		/* room for the NUL of a text script */
+		if (!buf || size - *len == 1) {
+			size = buf ? size * 2 : size;
+			tmp = realloc(buf, size);
+			if (!tmp) {
+				ret = -ENOMEM;
+				break;
+			}
+			buf = tmp;
+		}
+		n = fread(buf + *len, 1, size - *len - 1, f);
+		*len += n;
+	} while (n);
+
+	if (!ret && ferror(f))
+		ret = -EIO;
+	fclose(f);
+	if (ret) {
+		free(buf);
+		return ret;
+	}
+
+	buf[*len] = '\0';
+	*data = buf;
+
+	return 0;
+}
+
+static int is_compiled(const uint8_t *data, size_t len)
+{
+	return len >= ISO7816_SCRIPT_HDR_LEN &&
+	       (uint32_t)(data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]) ==
+	       ISO7816_SCRIPT_MAGIC;
+}
+
+static int compile(const char *path, uint8_t **bin, size_t *bin_len)
+{
+	uint8_t *text;
+	size_t len;
+	int ret, line = 0;
+
+	ret = read_file(path, &text, &len);
+	if (ret) {
+		fprintf(stderr, "iso7816perso: %s: %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (is_compiled(text, len)) {
+		*bin = text;
+		*bin_len = len;
+		return 0;
+	}
+
+	ret = csi_iso7816_script_compile((char *)text, bin, bin_len, &line);
+	free(text);
+	if (ret == -EINVAL)
+		fprintf(stderr, "iso7816perso: %s:%d: bad command\n", path, line);
+	else if (ret)
+		fprintf(stderr, "iso7816perso: %s: %s\n", path, strerror(-ret));
+
+	return ret;
+}
+
+static int write_file(const char *path, const uint8_t *data, size_t len)
+{
+	FILE *f;
+	int ret = 0;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		perror(path);
+		return 1;
+	}
+	if (fwrite(data, 1, len, f) != len) {
+		perror(path);
+		ret = 1;
+	}
+	if (fclose(f) && !ret) {
+		perror(path);
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static int run(const char *device, const uint8_t *bin, size_t bin_len,
+	       int window, int recovery)
+{
+	csi_iso7816_script_result_t result;
+	csi_iso7816_session_t session;
+	int ret;
+
+	if (csi_iso7816_open(&session, device))
+		return 1;
+
+	ret = csi_iso7816_set_recovery(&session, recovery);
+	if (!ret)
+		ret = csi_iso7816_cold_reset(&session);
+	if (!ret)
+		ret = csi_iso7816_negotiate(&session);
+	if (ret) {
+		fprintf(stderr, "iso7816perso: card activation failed: %s\n", strerror(-ret));
+		csi_iso7816_close(&session);
+		return 1;
+	}
+
+	ret = csi_iso7816_script_run(&session, bin, bin_len, window, &result);
+	csi_iso7816_close(&session);
+
+	printf("%u/%u APDUs in %.3f ms, %.1f APDU/s\n", result.completed,
+	       result.commands, result.elapsed_ns / 1e6, result.apdus_per_sec);
+
+	if (ret == -EREMOTEIO)
+		fprintf(stderr, "iso7816perso: command %d: SW %04X, expected %04X/%04X\n",
+			result.failed + 1, result.sw, result.sw_expect, result.sw_mask);
+	else if (ret && result.failed >= 0)
+		fprintf(stderr, "iso7816perso: command %d: %s\n",
+			result.failed + 1, strerror(-ret));
+	else if (ret)
+		fprintf(stderr, "iso7816perso: %s\n", strerror(-ret));
+
+	return ret ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *device = NULL, *source = NULL, *output = NULL;
+	int opt, ret, window = 0, recovery = ISO7816_RECOVER_NONE;
+	uint8_t *bin;
+	size_t bin_len;
+
+	while ((opt = getopt(argc, argv, "c:o:d:w:r:h")) != -1) {
+		switch (opt) {
+		case 'c':
+			source = optarg;
+			break;
+		case 'o':
+			output = optarg;
+			break;
+		case 'd':
+			device = optarg;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			break;
+		case 'r':
+			recovery = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (source ? !output || optind != argc : optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (compile(source ? source : argv[optind], &bin, &bin_len))
+		return 1;
+
+	if (source)
+		ret = write_file(output, bin, bin_len);
+	else
+		ret = run(device, bin, bin_len, window, recovery);
+
+	free(bin);
+
+	return ret;
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * iso7816stat: print the exchange latencies collected by iso7816d -t.
+ */
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iso7816.h"
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-s socket]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = ISO7816D_DEFAULT_SOCKET;
+	csi_iso7816_client_t client;
+	csi_iso7816_stats_t *stats;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "s:h")) != -1) {
+		switch (opt) {
+		case 's':
+			path = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	stats = malloc(sizeof(*stats));
+	if (!stats)
+		return 1;
+
+	ret = csi_iso7816_client_connect(&client, path, ISO7816_PRIO_LOW);
+	if (!ret)
+		ret = csi_iso7816_client_stats(&client, stats);
+	csi_iso7816_client_close(&client);
+	if (ret) {
+		fprintf(stderr, "iso7816stat: %s%s\n", strerror(-ret),
+			ret == -ENODATA ? ", iso7816d runs without -t" : "");
+		free(stats);
+		return 1;
+	}
+
+	csi_iso7816_trace_print(stdout, stats);
+	free(stats);
+
+	return 0;
+}
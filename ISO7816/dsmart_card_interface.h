@@ -44,6 +44,18 @@ struct dsmart_card_xmt {
 	int errval;
 };
 
+/*
+ * XMT_PTR/RCV_PTR: transfer from/to a user buffer without the 256 byte
+ * limit. length is the number of bytes to send or to receive, RCV_PTR
+ * updates it with the number of bytes received.
+ */
+struct dsmart_card_xfer {
+	unsigned long long buffer;	/* user pointer */
+	unsigned int length;
+	int time_out;
+	int errval;
+};
+
 struct dsmart_card_timing {
 	unsigned int wwt;
 	unsigned int cwt;
@@ -75,5 +87,7 @@ enum dsmart_protocol_type {
 #define DSMART_CARD_IOCTL_XMT			_IOR(DSMART_CARD_BASE, 9, int)
 #define DSMART_CARD_IOCTL_RCV			_IOR(DSMART_CARD_BASE, 10, int)
 #define DSMART_CARD_IOCTL_ATR_RCV		_IOR(DSMART_CARD_BASE, 11, int)
+#define DSMART_CARD_IOCTL_XMT_PTR		_IOR(DSMART_CARD_BASE, 12, int)
+#define DSMART_CARD_IOCTL_RCV_PTR		_IOR(DSMART_CARD_BASE, 13, int)
 
 #endif
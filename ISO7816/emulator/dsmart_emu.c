@@ -0,0 +1,523 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Stand-in for /dev/dsmart_card, preloaded in front of any program using
+ * the reader:
+ *
+ *   LD_PRELOAD=./output/libdsmart_emu.so ./output/iso7816
+ *
+ * open() of the device returns a descriptor the ioctls of which are served
+ * by a virtual card (dsmart_emu_card.c). Configuration comes from the
+ * environment:
+ *
+ *   DSMART_EMU_DEVICE     path to intercept, ISO7816_DEFAULT_DEVICE
+ *   DSMART_EMU_ATR        ATR in hex, or t0 / t1 for a built-in one (t1)
+ *   DSMART_EMU_CLOCK_HZ   card clock, characters then take their line time
+ *                         at the programmed rate (0: no line time)
+ *   DSMART_EMU_BYTE_US    extra time per character
+ *   DSMART_EMU_BLOCK_US   card processing time per response
+ *   DSMART_EMU_TIMEOUT_US receive timeout without clock or WWT (100000)
+ *   DSMART_EMU_CORRUPT    probability a T=1 block arrives with a bad EDC
+ *   DSMART_EMU_DROP       probability a response (T=0) or block (T=1) is lost
+ *   DSMART_EMU_T0_NULLS   T=0 NULL bytes before each procedure byte (0)
+ *   DSMART_EMU_T0_BYTEWISE 1 to acknowledge T=0 data byte by byte with ~INS
+ *   DSMART_EMU_SEED       random seed
+ *   DSMART_EMU_CHANNELS   logical channels, basic one included (4)
+ *   DSMART_EMU_FILE_SIZE  size of the transparent EF (32768)
+ *   DSMART_EMU_NO_PTR     1 to refuse XMT_PTR/RCV_PTR like older drivers
+ *   DSMART_EMU_TRACE      1 to log the traffic on stderr
+ *
+ * A test program run under the preload finds the configuration with
+ * dlsym(RTLD_DEFAULT, "emu_config") and may change it between exchanges.
+ * Faults then come on demand rather than by chance: corrupt_next, garble_next
+ * and drop_next count the blocks or responses still to be spoiled, mute
+ * silences the card, ATR included, until a reset, and applet answers APDUs
+ * of its own.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "dsmart_emu.h"
+
+#define EMU_OUT_MAX		(2 * EMU_RESP_MAX)
+#define EMU_TIMEOUT_US		100000
+#define EMU_FILE_SIZE		32768
+
+/* T=1, 3.57 MHz cards run at F 372 D 4, IFSC 254 */
+static const uint8_t emu_atr_t1[] = {
+	0x3b, 0xfa, 0x13, 0x00, 0x00, 0x81, 0x31, 0xfe, 0x45, 0x4a,
+	0x43, 0x4f, 0x50, 0x34, 0x31, 0x56, 0x32, 0x32, 0x31, 0x96,
+};
+
+/* T=0 only, F 372 D 4 */
+static const uint8_t emu_atr_t0[] = {
+	0x3b, 0x12, 0x13, 0x45, 0x4d,
+};
+
+static const unsigned int emu_f_table[16] = {
+	372, 372, 558, 744, 1116, 1488, 1860, 0,
+	0, 512, 768, 1024, 1536, 2048, 0, 0,
+};
+
+static const unsigned int emu_d_table[16] = {
+	0, 1, 2, 4, 8, 16, 32, 64, 12, 20, 0, 0, 0, 0, 0, 0,
+};
+
+struct emu_config emu_config;
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	int active;
+
+	/* as programmed by the host */
+	struct dsmart_card_baud baud;
+	struct dsmart_card_timing timing;
+	unsigned int protocol;
+
+	/* card to reader */
+	uint8_t out[EMU_OUT_MAX];
+	size_t out_len, out_pos;
+	unsigned long long out_ready;	/* ns, when out[out_pos] is on the line */
+} emu = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.fd = -1,
+};
+
+static unsigned long long emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void emu_sleep_until(unsigned long long ns)
+{
+	struct timespec ts = {
+		.tv_sec = ns / 1000000000ULL,
+		.tv_nsec = ns % 1000000000ULL,
+	};
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+/* one etu at the rate programmed in the reader, 0 without a clock */
+static unsigned long long emu_etu_ns(void)
+{
+	unsigned int f = emu_f_table[emu.baud.fi & 0x0f];
+	unsigned int d = emu_d_table[emu.baud.di & 0x0f];
+
+	if (!emu_config.clock_hz || !f || !d)
+		return 0;
+
+	return 1000000000ULL * f / d / emu_config.clock_hz;
+}
+
+static unsigned long long emu_char_ns(void)
+{
+	unsigned int etu = emu_card_protocol() == DSMART_CARD_PROTOCOL_T1 ? 11 : 12;
+
+	return (etu + emu.timing.egt) * emu_etu_ns() + emu_config.byte_us * 1000ULL;
+}
+
+static unsigned long long emu_wait_ns(void)
+{
+	unsigned long long etu = emu_etu_ns();
+
+	if (etu && emu.timing.wwt)
+		return etu * emu.timing.wwt;
+
+	return emu_config.timeout_us * 1000ULL;
+}
+
+/* reader and card must agree on the rate to understand each other */
+static int emu_rate_ok(void)
+{
+	int fi, di;
+
+	emu_card_rate(&fi, &di);
+
+	return emu_f_table[fi] == emu_f_table[emu.baud.fi & 0x0f] &&
+	       emu_d_table[di] == emu_d_table[emu.baud.di & 0x0f];
+}
+
+void emu_trace(const char *what, const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	if (!emu_config.trace)
+		return;
+
+	fprintf(stderr, "emu %s:", what);
+	for (i = 0; i < len && i < 64; i++)
+		fprintf(stderr, " %02x", buf[i]);
+	fprintf(stderr, "%s\n", i < len ? " ..." : "");
+}
+
+int emu_chance(double probability)
+{
+	return probability > 0 && rand() < probability * ((double)RAND_MAX + 1);
+}
+
+int emu_fault(int *count, double probability)
+{
+	if (*count > 0) {
+		(*count)--;
+		return 1;
+	}
+
+	return emu_chance(probability);
+}
+
+void emu_send(const uint8_t *buf, size_t len, int processed)
+{
+	unsigned long long now = emu_now();
+
+	if (emu_config.mute) {
+		emu_trace("mute", buf, len);
+		return;
+	}
+
+	if (emu.out_pos == emu.out_len) {
+		emu.out_pos = 0;
+		emu.out_len = 0;
+		emu.out_ready = now;
+	}
+	if (emu.out_len + len > sizeof(emu.out)) {
+		fprintf(stderr, "emu: card output overflow, dropped\n");
+		return;
+	}
+
+	if (processed && emu.out_ready < now + emu_config.block_us * 1000ULL)
+		emu.out_ready = now + emu_config.block_us * 1000ULL;
+
+	memcpy(emu.out + emu.out_len, buf, len);
+	emu.out_len += len;
+}
+
+static int emu_xmt(const uint8_t *buf, size_t len)
+{
+	if (!emu.active)
+		return DSMART_CARD_E_NOACT;
+
+	emu_trace(">", buf, len);
+	emu_card_turn();
+	emu_sleep_until(emu_now() + len * emu_char_ns());
+
+	if (!emu_rate_ok()) {
+		emu_trace("garbled, wrong rate", buf, len);
+		return DSMART_CARD_OK;
+	}
+
+	emu_card_input(buf, len);
+
+	return DSMART_CARD_OK;
+}
+
+static int emu_rcv(uint8_t *buf, size_t *len)
+{
+	unsigned long long now = emu_now(), deadline = now + emu_wait_ns();
+	size_t n;
+
+	if (!emu.active) {
+		*len = 0;
+		return DSMART_CARD_E_NOACT;
+	}
+
+	if (emu.out_pos == emu.out_len || emu.out_ready > deadline || !emu_rate_ok()) {
+		emu_sleep_until(deadline);
+		*len = 0;
+		return DSMART_CARD_E_DATA_TIMEOUT;
+	}
+
+	n = emu.out_len - emu.out_pos;
+	if (n > *len)
+		n = *len;
+
+	emu_sleep_until((emu.out_ready > now ? emu.out_ready : now) + n * emu_char_ns());
+
+	memcpy(buf, emu.out + emu.out_pos, n);
+	emu.out_pos += n;
+	*len = n;
+	emu_trace("<", buf, n);
+
+	return DSMART_CARD_OK;
+}
+
+static void emu_reset(void)
+{
+	emu.active = 1;
+	emu.out_pos = 0;
+	emu.out_len = 0;
+	emu.baud.fi = 1;
+	emu.baud.di = 1;
+	emu_card_reset();
+}
+
+static void emu_atr(struct dsmart_card_atr *atr)
+{
+	memcpy(atr->atr_buffer, emu_config.atr, emu_config.atr_len);
+	atr->len = emu_config.atr_len;
+	if (!emu.active)
+		atr->errval = DSMART_CARD_E_NOACT;
+	else if (emu_config.mute)	/* still mute after the reset, no ATR either */
+		atr->errval = DSMART_CARD_E_ACT_TIMEOUT;
+	else
+		atr->errval = DSMART_CARD_OK;
+}
+
+static int emu_ioctl(unsigned long cmd, void *arg)
+{
+	struct dsmart_card_xmt *xmt = arg;
+	struct dsmart_card_rcv *rcv = arg;
+	struct dsmart_card_xfer *xfer = arg;
+	size_t len;
+
+	switch (cmd) {
+	case DSMART_CARD_IOCTL_COLD_RESET:
+	case DSMART_CARD_IOCTL_WARM_RESET:
+		if (emu_config.mute == EMU_MUTE_RESET ||
+		    (emu_config.mute == EMU_MUTE_COLD && cmd == DSMART_CARD_IOCTL_COLD_RESET))
+			emu_config.mute = EMU_MUTE_NONE;
+		emu_reset();
+		if (arg && cmd == DSMART_CARD_IOCTL_COLD_RESET)
+			emu_atr(arg);
+		return 0;
+	case DSMART_CARD_IOCTL_DEACTIVATE:
+		emu.active = 0;
+		return 0;
+	case DSMART_CARD_IOCTL_ATR_RCV:
+		emu_atr(arg);
+		return 0;
+	case DSMART_CARD_IOCTL_SET_PROTOCOL:
+		emu.protocol = *(unsigned int *)arg;
+		return 0;
+	case DSMART_CARD_IOCTL_SET_BAUD:
+		emu.baud = *(struct dsmart_card_baud *)arg;
+		return 0;
+	case DSMART_CARD_IOCTL_SET_TIMING:
+		emu.timing = *(struct dsmart_card_timing *)arg;
+		return 0;
+	case DSMART_CARD_IOCTL_SET_RX_THRESHOLD:
+	case DSMART_CARD_IOCTL_SET_TX_THRESHOLD:
+		return 0;
+	case DSMART_CARD_IOCTL_XMT:
+		if (xmt->xmt_length < 0 || xmt->xmt_length > (int)sizeof(xmt->xmt_buffer)) {
+			errno = EINVAL;
+			return -1;
+		}
+		xmt->errval = emu_xmt(xmt->xmt_buffer, xmt->xmt_length);
+		return 0;
+	case DSMART_CARD_IOCTL_RCV:
+		if (rcv->rcv_length < 0 || rcv->rcv_length > (int)sizeof(rcv->rcv_buffer)) {
+			errno = EINVAL;
+			return -1;
+		}
+		len = rcv->rcv_length;
+		rcv->errval = emu_rcv(rcv->rcv_buffer, &len);
+		rcv->rcv_length = len;
+		return 0;
+	case DSMART_CARD_IOCTL_XMT_PTR:
+		if (emu_config.no_ptr)
+			break;
+		xfer->errval = xfer->length ?
+			       emu_xmt((const uint8_t *)(uintptr_t)xfer->buffer, xfer->length) :
+			       DSMART_CARD_OK;
+		return 0;
+	case DSMART_CARD_IOCTL_RCV_PTR:
+		if (emu_config.no_ptr)
+			break;
+		len = xfer->length;
+		xfer->errval = emu_rcv((uint8_t *)(uintptr_t)xfer->buffer, &len);
+		xfer->length = len;
+		return 0;
+	}
+
+	errno = ENOTTY;
+	return -1;
+}
+
+static int emu_parse_hex(const char *hex, uint8_t *buf, size_t size)
+{
+	size_t len = 0;
+	unsigned int byte;
+
+	while (*hex) {
+		if (*hex == ' ' || *hex == ':') {
+			hex++;
+			continue;
+		}
+		if (len == size || sscanf(hex, "%2x", &byte) != 1)
+			return -1;
+		buf[len++] = byte;
+		hex += hex[1] ? 2 : 1;
+	}
+
+	return len;
+}
+
+static unsigned long emu_env(const char *name, unsigned long def)
+{
+	const char *value = getenv(name);
+
+	return value ? strtoul(value, NULL, 0) : def;
+}
+
+__attribute__((constructor))
+static void emu_init(void)
+{
+	const char *atr = getenv("DSMART_EMU_ATR");
+	const char *value;
+	int len;
+
+	emu_config.device = getenv("DSMART_EMU_DEVICE");
+	if (!emu_config.device)
+		emu_config.device = ISO7816_DEFAULT_DEVICE;
+
+	if (atr && !strcmp(atr, "t0")) {
+		memcpy(emu_config.atr, emu_atr_t0, sizeof(emu_atr_t0));
+		emu_config.atr_len = sizeof(emu_atr_t0);
+	} else if (atr && strcmp(atr, "t1")) {
+		len = emu_parse_hex(atr, emu_config.atr, sizeof(emu_config.atr));
+		if (len < 2) {
+			fprintf(stderr, "emu: bad DSMART_EMU_ATR, using the T=1 one\n");
+		} else {
+			emu_config.atr_len = len;
+		}
+	}
+	if (!emu_config.atr_len) {
+		memcpy(emu_config.atr, emu_atr_t1, sizeof(emu_atr_t1));
+		emu_config.atr_len = sizeof(emu_atr_t1);
+	}
+
+	emu_config.clock_hz = emu_env("DSMART_EMU_CLOCK_HZ", 0);
+	emu_config.byte_us = emu_env("DSMART_EMU_BYTE_US", 0);
+	emu_config.block_us = emu_env("DSMART_EMU_BLOCK_US", 0);
+	emu_config.timeout_us = emu_env("DSMART_EMU_TIMEOUT_US", EMU_TIMEOUT_US);
+	value = getenv("DSMART_EMU_CORRUPT");
+	emu_config.corrupt = value ? strtod(value, NULL) : 0;
+	value = getenv("DSMART_EMU_DROP");
+	emu_config.drop = value ? strtod(value, NULL) : 0;
+	emu_config.t0_nulls = emu_env("DSMART_EMU_T0_NULLS", 0);
+	emu_config.t0_bytewise = emu_env("DSMART_EMU_T0_BYTEWISE", 0);
+	emu_config.channels = emu_env("DSMART_EMU_CHANNELS", ISO7816_DEFAULT_CHANNELS);
+	if (emu_config.channels < 1 || emu_config.channels > ISO7816_MAX_CHANNELS)
+		emu_config.channels = ISO7816_DEFAULT_CHANNELS;
+	emu_config.file_size = emu_env("DSMART_EMU_FILE_SIZE", EMU_FILE_SIZE);
+	if (emu_config.file_size > 0x8000)
+		emu_config.file_size = 0x8000;	/* offsets are 15 bits */
+	emu_config.no_ptr = emu_env("DSMART_EMU_NO_PTR", 0);
+	emu_config.trace = emu_env("DSMART_EMU_TRACE", 0);
+	srand(emu_env("DSMART_EMU_SEED", 1));
+}
+
+/*
+ * Interposed libc entry points
+ */
+
+static int emu_open(const char *path, int flags, mode_t mode, const char *sym)
+{
+	int (*real_open)(const char *, int, ...) = dlsym(RTLD_NEXT, sym);
+	int fd;
+
+	if (strcmp(path, emu_config.device))
+		return real_open(path, flags, mode);
+
+	pthread_mutex_lock(&emu.lock);
+	if (emu.fd >= 0) {
+		pthread_mutex_unlock(&emu.lock);
+		errno = EBUSY;
+		return -1;
+	}
+
+	/* any descriptor will do, the ioctls never reach it */
+	fd = real_open("/dev/null", O_RDWR | (flags & O_CLOEXEC));
+	if (fd >= 0) {
+		emu.fd = fd;
+		emu.active = 0;
+	}
+	pthread_mutex_unlock(&emu.lock);
+
+	return fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return emu_open(path, flags, mode, "open");
+}
+
+int open64(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+
+	return emu_open(path, flags, mode, "open64");
+}
+
+int close(int fd)
+{
+	static int (*real_close)(int);
+
+	if (!real_close)
+		real_close = dlsym(RTLD_NEXT, "close");
+
+	pthread_mutex_lock(&emu.lock);
+	if (fd >= 0 && fd == emu.fd) {
+		emu.fd = -1;
+		emu.active = 0;
+	}
+	pthread_mutex_unlock(&emu.lock);
+
+	return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long cmd, ...)
+{
+	static int (*real_ioctl)(int, unsigned long, ...);
+	void *arg;
+	va_list ap;
+	int ret;
+
+	va_start(ap, cmd);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	if (fd < 0 || fd != emu.fd) {
+		if (!real_ioctl)
+			real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+		return real_ioctl(fd, cmd, arg);
+	}
+
+	pthread_mutex_lock(&emu.lock);
+	ret = emu_ioctl(cmd, arg);
+	pthread_mutex_unlock(&emu.lock);
+
+	return ret;
+}
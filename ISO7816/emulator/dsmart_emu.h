@@ -0,0 +1,78 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Virtual smart card behind the dsmart_card ioctls, shared between the
+ * driver side (dsmart_emu.c) and the card side (dsmart_emu_card.c).
+ */
+#ifndef _DSMART_EMU_H
+#define _DSMART_EMU_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "iso7816.h"
+
+#define EMU_ATR_MAX		33
+
+/* largest command or response the card handles, an extended APDU */
+#define EMU_APDU_MAX		(ISO7816_EXT_APDU_MAX)
+#define EMU_RESP_MAX		(ISO7816_EXT_LE_MAX + 2)
+
+/* T=0 NULL bytes the card sends at most before a procedure byte */
+#define EMU_T0_NULL_MAX		16
+
+/* emu_config.mute, the card stays silent until */
+#define EMU_MUTE_NONE		0
+#define EMU_MUTE_RESET		1	/* the next reset */
+#define EMU_MUTE_COLD		2	/* the next cold reset */
+
+/*
+ * An applet of the test program, tried before the built-in ones: fills
+ * resp (at most EMU_RESP_MAX bytes, ending with SW1 SW2) and returns 0,
+ * or returns -1 to leave the APDU to the card.
+ */
+typedef int (*emu_applet_t)(const uint8_t *apdu, size_t len, uint8_t *resp, size_t *resp_len);
+
+struct emu_config {
+	const char *device;		/* path intercepted by open() */
+	uint8_t atr[EMU_ATR_MAX];
+	size_t atr_len;
+	unsigned int clock_hz;		/* line time from the rate, 0 for none */
+	unsigned int byte_us;		/* extra time per character */
+	unsigned int block_us;		/* card processing time per response */
+	unsigned int timeout_us;	/* receive timeout when WWT is not known */
+	double corrupt;			/* probability a T=1 block is sent corrupted */
+	double drop;			/* probability a response is lost */
+	int t0_nulls;			/* T=0 NULL bytes before each procedure byte */
+	int t0_bytewise;		/* T=0 data acknowledged byte by byte with ~INS */
+	int channels;			/* logical channels, basic one included */
+	size_t file_size;		/* transparent EF of READ/UPDATE BINARY */
+	int no_ptr;			/* refuse XMT_PTR/RCV_PTR */
+	int trace;
+
+	/* set at run time by a test, see dsmart_emu.c */
+	int corrupt_next;		/* T=1 blocks sent corrupted before corrupt applies */
+	int garble_next;		/* reader T=1 blocks taken as having a bad EDC */
+	int drop_next;			/* responses lost before drop applies */
+	int mute;			/* EMU_MUTE_* */
+	emu_applet_t applet;
+};
+
+extern struct emu_config emu_config;
+
+/* card side */
+void emu_card_reset(void);
+void emu_card_input(const uint8_t *buf, size_t len);
+int emu_card_rate(int *fi, int *di);
+/* the reader starts sending, the card has nothing more to say at the old rate */
+void emu_card_turn(void);
+int emu_card_protocol(void);
+
+/* driver side, used by the card */
+void emu_send(const uint8_t *buf, size_t len, int processed);
+int emu_chance(double probability);
+/* a fault of count, while there are any left, or one of probability */
+int emu_fault(int *count, double probability);
+void emu_trace(const char *what, const uint8_t *buf, size_t len);
+
+#endif
@@ -0,0 +1,906 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * The card: answers PPS, speaks T=0 or T=1 as its ATR says, and runs a
+ * small applet set on up to emu_config.channels logical channels:
+ *
+ *   MANAGE CHANNEL     open and close channels
+ *   SELECT             any AID not starting with FF, FCI unless P2 = 0C
+ *   READ BINARY        transparent EF of emu_config.file_size bytes
+ *   UPDATE BINARY      same EF
+ *   READ RECORD        16 records of 32 bytes
+ *   GET CHALLENGE      random bytes
+ *   anything else      echoes the command data
+ *
+ * emu_config.applet, when set, gets the first say on every APDU.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dsmart_emu.h"
+
+#define INS_MANAGE_CHANNEL	0x70
+#define INS_SELECT		0xa4
+#define INS_READ_BINARY		0xb0
+#define INS_READ_RECORD		0xb2
+#define INS_UPDATE_BINARY	0xd6
+#define INS_GET_CHALLENGE	0x84
+#define INS_GET_DATA		0xca
+
+#define SW_OK			0x9000
+#define SW_END_OF_FILE		0x6282
+#define SW_WRONG_LENGTH		0x6700
+#define SW_CHANNEL		0x6881
+#define SW_NOT_FOUND		0x6a82
+#define SW_RECORD_NOT_FOUND	0x6a83
+#define SW_WRONG_P1P2		0x6b00
+#define SW_NO_RESPONSE		0x6985
+
+#define RECORD_SIZE		32
+#define RECORD_COUNT		16
+
+/* T=1 block fields */
+#define T1_PCB_R		0x80
+#define T1_PCB_S		0xc0
+#define T1_PCB_I_NS		0x40
+#define T1_PCB_I_MORE		0x20
+#define T1_PCB_R_NR		0x10
+#define T1_PCB_S_RESPONSE	0x20
+#define T1_S_RESYNCH		0x00
+#define T1_S_IFS		0x01
+#define T1_S_ABORT		0x02
+#define T1_R_EDC_ERROR		0x01
+#define T1_R_OTHER_ERROR	0x02
+#define T1_IFS_DEFAULT		32
+
+struct emu_cmd {
+	uint8_t cla, ins, p1, p2;
+	size_t lc;
+	const uint8_t *data;
+	size_t le;		/* 0 for none */
+	int le_max;		/* Le was 00 (or 0000): as much as available */
+};
+
+static struct {
+	/* from the ATR */
+	int fi, di;		/* TA1 */
+	int protocol;		/* first offered, or the specific one */
+	int specific;
+	int crc;
+	int ifsc;
+
+	/* after reset */
+	int cur_fi, cur_di;
+	int next_fi, next_di;	/* agreed by PPS, in effect once the reply is out */
+	int pps_allowed;
+	uint8_t pps[6];
+	size_t pps_len;
+
+	uint8_t channel_open[ISO7816_MAX_CHANNELS];
+	uint8_t *file;
+
+	/* T=0 */
+	uint8_t hdr[5];
+	size_t hdr_len;
+	uint8_t data[ISO7816_SHORT_LC_MAX];
+	size_t data_len;
+	size_t need;			/* command data bytes still to come */
+	uint8_t env[EMU_APDU_MAX];	/* ENVELOPE contents */
+	size_t env_len;
+
+	/* T=1 */
+	uint8_t blk[3 + 254 + 2];
+	size_t blk_len;
+	uint8_t last[3 + 254 + 2];	/* last block sent, for retransmission */
+	size_t last_len;
+	int ns, nr;
+	int ifsd;
+
+	/* command being received, response being sent */
+	uint8_t apdu[EMU_APDU_MAX];
+	size_t apdu_len;
+	uint8_t resp[EMU_RESP_MAX];
+	size_t resp_len, resp_pos, chunk;
+} card;
+
+/* the parts of the ATR the card behaves by */
+static void card_scan_atr(void)
+{
+	const uint8_t *atr = emu_config.atr;
+	size_t i = 2, len = emu_config.atr_len;
+	uint8_t y = atr[1] >> 4, td;
+	int level = 1, t = 0;
+
+	card.fi = 1;
+	card.di = 1;
+	card.protocol = -1;
+	card.specific = 0;
+	card.crc = 0;
+	card.ifsc = T1_IFS_DEFAULT;
+
+	for (;;) {
+		uint8_t ta = 0, tc = 0;
+		int has_ta = 0, has_tc = 0;
+
+		if ((y & 1) && i < len) {
+			ta = atr[i++];
+			has_ta = 1;
+		}
+		if ((y & 2) && i < len)
+			i++;
+		if ((y & 4) && i < len) {
+			tc = atr[i++];
+			has_tc = 1;
+		}
+		td = (y & 8) && i < len ? atr[i++] : 0;
+
+		if (level == 1 && has_ta) {
+			card.fi = ta >> 4;
+			card.di = ta & 0x0f;
+		} else if (level == 2 && has_ta) {
+			card.specific = 1;
+			card.protocol = ta & 0x0f;
+		} else if (level > 2 && t == 1) {
+			if (has_ta)
+				card.ifsc = ta;
+			if (has_tc)
+				card.crc = tc & 1;
+		}
+
+		if (!(y & 8))
+			break;
+		t = td & 0x0f;
+		if (card.protocol < 0)
+			card.protocol = t;
+		y = td >> 4;
+		level++;
+	}
+
+	if (card.protocol < 0)
+		card.protocol = DSMART_CARD_PROTOCOL_T0;
+}
+
+void emu_card_reset(void)
+{
+	if (!card.file) {
+		size_t i;
+
+		card.file = malloc(emu_config.file_size ? emu_config.file_size : 1);
+		if (!card.file)
+			abort();
+		for (i = 0; i < emu_config.file_size; i++)
+			card.file[i] = i ^ (i >> 8);
+	}
+
+	card_scan_atr();
+
+	/* a card in specific mode runs at its TA1 rate right away */
+	card.cur_fi = card.specific ? card.fi : 1;
+	card.cur_di = card.specific ? card.di : 1;
+	card.next_fi = card.cur_fi;
+	card.next_di = card.cur_di;
+	card.pps_allowed = !card.specific;
+	card.pps_len = 0;
+
+	memset(card.channel_open, 0, sizeof(card.channel_open));
+	card.channel_open[0] = 1;
+
+	card.hdr_len = 0;
+	card.data_len = 0;
+	card.need = 0;
+	card.env_len = 0;
+	card.blk_len = 0;
+	card.last_len = 0;
+	card.ns = 0;
+	card.nr = 0;
+	card.ifsd = T1_IFS_DEFAULT;
+	card.apdu_len = 0;
+	card.resp_len = 0;
+	card.resp_pos = 0;
+	card.chunk = 0;
+}
+
+void emu_card_turn(void)
+{
+	card.cur_fi = card.next_fi;
+	card.cur_di = card.next_di;
+}
+
+int emu_card_rate(int *fi, int *di)
+{
+	*fi = card.cur_fi;
+	*di = card.cur_di;
+
+	return 0;
+}
+
+int emu_card_protocol(void)
+{
+	return card.protocol;
+}
+
+/*
+ * APDU level
+ */
+
+static int cmd_channel(uint8_t cla)
+{
+	if (cla & 0x40)
+		return 4 + (cla & 0x0f);
+
+	return cla & 0x03;
+}
+
+static uint16_t cmd_manage_channel(const struct emu_cmd *cmd, int channel,
+				   uint8_t *out, size_t *out_len)
+{
+	int ch = cmd->p2;
+
+	if (cmd->p1 == 0x80) {
+		if (!ch)
+			ch = channel;
+		if (ch < 1 || ch >= emu_config.channels || !card.channel_open[ch])
+			return SW_CHANNEL;
+		card.channel_open[ch] = 0;
+		return SW_OK;
+	}
+
+	if (cmd->p1)
+		return SW_WRONG_P1P2;
+
+	if (!ch) {
+		for (ch = 1; ch < emu_config.channels; ch++)
+			if (!card.channel_open[ch])
+				break;
+		if (ch >= emu_config.channels)
+			return SW_CHANNEL;
+		out[(*out_len)++] = ch;
+	} else if (ch >= emu_config.channels || card.channel_open[ch]) {
+		return SW_CHANNEL;
+	}
+
+	card.channel_open[ch] = 1;
+
+	return SW_OK;
+}
+
+static uint16_t cmd_select(const struct emu_cmd *cmd, uint8_t *out, size_t *out_len)
+{
+	size_t n = 0;
+
+	if (cmd->p1 != 0x04)
+		return SW_OK;
+	if (cmd->lc < 5 || cmd->lc > ISO7816_AID_MAX || cmd->data[0] == 0xff)
+		return SW_NOT_FOUND;
+	if ((cmd->p2 & 0x0c) == 0x0c)
+		return SW_OK;
+
+	/* FCI template: DF name and a proprietary life cycle byte */
+	out[n++] = 0x6f;
+	out[n++] = 2 + cmd->lc + 5;
+	out[n++] = 0x84;
+	out[n++] = cmd->lc;
+	memcpy(out + n, cmd->data, cmd->lc);
+	n += cmd->lc;
+	out[n++] = 0xa5;
+	out[n++] = 0x03;
+	out[n++] = 0x88;
+	out[n++] = 0x01;
+	out[n++] = 0x01;
+
+	if (cmd->le && !cmd->le_max && n > cmd->le)
+		n = cmd->le;
+	*out_len = n;
+
+	return SW_OK;
+}
+
+static uint16_t cmd_binary(const struct emu_cmd *cmd, uint8_t *out, size_t *out_len)
+{
+	size_t offset, n;
+
+	if (cmd->p1 & 0x80)
+		offset = cmd->p2;
+	else
+		offset = (cmd->p1 << 8) | cmd->p2;
+	if (offset >= emu_config.file_size)
+		return SW_WRONG_P1P2;
+
+	n = emu_config.file_size - offset;
+
+	if (cmd->ins == INS_UPDATE_BINARY) {
+		if (!cmd->lc || cmd->lc > n)
+			return SW_WRONG_LENGTH;
+		memcpy(card.file + offset, cmd->data, cmd->lc);
+		return SW_OK;
+	}
+
+	if (!cmd->le)
+		return SW_WRONG_LENGTH;
+	if (n > cmd->le)
+		n = cmd->le;
+	memcpy(out, card.file + offset, n);
+	*out_len = n;
+
+	return n < cmd->le && !cmd->le_max ? SW_END_OF_FILE : SW_OK;
+}
+
+static uint16_t cmd_record(const struct emu_cmd *cmd, uint8_t *out, size_t *out_len)
+{
+	size_t n = RECORD_SIZE;
+	size_t i;
+
+	if ((cmd->p2 & 0x07) != 0x04)
+		return SW_WRONG_P1P2;
+	if (cmd->p1 < 1 || cmd->p1 > RECORD_COUNT)
+		return SW_RECORD_NOT_FOUND;
+	if (cmd->le && !cmd->le_max && n > cmd->le)
+		n = cmd->le;
+
+	for (i = 0; i < n; i++)
+		out[i] = cmd->p1 << 4 | (i & 0x0f);
+	*out_len = n;
+
+	return SW_OK;
+}
+
+/* run one command, out gets up to EMU_RESP_MAX - 2 bytes */
+static uint16_t emu_execute(const struct emu_cmd *cmd, uint8_t *out, size_t *out_len)
+{
+	int channel = cmd_channel(cmd->cla);
+	size_t i, n;
+
+	*out_len = 0;
+
+	if (channel >= emu_config.channels || !card.channel_open[channel])
+		return SW_CHANNEL;
+
+	switch (cmd->ins) {
+	case INS_MANAGE_CHANNEL:
+		return cmd_manage_channel(cmd, channel, out, out_len);
+	case INS_SELECT:
+		return cmd_select(cmd, out, out_len);
+	case INS_READ_BINARY:
+	case INS_UPDATE_BINARY:
+		return cmd_binary(cmd, out, out_len);
+	case INS_READ_RECORD:
+		return cmd_record(cmd, out, out_len);
+	case INS_GET_CHALLENGE:
+		n = cmd->le ? (cmd->le_max ? 8 : cmd->le) : 8;
+		for (i = 0; i < n; i++)
+			out[i] = rand();
+		*out_len = n;
+		return SW_OK;
+	default:
+		n = cmd->lc;
+		if (cmd->le && !cmd->le_max && n > cmd->le)
+			n = cmd->le;
+		memcpy(out, cmd->data, n);
+		*out_len = n;
+		return SW_OK;
+	}
+}
+
+/* 0 on success, -1 for a malformed APDU */
+static int emu_parse(const uint8_t *apdu, size_t len, struct emu_cmd *cmd)
+{
+	size_t body;
+
+	if (len < 4)
+		return -1;
+
+	memset(cmd, 0, sizeof(*cmd));
+	cmd->cla = apdu[0];
+	cmd->ins = apdu[1];
+	cmd->p1 = apdu[2];
+	cmd->p2 = apdu[3];
+	body = len - 4;
+	apdu += 4;
+
+	if (!body)
+		return 0;
+
+	if (body == 1) {
+		cmd->le = apdu[0] ? apdu[0] : 256;
+		cmd->le_max = !apdu[0];
+		return 0;
+	}
+
+	if (apdu[0]) {
+		cmd->lc = apdu[0];
+		cmd->data = apdu + 1;
+		if (body == 1 + cmd->lc)
+			return 0;
+		if (body != 2 + cmd->lc)
+			return -1;
+		cmd->le = apdu[1 + cmd->lc] ? apdu[1 + cmd->lc] : 256;
+		cmd->le_max = !apdu[1 + cmd->lc];
+		return 0;
+	}
+
+	if (body == 3) {
+		cmd->le = apdu[1] << 8 | apdu[2];
+		cmd->le_max = !cmd->le;
+		if (!cmd->le)
+			cmd->le = ISO7816_EXT_LE_MAX;
+		return 0;
+	}
+
+	if (body < 3)
+		return -1;
+	cmd->lc = apdu[1] << 8 | apdu[2];
+	cmd->data = apdu + 3;
+	if (!cmd->lc || (body != 3 + cmd->lc && body != 5 + cmd->lc))
+		return -1;
+	if (body == 5 + cmd->lc) {
+		cmd->le = apdu[3 + cmd->lc] << 8 | apdu[4 + cmd->lc];
+		cmd->le_max = !cmd->le;
+		if (!cmd->le)
+			cmd->le = ISO7816_EXT_LE_MAX;
+	}
+
+	return 0;
+}
+
+/* execute card.apdu into card.resp (data then SW1 SW2) */
+static void emu_run_apdu(void)
+{
+	struct emu_cmd cmd;
+	uint16_t sw;
+	size_t n = 0;
+
+	emu_trace("apdu", card.apdu, card.apdu_len);
+
+	/* T=0 commands reach the applet as rebuilt from header and data */
+	if (!emu_config.applet || emu_config.applet(card.apdu, card.apdu_len, card.resp, &n)) {
+		if (emu_parse(card.apdu, card.apdu_len, &cmd))
+			sw = SW_WRONG_LENGTH;
+		else
+			sw = emu_execute(&cmd, card.resp, &n);
+
+		card.resp[n++] = sw >> 8;
+		card.resp[n++] = sw & 0xff;
+	}
+	card.resp_len = n;
+	card.resp_pos = 0;
+	card.apdu_len = 0;
+}
+
+/*
+ * PPS
+ */
+
+static void card_pps(uint8_t byte)
+{
+	size_t need;
+	uint8_t pck = 0, resp[4];
+	size_t i, n = 0;
+	int t;
+
+	card.pps[card.pps_len++] = byte;
+	if (card.pps_len < 2)
+		return;
+
+	need = 3 + !!(card.pps[1] & 0x10) + !!(card.pps[1] & 0x20) + !!(card.pps[1] & 0x40);
+	if (card.pps_len < need)
+		return;
+
+	card.pps_allowed = 0;
+	card.pps_len = 0;
+
+	for (i = 0; i < need; i++)
+		pck ^= card.pps[i];
+	t = card.pps[1] & 0x0f;
+	if (pck || (t != DSMART_CARD_PROTOCOL_T0 && t != DSMART_CARD_PROTOCOL_T1)) {
+		/* a wrong PPS request leaves the card mute */
+		emu_trace("pps rejected", card.pps, need);
+		return;
+	}
+	card.protocol = t;
+
+	resp[n++] = 0xff;
+	/* the only rates on offer are the default and TA1 */
+	if ((card.pps[1] & 0x10) && (card.pps[2] == (card.fi << 4 | card.di) || card.pps[2] == 0x11)) {
+		resp[n++] = 0x10 | t;
+		resp[n++] = card.pps[2];
+	} else {
+		resp[n++] = t;
+	}
+	resp[n] = 0;
+	for (i = 0; i < n; i++)
+		resp[n] ^= resp[i];
+
+	emu_send(resp, n + 1, 0);
+
+	if (n == 3) {
+		card.next_fi = resp[2] >> 4;
+		card.next_di = resp[2] & 0x0f;
+	}
+}
+
+/*
+ * T=0
+ */
+
+/* NULL bytes asking the reader to wait, into out */
+static size_t t0_nulls(uint8_t *out)
+{
+	size_t n = emu_config.t0_nulls < 0 ? 0 : emu_config.t0_nulls;
+
+	if (n > EMU_T0_NULL_MAX)
+		n = EMU_T0_NULL_MAX;
+	memset(out, 0x60, n);
+
+	return n;
+}
+
+/* acknowledge command data: all of it with INS, the next byte with ~INS */
+static void t0_ack(void)
+{
+	uint8_t out[EMU_T0_NULL_MAX + 1];
+	size_t n = t0_nulls(out);
+
+	out[n++] = emu_config.t0_bytewise ? ~card.hdr[1] : card.hdr[1];
+	emu_send(out, n, 0);
+}
+
+/* one complete answer: procedure byte and/or data and status word */
+static void t0_reply(const uint8_t *ack, const uint8_t *data, size_t len, uint16_t sw)
+{
+	static uint8_t out[EMU_T0_NULL_MAX + 2 * 256 + 2];
+	size_t n, i;
+
+	n = t0_nulls(out);
+	if (ack && emu_config.t0_bytewise) {
+		for (i = 0; i < len; i++) {
+			out[n++] = ~*ack;
+			out[n++] = data[i];
+		}
+	} else {
+		if (ack)
+			out[n++] = *ack;
+		memcpy(out + n, data, len);
+		n += len;
+	}
+	out[n++] = sw >> 8;
+	out[n++] = sw & 0xff;
+
+	if (emu_fault(&emu_config.drop_next, emu_config.drop)) {
+		emu_trace("dropped", out, n);
+		return;
+	}
+
+	emu_send(out, n, 1);
+}
+
+/* status word telling what is left for GET RESPONSE, or the final one */
+static uint16_t t0_pending_sw(void)
+{
+	size_t left = card.resp_len - 2 - card.resp_pos;
+
+	if (!left)
+		return card.resp[card.resp_len - 2] << 8 | card.resp[card.resp_len - 1];
+
+	return 0x6100 | (left > 255 ? 0 : left);
+}
+
+/* send le bytes of the pending response, 6Cxx when fewer are left */
+static void t0_send_pending(uint8_t ins, size_t le)
+{
+	size_t left = card.resp_len - 2 - card.resp_pos;
+
+	if (le > left) {
+		t0_reply(NULL, NULL, 0, 0x6c00 | (left > 255 ? 0 : left));
+		return;
+	}
+
+	card.resp_pos += le;
+	t0_reply(&ins, card.resp + card.resp_pos - le, le, t0_pending_sw());
+}
+
+/* instructions whose P3 is Le */
+static int t0_outgoing(const uint8_t *hdr)
+{
+	uint8_t ins = hdr[1];
+
+	/* MANAGE CHANNEL open returns the channel number, close has no data */
+	if (ins == INS_MANAGE_CHANNEL)
+		return !(hdr[2] & 0x80);
+
+	return ins == ISO7816_INS_GET_RESPONSE || ins == INS_READ_BINARY ||
+	       ins == INS_READ_RECORD || ins == INS_GET_CHALLENGE || ins == INS_GET_DATA;
+}
+
+/* an ENVELOPE completes an extended APDU once it holds all of it */
+static int t0_envelope_complete(size_t last_chunk)
+{
+	size_t lc;
+
+	if (card.env_len < 7)
+		return card.env_len == 4 || (card.env_len >= 5 && last_chunk < ISO7816_SHORT_LC_MAX);
+
+	lc = card.env[5] << 8 | card.env[6];
+	if (card.env_len == 7 + lc + 2)
+		return 1;
+
+	/* Le could still follow in another ENVELOPE when this one was full */
+	return card.env_len == 7 + lc && last_chunk < ISO7816_SHORT_LC_MAX;
+}
+
+static void t0_command(void)
+{
+	uint8_t ins = card.hdr[1];
+	size_t p3 = card.hdr[4];
+
+	if (ins == ISO7816_INS_GET_RESPONSE) {
+		if (card.resp_len < 2 || card.resp_pos + 2 >= card.resp_len) {
+			t0_reply(NULL, NULL, 0, SW_NO_RESPONSE);
+			return;
+		}
+		t0_send_pending(ins, p3 ? p3 : 256);
+		return;
+	}
+
+	if (ins == ISO7816_INS_ENVELOPE) {
+		if (card.env_len + card.data_len > sizeof(card.env)) {
+			card.env_len = 0;
+			t0_reply(NULL, NULL, 0, SW_WRONG_LENGTH);
+			return;
+		}
+		memcpy(card.env + card.env_len, card.data, card.data_len);
+		card.env_len += card.data_len;
+		if (!t0_envelope_complete(card.data_len)) {
+			t0_reply(NULL, NULL, 0, SW_OK);
+			return;
+		}
+		memcpy(card.apdu, card.env, card.env_len);
+		card.apdu_len = card.env_len;
+		card.env_len = 0;
+		emu_run_apdu();
+		t0_reply(NULL, NULL, 0, t0_pending_sw());
+		return;
+	}
+
+	card.env_len = 0;
+	memcpy(card.apdu, card.hdr, 4);
+	card.apdu_len = 4;
+
+	if (t0_outgoing(card.hdr)) {
+		/*
+		 * P3 = 00 asks for 256 bytes, or more through GET RESPONSE
+		 * (case 2E): run the command with the extended maximum.
+		 */
+		card.apdu[card.apdu_len++] = 0;
+		card.apdu[card.apdu_len++] = 0;
+		card.apdu[card.apdu_len++] = p3;
+		emu_run_apdu();
+		if (card.resp_len == 2) {
+			t0_reply(NULL, NULL, 0, t0_pending_sw());
+			return;
+		}
+		t0_send_pending(ins, p3 ? p3 : 256);
+		return;
+	}
+
+	/* command data, if any, then the answer through GET RESPONSE */
+	if (card.data_len) {
+		card.apdu[card.apdu_len++] = card.data_len;
+		memcpy(card.apdu + card.apdu_len, card.data, card.data_len);
+		card.apdu_len += card.data_len;
+	}
+	emu_run_apdu();
+	t0_reply(NULL, NULL, 0, t0_pending_sw());
+}
+
+static void t0_input(uint8_t byte)
+{
+	if (card.need) {
+		card.data[card.data_len++] = byte;
+		if (--card.need == 0)
+			t0_command();
+		else if (emu_config.t0_bytewise)
+			t0_ack();
+		return;
+	}
+
+	card.hdr[card.hdr_len++] = byte;
+	if (card.hdr_len < 5)
+		return;
+	card.hdr_len = 0;
+	card.data_len = 0;
+
+	if (card.hdr[4] && !t0_outgoing(card.hdr)) {
+		card.need = card.hdr[4];
+		t0_ack();
+		return;
+	}
+
+	t0_command();
+}
+
+/*
+ * T=1
+ */
+
+static size_t t1_edc_len(void)
+{
+	return card.crc ? 2 : 1;
+}
+
+static void t1_edc(const uint8_t *buf, size_t len, uint8_t *edc)
+{
+	uint16_t crc = 0xffff;
+	uint8_t lrc = 0;
+	size_t i;
+	int bit;
+
+	if (!card.crc) {
+		for (i = 0; i < len; i++)
+			lrc ^= buf[i];
+		edc[0] = lrc;
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	edc[0] = crc >> 8;
+	edc[1] = crc & 0xff;
+}
+
+static void t1_send(uint8_t pcb, const uint8_t *inf, size_t len, int processed)
+{
+	uint8_t out[sizeof(card.last)];
+	size_t n = 3 + len;
+
+	card.last[0] = 0;
+	card.last[1] = pcb;
+	card.last[2] = len;
+	memcpy(card.last + 3, inf, len);
+	t1_edc(card.last, n, card.last + n);
+	n += t1_edc_len();
+	card.last_len = n;
+
+	if (emu_fault(&emu_config.drop_next, emu_config.drop)) {
+		emu_trace("dropped", card.last, n);
+		return;
+	}
+
+	memcpy(out, card.last, n);
+	if (emu_fault(&emu_config.corrupt_next, emu_config.corrupt)) {
+		out[n - 1] ^= 0x5a;
+		emu_trace("corrupted", out, n);
+	}
+
+	emu_send(out, n, processed);
+}
+
+static void t1_resend(void)
+{
+	uint8_t out[sizeof(card.last)];
+
+	if (!card.last_len)
+		return;
+
+	memcpy(out, card.last, card.last_len);
+	if (emu_fault(&emu_config.corrupt_next, emu_config.corrupt)) {
+		out[card.last_len - 1] ^= 0x5a;
+		emu_trace("corrupted", out, card.last_len);
+	}
+
+	emu_send(out, card.last_len, 0);
+}
+
+static void t1_send_chunk(int processed)
+{
+	size_t left = card.resp_len - card.resp_pos;
+	int more;
+
+	card.chunk = left < (size_t)card.ifsd ? left : (size_t)card.ifsd;
+	more = card.resp_pos + card.chunk < card.resp_len;
+
+	t1_send((card.ns ? T1_PCB_I_NS : 0) | (more ? T1_PCB_I_MORE : 0),
+		card.resp + card.resp_pos, card.chunk, processed);
+	card.ns ^= 1;
+}
+
+static void t1_block(void)
+{
+	uint8_t pcb = card.blk[1];
+	size_t len = card.blk[2];
+	uint8_t edc[2];
+
+	t1_edc(card.blk, 3 + len, edc);
+	if (memcmp(edc, card.blk + 3 + len, t1_edc_len()) || emu_fault(&emu_config.garble_next, 0)) {
+		t1_send(T1_PCB_R | (card.nr ? T1_PCB_R_NR : 0) | T1_R_EDC_ERROR, NULL, 0, 0);
+		return;
+	}
+
+	if ((pcb & 0xc0) == T1_PCB_S) {
+		uint8_t type = pcb & 0x1f;
+
+		if (pcb & T1_PCB_S_RESPONSE)
+			return;
+		if (type == T1_S_IFS && len == 1)
+			card.ifsd = card.blk[3];
+		if (type == T1_S_RESYNCH) {
+			card.ns = 0;
+			card.nr = 0;
+		}
+		if (type == T1_S_ABORT || type == T1_S_RESYNCH) {
+			card.apdu_len = 0;
+			card.resp_len = 0;
+		}
+		t1_send(pcb | T1_PCB_S_RESPONSE, card.blk + 3, len, 0);
+		return;
+	}
+
+	if ((pcb & 0xc0) == T1_PCB_R) {
+		int nr = !!(pcb & T1_PCB_R_NR);
+
+		/* N(R) past our last I-block acknowledges it: next chunk */
+		if (nr == card.ns && card.resp_pos + card.chunk < card.resp_len) {
+			card.resp_pos += card.chunk;
+			t1_send_chunk(0);
+			return;
+		}
+		t1_resend();
+		return;
+	}
+
+	/* I-block */
+	if (!!(pcb & T1_PCB_I_NS) != card.nr || len > (size_t)card.ifsc) {
+		t1_send(T1_PCB_R | (card.nr ? T1_PCB_R_NR : 0) | T1_R_OTHER_ERROR, NULL, 0, 0);
+		return;
+	}
+	if (card.apdu_len + len > sizeof(card.apdu)) {
+		card.apdu_len = 0;
+		t1_send(T1_PCB_R | (card.nr ? T1_PCB_R_NR : 0) | T1_R_OTHER_ERROR, NULL, 0, 0);
+		return;
+	}
+
+	/* a new command ends any response still being chained */
+	card.resp_len = 0;
+	memcpy(card.apdu + card.apdu_len, card.blk + 3, len);
+	card.apdu_len += len;
+	card.nr ^= 1;
+
+	if (pcb & T1_PCB_I_MORE) {
+		t1_send(T1_PCB_R | (card.nr ? T1_PCB_R_NR : 0), NULL, 0, 0);
+		return;
+	}
+
+	emu_run_apdu();
+	t1_send_chunk(1);
+}
+
+static void t1_input(uint8_t byte)
+{
+	card.blk[card.blk_len++] = byte;
+	if (card.blk_len < 3 || card.blk_len < 3 + card.blk[2] + t1_edc_len())
+		return;
+
+	t1_block();
+	card.blk_len = 0;
+}
+
+void emu_card_input(const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (card.pps_allowed && (card.pps_len || buf[i] == 0xff)) {
+			card_pps(buf[i]);
+			continue;
+		}
+		card.pps_allowed = 0;
+
+		if (card.protocol == DSMART_CARD_PROTOCOL_T1)
+			t1_input(buf[i]);
+		else
+			t0_input(buf[i]);
+	}
+}
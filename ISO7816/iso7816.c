@@ -0,0 +1,815 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ */
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+/* direction of the P3 data bytes of a T=0 command */
+enum t0_dir {
+	T0_NONE,
+	T0_OUT,
+	T0_IN,
+};
+
+int iso7816_ioctl(csi_iso7816_session_t *session, unsigned long cmd, void *arg)
+{
+	int ret;
+
+	do {
+		ret = ioctl(session->fd, cmd, arg);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : 0;
+}
+
+int iso7816_errval(csi_iso7816_session_t *session, int errval)
+{
+	if (errval == DSMART_CARD_OK)
+		return 0;
+
+	session->errval = errval;
+	iso7816_trace_errval(session, errval);
+
+	switch (errval) {
+	case DSMART_CARD_E_DATA_TIMEOUT:
+	case DSMART_CARD_E_ACT_TIMEOUT:
+	case DSMART_CARD_E_CWT_TIM:
+		return -ETIMEDOUT;
+	case DSMART_CARD_E_NOCARD:
+	case DSMART_CARD_E_REMOVED:
+		return -ENODEV;
+	default:
+		return -EIO;
+	}
+}
+
+void iso7816_rx_flush(csi_iso7816_session_t *session)
+{
+	session->rx_pos = 0;
+	session->rx_len = 0;
+}
+
+static int iso7816_xfer_ptr(csi_iso7816_session_t *session, unsigned long cmd,
+			    uint8_t *buf, size_t *len)
+{
+	struct dsmart_card_xfer xfer = {
+		.buffer = (uintptr_t)buf,
+		.length = *len,
+		.time_out = session->time_out,
+		.errval = DSMART_CARD_OK,
+	};
+	int ret;
+
+	ret = iso7816_ioctl(session, cmd, &xfer);
+	if (ret)
+		return ret;
+
+	*len = xfer.length;
+
+	return iso7816_errval(session, xfer.errval);
+}
+
+int iso7816_xmt(csi_iso7816_session_t *session, const uint8_t *buf, size_t len)
+{
+	struct dsmart_card_xmt xmt;
+	size_t n;
+	int ret;
+
+	/* the next receive waits for the card to process this */
+	session->tune.after_xmt = 1;
+	iso7816_trace_xmt(session, len);
+
+	if (session->xfer_ptr)
+		return iso7816_xfer_ptr(session, DSMART_CARD_IOCTL_XMT_PTR, (uint8_t *)buf, &len);
+
+	while (len) {
+		n = len < ISO7816_IOCTL_MAX ? len : ISO7816_IOCTL_MAX;
+
+		memcpy(xmt.xmt_buffer, buf, n);
+		xmt.xmt_length = n;
+		xmt.time_out = session->time_out;
+		xmt.errval = DSMART_CARD_OK;
+
+		ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_XMT, &xmt);
+		if (ret)
+			return ret;
+
+		ret = iso7816_errval(session, xmt.errval);
+		if (ret)
+			return ret;
+
+		buf += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+ * One receive from the driver: straight into buf when given, otherwise into
+ * the rx queue. *len is the number of bytes to ask for, then received.
+ */
+static int iso7816_rcv_driver(csi_iso7816_session_t *session, uint8_t *buf, size_t *len)
+{
+	struct dsmart_card_rcv rcv;
+	int ret;
+
+	if (buf) {
+		ret = iso7816_xfer_ptr(session, DSMART_CARD_IOCTL_RCV_PTR, buf, len);
+		if (ret)
+			return ret;
+	} else {
+		rcv.rcv_length = *len < ISO7816_IOCTL_MAX ? *len : ISO7816_IOCTL_MAX;
+		rcv.time_out = session->time_out;
+		rcv.errval = DSMART_CARD_OK;
+
+		ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_RCV, &rcv);
+		if (ret)
+			return ret;
+
+		ret = iso7816_errval(session, rcv.errval);
+		if (ret)
+			return ret;
+
+		*len = rcv.rcv_length > 0 ? rcv.rcv_length : 0;
+		if (*len > ISO7816_IOCTL_MAX)
+			*len = ISO7816_IOCTL_MAX;
+		session->rx_pos = 0;
+		session->rx_len = *len;
+		memcpy(session->rx_buf, rcv.rcv_buffer, *len);
+	}
+
+	if (!*len)
+		return iso7816_errval(session, DSMART_CARD_E_DATA_TIMEOUT);
+
+	return 0;
+}
+
+/*
+ * Read exactly len bytes. want (>= len) is the number of bytes the caller
+ * expects to read in a row, it is requested from the driver at once so that
+ * e.g. a procedure byte, the response data and SW1 SW2 cost a single ioctl.
+ */
+int iso7816_rcv(csi_iso7816_session_t *session, uint8_t *buf, size_t len, size_t want)
+{
+	struct timespec start;
+	uint8_t *direct;
+	size_t n;
+	int ret;
+
+	if (want < len)
+		want = len;
+
+	while (len) {
+		if (session->rx_pos < session->rx_len) {
+			n = session->rx_len - session->rx_pos;
+			if (n > len)
+				n = len;
+			memcpy(buf, session->rx_buf + session->rx_pos, n);
+			session->rx_pos += n;
+			buf += n;
+			len -= n;
+			want -= n;
+			continue;
+		}
+
+		/* nothing more expected, read straight into the caller buffer */
+		direct = session->xfer_ptr && want == len ? buf : NULL;
+
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			n = direct ? len : want;
+			ret = iso7816_rcv_driver(session, direct, &n);
+		} while (ret == -ETIMEDOUT && iso7816_tune_timeout(session));
+		if (ret)
+			return ret;
+
+		iso7816_tune_sample(session, &start, n);
+		iso7816_trace_rcv(session, n);
+
+		if (direct) {
+			if (n > len)
+				n = len;
+			buf += n;
+			len -= n;
+			want -= n;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief  Open the smart card reader.
+ *
+ * @param session  Session to initialize
+ * @param device   Device node, NULL for ISO7816_DEFAULT_DEVICE
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_open(csi_iso7816_session_t *session, const char *device)
+{
+	size_t probe_len;
+
+	assert(session != NULL);
+
+	memset(session, 0, sizeof(*session));
+	session->protocol = DSMART_CARD_PROTOCOL_T0;
+	session->fi = ISO7816_ATR_FI_DEFAULT;
+	session->di = ISO7816_ATR_DI_DEFAULT;
+	session->max_channels = ISO7816_DEFAULT_CHANNELS;
+	session->channels[0].open = 1;
+
+	session->fd = open(device ? device : ISO7816_DEFAULT_DEVICE, O_RDWR | O_CLOEXEC);
+	if (session->fd < 0) {
+		perror("failed to open iso7816 smart card");
+		return -errno;
+	}
+
+	/* an empty XMT_PTR tells whether the driver has the pointer variants */
+	probe_len = 0;
+	session->xfer_ptr = !iso7816_xfer_ptr(session, DSMART_CARD_IOCTL_XMT_PTR, NULL, &probe_len);
+	session->errval = DSMART_CARD_OK;
+
+	return 0;
+}
+
+/**
+ * @brief  Deactivate the card and close the reader.
+ *
+ * @param session  Session to release
+ */
+void csi_iso7816_close(csi_iso7816_session_t *session)
+{
+	if (session->fd < 0)
+		return;
+
+	csi_iso7816_async_stop(session);
+	csi_iso7816_trace_stop(session);
+	csi_iso7816_sm_close(session);
+	iso7816_ioctl(session, DSMART_CARD_IOCTL_DEACTIVATE, NULL);
+	close(session->fd);
+	session->fd = -1;
+}
+
+/* the card answers a reset at the default rate, bring the reader back to it */
+static int iso7816_default_rate(csi_iso7816_session_t *session)
+{
+	if (session->fi == ISO7816_ATR_FI_DEFAULT && session->di == ISO7816_ATR_DI_DEFAULT)
+		return 0;
+
+	return csi_iso7816_set_baud(session, ISO7816_ATR_FI_DEFAULT, ISO7816_ATR_DI_DEFAULT);
+}
+
+static int iso7816_read_atr(csi_iso7816_session_t *session)
+{
+	int ret;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_ATR_RCV, &session->atr);
+	if (ret)
+		return ret;
+
+	if (session->atr.len > sizeof(session->atr.atr_buffer))
+		session->atr.len = sizeof(session->atr.atr_buffer);
+
+	/* the card restarts its block numbering, closes its channels and secure channel */
+	iso7816_t1_init(session);
+	iso7816_channel_reset(session);
+	/* and may not even be the same card, its applets answer anew */
+	csi_iso7816_fci_flush(session);
+	csi_iso7816_sm_close(session);
+	session->le_max = 0;
+
+	return iso7816_errval(session, session->atr.errval);
+}
+
+/**
+ * @brief  Cold reset the card and read its ATR into session->atr.
+ *
+ * @param session  Opened session
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_cold_reset(csi_iso7816_session_t *session)
+{
+	int ret;
+
+	iso7816_rx_flush(session);
+
+	ret = iso7816_default_rate(session);
+	if (ret)
+		return ret;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_COLD_RESET, &session->atr);
+	if (ret)
+		return ret;
+
+	return iso7816_read_atr(session);
+}
+
+/**
+ * @brief  Warm reset the card and read its ATR into session->atr.
+ *
+ * @param session  Opened session
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_warm_reset(csi_iso7816_session_t *session)
+{
+	int ret;
+
+	iso7816_rx_flush(session);
+
+	ret = iso7816_default_rate(session);
+	if (ret)
+		return ret;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_WARM_RESET, NULL);
+	if (ret)
+		return ret;
+
+	return iso7816_read_atr(session);
+}
+
+/**
+ * @brief  Select the transmission protocol.
+ *
+ * @param session   Opened session
+ * @param protocol  DSMART_CARD_PROTOCOL_T0 or DSMART_CARD_PROTOCOL_T1
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_protocol(csi_iso7816_session_t *session, int protocol)
+{
+	unsigned int value = protocol;
+	int ret;
+
+	if (protocol != DSMART_CARD_PROTOCOL_T0 && protocol != DSMART_CARD_PROTOCOL_T1)
+		return -EINVAL;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_PROTOCOL, &value);
+	if (ret)
+		return ret;
+
+	session->protocol = protocol;
+	if (protocol == DSMART_CARD_PROTOCOL_T1)
+		iso7816_t1_init(session);
+
+	return 0;
+}
+
+/**
+ * @brief  Program the reader baud rate.
+ *
+ * @param session  Opened session
+ * @param fi       FI index of ISO/IEC 7816-3 table 7
+ * @param di       DI index of ISO/IEC 7816-3 table 8
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_baud(csi_iso7816_session_t *session, int fi, int di)
+{
+	struct dsmart_card_baud baud = {
+		.di = di,
+		.fi = fi,
+	};
+	int ret;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_BAUD, &baud);
+	if (ret)
+		return ret;
+
+	session->fi = fi;
+	session->di = di;
+
+	return 0;
+}
+
+/**
+ * @brief  Program the reader waiting times.
+ *
+ * The values are the limits csi_iso7816_tune_start() stays within.
+ *
+ * @param session  Opened session
+ * @param timing   Waiting times in etu
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_timing(csi_iso7816_session_t *session,
+			   const struct dsmart_card_timing *timing)
+{
+	struct dsmart_card_timing value = *timing;
+	int ret;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_TIMING, &value);
+	if (ret)
+		return ret;
+
+	session->timing = *timing;
+
+	/* new limits, what was measured under the old ones no longer holds */
+	session->tune.spec = *timing;
+	session->tune.tuned = 0;
+	session->tune.samples = 0;
+	session->tune.max_wait = 0;
+	session->tune.max_gap = 0;
+
+	return 0;
+}
+
+/*
+ * One T=0 command: send the header, then serve procedure bytes until SW1 SW2.
+ * Incoming data beyond in_size is drained and reported as -ENOSPC.
+ */
+static int iso7816_t0_command(csi_iso7816_session_t *session, const uint8_t *hdr,
+			      enum t0_dir dir, const uint8_t *out,
+			      uint8_t *in, size_t in_size, size_t *in_len,
+			      uint16_t *sw)
+{
+	uint8_t ins = hdr[1], pb, sw2, scratch[ISO7816_IOCTL_MAX];
+	size_t remain, n, want;
+	int ret, overflow = 0;
+
+	remain = hdr[4];
+	if (dir == T0_IN && !remain)
+		remain = ISO7816_SHORT_LE_MAX;
+	else if (dir == T0_NONE)
+		remain = 0;
+
+	*in_len = 0;
+
+	ret = iso7816_xmt(session, hdr, 5);
+	if (ret)
+		return ret;
+
+	/* procedure byte, incoming data and SW1 SW2 */
+	want = 1 + (dir == T0_IN ? remain : 0) + 2;
+
+	for (;;) {
+		ret = iso7816_rcv(session, &pb, 1, want);
+		if (ret)
+			return ret;
+		if (want > 1)
+			want--;
+
+		if (pb == 0x60) {
+			iso7816_trace_event(session, ISO7816_TRACE_WAIT);
+			continue;
+		}
+
+		if ((pb & 0xf0) == 0x60 || (pb & 0xf0) == 0x90) {
+			ret = iso7816_rcv(session, &sw2, 1, 1);
+			if (ret)
+				return ret;
+			*sw = pb << 8 | sw2;
+			return overflow ? -ENOSPC : 0;
+		}
+
+		if (pb != ins && pb != (uint8_t)~ins)
+			return -EPROTO;
+
+		if (!remain)
+			return -EPROTO;
+
+		/* INS: all remaining bytes, ~INS: the next byte only */
+		n = pb == ins ? remain : 1;
+
+		if (dir == T0_OUT) {
+			ret = iso7816_xmt(session, out, n);
+			out += n;
+			want = 3;
+		} else {
+			if (*in_len + n <= in_size) {
+				ret = iso7816_rcv(session, in + *in_len, n, want);
+				*in_len += n;
+			} else {
+				ret = iso7816_rcv(session, scratch, n, want);
+				overflow = 1;
+			}
+			want -= n;
+		}
+		if (ret)
+			return ret;
+
+		remain -= n;
+	}
+}
+
+/* CLA for GET RESPONSE on the logical channel of cla, without SM and chaining */
+uint8_t iso7816_get_response_cla(uint8_t cla)
+{
+	if (cla & 0x40)
+		return 0x40 | (cla & 0x0f);
+
+	return cla & 0x03;
+}
+
+/**
+ * Split a command APDU into its ISO/IEC 7816-4 case, Lc, data and Le.
+ */
+int iso7816_apdu_parse(const uint8_t *apdu, size_t apdu_len, struct iso7816_apdu *cmd)
+{
+	size_t body = apdu_len - 4;
+
+	memset(cmd, 0, sizeof(*cmd));
+
+	if (apdu_len < 4)
+		return -EINVAL;
+
+	if (!body) {
+		cmd->cas = 1;
+		return 0;
+	}
+
+	if (body == 1) {
+		cmd->cas = 2;
+		cmd->le = apdu[4] ? apdu[4] : ISO7816_SHORT_LE_MAX;
+		return 0;
+	}
+
+	if (apdu[4]) {
+		cmd->lc = apdu[4];
+		cmd->data = apdu + 5;
+		if (body == 1 + cmd->lc) {
+			cmd->cas = 3;
+		} else if (body == 2 + cmd->lc) {
+			cmd->cas = 4;
+			cmd->le = apdu[apdu_len - 1] ? apdu[apdu_len - 1] : ISO7816_SHORT_LE_MAX;
+		} else {
+			return -EINVAL;
+		}
+		return 0;
+	}
+
+	/* extended length, 0x00 then two bytes */
+	cmd->extended = 1;
+	if (body == 3) {
+		cmd->cas = 2;
+		cmd->le = apdu[5] << 8 | apdu[6];
+		if (!cmd->le)
+			cmd->le = ISO7816_EXT_LE_MAX;
+		return 0;
+	}
+
+	if (body < 3)
+		return -EINVAL;
+
+	cmd->lc = apdu[5] << 8 | apdu[6];
+	cmd->data = apdu + 7;
+	if (!cmd->lc)
+		return -EINVAL;
+	if (body == 3 + cmd->lc) {
+		cmd->cas = 3;
+	} else if (body == 5 + cmd->lc) {
+		cmd->cas = 4;
+		cmd->le = apdu[apdu_len - 2] << 8 | apdu[apdu_len - 1];
+		if (!cmd->le)
+			cmd->le = ISO7816_EXT_LE_MAX;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Send all but the last ISO7816_SHORT_LC_MAX bytes of apdu in ENVELOPE
+ * commands, and leave hdr/out ready for the last one.
+ */
+static int iso7816_t0_envelope(csi_iso7816_session_t *session,
+			       const uint8_t *apdu, size_t apdu_len,
+			       uint8_t *hdr, const uint8_t **out, uint16_t *sw)
+{
+	size_t n;
+	int ret;
+
+	hdr[0] = iso7816_get_response_cla(apdu[0]);
+	hdr[1] = ISO7816_INS_ENVELOPE;
+	hdr[2] = 0;
+	hdr[3] = 0;
+
+	while (apdu_len > ISO7816_SHORT_LC_MAX) {
+		hdr[4] = ISO7816_SHORT_LC_MAX;
+		ret = iso7816_t0_command(session, hdr, T0_OUT, apdu, NULL, 0, &n, sw);
+		if (ret)
+			return ret;
+		if (*sw != ISO7816_SW_OK)
+			return 0;
+		apdu += ISO7816_SHORT_LC_MAX;
+		apdu_len -= ISO7816_SHORT_LC_MAX;
+	}
+
+	hdr[4] = apdu_len;
+	*out = apdu;
+	*sw = ISO7816_SW_OK;
+
+	return 0;
+}
+
+static int iso7816_t0_exchange(csi_iso7816_session_t *session,
+			       const uint8_t *apdu, size_t apdu_len,
+			       uint8_t *data, size_t data_size, size_t *data_len,
+			       uint16_t *sw)
+{
+	struct iso7816_apdu cmd;
+	const uint8_t *out;
+	uint8_t hdr[5];
+	enum t0_dir dir;
+	size_t n, avail;
+	int ret, retry = 0, chain = 0;
+
+	ret = iso7816_apdu_parse(apdu, apdu_len, &cmd);
+	if (ret)
+		return ret;
+
+	*data_len = 0;
+	iso7816_rx_flush(session);
+
+	memcpy(hdr, apdu, 4);
+	out = cmd.data;
+	switch (cmd.cas) {
+	case 1:
+		dir = T0_NONE;
+		hdr[4] = 0;
+		break;
+	case 2:
+		/* an extended Le beyond 256 is served by 61xx */
+		dir = T0_IN;
+		hdr[4] = cmd.le < ISO7816_SHORT_LE_MAX ? cmd.le : 0;
+		break;
+	default:
+		/* case 3 and 4, Le of case 4 is implied by 61xx */
+		dir = T0_OUT;
+		if (cmd.lc <= ISO7816_SHORT_LC_MAX) {
+			hdr[4] = cmd.lc;
+			break;
+		}
+		ret = iso7816_t0_envelope(session, apdu, apdu_len, hdr, &out, sw);
+		if (ret || *sw != ISO7816_SW_OK)
+			return ret;
+		break;
+	}
+
+	ret = iso7816_t0_command(session, hdr, dir, out, data, data_size, &n, sw);
+	for (;;) {
+		if (ret)
+			return ret;
+		*data_len += n;
+
+		if ((*sw >> 8) == 0x6c && dir == T0_IN && retry++ < 2) {
+			/* wrong Le, the card tells the right one */
+			iso7816_trace_event(session, ISO7816_TRACE_RETRY);
+			hdr[4] = *sw & 0xff;
+			*data_len -= n;
+		} else if ((*sw >> 8) == 0x61) {
+			/* Le satisfied, the 61xx tells the caller there is more */
+			if (cmd.le && *data_len >= cmd.le)
+				return 0;
+			if (*data_len >= data_size)
+				return -ENOSPC;
+			/* a response body is at most 64KiB */
+			if (++chain > 256)
+				return -EPROTO;
+			avail = *sw & 0xff ? *sw & 0xff : ISO7816_SHORT_LE_MAX;
+			if (cmd.le && avail > cmd.le - *data_len)
+				avail = cmd.le - *data_len;
+			iso7816_trace_event(session, ISO7816_TRACE_CHAIN);
+			hdr[0] = iso7816_get_response_cla(apdu[0]);
+			hdr[1] = ISO7816_INS_GET_RESPONSE;
+			hdr[2] = 0;
+			hdr[3] = 0;
+			hdr[4] = avail & 0xff;
+			dir = T0_IN;
+			retry = 0;
+		} else {
+			return 0;
+		}
+
+		ret = iso7816_t0_command(session, hdr, dir, NULL, data + *data_len,
+					 data_size - *data_len, &n, sw);
+	}
+}
+
+int iso7816_exchange_once(csi_iso7816_session_t *session,
+			  const uint8_t *apdu, size_t apdu_len,
+			  uint8_t *data, size_t data_size, size_t *data_len,
+			  uint16_t *sw)
+{
+	if (session->protocol == DSMART_CARD_PROTOCOL_T1)
+		return iso7816_t1_exchange(session, apdu, apdu_len, data, data_size,
+					   data_len, sw);
+
+	return iso7816_t0_exchange(session, apdu, apdu_len, data, data_size,
+				   data_len, sw);
+}
+
+int iso7816_exchange_recover(csi_iso7816_session_t *session,
+			     const uint8_t *apdu, size_t apdu_len,
+			     uint8_t *data, size_t data_size, size_t *data_len,
+			     uint16_t *sw)
+{
+	int ret;
+
+	ret = iso7816_exchange_once(session, apdu, apdu_len, data, data_size, data_len, sw);
+	if (ret && session->recover_max)
+		ret = iso7816_recover(session, ret, apdu, apdu_len, data, data_size,
+				      data_len, sw);
+
+	return ret;
+}
+
+/**
+ * @brief  Exchange one command APDU, returning data and status word apart.
+ *
+ * T=0 procedure bytes, 61xx (GET RESPONSE) and 6Cxx (wrong Le) are handled
+ * internally, so data holds the complete response body. With T=1 the APDU
+ * and the response are chained over I-blocks of up to IFSC/IFSD bytes.
+ *
+ * Extended APDUs (Lc up to 65535, Le up to 65536) are accepted. T=1 chains
+ * them as any other APDU. T=0 sends them as short APDUs when Lc allows,
+ * otherwise wrapped in ENVELOPE commands, and collects a long response with
+ * GET RESPONSE.
+ *
+ * A failed exchange goes through the steps of csi_iso7816_set_recovery().
+ * On the channel of a secure channel (csi_iso7816_scp03_open() and co) the
+ * APDU is wrapped and the response unwrapped, a failed exchange or a
+ * response failing its check (-EBADMSG) closes the secure channel.
+ *
+ * @param session    Session with a protocol selected
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param data       Buffer for the response body
+ * @param data_size  Size of data
+ * @param data_len   Out: length of the response body
+ * @param sw         Out: status word SW1SW2
+ * @return 0 on success, -ECONNRESET when recovery had to reset the card
+ *         (the APDU was not completed), or negative errno on failure
+ */
+int csi_iso7816_exchange(csi_iso7816_session_t *session,
+			 const uint8_t *apdu, size_t apdu_len,
+			 uint8_t *data, size_t data_size, size_t *data_len,
+			 uint16_t *sw)
+{
+	int ret;
+
+	assert(session != NULL && apdu != NULL && data_len != NULL && sw != NULL);
+
+	if (apdu_len < 4)
+		return -EINVAL;
+
+	session->recovered = ISO7816_RECOVER_NONE;
+	iso7816_trace_begin(session, apdu);
+
+	if (iso7816_sm_applies(session, apdu[0]))
+		ret = iso7816_sm_exchange(session, apdu, apdu_len, data, data_size,
+					  data_len, sw);
+	else
+		ret = iso7816_exchange_recover(session, apdu, apdu_len, data, data_size,
+					       data_len, sw);
+
+	iso7816_trace_end(session, ret);
+
+	return ret;
+}
+
+/**
+ * @brief  Exchange one command APDU, returning the response APDU.
+ *
+ * @param session    Session with a protocol selected
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param resp       Buffer for the response body followed by SW1 SW2
+ * @param resp_size  Size of resp, at least 2, up to ISO7816_EXT_LE_MAX + 2
+ *                   for an extended Le
+ * @param resp_len   Out: length of the response APDU
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_transceive(csi_iso7816_session_t *session,
+			   const uint8_t *apdu, size_t apdu_len,
+			   uint8_t *resp, size_t resp_size, size_t *resp_len)
+{
+	uint16_t sw;
+	size_t len;
+	int ret;
+
+	assert(resp != NULL && resp_len != NULL);
+
+	if (resp_size < 2)
+		return -EINVAL;
+
+	ret = csi_iso7816_exchange(session, apdu, apdu_len, resp, resp_size - 2, &len, &sw);
+	if (ret)
+		return ret;
+
+	resp[len] = sw >> 8;
+	resp[len + 1] = sw & 0xff;
+	*resp_len = len + 2;
+
+	return 0;
+}
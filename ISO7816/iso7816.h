@@ -0,0 +1,990 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ */
+#ifndef _ISO7816_H
+#define _ISO7816_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include "dsmart_card_interface.h"
+
+#define ISO7816_DEFAULT_DEVICE	"/dev/dsmart_card"
+
+/* largest transfer of a single DSMART_CARD_IOCTL_XMT/RCV */
+#define ISO7816_IOCTL_MAX	256
+
+/* short APDU limits */
+#define ISO7816_SHORT_LC_MAX	255
+#define ISO7816_SHORT_LE_MAX	256
+
+/* extended APDU limits */
+#define ISO7816_EXT_LC_MAX	65535
+#define ISO7816_EXT_LE_MAX	65536
+#define ISO7816_EXT_APDU_MAX	(7 + ISO7816_EXT_LC_MAX + 2)
+
+#define ISO7816_INS_GET_RESPONSE	0xc0
+#define ISO7816_INS_ENVELOPE		0xc2
+
+#define ISO7816_SW_OK			0x9000
+
+/* ATR defaults of ISO/IEC 7816-3 when the interface byte is absent */
+#define ISO7816_ATR_FI_DEFAULT		1	/* Fd = 372 */
+#define ISO7816_ATR_DI_DEFAULT		1	/* Dd = 1 */
+#define ISO7816_ATR_WI_DEFAULT		10
+#define ISO7816_ATR_IFSC_DEFAULT	32
+#define ISO7816_ATR_CWI_DEFAULT		13
+#define ISO7816_ATR_BWI_DEFAULT		4
+
+/* T=1 information field sizes */
+#define ISO7816_T1_IFS_MAX		254
+
+#define ISO7816_ATR_MAX_LEVELS		8
+#define ISO7816_ATR_HIST_MAX		15
+
+/* negotiated parameters per card model, see csi_iso7816_cache_load() */
+#define ISO7816_CACHE_DEFAULT_PATH	"/var/lib/iso7816/cards"
+#define ISO7816_CACHE_MAX_ENTRIES	64
+
+typedef struct _csi_iso7816_atr_info {
+	uint8_t ts;
+	uint8_t t0;
+
+	/* raw interface bytes TAi..TDi, i = 1..levels, present bit i-1 */
+	uint8_t ta[ISO7816_ATR_MAX_LEVELS];
+	uint8_t tb[ISO7816_ATR_MAX_LEVELS];
+	uint8_t tc[ISO7816_ATR_MAX_LEVELS];
+	uint8_t td[ISO7816_ATR_MAX_LEVELS];
+	uint8_t ta_present, tb_present, tc_present, td_present;
+	int levels;
+
+	uint8_t hist[ISO7816_ATR_HIST_MAX];
+	int hist_len;
+	int tck_present;
+	uint8_t tck;
+
+	/* global and protocol parameters, defaults filled in */
+	uint8_t fi;		/* TA1 high nibble */
+	uint8_t di;		/* TA1 low nibble */
+	uint8_t n;		/* TC1, extra guard time */
+	uint8_t wi;		/* TC2, T=0 waiting time integer */
+	uint8_t ifsc;		/* first TA for T=1 */
+	uint8_t cwi;		/* first TB for T=1, low nibble */
+	uint8_t bwi;		/* first TB for T=1, high nibble */
+	uint8_t edc_crc;	/* first TC for T=1, bit 1: CRC instead of LRC */
+	uint16_t protocols;	/* bit T set for every T offered in TDi */
+	uint8_t first_protocol;	/* T of TD1, 0 without TD1 */
+
+	/* specific mode, TA2 present */
+	int specific;
+	uint8_t specific_protocol;
+	int specific_changeable;	/* warm reset returns to negotiable mode */
+	int specific_implicit;		/* use default Fd/Dd instead of TA1 */
+
+	/* card capabilities in the historical bytes */
+	int extended_length;		/* extended Lc and Le fields */
+} csi_iso7816_atr_info_t;
+
+/* logical channels, 0 is the basic channel */
+#define ISO7816_MAX_CHANNELS		20
+#define ISO7816_DEFAULT_CHANNELS	4
+
+#define ISO7816_AID_MAX			16
+
+/* SELECT responses kept per AID */
+#define ISO7816_FCI_CACHE_SIZE		8
+#define ISO7816_FCI_MAX			256
+
+struct iso7816_channel {
+	int open;
+	uint8_t aid[ISO7816_AID_MAX];	/* applet selected, aid_len 0 for none */
+	int aid_len;
+	uint64_t last_use;
+};
+
+struct iso7816_fci {
+	uint8_t aid[ISO7816_AID_MAX];
+	int aid_len;			/* 0 for a free entry */
+	uint8_t data[ISO7816_FCI_MAX];
+	int len;
+	uint64_t last_use;
+};
+
+/* waiting time tuning, see csi_iso7816_tune_start() */
+#define ISO7816_TUNE_MARGIN_DEFAULT	300	/* percent of the longest wait seen */
+#define ISO7816_TUNE_WINDOW		16	/* receives between two adjustments */
+
+struct iso7816_tune {
+	unsigned int clock_hz;		/* card clock, 0 when not measuring */
+	unsigned int margin;		/* percent */
+	struct dsmart_card_timing spec;	/* as set by csi_iso7816_set_timing() */
+	int tuned;			/* session->timing is below spec */
+	int after_xmt;			/* next receive waits for the card */
+	unsigned int samples;
+	unsigned int max_wait;		/* longest wait for a response, etu */
+	unsigned int max_gap;		/* longest wait inside a response, etu */
+};
+
+/* steps of the recovery of a failed exchange, see csi_iso7816_set_recovery() */
+#define ISO7816_RECOVER_NONE		0
+#define ISO7816_RECOVER_RETRANSMIT	1	/* send the APDU again */
+#define ISO7816_RECOVER_RESYNCH		2	/* T=1 S(RESYNCH), then send it again */
+#define ISO7816_RECOVER_WARM_RESET	3	/* warm reset, parameters in use replayed */
+#define ISO7816_RECOVER_COLD_RESET	4	/* cold reset and negotiation */
+#define ISO7816_RECOVER_STEPS		5
+
+typedef struct _csi_iso7816_recover_stats {
+	unsigned long attempts;
+	unsigned long recovered;
+	unsigned long long sum_us;
+	unsigned int max_us;
+} csi_iso7816_recover_stats_t;
+
+/* exchange latencies, see csi_iso7816_trace_start() */
+#define ISO7816_PHASE_TOTAL		0	/* submission to return */
+#define ISO7816_PHASE_RESPONSE		1	/* submission to first byte */
+#define ISO7816_PHASE_TRANSFER		2	/* first byte to last byte */
+#define ISO7816_PHASE_WAIT		3	/* extra time asked by T=0 NULL or T=1 WTX */
+#define ISO7816_PHASE_CHAIN		4	/* first GET RESPONSE or chained block to last byte */
+#define ISO7816_PHASES			5
+
+/* bucket b counts latencies of 2^b to 2^(b+1) - 1 us, the last one all above */
+#define ISO7816_TRACE_BUCKETS		24
+
+typedef struct _csi_iso7816_ins_stats {
+	unsigned long exchanges;
+	unsigned long errors;		/* exchanges returning an error */
+	unsigned long retries;		/* T=1 blocks sent again, T=0 6Cxx */
+	unsigned long waits;		/* T=0 NULL bytes, T=1 WTX requests */
+	unsigned long chained;		/* GET RESPONSE, T=1 chained blocks */
+	unsigned long long tx_bytes;	/* on the line, framing included */
+	unsigned long long rx_bytes;
+	unsigned long long sum_us[ISO7816_PHASES];
+	unsigned int max_us[ISO7816_PHASES];
+	unsigned int hist[ISO7816_PHASES][ISO7816_TRACE_BUCKETS];
+} csi_iso7816_ins_stats_t;
+
+typedef struct _csi_iso7816_stats {
+	csi_iso7816_ins_stats_t ins[256];	/* by INS of the command APDU */
+	unsigned long errval[DSMART_CARD_STATE_ERR_EVENT + 1];	/* by DSMART_CARD_E_* */
+	csi_iso7816_recover_stats_t recover[ISO7816_RECOVER_STEPS];	/* by step */
+} csi_iso7816_stats_t;
+
+struct iso7816_async;
+struct iso7816_trace;
+struct iso7816_sm;
+
+typedef struct _csi_iso7816_session {
+	int fd;
+	int protocol;		/* DSMART_CARD_PROTOCOL_T0 or DSMART_CARD_PROTOCOL_T1 */
+	int time_out;		/* per transfer time_out passed to the driver, 0 for its default */
+	int errval;		/* DSMART_CARD_E_* of the last failed transfer */
+	int xfer_ptr;		/* driver has DSMART_CARD_IOCTL_XMT_PTR/RCV_PTR */
+	struct dsmart_card_atr atr;
+	csi_iso7816_atr_info_t atr_info;	/* parsed by csi_iso7816_negotiate() */
+
+	/* rate in use, FI and DI indices */
+	int fi;
+	int di;
+
+	/* waiting times last programmed, restored after a T=1 WTX */
+	struct dsmart_card_timing timing;
+
+	/* T=1 state, reset by csi_iso7816_set_protocol() and the resets */
+	uint8_t t1_ns;		/* N(S) of the next I-block sent */
+	uint8_t t1_nr;		/* N(S) expected in the next I-block received */
+	int t1_ifsc;		/* largest INF the card accepts */
+	int t1_ifsd;		/* largest INF the card may send, 0 before S(IFS) */
+	int t1_crc;		/* EDC is CRC instead of LRC */
+	int t1_ifsd_want;	/* IFSD asked on the first exchange, 0 for the largest */
+
+	/* reader limits for the negotiation, see csi_iso7816_set_reader_caps() */
+	unsigned int reader_max_d;
+	unsigned int reader_min_fd;
+
+	/* measured latencies and waiting times derived from them */
+	struct iso7816_tune tune;
+
+	/* worker of csi_iso7816_async_start(), NULL when not started */
+	struct iso7816_async *async;
+
+	/* last recovery step tried, see csi_iso7816_set_recovery() */
+	int recover_max;
+	int recovered;		/* step that recovered the last exchange */
+
+	/* latency statistics of csi_iso7816_trace_start(), NULL when not started */
+	struct iso7816_trace *trace;
+
+	/* largest Le of csi_iso7816_read_binary(), 0 until known, reset with the ATR */
+	size_t le_max;
+
+	/* secure messaging of csi_iso7816_scp03_open() and co, NULL when none */
+	struct iso7816_sm *sm;
+
+	/* channel table and FCI cache of csi_iso7816_select_aid() */
+	struct iso7816_channel channels[ISO7816_MAX_CHANNELS];
+	int max_channels;
+	struct iso7816_fci fci_cache[ISO7816_FCI_CACHE_SIZE];
+	uint64_t use_tick;
+
+	/* bytes received from the driver but not consumed yet */
+	uint8_t rx_buf[ISO7816_IOCTL_MAX];
+	int rx_pos;
+	int rx_len;
+} csi_iso7816_session_t;
+
+/**
+ * @brief  Open the smart card reader.
+ *
+ * @param session  Session to initialize
+ * @param device   Device node, NULL for ISO7816_DEFAULT_DEVICE
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_open(csi_iso7816_session_t *session, const char *device);
+
+/**
+ * @brief  Deactivate the card and close the reader.
+ *
+ * @param session  Session to release
+ */
+void csi_iso7816_close(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Cold reset the card and read its ATR into session->atr.
+ *
+ * @param session  Opened session
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_cold_reset(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Warm reset the card and read its ATR into session->atr.
+ *
+ * @param session  Opened session
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_warm_reset(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Select the transmission protocol.
+ *
+ * @param session   Opened session
+ * @param protocol  DSMART_CARD_PROTOCOL_T0 or DSMART_CARD_PROTOCOL_T1
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_protocol(csi_iso7816_session_t *session, int protocol);
+
+/**
+ * @brief  Program the reader baud rate.
+ *
+ * @param session  Opened session
+ * @param fi       FI index of ISO/IEC 7816-3 table 7
+ * @param di       DI index of ISO/IEC 7816-3 table 8
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_baud(csi_iso7816_session_t *session, int fi, int di);
+
+/**
+ * @brief  Program the reader waiting times.
+ *
+ * The values are the limits csi_iso7816_tune_start() stays within.
+ *
+ * @param session  Opened session
+ * @param timing   Waiting times in etu
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_timing(csi_iso7816_session_t *session,
+			   const struct dsmart_card_timing *timing);
+
+/**
+ * @brief  Exchange one command APDU, returning data and status word apart.
+ *
+ * T=0 procedure bytes, 61xx (GET RESPONSE) and 6Cxx (wrong Le) are handled
+ * internally, so data holds the complete response body. With T=1 the APDU
+ * and the response are chained over I-blocks of up to IFSC/IFSD bytes.
+ *
+ * Extended APDUs (Lc up to 65535, Le up to 65536) are accepted. T=1 chains
+ * them as any other APDU. T=0 sends them as short APDUs when Lc allows,
+ * otherwise wrapped in ENVELOPE commands, and collects a long response with
+ * GET RESPONSE.
+ *
+ * A failed exchange goes through the steps of csi_iso7816_set_recovery().
+ * On the channel of a secure channel (csi_iso7816_scp03_open() and co) the
+ * APDU is wrapped and the response unwrapped, a failed exchange or a
+ * response failing its check (-EBADMSG) closes the secure channel.
+ *
+ * @param session    Session with a protocol selected
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param data       Buffer for the response body
+ * @param data_size  Size of data
+ * @param data_len   Out: length of the response body
+ * @param sw         Out: status word SW1SW2
+ * @return 0 on success, -ECONNRESET when recovery had to reset the card
+ *         (the APDU was not completed), or negative errno on failure
+ */
+int csi_iso7816_exchange(csi_iso7816_session_t *session,
+			 const uint8_t *apdu, size_t apdu_len,
+			 uint8_t *data, size_t data_size, size_t *data_len,
+			 uint16_t *sw);
+
+/**
+ * @brief  Exchange one command APDU, returning the response APDU.
+ *
+ * @param session    Session with a protocol selected
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param resp       Buffer for the response body followed by SW1 SW2
+ * @param resp_size  Size of resp, at least 2, up to ISO7816_EXT_LE_MAX + 2
+ *                   for an extended Le
+ * @param resp_len   Out: length of the response APDU
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_transceive(csi_iso7816_session_t *session,
+			   const uint8_t *apdu, size_t apdu_len,
+			   uint8_t *resp, size_t resp_size, size_t *resp_len);
+
+/* APDU exchange queued with csi_iso7816_submit() */
+typedef struct _csi_iso7816_req {
+	const uint8_t *apdu;
+	size_t apdu_len;
+	uint8_t *resp;		/* response body followed by SW1 SW2 */
+	size_t resp_size;
+	size_t resp_len;	/* out */
+	int result;		/* out: -EINPROGRESS, then 0 or negative errno */
+	/* SW & sw_mask != sw_expect or an error halts the queue, see csi_iso7816_submit() */
+	uint16_t sw_expect;
+	uint16_t sw_mask;
+	void *priv;		/* for the caller */
+	struct _csi_iso7816_req *next;
+} csi_iso7816_req_t;
+
+/**
+ * @brief  Start non-blocking operation on a session.
+ *
+ * Once started, the session must only be used through csi_iso7816_submit()
+ * until csi_iso7816_async_stop().
+ *
+ * The driver only has blocking ioctls, so every started session owns a
+ * worker pthread that runs its exchanges until csi_iso7816_async_stop():
+ * N started sessions cost N threads, and a child fork()ed meanwhile has no
+ * worker and must not use the session.
+ *
+ * @param session  Session ready for exchanges (protocol, rate, timing set)
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_async_start(csi_iso7816_session_t *session);
+
+/**
+ * @brief  File descriptor that polls readable while completions are queued.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ * @return the descriptor, or -EINVAL when not started
+ */
+int csi_iso7816_async_fd(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Queue an APDU exchange and return immediately.
+ *
+ * req->apdu, req->resp and req itself must stay valid until the request is
+ * returned by csi_iso7816_reap().
+ *
+ * With a non-zero req->sw_mask, a response whose SW does not match or a
+ * failed exchange halts the queue: the requests behind it complete with
+ * -ECANCELED without reaching the card, and so do the ones submitted
+ * until the halting request is reaped.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ * @param req      Request with apdu, apdu_len, resp and resp_size set
+ * @return 0 on success, -ECANCELED while halted, or negative errno on failure
+ */
+int csi_iso7816_submit(csi_iso7816_session_t *session, csi_iso7816_req_t *req);
+
+/**
+ * @brief  Take one completed request, without blocking.
+ *
+ * Requests complete in submission order. req->result holds the return of
+ * csi_iso7816_transceive() and req->resp_len the response length.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ * @return the completed request, or NULL when none is queued
+ */
+csi_iso7816_req_t *csi_iso7816_reap(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Stop non-blocking operation.
+ *
+ * Waits for the exchange in progress. Requests not started complete with
+ * -ECANCELED and, as the completed ones, are dropped without being reaped.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ */
+void csi_iso7816_async_stop(csi_iso7816_session_t *session);
+
+/*
+ * Compiled APDU script, see csi_iso7816_script_compile(). All fields are
+ * big-endian: the header, then for each command its length, expected SW and
+ * SW mask followed by the command APDU.
+ */
+#define ISO7816_SCRIPT_MAGIC		0x49375331	/* "I7S1" */
+#define ISO7816_SCRIPT_HDR_LEN		8		/* magic, command count */
+#define ISO7816_SCRIPT_CMD_LEN		8		/* length, SW, SW mask */
+
+/* default number of APDUs csi_iso7816_script_run() keeps queued */
+#define ISO7816_SCRIPT_WINDOW		4
+
+typedef struct _csi_iso7816_script_result {
+	uint32_t commands;	/* in the script */
+	uint32_t completed;	/* exchanged with a matching SW */
+	int32_t failed;		/* index of the failing command, -1 for none */
+	int error;		/* exchange error of the failing command, 0 for a SW mismatch */
+	uint16_t sw;		/* SW of the failing command */
+	uint16_t sw_expect;
+	uint16_t sw_mask;
+	uint64_t elapsed_ns;
+	double apdus_per_sec;	/* exchanged APDUs, the failing one included */
+} csi_iso7816_script_result_t;
+
+/**
+ * @brief  Compile an APDU script into the binary form run by
+ *         csi_iso7816_script_run().
+ *
+ * One command per line, in hex with optional spaces, followed by the
+ * status word expected after a ':'. 'X' stands for any nibble of the
+ * status word and '*' for any status word, 9000 is expected when none is
+ * given. '#' starts a comment. For example:
+ *   00 A4 04 00 07 A0000000031010
+ *   80 E2 00 00 04 01020304 : 9000
+ *   00 B0 00 00 00 : 6XXX
+ *
+ * @param text     Script, NUL terminated
+ * @param bin      Out: compiled script, to free()
+ * @param bin_len  Out: length of bin
+ * @param line     Out: on -EINVAL the line in error, may be NULL
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_script_compile(const char *text, uint8_t **bin, size_t *bin_len, int *line);
+
+/**
+ * @brief  Run a compiled script, stopping at the first unexpected response.
+ *
+ * The commands go through the queue of csi_iso7816_submit(), window of
+ * them at a time, so the card gets the next APDU as soon as it answers
+ * while the responses are checked behind it. Each one carries its expected
+ * SW, so a mismatch or a failed exchange halts the queue before the
+ * following commands reach the card.
+ *
+ * @param session  Session ready for exchanges, not started for async use
+ * @param bin      Compiled script
+ * @param bin_len  Length of bin
+ * @param window   APDUs queued at most, 0 for ISO7816_SCRIPT_WINDOW
+ * @param result   Out: progress, failing command and throughput
+ * @return 0 when every command completed as expected, -EREMOTEIO on a SW
+ *         mismatch, or negative errno on failure
+ */
+int csi_iso7816_script_run(csi_iso7816_session_t *session,
+			   const uint8_t *bin, size_t bin_len, int window,
+			   csi_iso7816_script_result_t *result);
+
+/* clients of iso7816d, see daemon/ */
+#define ISO7816D_DEFAULT_SOCKET		"/run/iso7816d.sock"
+
+/* priority classes of iso7816d clients, served highest first */
+#define ISO7816_PRIO_HIGH		0
+#define ISO7816_PRIO_NORMAL		1
+#define ISO7816_PRIO_LOW		2
+#define ISO7816_PRIO_CLASSES		3
+
+typedef struct _csi_iso7816_client {
+	int fd;
+} csi_iso7816_client_t;
+
+/**
+ * @brief  Connect to iso7816d.
+ *
+ * @param client    Client to initialize
+ * @param path      Socket path, NULL for ISO7816D_DEFAULT_SOCKET
+ * @param priority  ISO7816_PRIO_HIGH, ISO7816_PRIO_NORMAL or ISO7816_PRIO_LOW
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_connect(csi_iso7816_client_t *client, const char *path, int priority);
+
+/**
+ * @brief  Disconnect, ending a transaction still open.
+ *
+ * @param client  Connected client
+ */
+void csi_iso7816_client_close(csi_iso7816_client_t *client);
+
+/**
+ * @brief  Wait until the card is exclusive to this client.
+ *
+ * APDUs of other clients are held until csi_iso7816_client_end(). The
+ * daemon ends a transaction left idle for too long, the next call then
+ * fails with -ETIMEDOUT.
+ *
+ * @param client  Connected client
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_begin(csi_iso7816_client_t *client);
+
+/**
+ * @brief  End the transaction started by csi_iso7816_client_begin().
+ *
+ * @param client  Connected client
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_end(csi_iso7816_client_t *client);
+
+/**
+ * @brief  Exchange one command APDU through the daemon.
+ *
+ * @param client     Connected client
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param resp       Buffer for the response body followed by SW1 SW2
+ * @param resp_size  Size of resp
+ * @param resp_len   Out: length of the response APDU
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_transceive(csi_iso7816_client_t *client,
+				  const uint8_t *apdu, size_t apdu_len,
+				  uint8_t *resp, size_t resp_size, size_t *resp_len);
+
+/**
+ * @brief  Fetch the latency statistics of the daemon session.
+ *
+ * @param client  Connected client
+ * @param stats   Out: statistics, see csi_iso7816_trace_get()
+ * @return 0 on success, -ENODATA when iso7816d runs without -t,
+ *         or negative errno on failure
+ */
+int csi_iso7816_client_stats(csi_iso7816_client_t *client, csi_iso7816_stats_t *stats);
+
+/**
+ * @brief  Set how many logical channels csi_iso7816_select_aid() may open.
+ *
+ * Defaults to ISO7816_DEFAULT_CHANNELS. A card refusing MANAGE CHANNEL
+ * lowers it to the channels opened so far.
+ *
+ * @param session   Opened session
+ * @param channels  1 (basic channel only) to ISO7816_MAX_CHANNELS
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_max_channels(csi_iso7816_session_t *session, int channels);
+
+/**
+ * @brief  Select an applet, keeping it selected on its own logical channel.
+ *
+ * An AID already selected on a channel is returned without any APDU.
+ * Otherwise the AID is selected on a free channel, a new one opened with
+ * MANAGE CHANNEL, or the least recently used one. A cached FCI lets the
+ * SELECT skip the response data (P2 = 0x0C). The cache is dropped on every
+ * reset, which is also when a swapped card is first seen.
+ *
+ * @param session   Session ready for exchanges
+ * @param aid       Application identifier, 5 to 16 bytes
+ * @param aid_len   Length of aid
+ * @param fci       Buffer for the SELECT response data, may be NULL
+ * @param fci_size  Size of fci
+ * @param fci_len   Out: length of the response data, may be NULL
+ * @param channel   Out: channel the applet is selected on
+ * @param sw        Out: status word of the SELECT, channel is valid on 9000
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_select_aid(csi_iso7816_session_t *session,
+			   const uint8_t *aid, size_t aid_len,
+			   uint8_t *fci, size_t fci_size, size_t *fci_len,
+			   int *channel, uint16_t *sw);
+
+/**
+ * @brief  Exchange one command APDU on a logical channel.
+ *
+ * The channel number is encoded into CLA (ISO/IEC 7816-4 5.4.1), the rest
+ * of the APDU is sent as given. Applets are switched with
+ * csi_iso7816_select_aid(), not with a SELECT sent here.
+ *
+ * @param session    Session ready for exchanges
+ * @param channel    Channel returned by csi_iso7816_select_aid()
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param resp       Buffer for the response body followed by SW1 SW2
+ * @param resp_size  Size of resp
+ * @param resp_len   Out: length of the response APDU
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_channel_transceive(csi_iso7816_session_t *session, int channel,
+				   const uint8_t *apdu, size_t apdu_len,
+				   uint8_t *resp, size_t resp_size, size_t *resp_len);
+
+/**
+ * @brief  Close a logical channel with MANAGE CHANNEL.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  1 to ISO7816_MAX_CHANNELS - 1
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_close_channel(csi_iso7816_session_t *session, int channel);
+
+/**
+ * @brief  Drop the cached SELECT responses, e.g. after installing applets.
+ *
+ * @param session  Opened session
+ */
+void csi_iso7816_fci_flush(csi_iso7816_session_t *session);
+
+/* data of csi_iso7816_read_binary() and csi_iso7816_read_records() */
+typedef int (*csi_iso7816_read_cb_t)(void *priv, size_t pos, const uint8_t *data, size_t len);
+
+/**
+ * @brief  Read a transparent EF with as few READ BINARY as possible.
+ *
+ * Each READ BINARY asks for the largest Le of the session: extended when
+ * the ATR announces extended lengths and the card accepts them, 256
+ * otherwise. The data goes straight into buf, or into a buffer of that
+ * size passed to cb. Reading stops after len bytes, at the end of the
+ * file (6282 or a short read), on an error status or once the offset
+ * passes 32767, the largest one READ BINARY B0 can address.
+ *
+ * @param session   Session ready for exchanges
+ * @param channel   Logical channel the EF is selected on, 0 for the basic one
+ * @param offset    Offset of the first byte, up to 32767
+ * @param len       Bytes to read at most, the size of buf when given
+ * @param buf       Buffer for the data, NULL to use cb
+ * @param cb        Called for each piece with its offset, when buf is NULL.
+ *                  Returns 0 to go on, or a negative errno to stop with.
+ * @param priv      Passed to cb
+ * @param read_len  Out: bytes read
+ * @param sw        Out: status word of the last READ BINARY
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_read_binary(csi_iso7816_session_t *session, int channel,
+			    size_t offset, size_t len, uint8_t *buf,
+			    csi_iso7816_read_cb_t cb, void *priv,
+			    size_t *read_len, uint16_t *sw);
+
+/**
+ * @brief  Read the records of an EF, one READ RECORD each.
+ *
+ * Each READ RECORD asks for the largest Le of the session, see
+ * csi_iso7816_read_binary(), and the record is received straight into the
+ * buffer passed to cb. Reading stops after count records, past the last
+ * record (6A83) or on an error status.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel the EF is selected on, 0 for the basic one
+ * @param sfi      Short EF identifier 1 to 30, 0 for the current EF
+ * @param first    Number of the first record, 1 to 254
+ * @param count    Records to read at most, 0 for all up to the last one
+ * @param cb       Called for each record with its number. Returns 0 to go
+ *                 on, or a negative errno to stop with.
+ * @param priv     Passed to cb
+ * @param records  Out: records read
+ * @param sw       Out: status word of the last READ RECORD, 6A83 once past
+ *                 the last record
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_read_records(csi_iso7816_session_t *session, int channel,
+			     int sfi, int first, int count,
+			     csi_iso7816_read_cb_t cb, void *priv,
+			     int *records, uint16_t *sw);
+
+/**
+ * @brief  Negotiate the T=1 IFSD with an S(IFS request).
+ *
+ * Done on the first T=1 exchange with ISO7816_T1_IFS_MAX if not called.
+ *
+ * @param session  Session using T=1
+ * @param ifsd     Largest information field the reader accepts, 1 to 254
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_t1_set_ifsd(csi_iso7816_session_t *session, int ifsd);
+
+/**
+ * @brief  Parse an Answer-To-Reset.
+ *
+ * Checks TS, walks T0 and the TAi/TBi/TCi/TDi chain, copies the historical
+ * bytes and verifies TCK when it is present.
+ *
+ * @param atr   ATR bytes, starting with TS
+ * @param len   Length of atr
+ * @param info  Out: raw interface bytes and decoded parameters
+ * @return 0 on success, -EBADMSG for a malformed ATR or a wrong TCK
+ */
+int csi_iso7816_atr_parse(const uint8_t *atr, size_t len, csi_iso7816_atr_info_t *info);
+
+/**
+ * @brief  F of an FI index (ISO/IEC 7816-3 table 7).
+ *
+ * @param fi  FI index
+ * @return F, or 0 for a reserved index
+ */
+unsigned int csi_iso7816_fi_to_f(int fi);
+
+/**
+ * @brief  D of a DI index (ISO/IEC 7816-3 table 8).
+ *
+ * @param di  DI index
+ * @return D, or 0 for a reserved index
+ */
+unsigned int csi_iso7816_di_to_d(int di);
+
+/**
+ * @brief  Limit the rates csi_iso7816_negotiate() may pick.
+ *
+ * @param session  Opened session
+ * @param max_d    Largest D the reader supports, 0 for no limit
+ * @param min_fd   Smallest F/D (clock cycles per etu) the reader supports,
+ *                 0 for no limit
+ */
+void csi_iso7816_set_reader_caps(csi_iso7816_session_t *session,
+				 unsigned int max_d, unsigned int min_fd);
+
+/**
+ * @brief  Run a PPS exchange at the current (default) rate.
+ *
+ * The reader rate is not changed, see csi_iso7816_negotiate().
+ *
+ * @param session   Session right after a reset
+ * @param protocol  T proposed in PPS0
+ * @param fi        FI proposed in PPS1
+ * @param di        DI proposed in PPS1
+ * @return 1 if the card accepted fi/di, 0 if it answered without PPS1
+ *         (default rate kept), or negative errno on failure
+ */
+int csi_iso7816_pps(csi_iso7816_session_t *session, int protocol, int fi, int di);
+
+/**
+ * @brief  Apply the ATR of the last reset: protocol, fastest rate, timing.
+ *
+ * Parses session->atr, picks the highest F/D supported by both the card and
+ * the reader, runs PPS unless the card is in specific mode, then programs
+ * the protocol, the baud rate and the waiting times derived from the ATR.
+ * A failed PPS warm resets the card and keeps the default rate.
+ *
+ * @param session  Session right after csi_iso7816_cold_reset()
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_negotiate(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Replay the parameters cached for the card of the last reset.
+ *
+ * Looks the ATR up in the cache file. On a hit, the ATR is parsed, PPS is
+ * sent with the cached rate and the protocol, rate, waiting times and T=1
+ * IFSD are programmed without deriving them again. On a miss, or when the
+ * card refuses the cached rate (the card is then warm reset), nothing is
+ * applied and csi_iso7816_negotiate() is to be used.
+ *
+ * @param session  Session right after csi_iso7816_cold_reset()
+ * @param path     Cache file, NULL for ISO7816_CACHE_DEFAULT_PATH
+ * @return 1 if replayed, 0 if not, or negative errno on failure
+ */
+int csi_iso7816_cache_load(csi_iso7816_session_t *session, const char *path);
+
+/**
+ * @brief  Record the parameters in use for the card of the last reset.
+ *
+ * Stores the protocol, rate, waiting times and, once an exchange has
+ * negotiated it, the T=1 IFSD under a hash of the ATR. The file keeps the
+ * ISO7816_CACHE_MAX_ENTRIES most recently stored cards. The directory of
+ * the file is created, readable by the owner only, when missing.
+ *
+ * @param session  Session after csi_iso7816_negotiate() and, preferably,
+ *                 a first exchange
+ * @param path     Cache file, NULL for ISO7816_CACHE_DEFAULT_PATH
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_cache_store(csi_iso7816_session_t *session, const char *path);
+
+/**
+ * @brief  Shorten the waiting times to what the card actually needs.
+ *
+ * Every receive is timed. Each ISO7816_TUNE_WINDOW receives, WWT (T=0) or
+ * BWT and CWT (T=1) are set to margin percent of the longest wait seen so
+ * far, never above the values of csi_iso7816_set_timing(). A timeout with
+ * shortened times restores those values and doubles the margin: T=0 then
+ * keeps waiting for the response, T=1 recovers it with its retransmission.
+ *
+ * @param session   Session with its protocol, rate and timing set
+ * @param clock_hz  Card clock frequency
+ * @param margin    Percent of the longest wait, at least 100,
+ *                  0 for ISO7816_TUNE_MARGIN_DEFAULT
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_tune_start(csi_iso7816_session_t *session,
+			   unsigned int clock_hz, unsigned int margin);
+
+/**
+ * @brief  Stop measuring and restore the waiting times of csi_iso7816_set_timing().
+ *
+ * @param session  Session started with csi_iso7816_tune_start()
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_tune_stop(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Recover failed exchanges in steps of growing cost.
+ *
+ * An exchange failing with a transmission error (-EIO, -ETIMEDOUT,
+ * -EPROTO, -EBADMSG) is recovered with the steps up to max_step, each
+ * tried once, cheapest first:
+ *  - ISO7816_RECOVER_RETRANSMIT: the APDU is sent again,
+ *  - ISO7816_RECOVER_RESYNCH: T=1 only, S(RESYNCH) then the APDU again,
+ *  - ISO7816_RECOVER_WARM_RESET: warm reset, the protocol, rate, waiting
+ *    times and IFSD in use are replayed without negotiating,
+ *  - ISO7816_RECOVER_COLD_RESET: cold reset and csi_iso7816_negotiate().
+ * The first two complete the exchange. After a reset the card has lost its
+ * selected applets and channels, so the exchange fails with -ECONNRESET
+ * for the caller to select again. session->recovered tells the step that
+ * worked, the statistics of csi_iso7816_trace_start() the count and time
+ * of each step.
+ *
+ * Sending the APDU again is only safe for commands the card may run twice.
+ *
+ * @param session   Opened session
+ * @param max_step  Last step to try, ISO7816_RECOVER_NONE (the default)
+ *                  to fail the exchange right away
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_recovery(csi_iso7816_session_t *session, int max_step);
+
+/**
+ * @brief  Start collecting latency statistics, or clear them when started.
+ *
+ * Each exchange is timestamped at submission, on the first and the last
+ * byte received, on T=0 NULL bytes and T=1 WTX requests and on the first
+ * GET RESPONSE or chained block. The driver only tells when a receive
+ * completes, so "first byte" is the end of the first receive. Phases are
+ * accounted under the INS of the command APDU, driver errors under their
+ * DSMART_CARD_E_* code.
+ *
+ * @param session  Opened session
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_trace_start(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Stop collecting latency statistics and drop them.
+ *
+ * The async worker records into the statistics without holding a
+ * reference, so they cannot be dropped while it runs: stop it with
+ * csi_iso7816_async_stop() first.
+ *
+ * @param session  Session started with csi_iso7816_trace_start()
+ * @return 0 on success, -EBUSY while the session is started for async use
+ */
+int csi_iso7816_trace_stop(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Copy the statistics collected so far.
+ *
+ * May be called while another thread (e.g. the async worker) exchanges.
+ *
+ * @param session  Session started with csi_iso7816_trace_start()
+ * @param stats    Out: statistics
+ * @return 0 on success, -ENODATA when not started
+ */
+int csi_iso7816_trace_get(csi_iso7816_session_t *session, csi_iso7816_stats_t *stats);
+
+/**
+ * @brief  Print statistics: per INS phase histograms, error counts, recoveries.
+ *
+ * @param file   Output stream
+ * @param stats  Statistics from csi_iso7816_trace_get()
+ */
+void csi_iso7816_trace_print(FILE *file, const csi_iso7816_stats_t *stats);
+
+/* security levels of csi_iso7816_scp03_open(), as in EXTERNAL AUTHENTICATE P1 */
+#define ISO7816_SM_C_MAC		0x01
+#define ISO7816_SM_C_DEC		0x02
+#define ISO7816_SM_R_MAC		0x10
+#define ISO7816_SM_R_ENC		0x20
+
+/* static keys of a GlobalPlatform security domain */
+typedef struct _csi_iso7816_scp_keys {
+	uint8_t enc[32];
+	uint8_t mac[32];
+	size_t len;		/* 16 (3DES for SCP02, AES-128), 24 or 32 (AES) */
+	uint8_t version;	/* key version number, 0 for the first available */
+} csi_iso7816_scp_keys_t;
+
+/**
+ * @brief  Open a GlobalPlatform SCP03 secure channel.
+ *
+ * INITIALIZE UPDATE and EXTERNAL AUTHENTICATE are sent on channel, the
+ * session keys derived from the static ones and the challenges, and the
+ * card cryptogram checked. From then on every csi_iso7816_exchange() on
+ * that channel is wrapped and unwrapped for the security level until
+ * csi_iso7816_sm_close() or a card reset.
+ *
+ * AES runs on the eip120 engine of OpenSSL when it loads, in software
+ * otherwise, see csi_iso7816_sm_offload().
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel with the security domain selected
+ * @param keys     Static AES keys
+ * @param level    ISO7816_SM_C_MAC, optionally with ISO7816_SM_C_DEC,
+ *                 ISO7816_SM_R_MAC and ISO7816_SM_R_ENC
+ * @param sw       Out: status word of the last command
+ * @return 0 on success, -EACCES when the card refuses the host or the card
+ *         cryptogram is wrong, or negative errno on failure
+ */
+int csi_iso7816_scp03_open(csi_iso7816_session_t *session, int channel,
+			   const csi_iso7816_scp_keys_t *keys, int level, uint16_t *sw);
+
+/**
+ * @brief  Open a GlobalPlatform SCP02 secure channel.
+ *
+ * As csi_iso7816_scp03_open(), with 3DES keys. Only C-MAC and C-DEC are
+ * supported, on short APDUs.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel with the security domain selected
+ * @param keys     Static 3DES keys, len 16
+ * @param i        SCP02 option "i" of the card, 0x15 or 0x55
+ * @param level    ISO7816_SM_C_MAC, optionally with ISO7816_SM_C_DEC
+ * @param sw       Out: status word of the last command
+ * @return 0 on success, -EACCES when the card refuses the host or the card
+ *         cryptogram is wrong, or negative errno on failure
+ */
+int csi_iso7816_scp02_open(csi_iso7816_session_t *session, int channel,
+			   const csi_iso7816_scp_keys_t *keys, int i, int level,
+			   uint16_t *sw);
+
+/**
+ * @brief  Start ICAO 9303 secure messaging after Basic Access Control.
+ *
+ * The 3DES session keys are derived from the key seed of the mutual
+ * authentication. Every csi_iso7816_exchange() on channel is then sent
+ * protected, with its data encrypted and a MAC over the header, and the
+ * response checked and decrypted.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel of the eMRTD application
+ * @param kseed    Key seed K.IFD xor K.IC
+ * @param ssc      Send sequence counter, RND.IC and RND.IFD low halves
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_icao_sm_start(csi_iso7816_session_t *session, int channel,
+			      const uint8_t kseed[16], const uint8_t ssc[8]);
+
+/**
+ * @brief  Drop the secure messaging of the session, exchanges go plain.
+ *
+ * @param session  Opened session
+ */
+void csi_iso7816_sm_close(csi_iso7816_session_t *session);
+
+/**
+ * @brief  Tell where the secure messaging ciphers run.
+ *
+ * @param session  Session with secure messaging started
+ * @return 1 on the eip120 engine, 0 in software, -ENOTCONN when not started
+ */
+int csi_iso7816_sm_offload(csi_iso7816_session_t *session);
+
+#endif
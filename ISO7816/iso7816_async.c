@@ -0,0 +1,288 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Non-blocking APDU submission. The dsmart_card driver only offers blocking
+ * ioctls, so each started session gets one worker that runs the exchanges
+ * in submission order and signals completions on an eventfd.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "iso7816.h"
+
+struct iso7816_async {
+	pthread_t worker;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int efd;
+	int stop;
+
+	/* submitted, not started yet */
+	csi_iso7816_req_t *pending;
+	csi_iso7816_req_t **pending_tail;
+
+	/* completed, not reaped yet */
+	csi_iso7816_req_t *done;
+	csi_iso7816_req_t **done_tail;
+
+	/* SW mismatch or error not reaped yet, the queue is halted meanwhile */
+	csi_iso7816_req_t *halt;
+};
+
+static void async_push(csi_iso7816_req_t ***tail, csi_iso7816_req_t *req)
+{
+	req->next = NULL;
+	**tail = req;
+	*tail = &req->next;
+}
+
+static csi_iso7816_req_t *async_pop(csi_iso7816_req_t **head, csi_iso7816_req_t ***tail)
+{
+	csi_iso7816_req_t *req = *head;
+
+	if (req) {
+		*head = req->next;
+		if (!*head)
+			*tail = head;
+	}
+
+	return req;
+}
+
+/* a failed exchange leaves the card state unknown, as a wrong SW does */
+static int async_halts(const csi_iso7816_req_t *req)
+{
+	uint16_t sw;
+
+	if (!req->sw_mask)
+		return 0;
+	if (req->result || req->resp_len < 2)
+		return 1;
+
+	sw = req->resp[req->resp_len - 2] << 8 | req->resp[req->resp_len - 1];
+
+	return (sw & req->sw_mask) != req->sw_expect;
+}
+
+static void async_complete(struct iso7816_async *async, csi_iso7816_req_t *req)
+{
+	uint64_t count = 1;
+
+	pthread_mutex_lock(&async->lock);
+	async_push(&async->done_tail, req);
+	if (async_halts(req)) {
+		/* what the queue holds was meant to follow a good response */
+		async->halt = req;
+		while ((req = async_pop(&async->pending, &async->pending_tail))) {
+			req->result = -ECANCELED;
+			async_push(&async->done_tail, req);
+			count++;
+		}
+	}
+	pthread_mutex_unlock(&async->lock);
+
+	/* a semaphore eventfd stays readable while completions are queued */
+	if (write(async->efd, &count, sizeof(count)) != sizeof(count))
+		perror("iso7816 async: eventfd write");
+}
+
+static void *async_worker(void *arg)
+{
+	csi_iso7816_session_t *session = arg;
+	struct iso7816_async *async = session->async;
+	csi_iso7816_req_t *req;
+
+	for (;;) {
+		pthread_mutex_lock(&async->lock);
+		while (!async->stop && !async->pending)
+			pthread_cond_wait(&async->cond, &async->lock);
+		if (async->stop) {
+			pthread_mutex_unlock(&async->lock);
+			break;
+		}
+		req = async_pop(&async->pending, &async->pending_tail);
+		pthread_mutex_unlock(&async->lock);
+
+		req->resp_len = 0;
+		req->result = csi_iso7816_transceive(session, req->apdu, req->apdu_len,
+						     req->resp, req->resp_size,
+						     &req->resp_len);
+		async_complete(async, req);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief  Start non-blocking operation on a session.
+ *
+ * Once started, the session must only be used through csi_iso7816_submit()
+ * until csi_iso7816_async_stop().
+ *
+ * The driver only has blocking ioctls, so every started session owns a
+ * worker pthread that runs its exchanges until csi_iso7816_async_stop():
+ * N started sessions cost N threads, and a child fork()ed meanwhile has no
+ * worker and must not use the session.
+ *
+ * @param session  Session ready for exchanges (protocol, rate, timing set)
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_async_start(csi_iso7816_session_t *session)
+{
+	struct iso7816_async *async;
+	int ret;
+
+	assert(session != NULL);
+
+	if (session->async)
+		return -EBUSY;
+
+	async = calloc(1, sizeof(*async));
+	if (!async)
+		return -ENOMEM;
+
+	async->efd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK | EFD_SEMAPHORE);
+	if (async->efd < 0) {
+		ret = -errno;
+		free(async);
+		return ret;
+	}
+
+	pthread_mutex_init(&async->lock, NULL);
+	pthread_cond_init(&async->cond, NULL);
+	async->pending_tail = &async->pending;
+	async->done_tail = &async->done;
+	session->async = async;
+
+	ret = -pthread_create(&async->worker, NULL, async_worker, session);
+	if (ret) {
+		session->async = NULL;
+		pthread_cond_destroy(&async->cond);
+		pthread_mutex_destroy(&async->lock);
+		close(async->efd);
+		free(async);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief  File descriptor that polls readable while completions are queued.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ * @return the descriptor, or -EINVAL when not started
+ */
+int csi_iso7816_async_fd(csi_iso7816_session_t *session)
+{
+	return session->async ? session->async->efd : -EINVAL;
+}
+
+/**
+ * @brief  Queue an APDU exchange and return immediately.
+ *
+ * req->apdu, req->resp and req itself must stay valid until the request is
+ * returned by csi_iso7816_reap().
+ *
+ * With a non-zero req->sw_mask, a response whose SW does not match or a
+ * failed exchange halts the queue: the requests behind it complete with
+ * -ECANCELED without reaching the card, and so do the ones submitted
+ * until the halting request is reaped.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ * @param req      Request with apdu, apdu_len, resp and resp_size set
+ * @return 0 on success, -ECANCELED while halted, or negative errno on failure
+ */
+int csi_iso7816_submit(csi_iso7816_session_t *session, csi_iso7816_req_t *req)
+{
+	struct iso7816_async *async = session->async;
+
+	assert(req != NULL);
+
+	if (!async)
+		return -EINVAL;
+
+	req->result = -EINPROGRESS;
+
+	pthread_mutex_lock(&async->lock);
+	if (async->halt) {
+		pthread_mutex_unlock(&async->lock);
+		req->result = -ECANCELED;
+		return -ECANCELED;
+	}
+	async_push(&async->pending_tail, req);
+	pthread_cond_signal(&async->cond);
+	pthread_mutex_unlock(&async->lock);
+
+	return 0;
+}
+
+/**
+ * @brief  Take one completed request, without blocking.
+ *
+ * Requests complete in submission order. req->result holds the return of
+ * csi_iso7816_transceive() and req->resp_len the response length.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ * @return the completed request, or NULL when none is queued
+ */
+csi_iso7816_req_t *csi_iso7816_reap(csi_iso7816_session_t *session)
+{
+	struct iso7816_async *async = session->async;
+	csi_iso7816_req_t *req;
+	uint64_t count;
+
+	if (!async)
+		return NULL;
+
+	if (read(async->efd, &count, sizeof(count)) != sizeof(count))
+		return NULL;
+
+	pthread_mutex_lock(&async->lock);
+	req = async_pop(&async->done, &async->done_tail);
+	if (req && req == async->halt)
+		async->halt = NULL;
+	pthread_mutex_unlock(&async->lock);
+
+	return req;
+}
+
+/**
+ * @brief  Stop non-blocking operation.
+ *
+ * Waits for the exchange in progress. Requests not started complete with
+ * -ECANCELED and, as the completed ones, are dropped without being reaped.
+ *
+ * @param session  Session started with csi_iso7816_async_start()
+ */
+void csi_iso7816_async_stop(csi_iso7816_session_t *session)
+{
+	struct iso7816_async *async = session->async;
+	csi_iso7816_req_t *req;
+
+	if (!async)
+		return;
+
+	pthread_mutex_lock(&async->lock);
+	async->stop = 1;
+	pthread_cond_signal(&async->cond);
+	pthread_mutex_unlock(&async->lock);
+
+	pthread_join(async->worker, NULL);
+
+	while ((req = async_pop(&async->pending, &async->pending_tail)))
+		req->result = -ECANCELED;
+
+	pthread_cond_destroy(&async->cond);
+	pthread_mutex_destroy(&async->lock);
+	close(async->efd);
+	free(async);
+	session->async = NULL;
+}
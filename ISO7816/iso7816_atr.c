@@ -0,0 +1,461 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * ATR parsing and PPS negotiation, ISO/IEC 7816-3 clauses 8 and 9.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+#define ATR_TS_DIRECT		0x3b
+#define ATR_TS_INVERSE		0x3f
+
+/* historical bytes, ISO/IEC 7816-4 clause 12.1 */
+#define HIST_COMPACT_STATUS	0x00	/* compact-TLV, then 3 status bytes */
+#define HIST_COMPACT		0x80	/* compact-TLV */
+#define HIST_TAG_CAPABILITIES	0x7
+#define CAP_EXTENDED_LENGTH	0x40	/* third software function table byte */
+
+#define PPS_PPSS		0xff
+#define PPS_PPS1_PRESENT	0x10
+#define PPS_PPS2_PRESENT	0x20
+#define PPS_PPS3_PRESENT	0x40
+
+/* T=1 block guard time in etu */
+#define T1_BGT			22
+
+static const unsigned int iso7816_f_table[16] = {
+	372, 372, 558, 744, 1116, 1488, 1860, 0,
+	0, 512, 768, 1024, 1536, 2048, 0, 0,
+};
+
+static const unsigned int iso7816_d_table[16] = {
+	0, 1, 2, 4, 8, 16, 32, 64,
+	12, 20, 0, 0, 0, 0, 0, 0,
+};
+
+/**
+ * @brief  F of an FI index (ISO/IEC 7816-3 table 7).
+ *
+ * @param fi  FI index
+ * @return F, or 0 for a reserved index
+ */
+unsigned int csi_iso7816_fi_to_f(int fi)
+{
+	return fi >= 0 && fi < 16 ? iso7816_f_table[fi] : 0;
+}
+
+/**
+ * @brief  D of a DI index (ISO/IEC 7816-3 table 8).
+ *
+ * @param di  DI index
+ * @return D, or 0 for a reserved index
+ */
+unsigned int csi_iso7816_di_to_d(int di)
+{
+	return di >= 0 && di < 16 ? iso7816_d_table[di] : 0;
+}
+
+static void atr_defaults(csi_iso7816_atr_info_t *info)
+{
+	memset(info, 0, sizeof(*info));
+	info->fi = ISO7816_ATR_FI_DEFAULT;
+	info->di = ISO7816_ATR_DI_DEFAULT;
+	info->wi = ISO7816_ATR_WI_DEFAULT;
+	info->ifsc = ISO7816_ATR_IFSC_DEFAULT;
+	info->cwi = ISO7816_ATR_CWI_DEFAULT;
+	info->bwi = ISO7816_ATR_BWI_DEFAULT;
+	info->protocols = 1 << 0;
+}
+
+/* decode the interface bytes of level i (0 based), t is the T of TD(i) */
+static void atr_decode_level(csi_iso7816_atr_info_t *info, int i, int t, int *t1_seen)
+{
+	uint8_t bit = 1 << i;
+
+	if (i == 0) {
+		if (info->ta_present & bit) {
+			info->fi = info->ta[0] >> 4;
+			info->di = info->ta[0] & 0x0f;
+		}
+		if (info->tc_present & bit)
+			info->n = info->tc[0];
+		return;
+	}
+
+	if (i == 1) {
+		if (info->ta_present & bit) {
+			info->specific = 1;
+			info->specific_protocol = info->ta[1] & 0x0f;
+			info->specific_changeable = !(info->ta[1] & 0x80);
+			info->specific_implicit = !!(info->ta[1] & 0x10);
+		}
+		if ((info->tc_present & bit) && info->tc[1])
+			info->wi = info->tc[1];
+		return;
+	}
+
+	/* i >= 2: specific to the T indicated in TD(i) */
+	if (t != 1 || *t1_seen)
+		return;
+
+	*t1_seen = 1;
+	if ((info->ta_present & bit) && info->ta[i] && info->ta[i] != 0xff)
+		info->ifsc = info->ta[i];
+	if (info->tb_present & bit) {
+		info->cwi = info->tb[i] & 0x0f;
+		info->bwi = info->tb[i] >> 4;
+	}
+	if (info->tc_present & bit)
+		info->edc_crc = info->tc[i] & 0x01;
+}
+
+/* card capabilities from the compact-TLV objects of the historical bytes */
+static void atr_decode_hist(csi_iso7816_atr_info_t *info)
+{
+	int pos = 1, end = info->hist_len, len;
+
+	if (!end)
+		return;
+	if (info->hist[0] == HIST_COMPACT_STATUS)
+		end -= 3;
+	else if (info->hist[0] != HIST_COMPACT)
+		return;
+
+	while (pos < end) {
+		len = info->hist[pos] & 0x0f;
+		if (pos + 1 + len > end)
+			return;
+		if (info->hist[pos] >> 4 == HIST_TAG_CAPABILITIES && len >= 3)
+			info->extended_length = !!(info->hist[pos + 3] & CAP_EXTENDED_LENGTH);
+		pos += 1 + len;
+	}
+}
+
+/**
+ * @brief  Parse an Answer-To-Reset.
+ *
+ * Checks TS, walks T0 and the TAi/TBi/TCi/TDi chain, copies the historical
+ * bytes and verifies TCK when it is present.
+ *
+ * @param atr   ATR bytes, starting with TS
+ * @param len   Length of atr
+ * @param info  Out: raw interface bytes and decoded parameters
+ * @return 0 on success, -EBADMSG for a malformed ATR or a wrong TCK
+ */
+int csi_iso7816_atr_parse(const uint8_t *atr, size_t len, csi_iso7816_atr_info_t *info)
+{
+	size_t pos = 2, i;
+	uint8_t y, tck = 0;
+	int level = 0, t = 0, t1_seen = 0, first_td = 1;
+
+	assert(atr != NULL && info != NULL);
+
+	atr_defaults(info);
+
+	if (len < 2 || (atr[0] != ATR_TS_DIRECT && atr[0] != ATR_TS_INVERSE))
+		return -EBADMSG;
+
+	info->ts = atr[0];
+	info->t0 = atr[1];
+	info->hist_len = atr[1] & 0x0f;
+	y = atr[1] >> 4;
+
+	while (y) {
+		uint8_t bit = 1 << level;
+
+		if (level == ISO7816_ATR_MAX_LEVELS)
+			return -EBADMSG;
+
+		if (y & 0x1) {
+			if (pos >= len)
+				return -EBADMSG;
+			info->ta[level] = atr[pos++];
+			info->ta_present |= bit;
+		}
+		if (y & 0x2) {
+			if (pos >= len)
+				return -EBADMSG;
+			info->tb[level] = atr[pos++];
+			info->tb_present |= bit;
+		}
+		if (y & 0x4) {
+			if (pos >= len)
+				return -EBADMSG;
+			info->tc[level] = atr[pos++];
+			info->tc_present |= bit;
+		}
+
+		/* the bytes of this level belong to the T announced by TD(level) */
+		atr_decode_level(info, level, t, &t1_seen);
+
+		if (!(y & 0x8)) {
+			level++;
+			break;
+		}
+
+		if (pos >= len)
+			return -EBADMSG;
+		info->td[level] = atr[pos++];
+		info->td_present |= bit;
+		t = info->td[level] & 0x0f;
+		y = info->td[level] >> 4;
+
+		if (first_td) {
+			info->first_protocol = t;
+			info->protocols = 0;
+			first_td = 0;
+		}
+		if (t != 15)
+			info->protocols |= 1 << t;
+		if (t != 0)
+			info->tck_present = 1;
+
+		level++;
+	}
+	info->levels = level;
+
+	if (pos + info->hist_len > len)
+		return -EBADMSG;
+	memcpy(info->hist, atr + pos, info->hist_len);
+	pos += info->hist_len;
+	atr_decode_hist(info);
+
+	if (info->tck_present) {
+		if (pos >= len)
+			return -EBADMSG;
+		info->tck = atr[pos++];
+
+		for (i = 1; i < pos; i++)
+			tck ^= atr[i];
+		if (tck)
+			return -EBADMSG;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief  Limit the rates csi_iso7816_negotiate() may pick.
+ *
+ * @param session  Opened session
+ * @param max_d    Largest D the reader supports, 0 for no limit
+ * @param min_fd   Smallest F/D (clock cycles per etu) the reader supports,
+ *                 0 for no limit
+ */
+void csi_iso7816_set_reader_caps(csi_iso7816_session_t *session,
+				 unsigned int max_d, unsigned int min_fd)
+{
+	session->reader_max_d = max_d;
+	session->reader_min_fd = min_fd;
+}
+
+int iso7816_rate_supported(csi_iso7816_session_t *session, int fi, int di)
+{
+	unsigned int f = csi_iso7816_fi_to_f(fi), d = csi_iso7816_di_to_d(di);
+
+	if (!f || !d)
+		return 0;
+	if (session->reader_max_d && d > session->reader_max_d)
+		return 0;
+	if (session->reader_min_fd && f < session->reader_min_fd * d)
+		return 0;
+
+	return 1;
+}
+
+int iso7816_rate_is_default(int fi, int di)
+{
+	return csi_iso7816_fi_to_f(fi) == 372 && csi_iso7816_di_to_d(di) == 1;
+}
+
+/*
+ * Keep the F of the card (it comes with its fmax) and take the largest D
+ * not above the card one that the reader accepts.
+ */
+static void iso7816_pick_rate(csi_iso7816_session_t *session,
+			      const csi_iso7816_atr_info_t *info, int *fi, int *di)
+{
+	unsigned int card_d = csi_iso7816_di_to_d(info->di), d, best_d = 0;
+	int i;
+
+	*fi = ISO7816_ATR_FI_DEFAULT;
+	*di = ISO7816_ATR_DI_DEFAULT;
+
+	if (!csi_iso7816_fi_to_f(info->fi) || !card_d)
+		return;
+
+	for (i = 0; i < 16; i++) {
+		d = iso7816_d_table[i];
+		if (!d || d > card_d || d <= best_d)
+			continue;
+		if (!iso7816_rate_supported(session, info->fi, i))
+			continue;
+		best_d = d;
+		*fi = info->fi;
+		*di = i;
+	}
+}
+
+/**
+ * @brief  Run a PPS exchange at the current (default) rate.
+ *
+ * The reader rate is not changed, see csi_iso7816_negotiate().
+ *
+ * @param session   Session right after a reset
+ * @param protocol  T proposed in PPS0
+ * @param fi        FI proposed in PPS1
+ * @param di        DI proposed in PPS1
+ * @return 1 if the card accepted fi/di, 0 if it answered without PPS1
+ *         (default rate kept), or negative errno on failure
+ */
+int csi_iso7816_pps(csi_iso7816_session_t *session, int protocol, int fi, int di)
+{
+	uint8_t req[4], resp[6], pck = 0;
+	int ret, i, n;
+
+	assert(session != NULL);
+
+	req[0] = PPS_PPSS;
+	req[1] = PPS_PPS1_PRESENT | (protocol & 0x0f);
+	req[2] = (fi & 0x0f) << 4 | (di & 0x0f);
+	req[3] = req[0] ^ req[1] ^ req[2];
+
+	iso7816_rx_flush(session);
+
+	ret = iso7816_xmt(session, req, sizeof(req));
+	if (ret)
+		return ret;
+
+	/* PPSS and PPS0 tell how many bytes follow */
+	ret = iso7816_rcv(session, resp, 2, 2);
+	if (ret)
+		return ret;
+
+	if (resp[0] != PPS_PPSS || (resp[1] & 0x0f) != (req[1] & 0x0f) ||
+	    (resp[1] & (PPS_PPS2_PRESENT | PPS_PPS3_PRESENT)))
+		return -EPROTO;
+
+	n = (resp[1] & PPS_PPS1_PRESENT ? 1 : 0) + 1;
+	ret = iso7816_rcv(session, resp + 2, n, n);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < 2 + n; i++)
+		pck ^= resp[i];
+	if (pck)
+		return -EBADMSG;
+
+	if (!(resp[1] & PPS_PPS1_PRESENT))
+		return 0;
+
+	return resp[2] == req[2] ? 1 : -EPROTO;
+}
+
+void iso7816_atr_timing(csi_iso7816_session_t *session,
+			const csi_iso7816_atr_info_t *info,
+			struct dsmart_card_timing *timing)
+{
+	unsigned int f = csi_iso7816_fi_to_f(session->fi);
+	unsigned int d = csi_iso7816_di_to_d(session->di);
+
+	memset(timing, 0, sizeof(*timing));
+
+	/* N = 255 means the minimum character time, no extra guard time */
+	timing->egt = info->n == 0xff ? 0 : info->n;
+
+	if (session->protocol == DSMART_CARD_PROTOCOL_T0) {
+		timing->wwt = 960 * info->wi * d;
+	} else {
+		timing->cwt = 11 + (1 << info->cwi);
+		timing->bwt = 11 + (1 << info->bwi) * 960 * 372 * d / f;
+		timing->bgt = T1_BGT;
+		/* the driver applies wwt to every RCV, do not cut a block short */
+		timing->wwt = timing->bwt;
+	}
+}
+
+/**
+ * @brief  Apply the ATR of the last reset: protocol, fastest rate, timing.
+ *
+ * Parses session->atr, picks the highest F/D supported by both the card and
+ * the reader, runs PPS unless the card is in specific mode, then programs
+ * the protocol, the baud rate and the waiting times derived from the ATR.
+ * A failed PPS warm resets the card and keeps the default rate.
+ *
+ * @param session  Session right after csi_iso7816_cold_reset()
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_negotiate(csi_iso7816_session_t *session)
+{
+	csi_iso7816_atr_info_t *info = &session->atr_info;
+	struct dsmart_card_timing timing;
+	int ret, protocol, fi, di, resets = 0, pps_failed = 0;
+
+	assert(session != NULL);
+
+	session->t1_ifsd_want = 0;
+
+again:
+	ret = csi_iso7816_atr_parse(session->atr.atr_buffer, session->atr.len, info);
+	if (ret)
+		return ret;
+
+	fi = ISO7816_ATR_FI_DEFAULT;
+	di = ISO7816_ATR_DI_DEFAULT;
+
+	if (info->specific) {
+		protocol = info->specific_protocol;
+		if (!info->specific_implicit) {
+			if (iso7816_rate_supported(session, info->fi, info->di)) {
+				fi = info->fi;
+				di = info->di;
+			} else if (info->specific_changeable && !resets++) {
+				/* a warm reset brings the card to negotiable mode */
+				ret = csi_iso7816_warm_reset(session);
+				if (ret)
+					return ret;
+				goto again;
+			} else {
+				return -EOPNOTSUPP;
+			}
+		}
+	} else {
+		protocol = info->first_protocol;
+		if (!pps_failed)
+			iso7816_pick_rate(session, info, &fi, &di);
+
+		if (!iso7816_rate_is_default(fi, di)) {
+			ret = csi_iso7816_pps(session, protocol, fi, di);
+			if (ret == 0) {
+				fi = ISO7816_ATR_FI_DEFAULT;
+				di = ISO7816_ATR_DI_DEFAULT;
+			} else if (ret < 0) {
+				/* the card is in an undefined state after a failed PPS */
+				if (resets++)
+					return ret;
+				pps_failed = 1;
+				ret = csi_iso7816_warm_reset(session);
+				if (ret)
+					return ret;
+				goto again;
+			}
+		}
+	}
+
+	ret = csi_iso7816_set_protocol(session, protocol);
+	if (ret)
+		return ret;
+
+	ret = csi_iso7816_set_baud(session, fi, di);
+	if (ret)
+		return ret;
+
+	iso7816_atr_timing(session, info, &timing);
+
+	return csi_iso7816_set_timing(session, &timing);
+}
@@ -0,0 +1,258 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Per card model cache of the negotiated session parameters. Cards of the
+ * same model answer the same ATR, so a known ATR lets the session start
+ * without working out the rate, the waiting times and the IFSD again.
+ *
+ * The cache is a text file, one card per line, most recent first:
+ *   <atr hash> <protocol> <fi> <di> <ifsd> <wwt> <cwt> <bwt> <bgt> <egt>
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+struct cache_entry {
+	unsigned long long hash;
+	struct iso7816_params params;
+};
+
+/* 64-bit FNV-1a of the ATR */
+static unsigned long long cache_atr_hash(const csi_iso7816_session_t *session)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	for (i = 0; i < session->atr.len; i++) {
+		hash ^= session->atr.atr_buffer[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* 1 for an entry, 0 for a line to skip */
+static int cache_parse(const char *line, struct cache_entry *entry)
+{
+	struct iso7816_params *p = &entry->params;
+	struct dsmart_card_timing *t = &p->timing;
+
+	if (line[0] == '#')
+		return 0;
+
+	return sscanf(line, "%llx %d %d %d %d %u %u %u %u %u",
+		      &entry->hash, &p->protocol, &p->fi, &p->di,
+		      &p->ifsd, &t->wwt, &t->cwt, &t->bwt, &t->bgt, &t->egt) == 10;
+}
+
+static void cache_print(FILE *file, const struct cache_entry *entry)
+{
+	const struct iso7816_params *p = &entry->params;
+	const struct dsmart_card_timing *t = &p->timing;
+
+	fprintf(file, "%016llx %d %d %d %d %u %u %u %u %u\n",
+		entry->hash, p->protocol, p->fi, p->di,
+		p->ifsd, t->wwt, t->cwt, t->bwt, t->bgt, t->egt);
+}
+
+static int cache_lookup(const char *path, unsigned long long hash, struct cache_entry *entry)
+{
+	char line[128];
+	FILE *file;
+	int found = 0;
+
+	file = fopen(path, "r");
+	if (!file)
+		return errno == ENOENT ? 0 : -errno;
+
+	while (!found && fgets(line, sizeof(line), file))
+		found = cache_parse(line, entry) && entry->hash == hash;
+
+	fclose(file);
+
+	return found;
+}
+
+void iso7816_params_get(const csi_iso7816_session_t *session, struct iso7816_params *params)
+{
+	params->protocol = session->protocol;
+	params->fi = session->fi;
+	params->di = session->di;
+	params->ifsd = session->protocol == DSMART_CARD_PROTOCOL_T1 ? session->t1_ifsd : 0;
+	params->timing = session->timing;
+}
+
+int iso7816_params_replay(csi_iso7816_session_t *session, const struct iso7816_params *params)
+{
+	csi_iso7816_atr_info_t *info = &session->atr_info;
+	struct dsmart_card_timing spec;
+	int ret;
+
+	/* the reader may have changed since the parameters were taken */
+	if ((params->protocol != DSMART_CARD_PROTOCOL_T0 &&
+	     params->protocol != DSMART_CARD_PROTOCOL_T1) ||
+	    !iso7816_rate_supported(session, params->fi, params->di) ||
+	    params->ifsd < 0 || params->ifsd > ISO7816_T1_IFS_MAX)
+		return 0;
+
+	/* T=1 framing (IFSC, EDC) still comes from the ATR */
+	ret = csi_iso7816_atr_parse(session->atr.atr_buffer, session->atr.len, info);
+	if (ret)
+		return ret;
+
+	if (!info->specific && !iso7816_rate_is_default(params->fi, params->di)) {
+		ret = csi_iso7816_pps(session, params->protocol, params->fi, params->di);
+		if (ret != 1) {
+			/* a single PPS per reset, give negotiate a fresh card */
+			ret = csi_iso7816_warm_reset(session);
+			return ret ? ret : 0;
+		}
+	}
+
+	ret = csi_iso7816_set_protocol(session, params->protocol);
+	if (ret)
+		return ret;
+
+	ret = csi_iso7816_set_baud(session, params->fi, params->di);
+	if (ret)
+		return ret;
+
+	/* the ATR gives the limits, the parameters what the card was tuned to */
+	iso7816_atr_timing(session, info, &spec);
+	ret = csi_iso7816_set_timing(session, &spec);
+	if (ret)
+		return ret;
+
+	ret = iso7816_tune_program(session, &params->timing);
+	if (ret)
+		return ret;
+
+	session->t1_ifsd_want = params->ifsd;
+
+	return 1;
+}
+
+/**
+ * @brief  Replay the parameters cached for the card of the last reset.
+ *
+ * Looks the ATR up in the cache file. On a hit, the ATR is parsed, PPS is
+ * sent with the cached rate and the protocol, rate, waiting times and T=1
+ * IFSD are programmed without deriving them again. On a miss, or when the
+ * card refuses the cached rate (the card is then warm reset), nothing is
+ * applied and csi_iso7816_negotiate() is to be used.
+ *
+ * @param session  Session right after csi_iso7816_cold_reset()
+ * @param path     Cache file, NULL for ISO7816_CACHE_DEFAULT_PATH
+ * @return 1 if replayed, 0 if not, or negative errno on failure
+ */
+int csi_iso7816_cache_load(csi_iso7816_session_t *session, const char *path)
+{
+	struct cache_entry entry;
+	int ret;
+
+	assert(session != NULL);
+
+	ret = cache_lookup(path ? path : ISO7816_CACHE_DEFAULT_PATH,
+			   cache_atr_hash(session), &entry);
+	if (ret <= 0)
+		return ret;
+
+	return iso7816_params_replay(session, &entry.params);
+}
+
+/* the directory of the cache file, e.g. /var/lib/iso7816 on first use */
+static int cache_mkdir(const char *path)
+{
+	char dir[256];
+	const char *slash = strrchr(path, '/');
+	size_t len;
+
+	if (!slash || slash == path)
+		return 0;
+
+	len = slash - path;
+	if (len >= sizeof(dir))
+		return -ENAMETOOLONG;
+	memcpy(dir, path, len);
+	dir[len] = '\0';
+
+	if (mkdir(dir, 0700) && errno != EEXIST)
+		return -errno;
+
+	return 0;
+}
+
+/**
+ * @brief  Record the parameters in use for the card of the last reset.
+ *
+ * Stores the protocol, rate, waiting times and, once an exchange has
+ * negotiated it, the T=1 IFSD under a hash of the ATR. The file keeps the
+ * ISO7816_CACHE_MAX_ENTRIES most recently stored cards. The directory of
+ * the file is created, readable by the owner only, when missing.
+ *
+ * @param session  Session after csi_iso7816_negotiate() and, preferably,
+ *                 a first exchange
+ * @param path     Cache file, NULL for ISO7816_CACHE_DEFAULT_PATH
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_cache_store(csi_iso7816_session_t *session, const char *path)
+{
+	struct cache_entry entry, old;
+	char tmp[256], line[128];
+	FILE *in, *out;
+	int count = 1;
+	int ret = 0;
+
+	assert(session != NULL);
+
+	if (!path)
+		path = ISO7816_CACHE_DEFAULT_PATH;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid()) >= (int)sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	memset(&entry, 0, sizeof(entry));
+	entry.hash = cache_atr_hash(session);
+	iso7816_params_get(session, &entry.params);
+
+	ret = cache_mkdir(path);
+	if (ret)
+		return ret;
+
+	out = fopen(tmp, "w");
+	if (!out)
+		return -errno;
+
+	fprintf(out, "# atr-hash protocol fi di ifsd wwt cwt bwt bgt egt\n");
+	cache_print(out, &entry);
+
+	/* carry the other cards over, dropping the least recent ones */
+	in = fopen(path, "r");
+	if (in) {
+		while (count < ISO7816_CACHE_MAX_ENTRIES && fgets(line, sizeof(line), in)) {
+			if (!cache_parse(line, &old) || old.hash == entry.hash)
+				continue;
+			cache_print(out, &old);
+			count++;
+		}
+		fclose(in);
+	}
+
+	if (ferror(out))
+		ret = -EIO;
+	if (fclose(out) && !ret)
+		ret = -errno;
+	/* rename() replaces the file atomically for concurrent readers */
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+	if (ret)
+		unlink(tmp);
+
+	return ret;
+}
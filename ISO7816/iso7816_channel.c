@@ -0,0 +1,422 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Logical channels, ISO/IEC 7816-4 clause 5.4.1 and 11.1.2. Each applet
+ * stays selected on its own channel so switching between applets costs no
+ * SELECT.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+#define INS_MANAGE_CHANNEL	0x70
+#define INS_SELECT		0xa4
+
+#define MANAGE_CHANNEL_OPEN	0x00
+#define MANAGE_CHANNEL_CLOSE	0x80
+
+#define SELECT_BY_AID		0x04
+#define SELECT_FCI		0x00
+#define SELECT_NO_DATA		0x0c
+
+#define CLA_PROPRIETARY		0x80
+#define CLA_FURTHER		0x40
+#define CLA_FURTHER_SM		0x20
+#define CLA_CHAINING		0x10
+#define CLA_FIRST_SM		0x0c
+#define CLA_FIRST_SM_CLAUSE6	0x08
+
+#define SW_WRONG_P1P2		0x6a86
+#define SW_WRONG_LC_P1P2	0x6a87
+
+/* a short command APDU with the largest data field */
+#define CHANNEL_APDU_STACK	(5 + ISO7816_SHORT_LC_MAX + 1)
+
+/*
+ * Rewrite the channel number of an interindustry CLA. Channels 0 to 3 use
+ * the first interindustry coding, 4 to 19 the further one. The chaining
+ * bit is kept, secure messaging is mapped to what the target coding has.
+ */
+uint8_t iso7816_channel_cla(uint8_t cla, int channel)
+{
+	uint8_t chain = cla & CLA_CHAINING;
+	int sm;
+
+	if (cla & CLA_FURTHER)
+		sm = !!(cla & CLA_FURTHER_SM);
+	else
+		sm = !!(cla & CLA_FIRST_SM);
+
+	if (channel < 4) {
+		if (cla & CLA_FURTHER)
+			return chain | (sm ? CLA_FIRST_SM_CLAUSE6 : 0) | channel;
+		return chain | (cla & CLA_FIRST_SM) | channel;
+	}
+
+	return CLA_FURTHER | (sm ? CLA_FURTHER_SM : 0) | chain | (channel - 4);
+}
+
+static int channel_aid_equal(const uint8_t *a, int a_len, const uint8_t *b, size_t b_len)
+{
+	return a_len > 0 && (size_t)a_len == b_len && !memcmp(a, b, b_len);
+}
+
+static struct iso7816_fci *fci_lookup(csi_iso7816_session_t *session,
+				      const uint8_t *aid, size_t aid_len)
+{
+	int i;
+
+	for (i = 0; i < ISO7816_FCI_CACHE_SIZE; i++) {
+		struct iso7816_fci *fci = &session->fci_cache[i];
+
+		if (channel_aid_equal(fci->aid, fci->aid_len, aid, aid_len))
+			return fci;
+	}
+
+	return NULL;
+}
+
+/* a free entry, or the least recently used one */
+static struct iso7816_fci *fci_alloc(csi_iso7816_session_t *session)
+{
+	struct iso7816_fci *lru = &session->fci_cache[0];
+	int i;
+
+	for (i = 0; i < ISO7816_FCI_CACHE_SIZE; i++) {
+		struct iso7816_fci *fci = &session->fci_cache[i];
+
+		if (!fci->aid_len)
+			return fci;
+		if (fci->last_use < lru->last_use)
+			lru = fci;
+	}
+
+	return lru;
+}
+
+static int fci_copy(const uint8_t *data, size_t len,
+		    uint8_t *fci, size_t fci_size, size_t *fci_len)
+{
+	if (fci_len)
+		*fci_len = len;
+	if (!fci || !len)
+		return 0;
+	if (len > fci_size)
+		return -ENOSPC;
+
+	memcpy(fci, data, len);
+
+	return 0;
+}
+
+void iso7816_channel_reset(csi_iso7816_session_t *session)
+{
+	memset(session->channels, 0, sizeof(session->channels));
+	session->channels[0].open = 1;
+}
+
+/**
+ * @brief  Set how many logical channels csi_iso7816_select_aid() may open.
+ *
+ * Defaults to ISO7816_DEFAULT_CHANNELS. A card refusing MANAGE CHANNEL
+ * lowers it to the channels opened so far.
+ *
+ * @param session   Opened session
+ * @param channels  1 (basic channel only) to ISO7816_MAX_CHANNELS
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_max_channels(csi_iso7816_session_t *session, int channels)
+{
+	assert(session != NULL);
+
+	if (channels < 1 || channels > ISO7816_MAX_CHANNELS)
+		return -EINVAL;
+
+	session->max_channels = channels;
+
+	return 0;
+}
+
+/* MANAGE CHANNEL open, the card assigns the number */
+static int channel_open(csi_iso7816_session_t *session)
+{
+	static const uint8_t apdu[] = {
+		0x00, INS_MANAGE_CHANNEL, MANAGE_CHANNEL_OPEN, 0x00, 0x01,
+	};
+	uint8_t resp[3];
+	size_t resp_len;
+	int channel;
+	int ret;
+
+	ret = csi_iso7816_transceive(session, apdu, sizeof(apdu), resp, sizeof(resp), &resp_len);
+	if (ret)
+		return ret;
+
+	if (resp_len != 3 || resp[1] != 0x90 || resp[2] != 0x00)
+		return -EOPNOTSUPP;
+
+	channel = resp[0];
+	if (channel < 1 || channel >= ISO7816_MAX_CHANNELS || session->channels[channel].open) {
+		fprintf(stderr, "iso7816: card opened unexpected channel %d\n", channel);
+		return -EPROTO;
+	}
+
+	session->channels[channel].open = 1;
+
+	return channel;
+}
+
+/* a channel to select a new applet on: free, newly opened, or the LRU one */
+static int channel_pick(csi_iso7816_session_t *session)
+{
+	int opened = 0;
+	int lru = -1;
+	int ret;
+	int i;
+
+	for (i = 0; i < ISO7816_MAX_CHANNELS; i++) {
+		struct iso7816_channel *ch = &session->channels[i];
+
+		if (!ch->open)
+			continue;
+		if (!ch->aid_len)
+			return i;
+
+		opened++;
+		if (lru < 0 || ch->last_use < session->channels[lru].last_use)
+			lru = i;
+	}
+
+	if (opened < session->max_channels) {
+		ret = channel_open(session);
+		if (ret > 0)
+			return ret;
+		if (ret != -EOPNOTSUPP)
+			return ret;
+
+		/* no more channels on this card */
+		session->max_channels = opened;
+	}
+
+	return lru;
+}
+
+static int select_send(csi_iso7816_session_t *session, int channel,
+		       const uint8_t *aid, size_t aid_len, uint8_t p2,
+		       uint8_t *resp, size_t resp_size, size_t *resp_len)
+{
+	uint8_t apdu[5 + ISO7816_AID_MAX + 1];
+	size_t len = 0;
+
+	apdu[len++] = iso7816_channel_cla(0x00, channel);
+	apdu[len++] = INS_SELECT;
+	apdu[len++] = SELECT_BY_AID;
+	apdu[len++] = p2;
+	apdu[len++] = aid_len;
+	memcpy(apdu + len, aid, aid_len);
+	len += aid_len;
+	if (p2 == SELECT_FCI)
+		apdu[len++] = 0x00;
+
+	return csi_iso7816_transceive(session, apdu, len, resp, resp_size, resp_len);
+}
+
+/**
+ * @brief  Select an applet, keeping it selected on its own logical channel.
+ *
+ * An AID already selected on a channel is returned without any APDU.
+ * Otherwise the AID is selected on a free channel, a new one opened with
+ * MANAGE CHANNEL, or the least recently used one. A cached FCI lets the
+ * SELECT skip the response data (P2 = 0x0C). The cache is dropped on every
+ * reset, which is also when a swapped card is first seen.
+ *
+ * @param session   Session ready for exchanges
+ * @param aid       Application identifier, 5 to 16 bytes
+ * @param aid_len   Length of aid
+ * @param fci       Buffer for the SELECT response data, may be NULL
+ * @param fci_size  Size of fci
+ * @param fci_len   Out: length of the response data, may be NULL
+ * @param channel   Out: channel the applet is selected on
+ * @param sw        Out: status word of the SELECT, channel is valid on 9000
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_select_aid(csi_iso7816_session_t *session,
+			   const uint8_t *aid, size_t aid_len,
+			   uint8_t *fci, size_t fci_size, size_t *fci_len,
+			   int *channel, uint16_t *sw)
+{
+	uint8_t resp[ISO7816_FCI_MAX + 2];
+	struct iso7816_fci *cached;
+	struct iso7816_channel *ch;
+	size_t resp_len;
+	uint8_t p2;
+	int ret;
+	int i;
+
+	assert(session != NULL && aid != NULL && channel != NULL && sw != NULL);
+
+	if (aid_len < 5 || aid_len > ISO7816_AID_MAX)
+		return -EINVAL;
+
+	session->use_tick++;
+	cached = fci_lookup(session, aid, aid_len);
+
+	for (i = 0; i < ISO7816_MAX_CHANNELS; i++) {
+		ch = &session->channels[i];
+		if (!ch->open || !channel_aid_equal(ch->aid, ch->aid_len, aid, aid_len))
+			continue;
+
+		ch->last_use = session->use_tick;
+		*channel = i;
+		*sw = ISO7816_SW_OK;
+		if (!cached)
+			return fci_copy(NULL, 0, fci, fci_size, fci_len);
+		cached->last_use = session->use_tick;
+		return fci_copy(cached->data, cached->len, fci, fci_size, fci_len);
+	}
+
+	ret = channel_pick(session);
+	if (ret < 0)
+		return ret;
+	*channel = ret;
+	ch = &session->channels[ret];
+
+	/* whatever happens, the previous applet is no longer known to be selected */
+	ch->aid_len = 0;
+	ch->last_use = session->use_tick;
+
+	p2 = cached ? SELECT_NO_DATA : SELECT_FCI;
+	ret = select_send(session, *channel, aid, aid_len, p2, resp, sizeof(resp), &resp_len);
+	if (!ret && p2 == SELECT_NO_DATA) {
+		*sw = resp[resp_len - 2] << 8 | resp[resp_len - 1];
+		/* not every card accepts "no response data" */
+		if (*sw == SW_WRONG_P1P2 || *sw == SW_WRONG_LC_P1P2) {
+			p2 = SELECT_FCI;
+			ret = select_send(session, *channel, aid, aid_len, p2,
+					  resp, sizeof(resp), &resp_len);
+		}
+	}
+	if (ret)
+		return ret;
+
+	resp_len -= 2;
+	*sw = resp[resp_len] << 8 | resp[resp_len + 1];
+	if (*sw != ISO7816_SW_OK) {
+		if (cached)
+			cached->aid_len = 0;
+		return fci_copy(NULL, 0, fci, fci_size, fci_len);
+	}
+
+	memcpy(ch->aid, aid, aid_len);
+	ch->aid_len = aid_len;
+
+	if (p2 == SELECT_FCI) {
+		if (!cached)
+			cached = fci_alloc(session);
+		memcpy(cached->aid, aid, aid_len);
+		cached->aid_len = aid_len;
+		memcpy(cached->data, resp, resp_len);
+		cached->len = resp_len;
+	}
+	cached->last_use = session->use_tick;
+
+	return fci_copy(cached->data, cached->len, fci, fci_size, fci_len);
+}
+
+/**
+ * @brief  Exchange one command APDU on a logical channel.
+ *
+ * The channel number is encoded into CLA (ISO/IEC 7816-4 5.4.1), the rest
+ * of the APDU is sent as given. Applets are switched with
+ * csi_iso7816_select_aid(), not with a SELECT sent here.
+ *
+ * @param session    Session ready for exchanges
+ * @param channel    Channel returned by csi_iso7816_select_aid()
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param resp       Buffer for the response body followed by SW1 SW2
+ * @param resp_size  Size of resp
+ * @param resp_len   Out: length of the response APDU
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_channel_transceive(csi_iso7816_session_t *session, int channel,
+				   const uint8_t *apdu, size_t apdu_len,
+				   uint8_t *resp, size_t resp_size, size_t *resp_len)
+{
+	uint8_t stack[CHANNEL_APDU_STACK];
+	uint8_t *copy = stack;
+	int ret;
+
+	assert(session != NULL && apdu != NULL);
+
+	if (channel < 0 || channel >= ISO7816_MAX_CHANNELS || !session->channels[channel].open)
+		return -EBADF;
+	if (apdu_len < 4 || (apdu[0] & CLA_PROPRIETARY))
+		return -EINVAL;
+
+	session->channels[channel].last_use = ++session->use_tick;
+
+	if (apdu_len > sizeof(stack)) {
+		copy = malloc(apdu_len);
+		if (!copy)
+			return -ENOMEM;
+	}
+
+	memcpy(copy, apdu, apdu_len);
+	copy[0] = iso7816_channel_cla(apdu[0], channel);
+
+	ret = csi_iso7816_transceive(session, copy, apdu_len, resp, resp_size, resp_len);
+
+	if (copy != stack)
+		free(copy);
+
+	return ret;
+}
+
+/**
+ * @brief  Close a logical channel with MANAGE CHANNEL.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  1 to ISO7816_MAX_CHANNELS - 1
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_close_channel(csi_iso7816_session_t *session, int channel)
+{
+	uint8_t apdu[4] = {
+		0x00, INS_MANAGE_CHANNEL, MANAGE_CHANNEL_CLOSE, channel,
+	};
+	uint8_t resp[2];
+	size_t resp_len;
+	int ret;
+
+	assert(session != NULL);
+
+	if (channel < 1 || channel >= ISO7816_MAX_CHANNELS || !session->channels[channel].open)
+		return -EBADF;
+
+	ret = csi_iso7816_transceive(session, apdu, sizeof(apdu), resp, sizeof(resp), &resp_len);
+	if (ret)
+		return ret;
+
+	if (resp[0] != 0x90 || resp[1] != 0x00)
+		return -EIO;
+
+	memset(&session->channels[channel], 0, sizeof(session->channels[channel]));
+
+	return 0;
+}
+
+/**
+ * @brief  Drop the cached SELECT responses, e.g. after installing applets.
+ *
+ * @param session  Opened session
+ */
+void csi_iso7816_fci_flush(csi_iso7816_session_t *session)
+{
+	memset(session->fci_cache, 0, sizeof(session->fci_cache));
+}
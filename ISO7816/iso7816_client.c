@@ -0,0 +1,221 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Client side of iso7816d, the daemon sharing the reader between processes.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include "iso7816.h"
+#include "iso7816_ipc.h"
+
+/* one request, one reply of the same op */
+static int client_call(csi_iso7816_client_t *client, uint32_t op,
+		       const void *payload, size_t len,
+		       void *reply, size_t reply_size, size_t *reply_len)
+{
+	struct iso7816_ipc_hdr hdr = {
+		.op = op,
+		.len = len,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &hdr, .iov_len = sizeof(hdr) },
+		{ .iov_base = (void *)payload, .iov_len = len },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = 2,
+	};
+	ssize_t n;
+
+	if (client->fd < 0)
+		return -ENOTCONN;
+
+	do {
+		n = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+
+	iov[1].iov_base = reply;
+	iov[1].iov_len = reply_size;
+	do {
+		n = recvmsg(client->fd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -errno;
+	if (n == 0)
+		return -ECONNRESET;
+	if ((size_t)n < sizeof(hdr) || hdr.op != op)
+		return -EPROTO;
+	if (msg.msg_flags & MSG_TRUNC)
+		return -ENOSPC;
+
+	if (reply_len)
+		*reply_len = n - sizeof(hdr);
+
+	return hdr.result;
+}
+
+/**
+ * @brief  Connect to iso7816d.
+ *
+ * @param client    Client to initialize
+ * @param path      Socket path, NULL for ISO7816D_DEFAULT_SOCKET
+ * @param priority  ISO7816_PRIO_HIGH, ISO7816_PRIO_NORMAL or ISO7816_PRIO_LOW
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_connect(csi_iso7816_client_t *client, const char *path, int priority)
+{
+	struct sockaddr_un addr = {
+		.sun_family = AF_UNIX,
+	};
+	uint32_t prio = priority;
+	int ret;
+
+	assert(client != NULL);
+
+	client->fd = -1;
+
+	if (priority < 0 || priority >= ISO7816_PRIO_CLASSES)
+		return -EINVAL;
+
+	if (!path)
+		path = ISO7816D_DEFAULT_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -ENAMETOOLONG;
+	strcpy(addr.sun_path, path);
+
+	client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (client->fd < 0)
+		return -errno;
+
+	if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		ret = -errno;
+		goto err;
+	}
+
+	ret = client_call(client, ISO7816_IPC_HELLO, &prio, sizeof(prio), NULL, 0, NULL);
+	if (ret)
+		goto err;
+
+	return 0;
+
+err:
+	close(client->fd);
+	client->fd = -1;
+	return ret;
+}
+
+/**
+ * @brief  Disconnect, ending a transaction still open.
+ *
+ * @param client  Connected client
+ */
+void csi_iso7816_client_close(csi_iso7816_client_t *client)
+{
+	if (client->fd < 0)
+		return;
+
+	close(client->fd);
+	client->fd = -1;
+}
+
+/**
+ * @brief  Wait until the card is exclusive to this client.
+ *
+ * APDUs of other clients are held until csi_iso7816_client_end(). The
+ * daemon ends a transaction left idle for too long, the next call then
+ * fails with -ETIMEDOUT.
+ *
+ * @param client  Connected client
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_begin(csi_iso7816_client_t *client)
+{
+	return client_call(client, ISO7816_IPC_BEGIN, NULL, 0, NULL, 0, NULL);
+}
+
+/**
+ * @brief  End the transaction started by csi_iso7816_client_begin().
+ *
+ * @param client  Connected client
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_end(csi_iso7816_client_t *client)
+{
+	return client_call(client, ISO7816_IPC_END, NULL, 0, NULL, 0, NULL);
+}
+
+/**
+ * @brief  Exchange one command APDU through the daemon.
+ *
+ * @param client     Connected client
+ * @param apdu       Command APDU
+ * @param apdu_len   Length of apdu
+ * @param resp       Buffer for the response body followed by SW1 SW2
+ * @param resp_size  Size of resp
+ * @param resp_len   Out: length of the response APDU
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_client_transceive(csi_iso7816_client_t *client,
+				  const uint8_t *apdu, size_t apdu_len,
+				  uint8_t *resp, size_t resp_size, size_t *resp_len)
+{
+	assert(apdu != NULL && resp != NULL && resp_len != NULL);
+
+	if (apdu_len > ISO7816_IPC_MAX_PAYLOAD)
+		return -EINVAL;
+
+	return client_call(client, ISO7816_IPC_TRANSMIT, apdu, apdu_len,
+			   resp, resp_size, resp_len);
+}
+
+/**
+ * @brief  Fetch the latency statistics of the daemon session.
+ *
+ * @param client  Connected client
+ * @param stats   Out: statistics, see csi_iso7816_trace_get()
+ * @return 0 on success, -ENODATA when iso7816d runs without -t,
+ *         or negative errno on failure
+ */
+int csi_iso7816_client_stats(csi_iso7816_client_t *client, csi_iso7816_stats_t *stats)
+{
+	uint32_t index;
+	size_t len;
+	int ret;
+
+	assert(stats != NULL);
+
+	/* one INS per message, index 0 first as it takes the snapshot */
+	for (index = 0; index < 256; index++) {
+		ret = client_call(client, ISO7816_IPC_STATS, &index, sizeof(index),
+				  &stats->ins[index], sizeof(stats->ins[index]), &len);
+		if (ret)
+			return ret;
+		if (len != sizeof(stats->ins[index]))
+			return -EPROTO;
+	}
+
+	index = ISO7816_IPC_STATS_ERRVAL;
+	ret = client_call(client, ISO7816_IPC_STATS, &index, sizeof(index),
+			  stats->errval, sizeof(stats->errval), &len);
+	if (ret)
+		return ret;
+	if (len != sizeof(stats->errval))
+		return -EPROTO;
+
+	index = ISO7816_IPC_STATS_RECOVER;
+	ret = client_call(client, ISO7816_IPC_STATS, &index, sizeof(index),
+			  stats->recover, sizeof(stats->recover), &len);
+	if (ret)
+		return ret;
+
+	return len == sizeof(stats->recover) ? 0 : -EPROTO;
+}
@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Streaming READ BINARY and READ RECORD, ISO/IEC 7816-4 clauses 11.2.3 and
+ * 11.3.3. Every command asks for the largest Le the card takes, so a large
+ * EF costs as few APDUs as the protocol allows, and the response data is
+ * received straight into the caller buffer or the buffer handed to the
+ * callback.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+#define INS_READ_BINARY		0xb0
+#define INS_READ_RECORD		0xb2
+
+#define READ_RECORD_BY_NUMBER	0x04
+#define READ_RECORD_MAX		254
+
+/* P1 bit 8 selects the SFI coding, offsets have 15 bits */
+#define READ_OFFSET_MAX		0x7fff
+
+#define SW_END_OF_FILE		0x6282
+#define SW_WRONG_LENGTH		0x6700
+
+static size_t file_le_max(csi_iso7816_session_t *session)
+{
+	if (!session->le_max)
+		session->le_max = session->atr_info.extended_length ?
+				  ISO7816_EXT_LE_MAX : ISO7816_SHORT_LE_MAX;
+
+	return session->le_max;
+}
+
+/* case 2 APDU, with a short Le when it fits */
+static size_t file_apdu(uint8_t *apdu, uint8_t cla, uint8_t ins,
+			uint8_t p1, uint8_t p2, size_t le)
+{
+	apdu[0] = cla;
+	apdu[1] = ins;
+	apdu[2] = p1;
+	apdu[3] = p2;
+
+	if (le <= ISO7816_SHORT_LE_MAX) {
+		apdu[4] = le & 0xff;
+		return 5;
+	}
+
+	apdu[4] = 0;
+	apdu[5] = (le >> 8) & 0xff;
+	apdu[6] = le & 0xff;
+
+	return 7;
+}
+
+/*
+ * One read of at most *le bytes into data, *le is then the Le last asked.
+ * 6Cxx gives the Le to ask again with, 6700 to an extended Le moves the
+ * session to short ones. 61xx left by the exchange (T=0 stops at Le) is a
+ * full read.
+ */
+static int file_read(csi_iso7816_session_t *session, uint8_t cla, uint8_t ins,
+		     uint8_t p1, uint8_t p2, size_t *le,
+		     uint8_t *data, size_t *len, uint16_t *sw)
+{
+	size_t size = *le, hint;
+	uint8_t apdu[7];
+	int ret, retry;
+
+	for (retry = 0; retry < 3; retry++) {
+		ret = csi_iso7816_exchange(session, apdu, file_apdu(apdu, cla, ins, p1, p2, *le),
+					   data, size, len, sw);
+		if (ret)
+			return ret;
+
+		if ((*sw >> 8) == 0x6c) {
+			hint = *sw & 0xff ? *sw & 0xff : ISO7816_SHORT_LE_MAX;
+			if (hint > size)
+				return 0;
+			*le = hint;
+		} else if (*sw == SW_WRONG_LENGTH && *le > ISO7816_SHORT_LE_MAX) {
+			session->le_max = ISO7816_SHORT_LE_MAX;
+			*le = ISO7816_SHORT_LE_MAX;
+		} else {
+			return 0;
+		}
+	}
+
+	return 0;
+}
+
+static int file_check(csi_iso7816_session_t *session, int channel)
+{
+	if (channel < 0 || channel >= ISO7816_MAX_CHANNELS || !session->channels[channel].open)
+		return -EBADF;
+
+	return 0;
+}
+
+/**
+ * @brief  Read a transparent EF with as few READ BINARY as possible.
+ *
+ * Each READ BINARY asks for the largest Le of the session: extended when
+ * the ATR announces extended lengths and the card accepts them, 256
+ * otherwise. The data goes straight into buf, or into a buffer of that
+ * size passed to cb. Reading stops after len bytes, at the end of the
+ * file (6282 or a short read), on an error status or once the offset
+ * passes 32767, the largest one READ BINARY B0 can address.
+ *
+ * @param session   Session ready for exchanges
+ * @param channel   Logical channel the EF is selected on, 0 for the basic one
+ * @param offset    Offset of the first byte, up to 32767
+ * @param len       Bytes to read at most, the size of buf when given
+ * @param buf       Buffer for the data, NULL to use cb
+ * @param cb        Called for each piece with its offset, when buf is NULL.
+ *                  Returns 0 to go on, or a negative errno to stop with.
+ * @param priv      Passed to cb
+ * @param read_len  Out: bytes read
+ * @param sw        Out: status word of the last READ BINARY
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_read_binary(csi_iso7816_session_t *session, int channel,
+			    size_t offset, size_t len, uint8_t *buf,
+			    csi_iso7816_read_cb_t cb, void *priv,
+			    size_t *read_len, uint16_t *sw)
+{
+	uint8_t cla, *chunk = NULL, *dst;
+	size_t want, n, pos;
+	int ret;
+
+	assert(session != NULL && (buf != NULL || cb != NULL));
+	assert(read_len != NULL && sw != NULL);
+
+	*read_len = 0;
+	*sw = ISO7816_SW_OK;
+
+	ret = file_check(session, channel);
+	if (ret)
+		return ret;
+	if (offset > READ_OFFSET_MAX)
+		return -EINVAL;
+
+	if (!buf) {
+		chunk = malloc(file_le_max(session));
+		if (!chunk)
+			return -ENOMEM;
+	}
+
+	cla = iso7816_channel_cla(0x00, channel);
+
+	while (*read_len < len) {
+		pos = offset + *read_len;
+		if (pos > READ_OFFSET_MAX)
+			break;
+
+		want = len - *read_len;
+		if (want > file_le_max(session))
+			want = file_le_max(session);
+		dst = buf ? buf + *read_len : chunk;
+
+		ret = file_read(session, cla, INS_READ_BINARY, pos >> 8, pos & 0xff,
+				&want, dst, &n, sw);
+		if (ret)
+			break;
+		if (*sw != ISO7816_SW_OK && *sw != SW_END_OF_FILE && (*sw >> 8) != 0x61)
+			break;
+
+		if (n && cb && !buf) {
+			ret = cb(priv, pos, dst, n);
+			if (ret)
+				break;
+		}
+		*read_len += n;
+
+		if (*sw == SW_END_OF_FILE || n < want)
+			break;
+	}
+
+	free(chunk);
+
+	return ret;
+}
+
+/**
+ * @brief  Read the records of an EF, one READ RECORD each.
+ *
+ * Each READ RECORD asks for the largest Le of the session, see
+ * csi_iso7816_read_binary(), and the record is received straight into the
+ * buffer passed to cb. Reading stops after count records, past the last
+ * record (6A83) or on an error status.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel the EF is selected on, 0 for the basic one
+ * @param sfi      Short EF identifier 1 to 30, 0 for the current EF
+ * @param first    Number of the first record, 1 to 254
+ * @param count    Records to read at most, 0 for all up to the last one
+ * @param cb       Called for each record with its number. Returns 0 to go
+ *                 on, or a negative errno to stop with.
+ * @param priv     Passed to cb
+ * @param records  Out: records read
+ * @param sw       Out: status word of the last READ RECORD, 6A83 once past
+ *                 the last record
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_read_records(csi_iso7816_session_t *session, int channel,
+			     int sfi, int first, int count,
+			     csi_iso7816_read_cb_t cb, void *priv,
+			     int *records, uint16_t *sw)
+{
+	uint8_t cla, *record;
+	int ret, number;
+	size_t n, le;
+
+	assert(session != NULL && cb != NULL && records != NULL && sw != NULL);
+
+	*records = 0;
+	*sw = ISO7816_SW_OK;
+
+	ret = file_check(session, channel);
+	if (ret)
+		return ret;
+	if (sfi < 0 || sfi > 30 || first < 1 || first > READ_RECORD_MAX || count < 0)
+		return -EINVAL;
+
+	record = malloc(file_le_max(session));
+	if (!record)
+		return -ENOMEM;
+
+	cla = iso7816_channel_cla(0x00, channel);
+
+	for (number = first; number <= READ_RECORD_MAX; number++) {
+		if (count && *records == count)
+			break;
+
+		le = file_le_max(session);
+		ret = file_read(session, cla, INS_READ_RECORD, number,
+				sfi << 3 | READ_RECORD_BY_NUMBER, &le, record, &n, sw);
+		if (ret)
+			break;
+		if (*sw != ISO7816_SW_OK && *sw != SW_END_OF_FILE && (*sw >> 8) != 0x61)
+			break;
+
+		ret = cb(priv, number, record, n);
+		if (ret)
+			break;
+		(*records)++;
+	}
+
+	free(record);
+
+	return ret;
+}
@@ -0,0 +1,42 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Messages between iso7816d and csi_iso7816_client_*() over a
+ * SOCK_SEQPACKET Unix socket. Every request gets one reply with the same
+ * op, result is 0 or negative errno.
+ */
+#ifndef _ISO7816_IPC_H
+#define _ISO7816_IPC_H
+
+#include <stdint.h>
+#include "iso7816.h"
+
+enum iso7816_ipc_op {
+	ISO7816_IPC_HELLO = 1,		/* payload: uint32_t priority class */
+	ISO7816_IPC_TRANSMIT,		/* payload: command APDU, reply: response APDU */
+	ISO7816_IPC_BEGIN,		/* reply once the card is exclusive to the client */
+	ISO7816_IPC_END,
+	ISO7816_IPC_STATS,		/* payload: uint32_t index, see below */
+};
+
+/*
+ * ISO7816_IPC_STATS index 0 to 255 replies the csi_iso7816_ins_stats_t of
+ * that INS, ISO7816_IPC_STATS_ERRVAL the errval counts and
+ * ISO7816_IPC_STATS_RECOVER the recovery steps. Index 0 takes the snapshot
+ * the other indices are served from, one snapshot per connection.
+ */
+#define ISO7816_IPC_STATS_ERRVAL	256
+#define ISO7816_IPC_STATS_RECOVER	257
+
+struct iso7816_ipc_hdr {
+	uint32_t op;
+	int32_t result;
+	uint32_t len;			/* payload bytes after the header */
+};
+
+/* a command APDU is the largest payload, a response is at most 65538 */
+#define ISO7816_IPC_MAX_PAYLOAD		ISO7816_EXT_APDU_MAX
+#define ISO7816_IPC_MAX_MSG		(sizeof(struct iso7816_ipc_hdr) + ISO7816_IPC_MAX_PAYLOAD)
+
+#endif
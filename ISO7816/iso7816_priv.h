@@ -0,0 +1,156 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Internal helpers shared by the libiso7816 sources, not part of the API.
+ */
+#ifndef _ISO7816_PRIV_H
+#define _ISO7816_PRIV_H
+
+#include <time.h>
+#include "iso7816.h"
+
+/* command APDU split by iso7816_apdu_parse() */
+struct iso7816_apdu {
+	int cas;		/* ISO/IEC 7816-4 case 1 to 4 */
+	int extended;
+	size_t lc;
+	size_t le;		/* 0 for none, up to ISO7816_EXT_LE_MAX */
+	const uint8_t *data;
+};
+
+/* negotiated parameters, replayed after a reset */
+struct iso7816_params {
+	int protocol;
+	int fi;
+	int di;
+	int ifsd;		/* T=1 IFSD, 0 for the largest */
+	struct dsmart_card_timing timing;
+};
+
+/* ioctl on the session fd, retried on EINTR, returns 0 or -errno */
+int iso7816_ioctl(csi_iso7816_session_t *session, unsigned long cmd, void *arg);
+
+/* map a DSMART_CARD_E_* into -errno and record it in session->errval */
+int iso7816_errval(csi_iso7816_session_t *session, int errval);
+
+/* drop the bytes queued by iso7816_rcv() */
+void iso7816_rx_flush(csi_iso7816_session_t *session);
+
+/* send len bytes, split into transfers of ISO7816_IOCTL_MAX */
+int iso7816_xmt(csi_iso7816_session_t *session, const uint8_t *buf, size_t len);
+
+/* read exactly len bytes, asking the driver for want bytes at once */
+int iso7816_rcv(csi_iso7816_session_t *session, uint8_t *buf, size_t len, size_t want);
+
+/* split a command APDU, -EINVAL when malformed */
+int iso7816_apdu_parse(const uint8_t *apdu, size_t apdu_len, struct iso7816_apdu *cmd);
+
+/* CLA for GET RESPONSE on the logical channel of cla */
+uint8_t iso7816_get_response_cla(uint8_t cla);
+
+/* interindustry cla rewritten for a logical channel */
+uint8_t iso7816_channel_cla(uint8_t cla, int channel);
+
+/* forget the channels and applets selected before a card reset */
+void iso7816_channel_reset(csi_iso7816_session_t *session);
+
+/* fi/di is a valid rate within the reader limits */
+int iso7816_rate_supported(csi_iso7816_session_t *session, int fi, int di);
+
+/* fi/di is the reset rate, F 372 D 1 */
+int iso7816_rate_is_default(int fi, int di);
+
+/* parameters in use */
+void iso7816_params_get(const csi_iso7816_session_t *session, struct iso7816_params *params);
+
+/*
+ * Apply params to the card of the last reset, see csi_iso7816_cache_load().
+ * 1 if applied, 0 if not (the card is then warm reset) or -errno.
+ */
+int iso7816_params_replay(csi_iso7816_session_t *session, const struct iso7816_params *params);
+
+/* waiting times of ISO/IEC 7816-3 for the parsed ATR at the current rate */
+void iso7816_atr_timing(csi_iso7816_session_t *session,
+			const csi_iso7816_atr_info_t *info,
+			struct dsmart_card_timing *timing);
+
+/* program timing, clamped to the tuner limits */
+int iso7816_tune_program(csi_iso7816_session_t *session,
+			 const struct dsmart_card_timing *timing);
+
+/* account a receive of len bytes that started at start */
+void iso7816_tune_sample(csi_iso7816_session_t *session,
+			 const struct timespec *start, size_t len);
+
+/* a receive timed out: 1 if it may wait again with the full waiting time */
+int iso7816_tune_timeout(csi_iso7816_session_t *session);
+
+/* events within an exchange, see csi_iso7816_trace_start() */
+enum iso7816_trace_event {
+	ISO7816_TRACE_RETRY,		/* T=1 block sent again, T=0 6Cxx */
+	ISO7816_TRACE_WAIT,		/* T=0 NULL byte, T=1 WTX */
+	ISO7816_TRACE_CHAIN,		/* GET RESPONSE, T=1 chained block */
+};
+
+/* exchange of apdu starts, and ends with ret */
+void iso7816_trace_begin(csi_iso7816_session_t *session, const uint8_t *apdu);
+void iso7816_trace_end(csi_iso7816_session_t *session, int ret);
+
+/* len bytes sent, or received by one driver receive */
+void iso7816_trace_xmt(csi_iso7816_session_t *session, size_t len);
+void iso7816_trace_rcv(csi_iso7816_session_t *session, size_t len);
+
+void iso7816_trace_event(csi_iso7816_session_t *session, enum iso7816_trace_event event);
+
+/* count a DSMART_CARD_E_* returned by the driver */
+void iso7816_trace_errval(csi_iso7816_session_t *session, int errval);
+
+/* account a recovery step that started at start */
+void iso7816_trace_recover(csi_iso7816_session_t *session, int step, int recovered,
+			   const struct timespec *start);
+
+/* one exchange on the protocol in use, without recovery */
+int iso7816_exchange_once(csi_iso7816_session_t *session,
+			  const uint8_t *apdu, size_t apdu_len,
+			  uint8_t *data, size_t data_size, size_t *data_len,
+			  uint16_t *sw);
+
+/* exchange_once, then the steps of csi_iso7816_set_recovery() when it failed */
+int iso7816_exchange_recover(csi_iso7816_session_t *session,
+			     const uint8_t *apdu, size_t apdu_len,
+			     uint8_t *data, size_t data_size, size_t *data_len,
+			     uint16_t *sw);
+
+/* run the steps of csi_iso7816_set_recovery() after an exchange failed with err */
+int iso7816_recover(csi_iso7816_session_t *session, int err,
+		    const uint8_t *apdu, size_t apdu_len,
+		    uint8_t *data, size_t data_size, size_t *data_len,
+		    uint16_t *sw);
+
+/* the APDU of class cla goes through the secure messaging of the session */
+int iso7816_sm_applies(const csi_iso7816_session_t *session, uint8_t cla);
+
+/* exchange_recover of the wrapped APDU, the unwrapped response into data */
+int iso7816_sm_exchange(csi_iso7816_session_t *session,
+			const uint8_t *apdu, size_t apdu_len,
+			uint8_t *data, size_t data_size, size_t *data_len,
+			uint16_t *sw);
+
+/* AES-CMAC of msg with a key of key_len bytes, as the SCP03 MACs, for tests */
+int iso7816_sm_cmac(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t len,
+		    uint8_t *mac);
+
+/* reset the T=1 block state from the parsed ATR */
+void iso7816_t1_init(csi_iso7816_session_t *session);
+
+/* S(RESYNCH) and back to the initial block state */
+int iso7816_t1_resynch(csi_iso7816_session_t *session);
+
+/* T=1 counterpart of the T=0 exchange, see csi_iso7816_exchange() */
+int iso7816_t1_exchange(csi_iso7816_session_t *session,
+			const uint8_t *apdu, size_t apdu_len,
+			uint8_t *data, size_t data_size, size_t *data_len,
+			uint16_t *sw);
+
+#endif
@@ -0,0 +1,134 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Recovery of failed exchanges. A parity error or a lost block should cost
+ * a retransmission, not a new session: the cheap steps are tried first and
+ * the resets, the warm one keeping the negotiated parameters, come last.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <time.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+/* errors a step may help with, anything else (no card...) is final */
+static int recover_possible(int err)
+{
+	return err == -EIO || err == -ETIMEDOUT || err == -EPROTO || err == -EBADMSG;
+}
+
+static int recover_warm(csi_iso7816_session_t *session)
+{
+	struct iso7816_params params;
+	int ret;
+
+	iso7816_params_get(session, &params);
+
+	ret = csi_iso7816_warm_reset(session);
+	if (ret)
+		return ret;
+
+	ret = iso7816_params_replay(session, &params);
+	if (ret < 0)
+		return ret;
+
+	/* the card refused the rate, a cold reset negotiates again */
+	return ret ? 0 : -EIO;
+}
+
+static int recover_cold(csi_iso7816_session_t *session)
+{
+	int ret;
+
+	ret = csi_iso7816_cold_reset(session);
+	if (ret)
+		return ret;
+
+	return csi_iso7816_negotiate(session);
+}
+
+int iso7816_recover(csi_iso7816_session_t *session, int err,
+		    const uint8_t *apdu, size_t apdu_len,
+		    uint8_t *data, size_t data_size, size_t *data_len,
+		    uint16_t *sw)
+{
+	struct timespec start;
+	int step, ret = err;
+
+	for (step = ISO7816_RECOVER_RETRANSMIT; step <= session->recover_max; step++) {
+		if (!recover_possible(ret))
+			break;
+		if (step == ISO7816_RECOVER_RESYNCH && session->protocol != DSMART_CARD_PROTOCOL_T1)
+			continue;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		switch (step) {
+		case ISO7816_RECOVER_RETRANSMIT:
+			iso7816_rx_flush(session);
+			ret = iso7816_exchange_once(session, apdu, apdu_len, data, data_size,
+						    data_len, sw);
+			break;
+		case ISO7816_RECOVER_RESYNCH:
+			ret = iso7816_t1_resynch(session);
+			if (!ret)
+				ret = iso7816_exchange_once(session, apdu, apdu_len, data,
+							    data_size, data_len, sw);
+			break;
+		case ISO7816_RECOVER_WARM_RESET:
+			ret = recover_warm(session);
+			break;
+		default:
+			ret = recover_cold(session);
+			break;
+		}
+
+		iso7816_trace_recover(session, step, !ret, &start);
+
+		if (!ret) {
+			session->recovered = step;
+			/* the card forgot its applets, the APDU is the caller's to send again */
+			return step >= ISO7816_RECOVER_WARM_RESET ? -ECONNRESET : 0;
+		}
+	}
+
+	return ret;
+}
+
+/**
+ * @brief  Recover failed exchanges in steps of growing cost.
+ *
+ * An exchange failing with a transmission error (-EIO, -ETIMEDOUT,
+ * -EPROTO, -EBADMSG) is recovered with the steps up to max_step, each
+ * tried once, cheapest first:
+ *  - ISO7816_RECOVER_RETRANSMIT: the APDU is sent again,
+ *  - ISO7816_RECOVER_RESYNCH: T=1 only, S(RESYNCH) then the APDU again,
+ *  - ISO7816_RECOVER_WARM_RESET: warm reset, the protocol, rate, waiting
+ *    times and IFSD in use are replayed without negotiating,
+ *  - ISO7816_RECOVER_COLD_RESET: cold reset and csi_iso7816_negotiate().
+ * The first two complete the exchange. After a reset the card has lost its
+ * selected applets and channels, so the exchange fails with -ECONNRESET
+ * for the caller to select again. session->recovered tells the step that
+ * worked, the statistics of csi_iso7816_trace_start() the count and time
+ * of each step.
+ *
+ * Sending the APDU again is only safe for commands the card may run twice.
+ *
+ * @param session   Opened session
+ * @param max_step  Last step to try, ISO7816_RECOVER_NONE (the default)
+ *                  to fail the exchange right away
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_set_recovery(csi_iso7816_session_t *session, int max_step)
+{
+	assert(session != NULL);
+
+	if (max_step < ISO7816_RECOVER_NONE || max_step >= ISO7816_RECOVER_STEPS)
+		return -EINVAL;
+
+	session->recover_max = max_step;
+
+	return 0;
+}
@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Precompiled APDU scripts for personalization. The script is parsed once
+ * into a binary stream, which the engine then feeds to the async queue
+ * with a few APDUs ahead, checking each response behind the card.
+ */
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iso7816.h"
+
+#define SCRIPT_RESP_SIZE	(ISO7816_EXT_LE_MAX + 2)
+
+struct script_buf {
+	uint8_t *data;
+	size_t len;
+	size_t size;
+};
+
+static void put_be16(uint8_t *p, uint16_t v)
+{
+	p[0] = v >> 8;
+	p[1] = v;
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	put_be16(p, v >> 16);
+	put_be16(p + 2, v);
+}
+
+static uint16_t get_be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (uint32_t)get_be16(p) << 16 | get_be16(p + 2);
+}
+
+static uint8_t *script_reserve(struct script_buf *buf, size_t len)
+{
+	size_t size = buf->size ? buf->size : 4096;
+	uint8_t *data;
+
+	while (size - buf->len < len)
+		size *= 2;
+
+	if (size != buf->size) {
+		data = realloc(buf->data, size);
+		if (!data)
+			return NULL;
+		buf->data = data;
+		buf->size = size;
+	}
+
+	data = buf->data + buf->len;
+	buf->len += len;
+
+	return data;
+}
+
+static int script_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c = tolower((unsigned char)c);
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+
+	return -1;
+}
+
+/* "9000", "6XXX" or "*" */
+static int script_sw(const char *s, const char *end, uint16_t *sw, uint16_t *mask)
+{
+	int i, nibble;
+
+	while (s < end && isspace((unsigned char)*s))
+		s++;
+	while (end > s && isspace((unsigned char)end[-1]))
+		end--;
+
+	*sw = 0;
+	*mask = 0;
+
+	if (end - s == 1 && *s == '*')
+		return 0;
+	if (end - s != 4)
+		return -EINVAL;
+
+	for (i = 0; i < 4; i++) {
+		*sw <<= 4;
+		*mask <<= 4;
+		if (s[i] == 'X' || s[i] == 'x')
+			continue;
+		nibble = script_nibble(s[i]);
+		if (nibble < 0)
+			return -EINVAL;
+		*sw |= nibble;
+		*mask |= 0xf;
+	}
+
+	return 0;
+}
+
+/* one line without its newline and comment, nothing added when blank */
+static int script_line(struct script_buf *buf, const char *s, const char *end,
+		       uint32_t *count)
+{
+	const char *colon = memchr(s, ':', end - s);
+	uint16_t sw = ISO7816_SW_OK, mask = 0xffff;
+	size_t cmd = buf->len, len = 0;
+	int nibble, high = -1;
+	uint8_t *p;
+	int ret;
+
+	if (colon) {
+		ret = script_sw(colon + 1, end, &sw, &mask);
+		if (ret)
+			return ret;
+		end = colon;
+	}
+
+	if (!script_reserve(buf, ISO7816_SCRIPT_CMD_LEN))
+		return -ENOMEM;
+
+	for (; s < end; s++) {
+		if (isspace((unsigned char)*s))
+			continue;
+		nibble = script_nibble(*s);
+		if (nibble < 0)
+			return -EINVAL;
+		if (high < 0) {
+			high = nibble;
+			continue;
+		}
+		if (len == ISO7816_EXT_APDU_MAX)
+			return -EINVAL;
+		p = script_reserve(buf, 1);
+		if (!p)
+			return -ENOMEM;
+		*p = high << 4 | nibble;
+		high = -1;
+		len++;
+	}
+
+	if (!len && !colon) {
+		buf->len = cmd;
+		return 0;
+	}
+	if (high >= 0 || len < 4)
+		return -EINVAL;
+
+	p = buf->data + cmd;
+	put_be32(p, len);
+	put_be16(p + 4, sw);
+	put_be16(p + 6, mask);
+	(*count)++;
+
+	return 0;
+}
+
+/**
+ * @brief  Compile an APDU script into the binary form run by
+ *         csi_iso7816_script_run().
+ *
+ * One command per line, in hex with optional spaces, followed by the
+ * status word expected after a ':'. 'X' stands for any nibble of the
+ * status word and '*' for any status word, 9000 is expected when none is
+ * given. '#' starts a comment. For example:
+ *   00 A4 04 00 07 A0000000031010
+ *   80 E2 00 00 04 01020304 : 9000
+ *   00 B0 00 00 00 : 6XXX
+ *
+ * @param text     Script, NUL terminated
+ * @param bin      Out: compiled script, to free()
+ * @param bin_len  Out: length of bin
+ * @param line     Out: on -EINVAL the line in error, may be NULL
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_script_compile(const char *text, uint8_t **bin, size_t *bin_len, int *line)
+{
+	struct script_buf buf = { 0 };
+	const char *s = text, *eol, *end;
+	uint32_t count = 0;
+	int ret = 0, n = 0;
+
+	assert(text != NULL && bin != NULL && bin_len != NULL);
+
+	if (!script_reserve(&buf, ISO7816_SCRIPT_HDR_LEN))
+		return -ENOMEM;
+
+	while (*s) {
+		n++;
+		eol = strchr(s, '\n');
+		if (!eol)
+			eol = s + strlen(s);
+		end = memchr(s, '#', eol - s);
+		if (!end)
+			end = eol;
+
+		ret = script_line(&buf, s, end, &count);
+		if (ret)
+			break;
+
+		s = *eol ? eol + 1 : eol;
+	}
+
+	if (ret) {
+		if (line)
+			*line = n;
+		free(buf.data);
+		return ret;
+	}
+
+	put_be32(buf.data, ISO7816_SCRIPT_MAGIC);
+	put_be32(buf.data + 4, count);
+	*bin = buf.data;
+	*bin_len = buf.len;
+
+	return 0;
+}
+
+/* the whole script is checked before the first APDU goes out */
+static int script_check(const uint8_t *bin, size_t bin_len, uint32_t *count)
+{
+	size_t pos = ISO7816_SCRIPT_HDR_LEN, len;
+	uint32_t i;
+
+	if (bin_len < ISO7816_SCRIPT_HDR_LEN || get_be32(bin) != ISO7816_SCRIPT_MAGIC)
+		return -EINVAL;
+
+	*count = get_be32(bin + 4);
+
+	for (i = 0; i < *count; i++) {
+		if (bin_len - pos < ISO7816_SCRIPT_CMD_LEN)
+			return -EINVAL;
+		len = get_be32(bin + pos);
+		pos += ISO7816_SCRIPT_CMD_LEN;
+		if (len < 4 || len > ISO7816_EXT_APDU_MAX || bin_len - pos < len)
+			return -EINVAL;
+		pos += len;
+	}
+
+	return pos == bin_len ? 0 : -EINVAL;
+}
+
+static uint64_t script_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* a reaped request, in script order */
+static void script_reaped(csi_iso7816_script_result_t *result, uint32_t index,
+			  const csi_iso7816_req_t *req)
+{
+	uint16_t sw;
+
+	/* cancelled behind the failing one */
+	if (result->failed >= 0)
+		return;
+
+	if (req->result) {
+		result->failed = index;
+		result->error = req->result;
+		return;
+	}
+
+	sw = req->resp[req->resp_len - 2] << 8 | req->resp[req->resp_len - 1];
+	if ((sw & req->sw_mask) != req->sw_expect) {
+		result->failed = index;
+		result->sw = sw;
+		result->sw_expect = req->sw_expect;
+		result->sw_mask = req->sw_mask;
+		return;
+	}
+
+	result->completed++;
+}
+
+/**
+ * @brief  Run a compiled script, stopping at the first unexpected response.
+ *
+ * The commands go through the queue of csi_iso7816_submit(), window of
+ * them at a time, so the card gets the next APDU as soon as it answers
+ * while the responses are checked behind it. Each one carries its expected
+ * SW, so a mismatch or a failed exchange halts the queue before the
+ * following commands reach the card.
+ *
+ * @param session  Session ready for exchanges, not started for async use
+ * @param bin      Compiled script
+ * @param bin_len  Length of bin
+ * @param window   APDUs queued at most, 0 for ISO7816_SCRIPT_WINDOW
+ * @param result   Out: progress, failing command and throughput
+ * @return 0 when every command completed as expected, -EREMOTEIO on a SW
+ *         mismatch, or negative errno on failure
+ */
+int csi_iso7816_script_run(csi_iso7816_session_t *session,
+			   const uint8_t *bin, size_t bin_len, int window,
+			   csi_iso7816_script_result_t *result)
+{
+	uint32_t count, next = 0, reaped = 0, inflight = 0;
+	size_t pos = ISO7816_SCRIPT_HDR_LEN;
+	csi_iso7816_req_t *reqs, *req;
+	struct pollfd pfd;
+	uint64_t start;
+	uint8_t *resp;
+	int ret, stop = 0;
+
+	assert(session != NULL && bin != NULL && result != NULL);
+
+	memset(result, 0, sizeof(*result));
+	result->failed = -1;
+
+	if (window < 0)
+		return -EINVAL;
+	if (!window)
+		window = ISO7816_SCRIPT_WINDOW;
+
+	ret = script_check(bin, bin_len, &count);
+	if (ret)
+		return ret;
+	result->commands = count;
+
+	reqs = calloc(window, sizeof(*reqs));
+	resp = malloc((size_t)window * SCRIPT_RESP_SIZE);
+	if (!reqs || !resp) {
+		free(reqs);
+		free(resp);
+		return -ENOMEM;
+	}
+
+	ret = csi_iso7816_async_start(session);
+	if (ret) {
+		free(reqs);
+		free(resp);
+		return ret;
+	}
+
+	pfd.fd = csi_iso7816_async_fd(session);
+	pfd.events = POLLIN;
+	start = script_now();
+
+	for (;;) {
+		while (!stop && next < count && inflight < (uint32_t)window) {
+			req = &reqs[next % window];
+			req->apdu_len = get_be32(bin + pos);
+			req->sw_expect = get_be16(bin + pos + 4);
+			req->sw_mask = get_be16(bin + pos + 6);
+			req->apdu = bin + pos + ISO7816_SCRIPT_CMD_LEN;
+			req->resp = resp + (size_t)(next % window) * SCRIPT_RESP_SIZE;
+			req->resp_size = SCRIPT_RESP_SIZE;
+
+			/* halted, the failing command is waiting to be reaped */
+			if (csi_iso7816_submit(session, req)) {
+				stop = 1;
+				break;
+			}
+			pos += ISO7816_SCRIPT_CMD_LEN + req->apdu_len;
+			next++;
+			inflight++;
+		}
+
+		if (!inflight)
+			break;
+
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		while ((req = csi_iso7816_reap(session))) {
+			script_reaped(result, reaped++, req);
+			inflight--;
+			if (result->failed >= 0)
+				stop = 1;
+		}
+	}
+
+	result->elapsed_ns = script_now() - start;
+	csi_iso7816_async_stop(session);
+	free(reqs);
+	free(resp);
+
+	if (result->elapsed_ns)
+		result->apdus_per_sec = (result->completed + (result->failed >= 0)) *
+					1e9 / result->elapsed_ns;
+
+	if (ret)
+		return ret;
+	if (result->failed >= 0)
+		return result->error ? result->error : -EREMOTEIO;
+
+	return 0;
+}
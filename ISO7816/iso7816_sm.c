@@ -0,0 +1,1254 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Secure messaging: GlobalPlatform SCP03 (Amendment D) and SCP02 (Card
+ * Specification 2.2 Appendix E) secure channels, and ICAO 9303 part 11
+ * secure messaging after BAC. The ciphers go through OpenSSL EVP on the
+ * eip120 engine when it loads. Their contexts are keyed once when the
+ * channel opens, so an APDU only costs IV loads, and CMAC and the retail
+ * MAC are computed over CBC: the engine offloads block ciphers, not MACs.
+ */
+#define OPENSSL_API_COMPAT	0x10100000L	/* ENGINE, deprecated by OpenSSL 3 */
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/crypto.h>
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#ifndef OPENSSL_NO_ENGINE
+#include <openssl/engine.h>
+#endif
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+#define SM_ENGINE_ID			"eip120"
+
+#define SCP_INS_INITIALIZE_UPDATE	0x50
+#define SCP_INS_EXTERNAL_AUTHENTICATE	0x82
+#define SCP_CHALLENGE_LEN		8
+#define SCP_CRYPTOGRAM_LEN		8
+#define SCP_MAC_LEN			8
+
+/* SCP03 KDF derivation constants */
+#define SCP03_CARD_CRYPTOGRAM		0x00
+#define SCP03_HOST_CRYPTOGRAM		0x01
+#define SCP03_S_ENC			0x04
+#define SCP03_S_MAC			0x06
+#define SCP03_S_RMAC			0x07
+
+/* SCP02 session key derivation constants */
+#define SCP02_S_ENC			0x0182
+#define SCP02_C_MAC			0x0101
+#define SCP02_I_ICV_ENCRYPT		0x40
+
+/* ICAO 9303 data objects */
+#define ICAO_DO_DATA_ODD		0x85
+#define ICAO_DO_DATA			0x87
+#define ICAO_DO_LE			0x97
+#define ICAO_DO_STATUS			0x99
+#define ICAO_DO_MAC			0x8e
+#define ICAO_PADDING_INDICATOR		0x01
+
+#define AES_BLOCK			16
+#define DES_BLOCK			8
+
+enum sm_scheme {
+	SM_SCP02,
+	SM_SCP03,
+	SM_ICAO,
+};
+
+/* a key with its contexts set up, an operation only loads the IV */
+struct sm_key {
+	EVP_CIPHER_CTX *enc;
+	EVP_CIPHER_CTX *dec;
+	uint8_t k1[AES_BLOCK];		/* CMAC subkeys */
+	uint8_t k2[AES_BLOCK];
+};
+
+struct iso7816_sm {
+	enum sm_scheme scheme;
+	int channel;
+	int level;
+	int offload;			/* every key runs on the engine */
+
+	struct sm_key enc;		/* S-ENC, KSenc */
+	struct sm_key mac;		/* S-MAC, KSmac, 3DES K1K2K1 for SCP02 and ICAO */
+	struct sm_key mac1;		/* single DES K1 of mac, SCP02 and ICAO */
+	struct sm_key rmac;		/* S-RMAC of SCP03 */
+
+	uint8_t chain[AES_BLOCK];	/* SCP03 MAC chaining value, SCP02 last C-MAC */
+	uint8_t counter[AES_BLOCK];	/* SCP03 encryption counter */
+	uint8_t ssc[DES_BLOCK];		/* ICAO send sequence counter */
+	int icv_encrypt;		/* SCP02 "i" asks for ICV encryption */
+	int chained;			/* SCP02 C-MAC computed, the next ICV is chain */
+
+	/* wrapped command, response as received, MAC input, cipher output */
+	uint8_t apdu[ISO7816_EXT_APDU_MAX];
+	uint8_t resp[ISO7816_EXT_LE_MAX];
+	uint8_t buf[ISO7816_EXT_APDU_MAX + 2 * AES_BLOCK];
+	uint8_t out[ISO7816_EXT_APDU_MAX + 2 * AES_BLOCK];
+};
+
+static const uint8_t sm_zero[AES_BLOCK];
+
+static ENGINE *sm_engine;
+static pthread_once_t sm_engine_once = PTHREAD_ONCE_INIT;
+
+static void sm_engine_load(void)
+{
+#ifndef OPENSSL_NO_ENGINE
+	ENGINE *engine;
+
+	/* the dynamic engine looks in OPENSSL_ENGINES, then ENGINESDIR */
+	ENGINE_load_builtin_engines();
+	engine = ENGINE_by_id(SM_ENGINE_ID);
+	if (engine && ENGINE_init(engine))
+		sm_engine = engine;
+	else if (engine)
+		ENGINE_free(engine);
+	ERR_clear_error();
+#endif
+}
+
+static int sm_ctx_init(EVP_CIPHER_CTX *ctx, const EVP_CIPHER *cipher,
+		       const uint8_t *key, int enc, int *offload)
+{
+	pthread_once(&sm_engine_once, sm_engine_load);
+
+	/* the engine may lack the cipher or the key size */
+	*offload = sm_engine && EVP_CipherInit_ex(ctx, cipher, sm_engine, key, NULL, enc);
+	if (!*offload) {
+		ERR_clear_error();
+		EVP_CIPHER_CTX_reset(ctx);
+		if (!EVP_CipherInit_ex(ctx, cipher, NULL, key, NULL, enc)) {
+			ERR_clear_error();
+			return -EIO;
+		}
+	}
+
+	EVP_CIPHER_CTX_set_padding(ctx, 0);
+
+	return 0;
+}
+
+static int sm_key_init(struct iso7816_sm *sm, struct sm_key *key,
+		       const EVP_CIPHER *cipher, const uint8_t *k)
+{
+	int ret, offload;
+
+	key->enc = EVP_CIPHER_CTX_new();
+	key->dec = EVP_CIPHER_CTX_new();
+	if (!key->enc || !key->dec)
+		return -ENOMEM;
+
+	ret = sm_ctx_init(key->enc, cipher, k, 1, &offload);
+	if (ret)
+		return ret;
+	sm->offload &= offload;
+
+	ret = sm_ctx_init(key->dec, cipher, k, 0, &offload);
+	if (ret)
+		return ret;
+	sm->offload &= offload;
+
+	return 0;
+}
+
+static void sm_key_free(struct sm_key *key)
+{
+	EVP_CIPHER_CTX_free(key->enc);
+	EVP_CIPHER_CTX_free(key->dec);
+	OPENSSL_cleanse(key, sizeof(*key));
+}
+
+/* CBC over whole blocks, IV loaded, key kept */
+static int sm_cbc(struct sm_key *key, int enc, const uint8_t *iv,
+		  const uint8_t *in, size_t len, uint8_t *out)
+{
+	EVP_CIPHER_CTX *ctx = enc ? key->enc : key->dec;
+	int n;
+
+	if (!EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, -1) ||
+	    !EVP_CipherUpdate(ctx, out, &n, in, len)) {
+		ERR_clear_error();
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static const EVP_CIPHER *sm_aes_cbc(size_t len)
+{
+	switch (len) {
+	case 16:
+		return EVP_aes_128_cbc();
+	case 24:
+		return EVP_aes_192_cbc();
+	case 32:
+		return EVP_aes_256_cbc();
+	default:
+		return NULL;
+	}
+}
+
+/* 2-key 3DES as K1K2K1, or single DES as K1K1K1, both on the 3-key cipher */
+static int sm_des_init(struct iso7816_sm *sm, struct sm_key *key, const uint8_t *k, int single)
+{
+	uint8_t k3[24];
+	int ret;
+
+	memcpy(k3, k, 8);
+	memcpy(k3 + 8, single ? k : k + 8, 8);
+	memcpy(k3 + 16, k, 8);
+	ret = sm_key_init(sm, key, EVP_des_ede3_cbc(), k3);
+	OPENSSL_cleanse(k3, sizeof(k3));
+
+	return ret;
+}
+
+static void sm_cmac_shift(uint8_t *out, const uint8_t *in)
+{
+	int i;
+
+	for (i = 0; i < AES_BLOCK - 1; i++)
+		out[i] = in[i] << 1 | in[i + 1] >> 7;
+	out[AES_BLOCK - 1] = in[AES_BLOCK - 1] << 1 ^ (in[0] & 0x80 ? 0x87 : 0);
+}
+
+static int sm_aes_init(struct iso7816_sm *sm, struct sm_key *key, const uint8_t *k, size_t len)
+{
+	uint8_t l[AES_BLOCK];
+	int ret;
+
+	ret = sm_key_init(sm, key, sm_aes_cbc(len), k);
+	if (ret)
+		return ret;
+
+	/* CMAC subkeys, NIST SP 800-38B */
+	ret = sm_cbc(key, 1, sm_zero, sm_zero, AES_BLOCK, l);
+	if (ret)
+		return ret;
+	sm_cmac_shift(key->k1, l);
+	sm_cmac_shift(key->k2, key->k1);
+	OPENSSL_cleanse(l, sizeof(l));
+
+	return 0;
+}
+
+/* AES-CMAC of msg, msg must not be sm->out */
+static int sm_cmac(struct iso7816_sm *sm, struct sm_key *key,
+		   const uint8_t *msg, size_t len, uint8_t *mac)
+{
+	size_t full = len ? (len - 1) / AES_BLOCK * AES_BLOCK : 0, rest = len - full, i;
+	const uint8_t *iv = sm_zero;
+	uint8_t last[AES_BLOCK];
+	int ret;
+
+	if (full) {
+		ret = sm_cbc(key, 1, sm_zero, msg, full, sm->out);
+		if (ret)
+			return ret;
+		iv = sm->out + full - AES_BLOCK;
+	}
+
+	memset(last, 0, sizeof(last));
+	memcpy(last, msg + full, rest);
+	if (rest < AES_BLOCK)
+		last[rest] = 0x80;
+	for (i = 0; i < AES_BLOCK; i++)
+		last[i] ^= rest == AES_BLOCK ? key->k1[i] : key->k2[i];
+
+	return sm_cbc(key, 1, iv, last, AES_BLOCK, mac);
+}
+
+/* ISO/IEC 9797-1 MAC algorithm 3 with DES over padded msg, not sm->out */
+static int sm_retail_mac(struct iso7816_sm *sm, const uint8_t *icv,
+			 const uint8_t *msg, size_t len, uint8_t *mac)
+{
+	const uint8_t *iv = icv;
+	int ret;
+
+	if (len > DES_BLOCK) {
+		ret = sm_cbc(&sm->mac1, 1, icv, msg, len - DES_BLOCK, sm->out);
+		if (ret)
+			return ret;
+		iv = sm->out + len - 2 * DES_BLOCK;
+	}
+
+	/* E(K1, D(K2, E(K1, x))) of the last block finishes the single DES chain */
+	return sm_cbc(&sm->mac, 1, iv, msg + len - DES_BLOCK, DES_BLOCK, mac);
+}
+
+/* ISO/IEC 9797-1 padding method 2 */
+static size_t sm_pad(uint8_t *buf, size_t len, size_t block)
+{
+	buf[len++] = 0x80;
+	while (len % block)
+		buf[len++] = 0x00;
+
+	return len;
+}
+
+static int sm_unpad(const uint8_t *buf, size_t *len)
+{
+	size_t n = *len;
+
+	while (n && !buf[n - 1])
+		n--;
+	if (!n || buf[n - 1] != 0x80)
+		return -EBADMSG;
+	*len = n - 1;
+
+	return 0;
+}
+
+static void sm_increment(uint8_t *counter, size_t len)
+{
+	while (len-- && !++counter[len])
+		;
+}
+
+static size_t sm_put_lc(uint8_t *p, size_t lc, int extended)
+{
+	if (!extended) {
+		p[0] = lc;
+		return 1;
+	}
+
+	p[0] = 0x00;
+	p[1] = lc >> 8;
+	p[2] = lc;
+
+	return 3;
+}
+
+/* Le of a command with data, 0 for the largest */
+static size_t sm_put_le(uint8_t *p, size_t le, int extended)
+{
+	if (!extended) {
+		p[0] = le == ISO7816_SHORT_LE_MAX ? 0x00 : le;
+		return 1;
+	}
+
+	p[0] = le == ISO7816_EXT_LE_MAX ? 0x00 : le >> 8;
+	p[1] = le == ISO7816_EXT_LE_MAX ? 0x00 : le;
+
+	return 2;
+}
+
+static int sm_cla_channel(uint8_t cla)
+{
+	return cla & 0x40 ? 4 + (cla & 0x0f) : cla & 0x03;
+}
+
+/* SM indication of the class, header authenticated for ICAO */
+static uint8_t sm_cla(uint8_t cla, int header)
+{
+	if (cla & 0x40)
+		return cla | 0x20;
+
+	return cla | (header ? 0x0c : 0x04);
+}
+
+/* status words after which the card adds no R-MAC */
+static int sm_sw_error(uint16_t sw)
+{
+	uint8_t sw1 = sw >> 8;
+
+	return sw1 != 0x90 && sw1 != 0x61 && sw1 != 0x62 && sw1 != 0x63;
+}
+
+static int scp03_wrap(struct iso7816_sm *sm, const uint8_t *apdu,
+		      const struct iso7816_apdu *cmd, size_t *len)
+{
+	const uint8_t *data = cmd->data;
+	size_t lc = cmd->lc, le = cmd->le, n;
+	uint8_t icv[AES_BLOCK], *p = sm->apdu;
+	int extended, ret;
+
+	if (sm->level & ISO7816_SM_C_DEC) {
+		/* counted for every command, the response uses the same value */
+		sm_increment(sm->counter, sizeof(sm->counter));
+		if (lc) {
+			ret = sm_cbc(&sm->enc, 1, sm_zero, sm->counter, AES_BLOCK, icv);
+			if (ret)
+				return ret;
+			memcpy(sm->buf, data, lc);
+			n = sm_pad(sm->buf, lc, AES_BLOCK);
+			ret = sm_cbc(&sm->enc, 1, icv, sm->buf, n, sm->out);
+			if (ret)
+				return ret;
+			data = sm->out;
+			lc = n;
+		}
+	}
+
+	if (lc + SCP_MAC_LEN > ISO7816_EXT_LC_MAX)
+		return -EMSGSIZE;
+	extended = cmd->extended || lc + SCP_MAC_LEN > ISO7816_SHORT_LC_MAX;
+	/* the R-MAC and the padding come on top of the data asked */
+	if (le && (sm->level & ISO7816_SM_R_MAC))
+		le = extended ? ISO7816_EXT_LE_MAX : ISO7816_SHORT_LE_MAX;
+
+	p[0] = sm_cla(apdu[0], 0);
+	memcpy(p + 1, apdu + 1, 3);
+	n = 4 + sm_put_lc(p + 4, lc + SCP_MAC_LEN, extended);
+	memcpy(p + n, data, lc);
+	n += lc;
+
+	/* C-MAC over the chaining value and the command up to its data */
+	memcpy(sm->buf, sm->chain, AES_BLOCK);
+	memcpy(sm->buf + AES_BLOCK, p, n);
+	ret = sm_cmac(sm, &sm->mac, sm->buf, AES_BLOCK + n, sm->chain);
+	if (ret)
+		return ret;
+	memcpy(p + n, sm->chain, SCP_MAC_LEN);
+	n += SCP_MAC_LEN;
+
+	if (le)
+		n += sm_put_le(p + n, le, extended);
+	*len = n;
+
+	return 0;
+}
+
+static int scp03_unwrap(struct iso7816_sm *sm, size_t len, uint16_t sw,
+			uint8_t *data, size_t data_size, size_t *data_len)
+{
+	uint8_t icv[AES_BLOCK], mac[AES_BLOCK];
+	const uint8_t *body = sm->resp;
+	int ret;
+
+	if (!(sm->level & ISO7816_SM_R_MAC) || (len < SCP_MAC_LEN && sm_sw_error(sw)))
+		goto out;
+	if (len < SCP_MAC_LEN)
+		return -EBADMSG;
+
+	len -= SCP_MAC_LEN;
+	memcpy(sm->buf, sm->chain, AES_BLOCK);
+	memcpy(sm->buf + AES_BLOCK, sm->resp, len);
+	sm->buf[AES_BLOCK + len] = sw >> 8;
+	sm->buf[AES_BLOCK + len + 1] = sw;
+	ret = sm_cmac(sm, &sm->rmac, sm->buf, AES_BLOCK + len + 2, mac);
+	if (ret)
+		return ret;
+	if (CRYPTO_memcmp(mac, sm->resp + len, SCP_MAC_LEN))
+		return -EBADMSG;
+
+	if ((sm->level & ISO7816_SM_R_ENC) && len) {
+		if (len % AES_BLOCK)
+			return -EBADMSG;
+		memcpy(icv, sm->counter, AES_BLOCK);
+		icv[0] = 0x80;
+		ret = sm_cbc(&sm->enc, 1, sm_zero, icv, AES_BLOCK, icv);
+		if (!ret)
+			ret = sm_cbc(&sm->enc, 0, icv, sm->resp, len, sm->out);
+		if (!ret)
+			ret = sm_unpad(sm->out, &len);
+		if (ret)
+			return ret;
+		body = sm->out;
+	}
+
+out:
+	if (len > data_size)
+		return -ENOSPC;
+	memcpy(data, body, len);
+	*data_len = len;
+
+	return 0;
+}
+
+static int scp02_wrap(struct iso7816_sm *sm, const uint8_t *apdu,
+		      const struct iso7816_apdu *cmd, size_t *len)
+{
+	const uint8_t *data = cmd->data;
+	uint8_t icv[DES_BLOCK], *p = sm->apdu;
+	size_t lc = cmd->lc, n;
+	int ret;
+
+	if (cmd->extended || lc + DES_BLOCK + SCP_MAC_LEN > ISO7816_SHORT_LC_MAX)
+		return -EMSGSIZE;
+
+	p[0] = sm_cla(apdu[0], 0);
+	memcpy(p + 1, apdu + 1, 3);
+	p[4] = lc + SCP_MAC_LEN;
+
+	/* C-MAC over the plain command, ICV the previous C-MAC */
+	memcpy(sm->buf, p, 5);
+	memcpy(sm->buf + 5, data, lc);
+	n = sm_pad(sm->buf, 5 + lc, DES_BLOCK);
+	if (sm->chained && sm->icv_encrypt) {
+		ret = sm_cbc(&sm->mac1, 1, sm_zero, sm->chain, DES_BLOCK, icv);
+		if (ret)
+			return ret;
+	} else {
+		memcpy(icv, sm->chained ? sm->chain : sm_zero, DES_BLOCK);
+	}
+	ret = sm_retail_mac(sm, icv, sm->buf, n, sm->chain);
+	if (ret)
+		return ret;
+	sm->chained = 1;
+
+	if ((sm->level & ISO7816_SM_C_DEC) && lc) {
+		memcpy(sm->buf, data, lc);
+		n = sm_pad(sm->buf, lc, DES_BLOCK);
+		ret = sm_cbc(&sm->enc, 1, sm_zero, sm->buf, n, sm->out);
+		if (ret)
+			return ret;
+		data = sm->out;
+		lc = n;
+		p[4] = lc + SCP_MAC_LEN;
+	}
+
+	memcpy(p + 5, data, lc);
+	memcpy(p + 5 + lc, sm->chain, SCP_MAC_LEN);
+	n = 5 + lc + SCP_MAC_LEN;
+	if (cmd->le)
+		n += sm_put_le(p + n, cmd->le, 0);
+	*len = n;
+
+	return 0;
+}
+
+static size_t icao_put_len(uint8_t *p, size_t len)
+{
+	if (len < 0x80) {
+		p[0] = len;
+		return 1;
+	}
+	if (len < 0x100) {
+		p[0] = 0x81;
+		p[1] = len;
+		return 2;
+	}
+
+	p[0] = 0x82;
+	p[1] = len >> 8;
+	p[2] = len;
+
+	return 3;
+}
+
+static int icao_get_len(const uint8_t *p, size_t avail, size_t *len, size_t *hdr)
+{
+	if (avail < 1)
+		return -EBADMSG;
+
+	if (p[0] < 0x80) {
+		*len = p[0];
+		*hdr = 1;
+	} else if (p[0] == 0x81 && avail >= 2) {
+		*len = p[1];
+		*hdr = 2;
+	} else if (p[0] == 0x82 && avail >= 3) {
+		*len = p[1] << 8 | p[2];
+		*hdr = 3;
+	} else {
+		return -EBADMSG;
+	}
+
+	return *len <= avail - *hdr ? 0 : -EBADMSG;
+}
+
+static int icao_wrap(struct iso7816_sm *sm, const uint8_t *apdu,
+		     const struct iso7816_apdu *cmd, size_t *len)
+{
+	/* DO87 and DO97 go to the end of sm->apdu first, DO8E after them */
+	uint8_t *dos = sm->apdu + 7, *p = dos;
+	size_t n, body;
+	int extended, ret;
+
+	sm_increment(sm->ssc, sizeof(sm->ssc));
+
+	if (cmd->lc) {
+		memcpy(sm->buf, cmd->data, cmd->lc);
+		n = sm_pad(sm->buf, cmd->lc, DES_BLOCK);
+		if (n + 16 > ISO7816_EXT_LC_MAX)
+			return -EMSGSIZE;
+		ret = sm_cbc(&sm->enc, 1, sm_zero, sm->buf, n, sm->out);
+		if (ret)
+			return ret;
+		/* odd INS carry BER-TLV data, without the padding indicator */
+		if (apdu[1] & 1) {
+			*p++ = ICAO_DO_DATA_ODD;
+			p += icao_put_len(p, n);
+		} else {
+			*p++ = ICAO_DO_DATA;
+			p += icao_put_len(p, n + 1);
+			*p++ = ICAO_PADDING_INDICATOR;
+		}
+		memcpy(p, sm->out, n);
+		p += n;
+	}
+
+	if (cmd->le) {
+		*p++ = ICAO_DO_LE;
+		if (cmd->le <= ISO7816_SHORT_LE_MAX && !cmd->extended) {
+			*p++ = 1;
+			p += sm_put_le(p, cmd->le, 0);
+		} else {
+			*p++ = 2;
+			p += sm_put_le(p, cmd->le, 1);
+		}
+	}
+
+	/* MAC over the SSC, the padded header and the data objects */
+	memcpy(sm->buf, sm->ssc, DES_BLOCK);
+	sm->buf[DES_BLOCK] = sm_cla(apdu[0], 1);
+	memcpy(sm->buf + DES_BLOCK + 1, apdu + 1, 3);
+	n = sm_pad(sm->buf, DES_BLOCK + 4, DES_BLOCK);
+	memcpy(sm->buf + n, dos, p - dos);
+	n = sm_pad(sm->buf, n + (p - dos), DES_BLOCK);
+	*p++ = ICAO_DO_MAC;
+	*p++ = SCP_MAC_LEN;
+	ret = sm_retail_mac(sm, sm_zero, sm->buf, n, p);
+	if (ret)
+		return ret;
+	p += SCP_MAC_LEN;
+
+	/* header and Lc in front of the data objects */
+	body = p - dos;
+	if (body > ISO7816_EXT_LC_MAX)
+		return -EMSGSIZE;
+	extended = cmd->extended || body > ISO7816_SHORT_LC_MAX;
+	n = 4 + (extended ? 3 : 1);
+	memmove(sm->apdu + n, dos, body);
+	sm->apdu[0] = sm_cla(apdu[0], 1);
+	memcpy(sm->apdu + 1, apdu + 1, 3);
+	sm_put_lc(sm->apdu + 4, body, extended);
+	n += body;
+	n += sm_put_le(sm->apdu + n, extended ? ISO7816_EXT_LE_MAX : ISO7816_SHORT_LE_MAX,
+		       extended);
+	*len = n;
+
+	return 0;
+}
+
+static int icao_unwrap(struct iso7816_sm *sm, size_t len, uint16_t *sw,
+		       uint8_t *data, size_t data_size, size_t *data_len)
+{
+	const uint8_t *p = sm->resp, *end = sm->resp + len, *mac = NULL;
+	const uint8_t *enc = NULL, *status = NULL;
+	size_t n, hdr, enc_len = 0;
+	uint8_t computed[DES_BLOCK];
+	int ret, indicator = 0;
+
+	sm_increment(sm->ssc, sizeof(sm->ssc));
+
+	while (p < end && !mac) {
+		ret = icao_get_len(p + 1, end - p - 1, &n, &hdr);
+		if (ret)
+			return ret;
+		switch (p[0]) {
+		case ICAO_DO_DATA:
+			indicator = 1;
+			/* fall through */
+		case ICAO_DO_DATA_ODD:
+			enc = p + 1 + hdr;
+			enc_len = n;
+			break;
+		case ICAO_DO_STATUS:
+			if (n != 2)
+				return -EBADMSG;
+			status = p + 1 + hdr;
+			break;
+		case ICAO_DO_MAC:
+			if (n != SCP_MAC_LEN)
+				return -EBADMSG;
+			mac = p + 1 + hdr;
+			continue;
+		default:
+			return -EBADMSG;
+		}
+		p += 1 + hdr + n;
+	}
+
+	/* an SM error of the card (6987, 6988...) comes plain */
+	if (!mac) {
+		if (len || !sm_sw_error(*sw))
+			return -EBADMSG;
+		*data_len = 0;
+		return 0;
+	}
+
+	memcpy(sm->buf, sm->ssc, DES_BLOCK);
+	memcpy(sm->buf + DES_BLOCK, sm->resp, p - sm->resp);
+	n = sm_pad(sm->buf, DES_BLOCK + (p - sm->resp), DES_BLOCK);
+	ret = sm_retail_mac(sm, sm_zero, sm->buf, n, computed);
+	if (ret)
+		return ret;
+	if (CRYPTO_memcmp(computed, mac, SCP_MAC_LEN))
+		return -EBADMSG;
+
+	if (status)
+		*sw = status[0] << 8 | status[1];
+
+	n = 0;
+	if (enc) {
+		if (indicator) {
+			if (!enc_len || enc[0] != ICAO_PADDING_INDICATOR)
+				return -EBADMSG;
+			enc++;
+			enc_len--;
+		}
+		if (enc_len % DES_BLOCK)
+			return -EBADMSG;
+		n = enc_len;
+		ret = sm_cbc(&sm->enc, 0, sm_zero, enc, n, sm->out);
+		if (!ret)
+			ret = sm_unpad(sm->out, &n);
+		if (ret)
+			return ret;
+	}
+
+	if (n > data_size)
+		return -ENOSPC;
+	memcpy(data, sm->out, n);
+	*data_len = n;
+
+	return 0;
+}
+
+int iso7816_sm_applies(const csi_iso7816_session_t *session, uint8_t cla)
+{
+	return session->sm && session->sm->channel == sm_cla_channel(cla);
+}
+
+int iso7816_sm_exchange(csi_iso7816_session_t *session,
+			const uint8_t *apdu, size_t apdu_len,
+			uint8_t *data, size_t data_size, size_t *data_len,
+			uint16_t *sw)
+{
+	struct iso7816_sm *sm = session->sm;
+	struct iso7816_apdu cmd;
+	size_t len, resp_len;
+	int ret;
+
+	ret = iso7816_apdu_parse(apdu, apdu_len, &cmd);
+	if (ret)
+		return ret;
+
+	switch (sm->scheme) {
+	case SM_SCP03:
+		ret = scp03_wrap(sm, apdu, &cmd, &len);
+		break;
+	case SM_SCP02:
+		ret = scp02_wrap(sm, apdu, &cmd, &len);
+		break;
+	default:
+		ret = icao_wrap(sm, apdu, &cmd, &len);
+		break;
+	}
+	if (ret)
+		return ret;
+
+	ret = iso7816_exchange_recover(session, sm->apdu, len, sm->resp, sizeof(sm->resp),
+				       &resp_len, sw);
+	if (ret) {
+		/* whether the card saw the command is unknown, so is its chaining */
+		csi_iso7816_sm_close(session);
+		return ret;
+	}
+
+	switch (sm->scheme) {
+	case SM_SCP03:
+		ret = scp03_unwrap(sm, resp_len, *sw, data, data_size, data_len);
+		break;
+	case SM_SCP02:
+		/* no R-MAC, the response comes plain */
+		ret = resp_len > data_size ? -ENOSPC : 0;
+		if (!ret) {
+			memcpy(data, sm->resp, resp_len);
+			*data_len = resp_len;
+		}
+		break;
+	default:
+		ret = icao_unwrap(sm, resp_len, sw, data, data_size, data_len);
+		break;
+	}
+	if (ret == -EBADMSG)
+		csi_iso7816_sm_close(session);
+
+	return ret;
+}
+
+static struct iso7816_sm *sm_alloc(enum sm_scheme scheme, int channel)
+{
+	struct iso7816_sm *sm;
+
+	sm = calloc(1, sizeof(*sm));
+	if (!sm)
+		return NULL;
+
+	sm->scheme = scheme;
+	sm->channel = channel;
+	sm->offload = 1;
+
+	return sm;
+}
+
+static void sm_free(struct iso7816_sm *sm)
+{
+	sm_key_free(&sm->enc);
+	sm_key_free(&sm->mac);
+	sm_key_free(&sm->mac1);
+	sm_key_free(&sm->rmac);
+	OPENSSL_cleanse(sm->chain, sizeof(sm->chain));
+	free(sm);
+}
+
+int iso7816_sm_cmac(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t len,
+		    uint8_t *mac)
+{
+	struct iso7816_sm *sm;
+	int ret;
+
+	if (!sm_aes_cbc(key_len))
+		return -EINVAL;
+
+	sm = sm_alloc(SM_SCP03, 0);
+	if (!sm)
+		return -ENOMEM;
+
+	if (len > sizeof(sm->out))
+		ret = -EMSGSIZE;
+	else
+		ret = sm_aes_init(sm, &sm->mac, key, key_len);
+	if (!ret)
+		ret = sm_cmac(sm, &sm->mac, msg, len, mac);
+	sm_free(sm);
+
+	return ret;
+}
+
+static int sm_check_channel(csi_iso7816_session_t *session, int channel)
+{
+	if (channel < 0 || channel >= ISO7816_MAX_CHANNELS || !session->channels[channel].open)
+		return -EBADF;
+
+	return 0;
+}
+
+static int scp_initialize_update(csi_iso7816_session_t *session, int channel,
+				 uint8_t version, uint8_t *challenge,
+				 uint8_t *resp, size_t resp_size, size_t *resp_len,
+				 uint16_t *sw)
+{
+	uint8_t apdu[5 + SCP_CHALLENGE_LEN + 1];
+
+	if (RAND_bytes(challenge, SCP_CHALLENGE_LEN) != 1) {
+		ERR_clear_error();
+		return -EIO;
+	}
+
+	apdu[0] = 0x80 | iso7816_channel_cla(0x00, channel);
+	apdu[1] = SCP_INS_INITIALIZE_UPDATE;
+	apdu[2] = version;
+	apdu[3] = 0x00;
+	apdu[4] = SCP_CHALLENGE_LEN;
+	memcpy(apdu + 5, challenge, SCP_CHALLENGE_LEN);
+	apdu[5 + SCP_CHALLENGE_LEN] = 0x00;
+
+	return csi_iso7816_exchange(session, apdu, sizeof(apdu), resp, resp_size,
+				    resp_len, sw);
+}
+
+/* sm holds the session keys, the C-MAC is added by the exchange */
+static int scp_external_authenticate(csi_iso7816_session_t *session, struct iso7816_sm *sm,
+				     int level, const uint8_t *cryptogram, uint16_t *sw)
+{
+	uint8_t apdu[5 + SCP_CRYPTOGRAM_LEN], resp[AES_BLOCK];
+	size_t resp_len;
+	int ret;
+
+	apdu[0] = 0x80 | iso7816_channel_cla(0x00, sm->channel);
+	apdu[1] = SCP_INS_EXTERNAL_AUTHENTICATE;
+	apdu[2] = level;
+	apdu[3] = 0x00;
+	apdu[4] = SCP_CRYPTOGRAM_LEN;
+	memcpy(apdu + 5, cryptogram, SCP_CRYPTOGRAM_LEN);
+
+	sm->level = ISO7816_SM_C_MAC;
+	session->sm = sm;
+
+	ret = csi_iso7816_exchange(session, apdu, sizeof(apdu), resp, sizeof(resp),
+				   &resp_len, sw);
+	if (!ret && *sw != ISO7816_SW_OK)
+		ret = -EACCES;
+	if (ret) {
+		csi_iso7816_sm_close(session);
+		return ret;
+	}
+
+	sm->level = level;
+
+	return 0;
+}
+
+/* GP Amendment D 4.1.5, KDF in counter mode with CMAC */
+static int scp03_kdf(struct iso7816_sm *sm, struct sm_key *key, uint8_t constant,
+		     size_t bits, const uint8_t *context, uint8_t *out)
+{
+	uint8_t data[2 * AES_BLOCK], mac[AES_BLOCK];
+	size_t done, n;
+	int ret;
+
+	memset(data, 0, 11);
+	data[11] = constant;
+	data[12] = 0x00;
+	data[13] = bits >> 8;
+	data[14] = bits;
+	memcpy(data + AES_BLOCK, context, 2 * SCP_CHALLENGE_LEN);
+
+	for (done = 0, data[15] = 1; done < bits / 8; done += n, data[15]++) {
+		ret = sm_cmac(sm, key, data, sizeof(data), mac);
+		if (ret)
+			return ret;
+		n = bits / 8 - done < AES_BLOCK ? bits / 8 - done : AES_BLOCK;
+		memcpy(out + done, mac, n);
+	}
+	OPENSSL_cleanse(mac, sizeof(mac));
+
+	return 0;
+}
+
+/* static key, then the session key derived with constant */
+static int scp03_session_key(struct iso7816_sm *sm, struct sm_key *key,
+			     const uint8_t *k, size_t len, uint8_t constant,
+			     const uint8_t *context)
+{
+	struct sm_key base = { 0 };
+	uint8_t derived[32];
+	int ret;
+
+	ret = sm_aes_init(sm, &base, k, len);
+	if (!ret)
+		ret = scp03_kdf(sm, &base, constant, len * 8, context, derived);
+	if (!ret)
+		ret = sm_aes_init(sm, key, derived, len);
+	sm_key_free(&base);
+	OPENSSL_cleanse(derived, sizeof(derived));
+
+	return ret;
+}
+
+/**
+ * @brief  Open a GlobalPlatform SCP03 secure channel.
+ *
+ * INITIALIZE UPDATE and EXTERNAL AUTHENTICATE are sent on channel, the
+ * session keys derived from the static ones and the challenges, and the
+ * card cryptogram checked. From then on every csi_iso7816_exchange() on
+ * that channel is wrapped and unwrapped for the security level until
+ * csi_iso7816_sm_close() or a card reset.
+ *
+ * AES runs on the eip120 engine of OpenSSL when it loads, in software
+ * otherwise, see csi_iso7816_sm_offload().
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel with the security domain selected
+ * @param keys     Static AES keys
+ * @param level    ISO7816_SM_C_MAC, optionally with ISO7816_SM_C_DEC,
+ *                 ISO7816_SM_R_MAC and ISO7816_SM_R_ENC
+ * @param sw       Out: status word of the last command
+ * @return 0 on success, -EACCES when the card refuses the host or the card
+ *         cryptogram is wrong, or negative errno on failure
+ */
+int csi_iso7816_scp03_open(csi_iso7816_session_t *session, int channel,
+			   const csi_iso7816_scp_keys_t *keys, int level, uint16_t *sw)
+{
+	uint8_t challenge[SCP_CHALLENGE_LEN], context[2 * SCP_CHALLENGE_LEN];
+	uint8_t resp[32], cryptogram[SCP_CRYPTOGRAM_LEN];
+	struct iso7816_sm *sm;
+	size_t resp_len;
+	int ret;
+
+	assert(session != NULL && keys != NULL && sw != NULL);
+
+	*sw = ISO7816_SW_OK;
+
+	ret = sm_check_channel(session, channel);
+	if (ret)
+		return ret;
+	if (!sm_aes_cbc(keys->len))
+		return -EINVAL;
+	if (level != ISO7816_SM_C_MAC &&
+	    level != (ISO7816_SM_C_MAC | ISO7816_SM_C_DEC) &&
+	    level != (ISO7816_SM_C_MAC | ISO7816_SM_R_MAC) &&
+	    level != (ISO7816_SM_C_MAC | ISO7816_SM_C_DEC | ISO7816_SM_R_MAC) &&
+	    level != (ISO7816_SM_C_MAC | ISO7816_SM_C_DEC | ISO7816_SM_R_MAC | ISO7816_SM_R_ENC))
+		return -EINVAL;
+
+	csi_iso7816_sm_close(session);
+
+	ret = scp_initialize_update(session, channel, keys->version, challenge,
+				    resp, sizeof(resp), &resp_len, sw);
+	if (ret)
+		return ret;
+	if (*sw != ISO7816_SW_OK)
+		return -EACCES;
+	/* diversification data, key information, card challenge and cryptogram */
+	if ((resp_len != 29 && resp_len != 32) || resp[11] != 0x03)
+		return -EPROTO;
+
+	memcpy(context, challenge, SCP_CHALLENGE_LEN);
+	memcpy(context + SCP_CHALLENGE_LEN, resp + 13, SCP_CHALLENGE_LEN);
+
+	sm = sm_alloc(SM_SCP03, channel);
+	if (!sm)
+		return -ENOMEM;
+
+	ret = scp03_session_key(sm, &sm->enc, keys->enc, keys->len, SCP03_S_ENC, context);
+	if (!ret)
+		ret = scp03_session_key(sm, &sm->mac, keys->mac, keys->len, SCP03_S_MAC, context);
+	if (!ret)
+		ret = scp03_session_key(sm, &sm->rmac, keys->mac, keys->len, SCP03_S_RMAC, context);
+	if (!ret)
+		ret = scp03_kdf(sm, &sm->mac, SCP03_CARD_CRYPTOGRAM, 64, context, cryptogram);
+	if (!ret && CRYPTO_memcmp(cryptogram, resp + 21, SCP_CRYPTOGRAM_LEN))
+		ret = -EACCES;
+	if (!ret)
+		ret = scp03_kdf(sm, &sm->mac, SCP03_HOST_CRYPTOGRAM, 64, context, cryptogram);
+	if (ret) {
+		sm_free(sm);
+		return ret;
+	}
+
+	return scp_external_authenticate(session, sm, level, cryptogram, sw);
+}
+
+/* SCP02 session key of a static key */
+static int scp02_session_key(struct iso7816_sm *sm, struct sm_key *key,
+			     const uint8_t *k, uint16_t constant, const uint8_t *sequence,
+			     int single)
+{
+	struct sm_key base = { 0 };
+	uint8_t data[16], derived[16];
+	int ret;
+
+	memset(data, 0, sizeof(data));
+	data[0] = constant >> 8;
+	data[1] = constant;
+	memcpy(data + 2, sequence, 2);
+
+	ret = sm_des_init(sm, &base, k, 0);
+	if (!ret)
+		ret = sm_cbc(&base, 1, sm_zero, data, sizeof(data), derived);
+	if (!ret)
+		ret = sm_des_init(sm, key, derived, single);
+	sm_key_free(&base);
+	OPENSSL_cleanse(derived, sizeof(derived));
+
+	return ret;
+}
+
+/* ISO/IEC 9797-1 MAC algorithm 1 with 3DES S-ENC, padded */
+static int scp02_cryptogram(struct iso7816_sm *sm, const uint8_t *a, size_t a_len,
+			    const uint8_t *b, size_t b_len, const uint8_t *c, size_t c_len,
+			    uint8_t *cryptogram)
+{
+	size_t n = a_len + b_len + c_len;
+	int ret;
+
+	memcpy(sm->buf, a, a_len);
+	memcpy(sm->buf + a_len, b, b_len);
+	memcpy(sm->buf + a_len + b_len, c, c_len);
+	n = sm_pad(sm->buf, n, DES_BLOCK);
+
+	ret = sm_cbc(&sm->enc, 1, sm_zero, sm->buf, n, sm->out);
+	if (!ret)
+		memcpy(cryptogram, sm->out + n - DES_BLOCK, SCP_CRYPTOGRAM_LEN);
+
+	return ret;
+}
+
+/**
+ * @brief  Open a GlobalPlatform SCP02 secure channel.
+ *
+ * As csi_iso7816_scp03_open(), with 3DES keys. Only C-MAC and C-DEC are
+ * supported, on short APDUs.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel with the security domain selected
+ * @param keys     Static 3DES keys, len 16
+ * @param i        SCP02 option "i" of the card, 0x15 or 0x55
+ * @param level    ISO7816_SM_C_MAC, optionally with ISO7816_SM_C_DEC
+ * @param sw       Out: status word of the last command
+ * @return 0 on success, -EACCES when the card refuses the host or the card
+ *         cryptogram is wrong, or negative errno on failure
+ */
+int csi_iso7816_scp02_open(csi_iso7816_session_t *session, int channel,
+			   const csi_iso7816_scp_keys_t *keys, int i, int level,
+			   uint16_t *sw)
+{
+	uint8_t challenge[SCP_CHALLENGE_LEN], resp[32], cryptogram[SCP_CRYPTOGRAM_LEN];
+	const uint8_t *sequence, *card_challenge;
+	struct iso7816_sm *sm;
+	size_t resp_len;
+	int ret;
+
+	assert(session != NULL && keys != NULL && sw != NULL);
+
+	*sw = ISO7816_SW_OK;
+
+	ret = sm_check_channel(session, channel);
+	if (ret)
+		return ret;
+	if (keys->len != 16)
+		return -EINVAL;
+	if (level & (ISO7816_SM_R_MAC | ISO7816_SM_R_ENC))
+		return -EOPNOTSUPP;
+	if (level != ISO7816_SM_C_MAC && level != (ISO7816_SM_C_MAC | ISO7816_SM_C_DEC))
+		return -EINVAL;
+
+	csi_iso7816_sm_close(session);
+
+	ret = scp_initialize_update(session, channel, keys->version, challenge,
+				    resp, sizeof(resp), &resp_len, sw);
+	if (ret)
+		return ret;
+	if (*sw != ISO7816_SW_OK)
+		return -EACCES;
+	/* diversification data, key information, sequence counter, challenge, cryptogram */
+	if (resp_len != 28 || resp[11] != 0x02)
+		return -EPROTO;
+	sequence = resp + 12;
+	card_challenge = resp + 14;
+
+	sm = sm_alloc(SM_SCP02, channel);
+	if (!sm)
+		return -ENOMEM;
+	sm->icv_encrypt = !!(i & SCP02_I_ICV_ENCRYPT);
+
+	ret = scp02_session_key(sm, &sm->enc, keys->enc, SCP02_S_ENC, sequence, 0);
+	if (!ret)
+		ret = scp02_session_key(sm, &sm->mac, keys->mac, SCP02_C_MAC, sequence, 0);
+	if (!ret)
+		ret = scp02_session_key(sm, &sm->mac1, keys->mac, SCP02_C_MAC, sequence, 1);
+	if (!ret)
+		ret = scp02_cryptogram(sm, challenge, SCP_CHALLENGE_LEN, sequence, 2,
+				       card_challenge, 6, cryptogram);
+	if (!ret && CRYPTO_memcmp(cryptogram, resp + 20, SCP_CRYPTOGRAM_LEN))
+		ret = -EACCES;
+	if (!ret)
+		ret = scp02_cryptogram(sm, sequence, 2, card_challenge, 6,
+				       challenge, SCP_CHALLENGE_LEN, cryptogram);
+	if (ret) {
+		sm_free(sm);
+		return ret;
+	}
+
+	return scp_external_authenticate(session, sm, level, cryptogram, sw);
+}
+
+/* ICAO 9303 part 11 9.7.1, SHA-1 of the seed and counter, odd parity */
+static int icao_kdf(const uint8_t *kseed, uint32_t counter, uint8_t *key)
+{
+	uint8_t data[16 + 4], md[EVP_MAX_MD_SIZE];
+	int i, bits;
+
+	memcpy(data, kseed, 16);
+	data[16] = counter >> 24;
+	data[17] = counter >> 16;
+	data[18] = counter >> 8;
+	data[19] = counter;
+
+	if (!EVP_Digest(data, sizeof(data), md, NULL, EVP_sha1(), NULL)) {
+		ERR_clear_error();
+		return -EIO;
+	}
+
+	for (i = 0; i < 16; i++) {
+		bits = __builtin_popcount(md[i] & 0xfe);
+		key[i] = (md[i] & 0xfe) | !(bits & 1);
+	}
+	OPENSSL_cleanse(md, sizeof(md));
+
+	return 0;
+}
+
+/**
+ * @brief  Start ICAO 9303 secure messaging after Basic Access Control.
+ *
+ * The 3DES session keys are derived from the key seed of the mutual
+ * authentication. Every csi_iso7816_exchange() on channel is then sent
+ * protected, with its data encrypted and a MAC over the header, and the
+ * response checked and decrypted.
+ *
+ * @param session  Session ready for exchanges
+ * @param channel  Logical channel of the eMRTD application
+ * @param kseed    Key seed K.IFD xor K.IC
+ * @param ssc      Send sequence counter, RND.IC and RND.IFD low halves
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_icao_sm_start(csi_iso7816_session_t *session, int channel,
+			      const uint8_t kseed[16], const uint8_t ssc[8])
+{
+	uint8_t kenc[16], kmac[16];
+	struct iso7816_sm *sm;
+	int ret;
+
+	assert(session != NULL && kseed != NULL && ssc != NULL);
+
+	ret = sm_check_channel(session, channel);
+	if (ret)
+		return ret;
+
+	csi_iso7816_sm_close(session);
+
+	sm = sm_alloc(SM_ICAO, channel);
+	if (!sm)
+		return -ENOMEM;
+	memcpy(sm->ssc, ssc, DES_BLOCK);
+
+	ret = icao_kdf(kseed, 1, kenc);
+	if (!ret)
+		ret = icao_kdf(kseed, 2, kmac);
+	if (!ret)
+		ret = sm_des_init(sm, &sm->enc, kenc, 0);
+	if (!ret)
+		ret = sm_des_init(sm, &sm->mac, kmac, 0);
+	if (!ret)
+		ret = sm_des_init(sm, &sm->mac1, kmac, 1);
+	OPENSSL_cleanse(kenc, sizeof(kenc));
+	OPENSSL_cleanse(kmac, sizeof(kmac));
+	if (ret) {
+		sm_free(sm);
+		return ret;
+	}
+
+	session->sm = sm;
+
+	return 0;
+}
+
+/**
+ * @brief  Drop the secure messaging of the session, exchanges go plain.
+ *
+ * @param session  Opened session
+ */
+void csi_iso7816_sm_close(csi_iso7816_session_t *session)
+{
+	if (!session->sm)
+		return;
+
+	sm_free(session->sm);
+	session->sm = NULL;
+}
+
+/**
+ * @brief  Tell where the secure messaging ciphers run.
+ *
+ * @param session  Session with secure messaging started
+ * @return 1 on the eip120 engine, 0 in software, -ENOTCONN when not started
+ */
+int csi_iso7816_sm_offload(csi_iso7816_session_t *session)
+{
+	return session->sm ? session->sm->offload : -ENOTCONN;
+}
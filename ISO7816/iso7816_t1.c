@@ -0,0 +1,506 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * T=1 block transmission protocol, ISO/IEC 7816-3 clause 11.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+#define T1_NAD			0x00
+#define T1_PROLOGUE_LEN		3
+
+#define T1_I_BLOCK(ns, more)	((ns) << 6 | (more) << 5)
+#define T1_R_BLOCK(nr, err)	(0x80 | (nr) << 4 | (err))
+#define T1_S_BLOCK(type)	(0xc0 | (type))
+
+#define T1_IS_I(pcb)		(!((pcb) & 0x80))
+#define T1_IS_R(pcb)		(((pcb) & 0xc0) == 0x80)
+#define T1_I_NS(pcb)		(((pcb) >> 6) & 1)
+#define T1_I_MORE(pcb)		(((pcb) >> 5) & 1)
+#define T1_R_NR(pcb)		(((pcb) >> 4) & 1)
+
+#define T1_R_OK			0x00
+#define T1_R_EDC_ERR		0x01
+#define T1_R_OTHER_ERR		0x02
+
+#define T1_S_RESYNCH		0x00
+#define T1_S_IFS		0x01
+#define T1_S_ABORT		0x02
+#define T1_S_WTX		0x03
+#define T1_S_RESPONSE		0x20
+
+/* retransmissions of one block before RESYNCH */
+#define T1_MAX_RETRIES		3
+
+struct t1_block {
+	uint8_t pcb;
+	int len;
+	uint8_t inf[ISO7816_T1_IFS_MAX];
+};
+
+/* block to send: an I-block of the APDU, an R-block or an S(response) */
+struct t1_tx {
+	uint8_t pcb;
+	const uint8_t *inf;
+	int len;
+};
+
+/* response bytes go to the caller buffer, the last two (SW1 SW2) are held */
+struct t1_sink {
+	uint8_t *buf;
+	size_t size;
+	size_t len;
+	uint8_t sw[2];
+	int held;
+	int overflow;
+};
+
+static int t1_edc_len(const csi_iso7816_session_t *session)
+{
+	return session->t1_crc ? 2 : 1;
+}
+
+static void t1_edc(const csi_iso7816_session_t *session, const uint8_t *buf,
+		   size_t len, uint8_t *edc)
+{
+	uint16_t crc = 0xffff;
+	uint8_t lrc = 0;
+	size_t i;
+	int bit;
+
+	if (!session->t1_crc) {
+		for (i = 0; i < len; i++)
+			lrc ^= buf[i];
+		edc[0] = lrc;
+		return;
+	}
+
+	/* ISO/IEC 13239 CRC, as sent by T=1 cards */
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x8408 : crc >> 1;
+	}
+	edc[0] = crc >> 8;
+	edc[1] = crc & 0xff;
+}
+
+/*
+ * Largest INF sent: IFSC, cut so that a whole block fits in one
+ * DSMART_CARD_IOCTL_XMT unless the driver takes a pointer.
+ */
+static int t1_max_send(const csi_iso7816_session_t *session)
+{
+	int max = ISO7816_IOCTL_MAX - T1_PROLOGUE_LEN - t1_edc_len(session);
+
+	if (session->xfer_ptr)
+		return session->t1_ifsc;
+
+	return session->t1_ifsc < max ? session->t1_ifsc : max;
+}
+
+/**
+ * Reset the T=1 block state from the parsed ATR.
+ */
+void iso7816_t1_init(csi_iso7816_session_t *session)
+{
+	const csi_iso7816_atr_info_t *info = &session->atr_info;
+
+	session->t1_ns = 0;
+	session->t1_nr = 0;
+	session->t1_ifsc = info->ifsc ? info->ifsc : ISO7816_ATR_IFSC_DEFAULT;
+	session->t1_ifsd = 0;
+	session->t1_crc = info->edc_crc;
+}
+
+static int t1_send(csi_iso7816_session_t *session, uint8_t pcb, const uint8_t *inf, int len)
+{
+	uint8_t buf[T1_PROLOGUE_LEN + ISO7816_T1_IFS_MAX + 2];
+
+	buf[0] = T1_NAD;
+	buf[1] = pcb;
+	buf[2] = len;
+	if (len)
+		memcpy(buf + T1_PROLOGUE_LEN, inf, len);
+	t1_edc(session, buf, T1_PROLOGUE_LEN + len, buf + T1_PROLOGUE_LEN + len);
+
+	return iso7816_xmt(session, buf, T1_PROLOGUE_LEN + len + t1_edc_len(session));
+}
+
+/* transmission errors the block protocol recovers from */
+static int t1_recoverable(int ret)
+{
+	return ret == -EBADMSG || ret == -EPROTO || ret == -ETIMEDOUT || ret == -EIO;
+}
+
+static int t1_recv_block(csi_iso7816_session_t *session, struct t1_block *blk)
+{
+	uint8_t buf[T1_PROLOGUE_LEN + ISO7816_T1_IFS_MAX + 2], edc[2];
+	int edc_len = t1_edc_len(session), len, ret;
+
+	ret = iso7816_rcv(session, buf, T1_PROLOGUE_LEN, T1_PROLOGUE_LEN);
+	if (ret)
+		return ret;
+
+	len = buf[2];
+	if (len > ISO7816_T1_IFS_MAX)
+		return -EPROTO;
+
+	ret = iso7816_rcv(session, buf + T1_PROLOGUE_LEN, len + edc_len, len + edc_len);
+	if (ret)
+		return ret;
+
+	t1_edc(session, buf, T1_PROLOGUE_LEN + len, edc);
+	if (memcmp(edc, buf + T1_PROLOGUE_LEN + len, edc_len))
+		return -EBADMSG;
+
+	blk->pcb = buf[1];
+	blk->len = len;
+	memcpy(blk->inf, buf + T1_PROLOGUE_LEN, len);
+
+	return 0;
+}
+
+/* receive one block, with BWT multiplied by wtx when the card asked for it */
+static int t1_recv(csi_iso7816_session_t *session, struct t1_block *blk, int wtx)
+{
+	struct dsmart_card_timing timing = session->timing;
+	int ret, restore_ret;
+
+	if (wtx > 1) {
+		timing.bwt *= wtx;
+		timing.wwt *= wtx;
+		ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_TIMING, &timing);
+		if (ret)
+			return ret;
+	}
+
+	ret = t1_recv_block(session, blk);
+	if (ret)
+		iso7816_rx_flush(session);
+
+	if (wtx > 1) {
+		timing = session->timing;
+		restore_ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_TIMING, &timing);
+		if (!ret)
+			ret = restore_ret;
+	}
+
+	return ret;
+}
+
+/* reader initiated S-block exchange, answered with the same INF */
+static int t1_s_request(csi_iso7816_session_t *session, uint8_t type,
+			const uint8_t *inf, int len)
+{
+	struct t1_block blk;
+	int tries, ret;
+
+	for (tries = 0; tries < T1_MAX_RETRIES; tries++) {
+		ret = t1_send(session, T1_S_BLOCK(type), inf, len);
+		if (ret)
+			return ret;
+
+		ret = t1_recv(session, &blk, 0);
+		if (t1_recoverable(ret))
+			continue;
+		if (ret)
+			return ret;
+
+		if (blk.pcb == T1_S_BLOCK(type | T1_S_RESPONSE) && blk.len == len &&
+		    !memcmp(blk.inf, inf, len))
+			return 0;
+	}
+
+	return -EIO;
+}
+
+int iso7816_t1_resynch(csi_iso7816_session_t *session)
+{
+	int ret;
+
+	ret = t1_s_request(session, T1_S_RESYNCH, NULL, 0);
+	if (ret)
+		return ret;
+
+	iso7816_t1_init(session);
+
+	return 0;
+}
+
+/* RESYNCH after too many errors, the APDU in progress is lost either way */
+static int t1_resynch(csi_iso7816_session_t *session)
+{
+	int ret;
+
+	ret = iso7816_t1_resynch(session);
+
+	return ret ? ret : -EIO;
+}
+
+/**
+ * @brief  Negotiate the T=1 IFSD with an S(IFS request).
+ *
+ * Done on the first T=1 exchange with ISO7816_T1_IFS_MAX if not called.
+ *
+ * @param session  Session using T=1
+ * @param ifsd     Largest information field the reader accepts, 1 to 254
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_t1_set_ifsd(csi_iso7816_session_t *session, int ifsd)
+{
+	uint8_t value = ifsd;
+	int ret;
+
+	assert(session != NULL);
+
+	if (session->protocol != DSMART_CARD_PROTOCOL_T1 ||
+	    ifsd < 1 || ifsd > ISO7816_T1_IFS_MAX)
+		return -EINVAL;
+
+	iso7816_rx_flush(session);
+
+	ret = t1_s_request(session, T1_S_IFS, &value, 1);
+	if (ret)
+		return ret;
+
+	session->t1_ifsd = ifsd;
+
+	return 0;
+}
+
+static void t1_sink_put(struct t1_sink *sink, const uint8_t *inf, int len)
+{
+	int i;
+
+	for (i = 0; i < len; i++) {
+		if (sink->held == 2) {
+			if (sink->len < sink->size)
+				sink->buf[sink->len++] = sink->sw[0];
+			else
+				sink->overflow = 1;
+			sink->sw[0] = sink->sw[1];
+			sink->held = 1;
+		}
+		sink->sw[sink->held++] = inf[i];
+	}
+}
+
+/*
+ * Card initiated S-block: answer IFS and WTX, give up on ABORT.
+ * Returns -EPROTO for a block the reader must not receive.
+ */
+static int t1_s_reply(csi_iso7816_session_t *session, const struct t1_block *blk,
+		      struct t1_tx *tx, uint8_t *s_inf, int *wtx)
+{
+	uint8_t type = blk->pcb & 0x3f;
+
+	switch (type) {
+	case T1_S_IFS:
+		if (blk->len != 1 || !blk->inf[0] || blk->inf[0] > ISO7816_T1_IFS_MAX)
+			return -EPROTO;
+		session->t1_ifsc = blk->inf[0];
+		break;
+	case T1_S_WTX:
+		if (blk->len != 1 || !blk->inf[0])
+			return -EPROTO;
+		*wtx = blk->inf[0];
+		iso7816_trace_event(session, ISO7816_TRACE_WAIT);
+		break;
+	case T1_S_ABORT:
+		t1_send(session, T1_S_BLOCK(T1_S_ABORT | T1_S_RESPONSE), NULL, 0);
+		return -ECONNABORTED;
+	default:
+		return -EPROTO;
+	}
+
+	s_inf[0] = blk->inf[0];
+	tx->pcb = T1_S_BLOCK(type | T1_S_RESPONSE);
+	tx->inf = s_inf;
+	tx->len = 1;
+
+	return 0;
+}
+
+/*
+ * Send apdu chained over I-blocks and collect the chained response into
+ * sink, following the error handling rules of ISO/IEC 7816-3 11.6.3.
+ */
+static int t1_transceive(csi_iso7816_session_t *session, const uint8_t *apdu,
+			 size_t apdu_len, struct t1_sink *sink)
+{
+	struct t1_block rx;
+	struct t1_tx tx, last;
+	uint8_t s_inf[1];
+	size_t sent = 0, chunk, max_send = t1_max_send(session);
+	int sending = 1, more, wtx = 0, retries = 0, ret, err;
+
+	chunk = apdu_len < max_send ? apdu_len : max_send;
+	more = chunk < apdu_len;
+
+	/* last: what an R-block of the card asks for again */
+	last.pcb = T1_I_BLOCK(session->t1_ns, more);
+	last.inf = apdu;
+	last.len = chunk;
+	tx = last;
+
+	for (;;) {
+		ret = t1_send(session, tx.pcb, tx.inf, tx.len);
+		if (ret)
+			return ret;
+
+		ret = t1_recv(session, &rx, wtx);
+		wtx = 0;
+		if (t1_recoverable(ret)) {
+			err = ret == -EBADMSG || ret == -EIO ? T1_R_EDC_ERR : T1_R_OTHER_ERR;
+			goto bad_block;
+		}
+		if (ret)
+			return ret;
+
+		if (!T1_IS_I(rx.pcb) && !T1_IS_R(rx.pcb)) {
+			ret = t1_s_reply(session, &rx, &tx, s_inf, &wtx);
+			if (ret == -EPROTO) {
+				err = T1_R_OTHER_ERR;
+				goto bad_block;
+			}
+			if (ret)
+				return ret;
+			continue;
+		}
+
+		if (T1_IS_R(rx.pcb)) {
+			if (rx.len) {
+				err = T1_R_OTHER_ERR;
+				goto bad_block;
+			}
+			if (sending && more && T1_R_NR(rx.pcb) != session->t1_ns) {
+				/* chained block acknowledged, send the next one */
+				session->t1_ns ^= 1;
+				sent += chunk;
+				retries = 0;
+				max_send = t1_max_send(session);
+				chunk = apdu_len - sent < max_send ? apdu_len - sent : max_send;
+				more = sent + chunk < apdu_len;
+				last.pcb = T1_I_BLOCK(session->t1_ns, more);
+				last.inf = apdu + sent;
+				last.len = chunk;
+				tx = last;
+				continue;
+			}
+			/* the card asks for the last block again */
+			if (++retries > T1_MAX_RETRIES)
+				return t1_resynch(session);
+			iso7816_trace_event(session, ISO7816_TRACE_RETRY);
+			tx = last;
+			continue;
+		}
+
+		/* I-block */
+		if (sending) {
+			if (more) {
+				err = T1_R_OTHER_ERR;
+				goto bad_block;
+			}
+			/* the response acknowledges the last block of the APDU */
+			session->t1_ns ^= 1;
+			sending = 0;
+		}
+		if (T1_I_NS(rx.pcb) != session->t1_nr) {
+			err = T1_R_OTHER_ERR;
+			goto bad_block;
+		}
+
+		t1_sink_put(sink, rx.inf, rx.len);
+		session->t1_nr ^= 1;
+		retries = 0;
+
+		if (!T1_I_MORE(rx.pcb))
+			return 0;
+
+		iso7816_trace_event(session, ISO7816_TRACE_CHAIN);
+		last.pcb = T1_R_BLOCK(session->t1_nr, T1_R_OK);
+		last.inf = NULL;
+		last.len = 0;
+		tx = last;
+		continue;
+
+bad_block:
+		if (++retries > T1_MAX_RETRIES)
+			return t1_resynch(session);
+		iso7816_trace_event(session, ISO7816_TRACE_RETRY);
+		tx.pcb = T1_R_BLOCK(session->t1_nr, err);
+		tx.inf = NULL;
+		tx.len = 0;
+	}
+}
+
+/**
+ * T=1 counterpart of the T=0 exchange, see csi_iso7816_exchange().
+ */
+int iso7816_t1_exchange(csi_iso7816_session_t *session,
+			const uint8_t *apdu, size_t apdu_len,
+			uint8_t *data, size_t data_size, size_t *data_len,
+			uint16_t *sw)
+{
+	struct t1_sink sink = {
+		.buf = data,
+		.size = data_size,
+	};
+	struct iso7816_apdu cmd;
+	uint8_t get_response[5];
+	int ret, chain = 0;
+
+	ret = iso7816_apdu_parse(apdu, apdu_len, &cmd);
+	if (ret)
+		return ret;
+
+	iso7816_rx_flush(session);
+
+	if (session->t1_ifsd_want == ISO7816_ATR_IFSC_DEFAULT) {
+		/* known to refuse S(IFS), do not ask again */
+		session->t1_ifsd = ISO7816_ATR_IFSC_DEFAULT;
+	} else if (!session->t1_ifsd) {
+		ret = csi_iso7816_t1_set_ifsd(session, session->t1_ifsd_want ?
+					      session->t1_ifsd_want : ISO7816_T1_IFS_MAX);
+		if (ret == -EIO)
+			/* the card keeps IFSD at its default */
+			session->t1_ifsd = ISO7816_ATR_IFSC_DEFAULT;
+		else if (ret)
+			return ret;
+	}
+
+	ret = t1_transceive(session, apdu, apdu_len, &sink);
+	for (;;) {
+		if (ret)
+			return ret;
+		if (sink.held < 2)
+			return -EPROTO;
+
+		*sw = sink.sw[0] << 8 | sink.sw[1];
+		if ((*sw >> 8) != 0x61)
+			break;
+
+		/* a response body is at most 64KiB */
+		if (++chain > 256)
+			return -EPROTO;
+		iso7816_trace_event(session, ISO7816_TRACE_CHAIN);
+		get_response[0] = iso7816_get_response_cla(apdu[0]);
+		get_response[1] = ISO7816_INS_GET_RESPONSE;
+		get_response[2] = 0;
+		get_response[3] = 0;
+		get_response[4] = *sw & 0xff;
+
+		sink.held = 0;
+		ret = t1_transceive(session, get_response, sizeof(get_response), &sink);
+	}
+
+	*data_len = sink.len;
+
+	return sink.overflow ? -ENOSPC : 0;
+}
@@ -5,120 +5,125 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <unistd.h>
 #include <sys/types.h>
-#include <sys/ioctl.h>
-#include "dsmart_card_interface.h"
-#include "ioctl.h"
+#include "iso7816.h"
+
+/* SELECT MF, used when no APDU is given on the command line */
+static const uint8_t select_mf[] = { 0x00, 0xa4, 0x00, 0x00, 0x02, 0x3f, 0x00 };
 
-int main()
+static int parse_hex(const char *str, uint8_t *buf, size_t size)
 {
-	int ret, i;
-	struct dsmart_card_baud baud_data;
-	unsigned int protocol = DSMART_CARD_PROTOCOL_T0;
-	struct dsmart_card_atr  atr = { 0 };
-	struct dsmart_card_rcv rcv_data = {};
-	struct dsmart_card_xmt xmt_data = {};
-	struct dsmart_card_timing timing_data;
-
-	int fd = open("/dev/dsmart_card", O_RDWR);
-	if (fd < 0) {
-		perror("failed to open iso7816 smart card\n");
-		exit(1);
+	size_t len = 0;
+	unsigned int byte;
+
+	while (*str) {
+		if (*str == ' ' || *str == ':') {
+			str++;
+			continue;
+		}
+		if (len == size || sscanf(str, "%2x", &byte) != 1 || !str[1])
+			return -1;
+		buf[len++] = byte;
+		str += 2;
 	}
 
-	printf("dsmart card cmd = 0x%x\n", DSMART_CARD_IOCTL_COLD_RESET);
-	ret = ioctl(fd, DSMART_CARD_IOCTL_COLD_RESET, &atr);
-	if (ret < 0) {
-		printf("failed to get atr from slave card(%d)\n", ret);
-		exit(1);
-	}
+	return len;
+}
 
-	ret = ioctl(fd, DSMART_CARD_IOCTL_ATR_RCV, (unsigned long)&atr);
-	if (ret < 0) {
-		printf("failed to get atr data from slave card(%d)\n", ret);
-		exit(1);
+int main(int argc, char *argv[])
+{
+	int ret, i, apdu_len;
+	csi_iso7816_session_t session;
+	static uint8_t apdu[ISO7816_EXT_APDU_MAX], resp[ISO7816_EXT_LE_MAX + 2];
+	static csi_iso7816_stats_t stats;
+	size_t resp_len;
+
+	if (argc > 1) {
+		apdu_len = parse_hex(argv[1], apdu, sizeof(apdu));
+		if (apdu_len < 4) {
+			printf("Usage: %s [apdu in hex]\n", argv[0]);
+			exit(1);
+		}
+	} else {
+		memcpy(apdu, select_mf, sizeof(select_mf));
+		apdu_len = sizeof(select_mf);
 	}
 
-	printf("\nATR data length: %d, result: %d, ATR DATA:\n", atr.len, atr.errval);
-
-	for (i = 0; i < atr.len; i++)
-		printf("0x%02x ", atr.atr_buffer[i]);
+	ret = csi_iso7816_open(&session, NULL);
+	if (ret)
+		exit(1);
 
-	printf("\n\nset transmision protocol T0\n");
-	ret = ioctl(fd, DSMART_CARD_IOCTL_SET_PROTOCOL, &protocol);
+	ret = csi_iso7816_cold_reset(&session);
 	if (ret < 0) {
-		printf("failed to set transmision protocol(%d)\n", ret);
+		printf("failed to get atr from slave card(%d)\n", ret);
 		exit(1);
 	}
 
-	baud_data.di = 1;
-	baud_data.fi = 1;
-
-	printf("\nset baud rate, fi: %d, di: %d\n", baud_data.fi, baud_data.di);
-	ret = ioctl(fd, DSMART_CARD_IOCTL_SET_BAUD, &baud_data);
-	if (ret < 0) {
-		printf("failed to set baud rate(%d)\n", ret);
-		exit(1);
+	printf("\nATR data length: %d, result: %d, ATR DATA:\n", session.atr.len, session.atr.errval);
+
+	for (i = 0; i < session.atr.len; i++)
+		printf("0x%02x ", session.atr.atr_buffer[i]);
+
+	ret = csi_iso7816_cache_load(&session, NULL);
+	if (ret > 0) {
+		printf("\n\nprotocol and baud rate replayed from the card cache\n");
+	} else {
+		printf("\n\nnegotiate protocol and baud rate from the ATR\n");
+		ret = csi_iso7816_negotiate(&session);
+		if (ret < 0) {
+			printf("failed to negotiate(%d)\n", ret);
+			exit(1);
+		}
 	}
 
+	printf("\nprotocol: T%d, fi: %d (F %u), di: %d (D %u), historical bytes: %d\n",
+	       session.protocol, session.fi, csi_iso7816_fi_to_f(session.fi),
+	       session.di, csi_iso7816_di_to_d(session.di), session.atr_info.hist_len);
 
-	timing_data.wwt = 9600;
-	timing_data.bgt = 0;
-	timing_data.cwt = 0;
-	timing_data.bwt = 0;
-	timing_data.egt = 0;
+	if (csi_iso7816_trace_start(&session))
+		printf("\nfailed to start the latency trace\n");
 
-	printf("\nset timming window, wwt: %d, bgt: %d, cwt: %d, bwt: %d, egt: %d\n", timing_data.wwt, timing_data.bgt, timing_data.cwt, timing_data.bwt, timing_data.egt);
-	ret = ioctl(fd, DSMART_CARD_IOCTL_SET_TIMING, &timing_data);
-	if (ret < 0) {
-		printf("failed to set timing window(%d)\n", ret);
-		exit(1);
-	}
+	printf("\ntransceive apdu:");
+	for (i = 0; i < apdu_len; i++)
+		printf(" %02x", apdu[i]);
 
-	printf("\nget data from sim card ");
-	ret = ioctl(fd, DSMART_CARD_IOCTL_RCV, &rcv_data);
+	ret = csi_iso7816_transceive(&session, apdu, apdu_len, resp, sizeof(resp), &resp_len);
 	if (ret < 0) {
-		printf("failed to receive data from sim card\n");
+		printf("\nfailed to transceive apdu(%d), errval: %d\n", ret, session.errval);
 		exit(1);
 	}
 
-	printf(", len: %d\n", rcv_data.rcv_length);
-	for (i = 0; i < rcv_data.rcv_length; i++) {
+	printf("\nresponse, len: %zu\n", resp_len);
+	for (i = 0; i < resp_len; i++) {
 		if (i % 8 == 0)
 			printf("\n");
-		printf("0x%x  ", rcv_data.rcv_buffer[i]);
+		printf("0x%x  ", resp[i]);
 	}
 
-
-	printf("\nreset the smart card\n");
-	ret = ioctl(fd, DSMART_CARD_IOCTL_WARM_RESET, NULL);
-	if (ret < 0) {
-		printf("failed to reset the smart card(%d)\n", ret);
-		exit(1);
+	if (!csi_iso7816_trace_get(&session, &stats)) {
+		printf("\n\nlatencies:\n");
+		csi_iso7816_trace_print(stdout, &stats);
 	}
 
+	ret = csi_iso7816_cache_store(&session, NULL);
+	if (ret < 0)
+		printf("\nfailed to update the card cache %s(%d)\n", ISO7816_CACHE_DEFAULT_PATH, ret);
 
-	ret = ioctl(fd, DSMART_CARD_IOCTL_ATR_RCV, (unsigned long)&atr);
+	printf("\nreset the smart card\n");
+	ret = csi_iso7816_warm_reset(&session);
 	if (ret < 0) {
-		printf("failed to get atr data from slave card(%d)\n", ret);
+		printf("failed to reset the smart card(%d)\n", ret);
 		exit(1);
 	}
 
-	printf("\n\nATR data length after warm reset: %d, result: %d, ATR DATA:\n", atr.len, atr.errval);
-	for (i = 0; i < atr.len; i++)
-		printf("0x%02x ", atr.atr_buffer[i]);
+	printf("\n\nATR data length after warm reset: %d, result: %d, ATR DATA:\n", session.atr.len, session.atr.errval);
+	for (i = 0; i < session.atr.len; i++)
+		printf("0x%02x ", session.atr.atr_buffer[i]);
 
 	printf("\n\nterminate the session\n");
-	ret = ioctl(fd, DSMART_CARD_IOCTL_DEACTIVATE, NULL);
-	if (ret < 0) {
-		printf("failed to terminate the session\n");
-		exit(1);
-	}
+	csi_iso7816_close(&session);
 
 	printf("\nsucceed to access smart card\n");
 
-	close(fd);
-
 	return 0;
 }
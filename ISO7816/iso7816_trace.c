@@ -0,0 +1,408 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Exchange latency statistics. Every exchange is split into phases (card
+ * response, transfer, waiting time extensions, GET RESPONSE chaining) and
+ * each phase goes into a log2 histogram of the INS, so that a slow command
+ * can be told apart: a slow card, a slow line or blocks sent again.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+struct iso7816_trace {
+	/* stats is read by csi_iso7816_trace_get() from any thread */
+	pthread_mutex_t lock;
+	csi_iso7816_stats_t stats;
+
+	/* exchange in progress, only touched by the exchanging thread */
+	int active;
+	uint8_t ins;
+	uint64_t submit;
+	uint64_t first;			/* end of the first receive, 0 before */
+	uint64_t last;
+	uint64_t chain;			/* first chained request, 0 for none */
+	uint64_t wait_mark;		/* NULL or WTX received, 0 for none */
+	uint64_t wait_ns;
+	unsigned long retries;
+	unsigned long waits;
+	unsigned long chained;
+	unsigned long long tx_bytes;
+	unsigned long long rx_bytes;
+};
+
+static const char *const trace_errval_names[DSMART_CARD_STATE_ERR_EVENT + 1] = {
+	[DSMART_CARD_E_ACCESS]		= "E_ACCESS",
+	[DSMART_CARD_E_DATA_TIMEOUT]	= "E_DATA_TIMEOUT",
+	[DSMART_CARD_E_NOCARD]		= "E_NOCARD",
+	[DSMART_CARD_E_NOACT]		= "E_NOACT",
+	[DSMART_CARD_E_REMOVED]		= "E_REMOVED",
+	[DSMART_CARD_E_NO_RX_EV]	= "E_NO_RX_EV",
+	[DSMART_CARD_E_NO_TX_EV]	= "E_NO_TX_EV",
+	[DSMART_CARD_E_NO_CRD_EV]	= "E_NO_CRD_EV",
+	[DSMART_CARD_E_ACT_TIMEOUT]	= "E_ACT_TIMEOUT",
+	[DSMART_CARD_E_DATA_RCV_FAILED]	= "E_DATA_RCV_FAILED",
+	[DSMART_CARD_E_ACTIVATE_FAILED]	= "E_ACTIVATE_FAILED",
+	[DSMART_CARD_E_TX_FULL]		= "E_TX_FULL",
+	[DSMART_CARD_E_PAR_ERR]		= "E_PAR_ERR",
+	[DSMART_CARD_E_CRC_ERR]		= "E_CRC_ERR",
+	[DSMART_CARD_E_REP_ERR]		= "E_REP_ERR",
+	[DSMART_CARD_E_CWT_TIM]		= "E_CWT_TIM",
+	[DSMART_CARD_E_RX_OVER]		= "E_RX_OVER",
+	[DSMART_CARD_STATE_ERR_EVENT]	= "STATE_ERR_EVENT",
+};
+
+static const char *const trace_phase_names[ISO7816_PHASES] = {
+	[ISO7816_PHASE_TOTAL]		= "total",
+	[ISO7816_PHASE_RESPONSE]	= "response",
+	[ISO7816_PHASE_TRANSFER]	= "transfer",
+	[ISO7816_PHASE_WAIT]		= "wait",
+	[ISO7816_PHASE_CHAIN]		= "chain",
+};
+
+static const char *const trace_recover_names[ISO7816_RECOVER_STEPS] = {
+	[ISO7816_RECOVER_RETRANSMIT]	= "retransmit",
+	[ISO7816_RECOVER_RESYNCH]	= "resynch",
+	[ISO7816_RECOVER_WARM_RESET]	= "warm reset",
+	[ISO7816_RECOVER_COLD_RESET]	= "cold reset",
+};
+
+static uint64_t trace_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void trace_account(csi_iso7816_ins_stats_t *ins, int phase, uint64_t ns)
+{
+	uint64_t us = ns / 1000;
+	unsigned int b = 0;
+
+	while (us >> (b + 1) && b < ISO7816_TRACE_BUCKETS - 1)
+		b++;
+
+	if (us > ~0U)
+		us = ~0U;
+
+	ins->sum_us[phase] += us;
+	if (us > ins->max_us[phase])
+		ins->max_us[phase] = us;
+	ins->hist[phase][b]++;
+}
+
+void iso7816_trace_begin(csi_iso7816_session_t *session, const uint8_t *apdu)
+{
+	struct iso7816_trace *trace = session->trace;
+
+	if (!trace)
+		return;
+
+	trace->active = 1;
+	trace->ins = apdu[1];
+	trace->submit = trace_now();
+	trace->first = 0;
+	trace->last = 0;
+	trace->chain = 0;
+	trace->wait_mark = 0;
+	trace->wait_ns = 0;
+	trace->retries = 0;
+	trace->waits = 0;
+	trace->chained = 0;
+	trace->tx_bytes = 0;
+	trace->rx_bytes = 0;
+}
+
+void iso7816_trace_end(csi_iso7816_session_t *session, int ret)
+{
+	struct iso7816_trace *trace = session->trace;
+	csi_iso7816_ins_stats_t *ins;
+	uint64_t now;
+
+	if (!trace || !trace->active)
+		return;
+
+	now = trace_now();
+	trace->active = 0;
+
+	pthread_mutex_lock(&trace->lock);
+
+	ins = &trace->stats.ins[trace->ins];
+	ins->exchanges++;
+	if (ret)
+		ins->errors++;
+	ins->retries += trace->retries;
+	ins->waits += trace->waits;
+	ins->chained += trace->chained;
+	ins->tx_bytes += trace->tx_bytes;
+	ins->rx_bytes += trace->rx_bytes;
+
+	trace_account(ins, ISO7816_PHASE_TOTAL, now - trace->submit);
+	if (trace->first) {
+		trace_account(ins, ISO7816_PHASE_RESPONSE, trace->first - trace->submit);
+		trace_account(ins, ISO7816_PHASE_TRANSFER, trace->last - trace->first);
+	}
+	if (trace->waits)
+		trace_account(ins, ISO7816_PHASE_WAIT, trace->wait_ns);
+	if (trace->chain && trace->last > trace->chain)
+		trace_account(ins, ISO7816_PHASE_CHAIN, trace->last - trace->chain);
+
+	pthread_mutex_unlock(&trace->lock);
+}
+
+void iso7816_trace_xmt(csi_iso7816_session_t *session, size_t len)
+{
+	struct iso7816_trace *trace = session->trace;
+
+	if (trace && trace->active)
+		trace->tx_bytes += len;
+}
+
+void iso7816_trace_rcv(csi_iso7816_session_t *session, size_t len)
+{
+	struct iso7816_trace *trace = session->trace;
+	uint64_t now;
+
+	if (!trace || !trace->active)
+		return;
+
+	now = trace_now();
+	if (!trace->first)
+		trace->first = now;
+	trace->last = now;
+	trace->rx_bytes += len;
+
+	/* the card took this long after asking for more time */
+	if (trace->wait_mark) {
+		trace->wait_ns += now - trace->wait_mark;
+		trace->wait_mark = 0;
+	}
+}
+
+void iso7816_trace_event(csi_iso7816_session_t *session, enum iso7816_trace_event event)
+{
+	struct iso7816_trace *trace = session->trace;
+
+	if (!trace || !trace->active)
+		return;
+
+	switch (event) {
+	case ISO7816_TRACE_RETRY:
+		trace->retries++;
+		break;
+	case ISO7816_TRACE_WAIT:
+		trace->waits++;
+		if (!trace->wait_mark)
+			trace->wait_mark = trace_now();
+		break;
+	case ISO7816_TRACE_CHAIN:
+		trace->chained++;
+		if (!trace->chain)
+			trace->chain = trace_now();
+		break;
+	}
+}
+
+void iso7816_trace_errval(csi_iso7816_session_t *session, int errval)
+{
+	struct iso7816_trace *trace = session->trace;
+
+	if (!trace || errval < 0 || errval > DSMART_CARD_STATE_ERR_EVENT)
+		return;
+
+	pthread_mutex_lock(&trace->lock);
+	trace->stats.errval[errval]++;
+	pthread_mutex_unlock(&trace->lock);
+}
+
+void iso7816_trace_recover(csi_iso7816_session_t *session, int step, int recovered,
+			   const struct timespec *start)
+{
+	struct iso7816_trace *trace = session->trace;
+	csi_iso7816_recover_stats_t *stats;
+	uint64_t us;
+
+	if (!trace)
+		return;
+
+	us = (trace_now() - (start->tv_sec * 1000000000ULL + start->tv_nsec)) / 1000;
+	if (us > ~0U)
+		us = ~0U;
+
+	pthread_mutex_lock(&trace->lock);
+	stats = &trace->stats.recover[step];
+	stats->attempts++;
+	if (recovered)
+		stats->recovered++;
+	stats->sum_us += us;
+	if (us > stats->max_us)
+		stats->max_us = us;
+	pthread_mutex_unlock(&trace->lock);
+}
+
+/**
+ * @brief  Start collecting latency statistics, or clear them when started.
+ *
+ * Each exchange is timestamped at submission, on the first and the last
+ * byte received, on T=0 NULL bytes and T=1 WTX requests and on the first
+ * GET RESPONSE or chained block. The driver only tells when a receive
+ * completes, so "first byte" is the end of the first receive. Phases are
+ * accounted under the INS of the command APDU, driver errors under their
+ * DSMART_CARD_E_* code.
+ *
+ * @param session  Opened session
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_trace_start(csi_iso7816_session_t *session)
+{
+	struct iso7816_trace *trace;
+
+	assert(session != NULL);
+
+	trace = session->trace;
+	if (trace) {
+		pthread_mutex_lock(&trace->lock);
+		memset(&trace->stats, 0, sizeof(trace->stats));
+		pthread_mutex_unlock(&trace->lock);
+		return 0;
+	}
+
+	trace = calloc(1, sizeof(*trace));
+	if (!trace)
+		return -ENOMEM;
+
+	pthread_mutex_init(&trace->lock, NULL);
+	session->trace = trace;
+
+	return 0;
+}
+
+/**
+ * @brief  Stop collecting latency statistics and drop them.
+ *
+ * The async worker records into the statistics without holding a
+ * reference, so they cannot be dropped while it runs: stop it with
+ * csi_iso7816_async_stop() first.
+ *
+ * @param session  Session started with csi_iso7816_trace_start()
+ * @return 0 on success, -EBUSY while the session is started for async use
+ */
+int csi_iso7816_trace_stop(csi_iso7816_session_t *session)
+{
+	struct iso7816_trace *trace = session->trace;
+
+	if (session->async)
+		return -EBUSY;
+
+	if (!trace)
+		return 0;
+
+	session->trace = NULL;
+	pthread_mutex_destroy(&trace->lock);
+	free(trace);
+
+	return 0;
+}
+
+/**
+ * @brief  Copy the statistics collected so far.
+ *
+ * May be called while another thread (e.g. the async worker) exchanges.
+ *
+ * @param session  Session started with csi_iso7816_trace_start()
+ * @param stats    Out: statistics
+ * @return 0 on success, -ENODATA when not started
+ */
+int csi_iso7816_trace_get(csi_iso7816_session_t *session, csi_iso7816_stats_t *stats)
+{
+	struct iso7816_trace *trace;
+
+	assert(session != NULL && stats != NULL);
+
+	trace = session->trace;
+	if (!trace)
+		return -ENODATA;
+
+	pthread_mutex_lock(&trace->lock);
+	memcpy(stats, &trace->stats, sizeof(*stats));
+	pthread_mutex_unlock(&trace->lock);
+
+	return 0;
+}
+
+static void trace_print_phase(FILE *file, const csi_iso7816_ins_stats_t *ins, int phase)
+{
+	unsigned long count = 0;
+	unsigned int b;
+
+	for (b = 0; b < ISO7816_TRACE_BUCKETS; b++)
+		count += ins->hist[phase][b];
+	if (!count)
+		return;
+
+	fprintf(file, "  %-9s %8llu %8u ", trace_phase_names[phase],
+		ins->sum_us[phase] / count, ins->max_us[phase]);
+	for (b = 0; b < ISO7816_TRACE_BUCKETS; b++) {
+		if (ins->hist[phase][b])
+			fprintf(file, " %lu:%u", b ? 1UL << b : 0UL, ins->hist[phase][b]);
+	}
+	fprintf(file, "\n");
+}
+
+/**
+ * @brief  Print statistics: per INS phase histograms, error counts, recoveries.
+ *
+ * @param file   Output stream
+ * @param stats  Statistics from csi_iso7816_trace_get()
+ */
+void csi_iso7816_trace_print(FILE *file, const csi_iso7816_stats_t *stats)
+{
+	const csi_iso7816_recover_stats_t *recover;
+	const csi_iso7816_ins_stats_t *ins;
+	int i, phase, errors = 0, recoveries = 0;
+
+	assert(file != NULL && stats != NULL);
+
+	for (i = 0; i < 256; i++) {
+		ins = &stats->ins[i];
+		if (!ins->exchanges)
+			continue;
+
+		fprintf(file, "INS %02x: %lu exchanges, %lu errors, %lu retries, %lu waits, "
+			"%lu chained, %llu bytes sent, %llu received\n",
+			i, ins->exchanges, ins->errors, ins->retries, ins->waits,
+			ins->chained, ins->tx_bytes, ins->rx_bytes);
+		fprintf(file, "  %-9s %8s %8s  %s\n", "phase", "avg us", "max us",
+			"histogram, from us:count");
+		for (phase = 0; phase < ISO7816_PHASES; phase++)
+			trace_print_phase(file, ins, phase);
+	}
+
+	for (i = 0; i <= DSMART_CARD_STATE_ERR_EVENT; i++) {
+		if (!stats->errval[i] || !trace_errval_names[i])
+			continue;
+		if (!errors++)
+			fprintf(file, "driver errors:\n");
+		fprintf(file, "  %-18s %lu\n", trace_errval_names[i], stats->errval[i]);
+	}
+
+	for (i = ISO7816_RECOVER_RETRANSMIT; i < ISO7816_RECOVER_STEPS; i++) {
+		recover = &stats->recover[i];
+		if (!recover->attempts)
+			continue;
+		if (!recoveries++)
+			fprintf(file, "recovery:  %-10s %8s %8s %8s %8s\n", "step", "tried",
+				"worked", "avg us", "max us");
+		fprintf(file, "           %-10s %8lu %8lu %8llu %8u\n", trace_recover_names[i],
+			recover->attempts, recover->recovered,
+			recover->sum_us / recover->attempts, recover->max_us);
+	}
+}
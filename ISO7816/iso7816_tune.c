@@ -0,0 +1,209 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Waiting time tuning. The ATR waiting times are worst cases, often orders
+ * of magnitude above what the card needs, and every lost block or silent
+ * card costs the full time. The receives are timed and the waiting times
+ * brought down to a margin over the longest wait actually seen.
+ */
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "iso7816.h"
+#include "iso7816_priv.h"
+
+/* added to the scaled wait, a few characters of jitter */
+#define TUNE_SLACK_ETU		48
+
+#define TUNE_MARGIN_MAX		6400
+
+/* smallest values the ATR can give: WI = 1, CWI = 0, BWI = 0 */
+#define TUNE_WWT_MIN		960
+#define TUNE_CWT_MIN		(11 + 1)
+#define TUNE_BWT_MIN		(11 + 960)
+
+/* margin percent of wait, clamped to [min, limit], limit 0 meaning unset */
+static unsigned int tune_value(const struct iso7816_tune *tune, unsigned int wait,
+			       unsigned int min, unsigned int limit)
+{
+	unsigned long long value;
+
+	if (!limit)
+		return 0;
+
+	value = (unsigned long long)wait * tune->margin / 100 + TUNE_SLACK_ETU;
+	if (value < min)
+		value = min;
+	if (value > limit)
+		value = limit;
+
+	return value;
+}
+
+/* a waiting time is only shortened, and only when it has a limit */
+static unsigned int tune_clamp(unsigned int value, unsigned int limit)
+{
+	return value && value < limit ? value : limit;
+}
+
+int iso7816_tune_program(csi_iso7816_session_t *session,
+			 const struct dsmart_card_timing *timing)
+{
+	const struct dsmart_card_timing *spec = &session->tune.spec;
+	struct dsmart_card_timing value;
+	int ret;
+
+	value.wwt = tune_clamp(timing->wwt, spec->wwt);
+	value.cwt = tune_clamp(timing->cwt, spec->cwt);
+	value.bwt = tune_clamp(timing->bwt, spec->bwt);
+	value.bgt = spec->bgt;
+	value.egt = spec->egt;
+
+	if (!memcmp(&value, &session->timing, sizeof(value)))
+		return 0;
+
+	ret = iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_TIMING, &value);
+	if (ret)
+		return ret;
+
+	session->timing = value;
+	session->tune.tuned = !!memcmp(&value, spec, sizeof(value));
+
+	return 0;
+}
+
+static void tune_adjust(csi_iso7816_session_t *session)
+{
+	struct iso7816_tune *tune = &session->tune;
+	struct dsmart_card_timing timing = tune->spec;
+	unsigned int wait;
+
+	if (session->protocol == DSMART_CARD_PROTOCOL_T0) {
+		/* procedure bytes and data alike must come within WWT */
+		wait = tune->max_wait > tune->max_gap ? tune->max_wait : tune->max_gap;
+		timing.wwt = tune_value(tune, wait, TUNE_WWT_MIN, tune->spec.wwt);
+	} else {
+		timing.bwt = tune_value(tune, tune->max_wait, TUNE_BWT_MIN, tune->spec.bwt);
+		timing.cwt = tune_value(tune, tune->max_gap, TUNE_CWT_MIN, tune->spec.cwt);
+		/* the driver applies wwt to every RCV, do not cut a block short */
+		if (tune->spec.wwt)
+			timing.wwt = timing.bwt;
+	}
+
+	if (iso7816_tune_program(session, &timing))
+		fprintf(stderr, "iso7816: failed to program tuned waiting times\n");
+}
+
+void iso7816_tune_sample(csi_iso7816_session_t *session,
+			 const struct timespec *start, size_t len)
+{
+	struct iso7816_tune *tune = &session->tune;
+	unsigned long long ns, etu, transfer;
+	unsigned int f, d;
+	struct timespec now;
+	int after_xmt = tune->after_xmt;
+
+	tune->after_xmt = 0;
+
+	if (!tune->clock_hz)
+		return;
+
+	f = csi_iso7816_fi_to_f(session->fi);
+	d = csi_iso7816_di_to_d(session->di);
+	if (!f || !d)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+
+	/* etu = F / (D * f), less the time the received characters took */
+	etu = ns * tune->clock_hz / 1000000000ULL * d / f;
+	transfer = (unsigned long long)len * (session->protocol == DSMART_CARD_PROTOCOL_T0 ?
+					      12 : 11);
+	transfer += (unsigned long long)len * tune->spec.egt;
+	etu = etu > transfer ? etu - transfer : 0;
+	if (etu > ~0U)
+		etu = ~0U;
+
+	if (after_xmt) {
+		if (etu > tune->max_wait)
+			tune->max_wait = etu;
+	} else if (etu > tune->max_gap) {
+		tune->max_gap = etu;
+	}
+
+	if (++tune->samples % ISO7816_TUNE_WINDOW == 0)
+		tune_adjust(session);
+}
+
+int iso7816_tune_timeout(csi_iso7816_session_t *session)
+{
+	struct iso7816_tune *tune = &session->tune;
+	struct dsmart_card_timing spec = tune->spec;
+
+	if (!tune->tuned)
+		return 0;
+
+	/* too tight: back to the limits, and leave more room next time */
+	if (iso7816_ioctl(session, DSMART_CARD_IOCTL_SET_TIMING, &spec))
+		return 0;
+
+	session->timing = tune->spec;
+	tune->tuned = 0;
+	tune->samples = 0;
+	if (tune->margin && tune->margin < TUNE_MARGIN_MAX)
+		tune->margin *= 2;
+
+	/* T=0 has no retransmission, keep waiting for the response */
+	return session->protocol == DSMART_CARD_PROTOCOL_T0;
+}
+
+/**
+ * @brief  Shorten the waiting times to what the card actually needs.
+ *
+ * Every receive is timed. Each ISO7816_TUNE_WINDOW receives, WWT (T=0) or
+ * BWT and CWT (T=1) are set to margin percent of the longest wait seen so
+ * far, never above the values of csi_iso7816_set_timing(). A timeout with
+ * shortened times restores those values and doubles the margin: T=0 then
+ * keeps waiting for the response, T=1 recovers it with its retransmission.
+ *
+ * @param session   Session with its protocol, rate and timing set
+ * @param clock_hz  Card clock frequency
+ * @param margin    Percent of the longest wait, at least 100,
+ *                  0 for ISO7816_TUNE_MARGIN_DEFAULT
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_tune_start(csi_iso7816_session_t *session,
+			   unsigned int clock_hz, unsigned int margin)
+{
+	assert(session != NULL);
+
+	if (!clock_hz || (margin && margin < 100))
+		return -EINVAL;
+
+	session->tune.clock_hz = clock_hz;
+	session->tune.margin = margin ? margin : ISO7816_TUNE_MARGIN_DEFAULT;
+	session->tune.samples = 0;
+	session->tune.max_wait = 0;
+	session->tune.max_gap = 0;
+
+	return 0;
+}
+
+/**
+ * @brief  Stop measuring and restore the waiting times of csi_iso7816_set_timing().
+ *
+ * @param session  Session started with csi_iso7816_tune_start()
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iso7816_tune_stop(csi_iso7816_session_t *session)
+{
+	assert(session != NULL);
+
+	session->tune.clock_hz = 0;
+
+	return iso7816_tune_program(session, &session->tune.spec);
+}
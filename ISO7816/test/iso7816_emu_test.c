@@ -0,0 +1,593 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Tests of libiso7816 against the card emulator, run by "make test":
+ *
+ *   LD_PRELOAD=../output/libdsmart_emu.so ../output/iso7816_emu_test
+ *
+ * The emulator configuration is reached through dlsym() and changed
+ * between cases: a new ATR takes effect at the next cold reset, faults
+ * and procedure bytes at the next exchange. The latency statistics tell
+ * what went on the line (NULL bytes, GET RESPONSE, retries).
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iso7816.h"
+#include "dsmart_emu.h"
+
+#define INS_MANAGE_CHANNEL	0x70
+#define INS_READ_BINARY		0xb0
+#define INS_READ_RECORD		0xb2
+#define INS_UPDATE_BINARY	0xd6
+#define INS_PSO			0x2a	/* no such applet, the card echoes the data */
+
+/* T=0 only, F 372 D 4 */
+static const uint8_t atr_t0[] = { 0x3b, 0x12, 0x13, 0x45, 0x4d };
+
+/* the emulator default: T=1, F 372 D 4, IFSC 254, LRC */
+static const uint8_t atr_t1[] = {
+	0x3b, 0xfa, 0x13, 0x00, 0x00, 0x81, 0x31, 0xfe, 0x45, 0x4a,
+	0x43, 0x4f, 0x50, 0x34, 0x31, 0x56, 0x32, 0x32, 0x31, 0x96,
+};
+
+/* T=1, IFSC 254, CRC */
+static const uint8_t atr_t1_crc[] = { 0x3b, 0x80, 0x81, 0x51, 0xfe, 0x01, 0xaf };
+
+/* T=1, IFSC 32, LRC */
+static const uint8_t atr_t1_ifsc32[] = { 0x3b, 0x80, 0x81, 0x31, 0x20, 0x45, 0x55 };
+
+static struct emu_config *emu;
+static csi_iso7816_session_t session;
+static csi_iso7816_stats_t stats;
+
+static uint8_t apdu[ISO7816_EXT_APDU_MAX];
+static uint8_t data[ISO7816_EXT_LE_MAX + 256];
+static uint8_t pattern[ISO7816_EXT_LC_MAX];
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++;					\
+		}							\
+	} while (0)
+
+/* cold reset a card answering atr and negotiate, statistics cleared */
+static int card_start(const uint8_t *atr, size_t len)
+{
+	int ret;
+
+	memcpy(emu->atr, atr, len);
+	emu->atr_len = len;
+
+	ret = csi_iso7816_cold_reset(&session);
+	if (!ret)
+		ret = csi_iso7816_negotiate(&session);
+	if (!ret)
+		ret = csi_iso7816_trace_start(&session);
+
+	return ret;
+}
+
+/* statistics of ins since the last stats_clear() */
+static const csi_iso7816_ins_stats_t *ins_stats(uint8_t ins)
+{
+	if (csi_iso7816_trace_get(&session, &stats))
+		memset(&stats, 0, sizeof(stats));
+
+	return &stats.ins[ins];
+}
+
+static void stats_clear(void)
+{
+	csi_iso7816_trace_start(&session);
+}
+
+/* command APDU into apdu, extended when lc or le needs it; le -1 for none */
+static size_t build_apdu(uint8_t cla, uint8_t ins, uint16_t p1p2,
+			 const uint8_t *cmd_data, size_t lc, long le)
+{
+	int extended = lc > ISO7816_SHORT_LC_MAX || le > ISO7816_SHORT_LE_MAX;
+	size_t n = 4;
+
+	apdu[0] = cla;
+	apdu[1] = ins;
+	apdu[2] = p1p2 >> 8;
+	apdu[3] = p1p2;
+
+	if (extended)
+		apdu[n++] = 0x00;
+	if (lc) {
+		if (extended)
+			apdu[n++] = lc >> 8;
+		apdu[n++] = lc;
+		memcpy(apdu + n, cmd_data, lc);
+		n += lc;
+	}
+	if (le >= 0) {
+		if (extended)
+			apdu[n++] = le >> 8;
+		apdu[n++] = le;
+	}
+
+	return n;
+}
+
+static int exchange(size_t apdu_len, size_t *data_len, uint16_t *sw)
+{
+	return csi_iso7816_exchange(&session, apdu, apdu_len, data, sizeof(data), data_len, sw);
+}
+
+/* the transparent EF of the emulator holds its offsets until updated */
+static int file_matches(size_t offset, const uint8_t *buf, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (buf[i] != (uint8_t)((offset + i) ^ ((offset + i) >> 8)))
+			return 0;
+
+	return 1;
+}
+
+static void test_t0_procedure_bytes(void)
+{
+	size_t len;
+	uint16_t sw;
+
+	printf("T=0 NULL and ~INS procedure bytes\n");
+	CHECK(card_start(atr_t0, sizeof(atr_t0)) == 0);
+	CHECK(session.protocol == DSMART_CARD_PROTOCOL_T0);
+
+	/* NULL bytes before the ACK and before SW1 SW2 */
+	emu->t0_nulls = 3;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_UPDATE_BINARY, 0x0100, pattern, 20, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 0);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->waits == 6);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x0100, NULL, 0, 20), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 20 && !memcmp(data, pattern, 20));
+	CHECK(ins_stats(INS_READ_BINARY)->waits == 3);
+
+	/* ~INS: one data byte after each, either way */
+	emu->t0_nulls = 0;
+	emu->t0_bytewise = 1;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_UPDATE_BINARY, 0x0100, pattern + 100, 20, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 0);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->rx_bytes == 20 + 2);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x0100, NULL, 0, 20), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 20 && !memcmp(data, pattern + 100, 20));
+	CHECK(ins_stats(INS_READ_BINARY)->rx_bytes == 2 * 20 + 2);
+
+	/* both, on a case 4 command answered through GET RESPONSE */
+	emu->t0_nulls = 2;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_PSO, 0, pattern, 8, 0), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 8 && !memcmp(data, pattern, 8));
+	CHECK(ins_stats(INS_PSO)->chained == 1);
+	/* before each ~INS asking for a data byte, 61 08 and the GET RESPONSE data */
+	CHECK(ins_stats(INS_PSO)->waits == 2 * 8 + 2 + 2);
+
+	emu->t0_nulls = 0;
+	emu->t0_bytewise = 0;
+}
+
+static void test_t0_get_response(void)
+{
+	uint8_t channel;
+	size_t len;
+	uint16_t sw;
+
+	printf("T=0 61xx and GET RESPONSE\n");
+	CHECK(card_start(atr_t0, sizeof(atr_t0)) == 0);
+
+	/* a case 4 command always goes through GET RESPONSE */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_PSO, 0, pattern, 200, 0), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 200 && !memcmp(data, pattern, 200));
+	CHECK(ins_stats(INS_PSO)->chained == 1);
+
+	/* more than 256 bytes: 61 00 twice, then the rest */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x1000, NULL, 0, 700), &len, &sw) == 0);
+	CHECK(len == 700 && file_matches(0x1000, data, 700));
+	CHECK(ins_stats(INS_READ_BINARY)->chained == 2);
+
+	/* GET RESPONSE goes on the channel of the command */
+	CHECK(exchange(build_apdu(0x00, INS_MANAGE_CHANNEL, 0x0000, NULL, 0, 1), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 1);
+	channel = data[0];
+	CHECK(channel >= 1 && channel <= 3);
+	CHECK(exchange(build_apdu(channel, INS_PSO, 0, pattern, 16, 0), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16 && !memcmp(data, pattern, 16));
+	CHECK(exchange(build_apdu(0x00, INS_MANAGE_CHANNEL, 0x8000 | channel, NULL, 0, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK);
+}
+
+static void test_t0_le_satisfied(void)
+{
+	size_t len;
+	uint16_t sw;
+
+	printf("T=0 GET RESPONSE stops at Le\n");
+	CHECK(card_start(atr_t0, sizeof(atr_t0)) == 0);
+
+	/* the file goes on, but 256 bytes were asked: 61 00 is for the caller */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x1000, NULL, 0, 0), &len, &sw) == 0);
+	CHECK(sw == 0x6100 && len == 256 && file_matches(0x1000, data, 256));
+	CHECK(ins_stats(INS_READ_BINARY)->chained == 0);
+
+	/* Le 300: GET RESPONSE asks for the 44 missing bytes, not 256 */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x1000, NULL, 0, 300), &len, &sw) == 0);
+	CHECK((sw >> 8) == 0x61 && len == 300 && file_matches(0x1000, data, 300));
+	CHECK(ins_stats(INS_READ_BINARY)->chained == 1);
+	CHECK(ins_stats(INS_READ_BINARY)->rx_bytes == 1 + 256 + 2 + 1 + 44 + 2);
+
+	/* Le 512 met by a full GET RESPONSE */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x1000, NULL, 0, 512), &len, &sw) == 0);
+	CHECK(sw == 0x6100 && len == 512 && file_matches(0x1000, data, 512));
+	CHECK(ins_stats(INS_READ_BINARY)->chained == 1);
+}
+
+static void test_t0_wrong_le(void)
+{
+	size_t len;
+	uint16_t sw;
+
+	printf("T=0 6Cxx\n");
+	CHECK(card_start(atr_t0, sizeof(atr_t0)) == 0);
+
+	/* a record is 32 bytes, 64 asked: 6C20 and again with 32 */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_RECORD, 0x0104, NULL, 0, 64), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 32);
+	CHECK(data[0] == 0x10 && data[31] == 0x1f);
+	CHECK(ins_stats(INS_READ_RECORD)->retries == 1);
+
+	/* 16 bytes left before the end of the file */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, emu->file_size - 16, NULL, 0, 32),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16 && file_matches(emu->file_size - 16, data, 16));
+	CHECK(ins_stats(INS_READ_BINARY)->retries == 1);
+}
+
+static void test_t0_envelope(void)
+{
+	size_t len;
+	uint16_t sw;
+
+	printf("T=0 ENVELOPE\n");
+	CHECK(card_start(atr_t0, sizeof(atr_t0)) == 0);
+
+	/* Lc 600: two full ENVELOPEs, the last one completes the APDU */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_UPDATE_BINARY, 0x0200, pattern, 600, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 0);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->tx_bytes == 3 * 5 + 7 + 600);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x0200, NULL, 0, 600), &len, &sw) == 0);
+	CHECK(len == 600 && !memcmp(data, pattern, 600));
+
+	/* case 4E, the response comes back through GET RESPONSE */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_PSO, 0, pattern + 1, 1000, ISO7816_EXT_LE_MAX),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 1000 && !memcmp(data, pattern + 1, 1000));
+	CHECK(ins_stats(INS_PSO)->chained == 4);
+}
+
+static void test_t1_chaining(void)
+{
+	size_t len;
+	uint16_t sw;
+
+	printf("T=1 chaining\n");
+	CHECK(card_start(atr_t1, sizeof(atr_t1)) == 0);
+	CHECK(session.protocol == DSMART_CARD_PROTOCOL_T1);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x0000, NULL, 0, 1), &len, &sw) == 0);
+	CHECK(session.t1_ifsc == 254 && session.t1_ifsd == 254);
+
+	/* 607 bytes of APDU in I-blocks of 254, 254 and 99 */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_UPDATE_BINARY, 0x2000, pattern, 600, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 0);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->tx_bytes == 3 * (3 + 1) + 7 + 600);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->retries == 0);
+
+	/* 602 bytes of response in three I-blocks */
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x2000, NULL, 0, 600), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 600 && !memcmp(data, pattern, 600));
+	CHECK(ins_stats(INS_READ_BINARY)->chained == 2);
+
+	/* both ways in one exchange, then with a small IFSD */
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_PSO, 0, pattern + 3, 2000, ISO7816_EXT_LE_MAX),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 2000 && !memcmp(data, pattern + 3, 2000));
+	CHECK(ins_stats(INS_PSO)->chained == 7);
+	CHECK(csi_iso7816_t1_set_ifsd(&session, 32) == 0);
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x2000, NULL, 0, 100), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 100 && !memcmp(data, pattern, 100));
+	CHECK(ins_stats(INS_READ_BINARY)->chained == 3);
+
+	/* the card takes 32 bytes per block */
+	CHECK(card_start(atr_t1_ifsc32, sizeof(atr_t1_ifsc32)) == 0);
+	CHECK(session.t1_ifsc == 32);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x0000, NULL, 0, 1), &len, &sw) == 0);
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_UPDATE_BINARY, 0x2000, pattern + 5, 100, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->tx_bytes == 4 * (3 + 1) + 5 + 100);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x2000, NULL, 0, 100), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 100 && !memcmp(data, pattern + 5, 100));
+}
+
+/* a bad EDC either way, and a lost block, cost one retransmission */
+static void t1_edc_errors(const uint8_t *atr, size_t atr_len, int crc)
+{
+	uint8_t before[16];
+	size_t len;
+	uint16_t sw;
+
+	CHECK(card_start(atr, atr_len) == 0);
+	CHECK(session.protocol == DSMART_CARD_PROTOCOL_T1 && session.t1_crc == crc);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	memcpy(before, data, sizeof(before));
+
+	/* the card block is corrupted: R(EDC error) from the reader, sent again */
+	emu->corrupt_next = 1;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16 && !memcmp(data, before, 16));
+	CHECK(ins_stats(INS_READ_BINARY)->retries == 1);
+
+	/* the reader block is: R(EDC error) from the card, sent again */
+	emu->garble_next = 1;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_UPDATE_BINARY, 0x3000, pattern, 16, -1),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK);
+	CHECK(ins_stats(INS_UPDATE_BINARY)->retries == 1);
+
+	/* within a chained response */
+	emu->corrupt_next = 2;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_PSO, 0, pattern + 7, 600, ISO7816_EXT_LE_MAX),
+		       &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 600 && !memcmp(data, pattern + 7, 600));
+	CHECK(ins_stats(INS_PSO)->retries == 2);
+
+	/* a lost block times out, R-block */
+	emu->drop_next = 1;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16 && !memcmp(data, pattern, 16));
+	CHECK(ins_stats(INS_READ_BINARY)->retries == 1);
+}
+
+static void test_t1_edc(void)
+{
+	printf("T=1 LRC errors\n");
+	t1_edc_errors(atr_t1, sizeof(atr_t1), 0);
+	printf("T=1 CRC errors\n");
+	t1_edc_errors(atr_t1_crc, sizeof(atr_t1_crc), 1);
+}
+
+static void test_t1_resynch(void)
+{
+	size_t len;
+	uint16_t sw;
+
+	printf("T=1 RESYNCH\n");
+	CHECK(card_start(atr_t1, sizeof(atr_t1)) == 0);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	CHECK(session.t1_ns == 0 && session.t1_nr == 0);
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	CHECK(session.t1_ns == 1 && session.t1_nr == 1);
+
+	/* the block and its three retransmissions corrupted: S(RESYNCH), APDU lost */
+	emu->corrupt_next = 4;
+	stats_clear();
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == -EIO);
+	CHECK(ins_stats(INS_READ_BINARY)->retries == 3);
+	CHECK(session.t1_ns == 0 && session.t1_nr == 0);
+
+	/* both sides start over from N(S) 0 */
+	CHECK(exchange(build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16), &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16 && !memcmp(data, pattern, 16));
+	CHECK(session.t1_ns == 1 && session.t1_nr == 1);
+}
+
+/* exchange with recovery up to max_step, statistics of the steps in stats */
+static int recover_exchange(int max_step, size_t apdu_len, size_t *len, uint16_t *sw)
+{
+	int ret;
+
+	CHECK(csi_iso7816_set_recovery(&session, max_step) == 0);
+	stats_clear();
+	ret = exchange(apdu_len, len, sw);
+	ins_stats(0);
+	CHECK(csi_iso7816_set_recovery(&session, ISO7816_RECOVER_NONE) == 0);
+
+	return ret;
+}
+
+static void test_recovery(void)
+{
+	unsigned int timeout_us = emu->timeout_us;
+	size_t read_len, len;
+	uint16_t sw;
+	int fi, di;
+
+	printf("tiered recovery\n");
+	/* every step below waits for a mute card */
+	emu->timeout_us = 10000;
+	read_len = build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16);
+
+	/* T=0, a lost response: sent again */
+	CHECK(card_start(atr_t0, sizeof(atr_t0)) == 0);
+	emu->drop_next = 1;
+	CHECK(recover_exchange(ISO7816_RECOVER_RETRANSMIT, read_len, &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16);
+	CHECK(session.recovered == ISO7816_RECOVER_RETRANSMIT);
+	CHECK(stats.recover[ISO7816_RECOVER_RETRANSMIT].attempts == 1);
+	CHECK(stats.recover[ISO7816_RECOVER_RETRANSMIT].recovered == 1);
+
+	/* T=0 has no RESYNCH, the warm reset comes next */
+	emu->drop_next = 2;
+	CHECK(recover_exchange(ISO7816_RECOVER_RESYNCH, read_len, &len, &sw) == -ETIMEDOUT);
+	CHECK(session.recovered == ISO7816_RECOVER_NONE);
+	CHECK(stats.recover[ISO7816_RECOVER_RETRANSMIT].attempts == 1);
+	CHECK(stats.recover[ISO7816_RECOVER_RESYNCH].attempts == 0);
+	emu->drop_next = 2;
+	CHECK(recover_exchange(ISO7816_RECOVER_WARM_RESET, read_len, &len, &sw) == -ECONNRESET);
+	CHECK(session.recovered == ISO7816_RECOVER_WARM_RESET);
+
+	/* no recovery by default */
+	CHECK(card_start(atr_t1, sizeof(atr_t1)) == 0);
+	CHECK(exchange(read_len, &len, &sw) == 0);
+	emu->corrupt_next = 4;
+	CHECK(exchange(read_len, &len, &sw) == -EIO);
+	CHECK(session.recovered == ISO7816_RECOVER_NONE);
+
+	/*
+	 * T=1: four corrupted blocks, then three S(RESYNCH response), fail
+	 * an attempt. The APDU sent again makes it.
+	 */
+	emu->corrupt_next = 4 + 3;
+	CHECK(recover_exchange(ISO7816_RECOVER_COLD_RESET, read_len, &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16);
+	CHECK(session.recovered == ISO7816_RECOVER_RETRANSMIT);
+
+	/* the second attempt fails too, the S(RESYNCH) of the next step goes through */
+	emu->corrupt_next = 2 * (4 + 3);
+	CHECK(recover_exchange(ISO7816_RECOVER_RETRANSMIT, read_len, &len, &sw) == -EIO);
+	CHECK(session.recovered == ISO7816_RECOVER_NONE);
+	CHECK(card_start(atr_t1, sizeof(atr_t1)) == 0);
+	CHECK(exchange(read_len, &len, &sw) == 0);
+	emu->corrupt_next = 2 * (4 + 3);
+	CHECK(recover_exchange(ISO7816_RECOVER_COLD_RESET, read_len, &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16);
+	CHECK(session.recovered == ISO7816_RECOVER_RESYNCH);
+	CHECK(stats.recover[ISO7816_RECOVER_RETRANSMIT].attempts == 1);
+	CHECK(stats.recover[ISO7816_RECOVER_RETRANSMIT].recovered == 0);
+	CHECK(stats.recover[ISO7816_RECOVER_RESYNCH].recovered == 1);
+
+	/* a card mute until reset: warm reset, the negotiated rate replayed */
+	fi = session.fi;
+	di = session.di;
+	CHECK(!(fi == ISO7816_ATR_FI_DEFAULT && di == ISO7816_ATR_DI_DEFAULT));
+	emu->mute = EMU_MUTE_RESET;
+	CHECK(recover_exchange(ISO7816_RECOVER_COLD_RESET, read_len, &len, &sw) == -ECONNRESET);
+	CHECK(session.recovered == ISO7816_RECOVER_WARM_RESET);
+	CHECK(stats.recover[ISO7816_RECOVER_RESYNCH].attempts == 1);
+	CHECK(stats.recover[ISO7816_RECOVER_WARM_RESET].recovered == 1);
+	CHECK(session.protocol == DSMART_CARD_PROTOCOL_T1 && session.fi == fi && session.di == di);
+	CHECK(exchange(read_len, &len, &sw) == 0);
+
+	/* mute until a cold reset: the warm one gets no ATR */
+	emu->mute = EMU_MUTE_COLD;
+	CHECK(recover_exchange(ISO7816_RECOVER_WARM_RESET, read_len, &len, &sw) == -ETIMEDOUT);
+	CHECK(session.recovered == ISO7816_RECOVER_NONE);
+	CHECK(stats.recover[ISO7816_RECOVER_WARM_RESET].attempts == 1);
+	CHECK(stats.recover[ISO7816_RECOVER_WARM_RESET].recovered == 0);
+	CHECK(emu->mute == EMU_MUTE_COLD);
+	CHECK(recover_exchange(ISO7816_RECOVER_COLD_RESET, read_len, &len, &sw) == -ECONNRESET);
+	CHECK(session.recovered == ISO7816_RECOVER_COLD_RESET);
+	CHECK(stats.recover[ISO7816_RECOVER_COLD_RESET].recovered == 1);
+	CHECK(emu->mute == EMU_MUTE_NONE);
+	CHECK(session.protocol == DSMART_CARD_PROTOCOL_T1 && session.fi == fi && session.di == di);
+	CHECK(exchange(read_len, &len, &sw) == 0);
+	CHECK(sw == ISO7816_SW_OK && len == 16);
+
+	emu->timeout_us = timeout_us;
+}
+
+/* the async worker records into the statistics, they stay until it stops */
+static void test_trace_async(void)
+{
+	csi_iso7816_req_t req = { 0 }, *done;
+	struct pollfd pfd;
+	size_t read_len;
+
+	printf("statistics under async\n");
+	CHECK(card_start(atr_t1, sizeof(atr_t1)) == 0);
+	read_len = build_apdu(0x00, INS_READ_BINARY, 0x3000, NULL, 0, 16);
+	CHECK(csi_iso7816_async_start(&session) == 0);
+
+	req.apdu = apdu;
+	req.apdu_len = read_len;
+	req.resp = data;
+	req.resp_size = sizeof(data);
+	CHECK(csi_iso7816_submit(&session, &req) == 0);
+	CHECK(csi_iso7816_trace_stop(&session) == -EBUSY);
+
+	pfd.fd = csi_iso7816_async_fd(&session);
+	pfd.events = POLLIN;
+	CHECK(poll(&pfd, 1, 1000) == 1);
+	done = csi_iso7816_reap(&session);
+	CHECK(done == &req && req.result == 0 && req.resp_len == 16 + 2);
+	CHECK(ins_stats(INS_READ_BINARY)->exchanges == 1);
+
+	csi_iso7816_async_stop(&session);
+	CHECK(csi_iso7816_trace_stop(&session) == 0);
+	CHECK(csi_iso7816_trace_get(&session, &stats) == -ENODATA);
+	CHECK(csi_iso7816_trace_stop(&session) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+	size_t i;
+
+	emu = dlsym(RTLD_DEFAULT, "emu_config");
+	if (!emu) {
+		fprintf(stderr, "run with LD_PRELOAD=.../libdsmart_emu.so\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(pattern); i++)
+		pattern[i] = i * 7 + (i >> 8);
+
+	if (csi_iso7816_open(&session, NULL)) {
+		fprintf(stderr, "cannot open the emulated reader\n");
+		return 1;
+	}
+
+	test_t0_procedure_bytes();
+	test_t0_get_response();
+	test_t0_le_satisfied();
+	test_t0_wrong_le();
+	test_t0_envelope();
+	test_t1_chaining();
+	test_t1_edc();
+	test_t1_resynch();
+	test_recovery();
+	test_trace_async();
+
+	csi_iso7816_close(&session);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,735 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Known-answer tests of the secure messaging, run by "make test" under the
+ * card emulator as iso7816_emu_test:
+ *  - ICAO 9303 part 11 Appendix D.4, the protected APDUs of the worked
+ *    example compared byte for byte and its responses unwrapped,
+ *  - the AES-CMAC examples of NIST SP 800-38B,
+ *  - SCP03 and SCP02 opened against a card of this program, built on
+ *    OpenSSL alone, with the host challenge fixed through RAND,
+ *  - an "eip120" engine of this program doing AES-128 only: the other
+ *    ciphers fall back to software, with the same results.
+ */
+#define _GNU_SOURCE
+#define OPENSSL_API_COMPAT	0x10100000L	/* ENGINE, RAND_METHOD, CMAC_CTX */
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <openssl/cmac.h>
+#include <openssl/engine.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+#include "iso7816.h"
+#include "iso7816_priv.h"
+#include "dsmart_emu.h"
+
+#define INS_INITIALIZE_UPDATE		0x50
+#define INS_EXTERNAL_AUTHENTICATE	0x82
+
+#define SW_SM_WRONG			0x6988	/* SM data objects incorrect */
+
+/* the emulator default: T=1, F 372 D 4, IFSC 254, LRC */
+static const uint8_t atr_t1[] = {
+	0x3b, 0xfa, 0x13, 0x00, 0x00, 0x81, 0x31, 0xfe, 0x45, 0x4a,
+	0x43, 0x4f, 0x50, 0x34, 0x31, 0x56, 0x32, 0x32, 0x31, 0x96,
+};
+
+static struct emu_config *emu;
+static csi_iso7816_session_t session;
+
+static uint8_t apdu[ISO7816_EXT_APDU_MAX];
+static uint8_t data[ISO7816_EXT_LE_MAX + 256];
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++;					\
+		}							\
+	} while (0)
+
+static size_t hex(const char *s, uint8_t *buf)
+{
+	size_t n;
+
+	for (n = 0; s[2 * n]; n++)
+		sscanf(s + 2 * n, "%2hhx", &buf[n]);
+
+	return n;
+}
+
+static int exchange(size_t apdu_len, size_t *data_len, uint16_t *sw)
+{
+	return csi_iso7816_exchange(&session, apdu, apdu_len, data, sizeof(data), data_len, sw);
+}
+
+/*
+ * The eip120 engine of the test: AES-128-CBC only, counting its calls, so
+ * that AES-256 and 3DES are refused and run in software.
+ */
+static EVP_CIPHER *engine_aes;
+static int (*engine_aes_cipher)(EVP_CIPHER_CTX *ctx, unsigned char *out,
+				const unsigned char *in, size_t len);
+static unsigned long engine_calls;
+
+static int engine_do_cipher(EVP_CIPHER_CTX *ctx, unsigned char *out,
+			    const unsigned char *in, size_t len)
+{
+	engine_calls++;
+
+	return engine_aes_cipher(ctx, out, in, len);
+}
+
+static int engine_ciphers(ENGINE *e, const EVP_CIPHER **cipher, const int **nids, int nid)
+{
+	static const int engine_nids[] = { NID_aes_128_cbc };
+
+	if (!cipher) {
+		*nids = engine_nids;
+		return 1;
+	}
+
+	*cipher = nid == NID_aes_128_cbc ? engine_aes : NULL;
+
+	return *cipher != NULL;
+}
+
+/* before the first secure messaging, the library loads its engine once */
+static int engine_add(void)
+{
+	const EVP_CIPHER *aes = EVP_aes_128_cbc();
+	ENGINE *e;
+	int ok;
+
+	/* the software cipher with a counting do_cipher, set once on a new method */
+	engine_aes_cipher = EVP_CIPHER_meth_get_do_cipher(aes);
+	engine_aes = EVP_CIPHER_meth_new(NID_aes_128_cbc, EVP_CIPHER_block_size(aes),
+					 EVP_CIPHER_key_length(aes));
+	ok = engine_aes && EVP_CIPHER_meth_set_iv_length(engine_aes, EVP_CIPHER_iv_length(aes)) &&
+	     EVP_CIPHER_meth_set_flags(engine_aes, EVP_CIPHER_flags(aes)) &&
+	     EVP_CIPHER_meth_set_init(engine_aes, EVP_CIPHER_meth_get_init(aes)) &&
+	     EVP_CIPHER_meth_set_do_cipher(engine_aes, engine_do_cipher) &&
+	     EVP_CIPHER_meth_set_impl_ctx_size(engine_aes, EVP_CIPHER_impl_ctx_size(aes));
+	if (!ok)
+		return -1;
+
+	e = ENGINE_new();
+	ok = e && ENGINE_set_id(e, "eip120") && ENGINE_set_name(e, "eip120 of the test") &&
+	     ENGINE_set_ciphers(e, engine_ciphers) && ENGINE_add(e);
+	ENGINE_free(e);
+
+	return ok ? 0 : -1;
+}
+
+/* RAND of the host, the SCP challenges known to the card */
+static const uint8_t host_challenge[8] = { 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88 };
+
+static int fixed_bytes(unsigned char *buf, int num)
+{
+	int i;
+
+	for (i = 0; i < num; i++)
+		buf[i] = host_challenge[i % sizeof(host_challenge)];
+
+	return 1;
+}
+
+static int fixed_status(void)
+{
+	return 1;
+}
+
+static RAND_METHOD fixed_rand = {
+	.bytes = fixed_bytes,
+	.pseudorand = fixed_bytes,
+	.status = fixed_status,
+};
+
+static const uint8_t zero[16];
+
+/* card side, OpenSSL only; single DES is the 3-key cipher with K1K1K1 */
+static void cipher(const EVP_CIPHER *type, const uint8_t *key, int enc, const uint8_t *iv,
+		   const uint8_t *in, size_t len, uint8_t *out)
+{
+	EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+	int n;
+
+	if (!ctx || !EVP_CipherInit_ex(ctx, type, NULL, key, iv, enc) ||
+	    !EVP_CIPHER_CTX_set_padding(ctx, 0) || !EVP_CipherUpdate(ctx, out, &n, in, len))
+		memset(out, 0, len);
+	EVP_CIPHER_CTX_free(ctx);
+}
+
+static const EVP_CIPHER *aes_cbc(size_t key_len)
+{
+	return key_len == 16 ? EVP_aes_128_cbc() : key_len == 24 ? EVP_aes_192_cbc() :
+	       EVP_aes_256_cbc();
+}
+
+static void des3_cbc(const uint8_t *k16, int enc, const uint8_t *in, size_t len, uint8_t *out)
+{
+	uint8_t k[24];
+
+	memcpy(k, k16, 16);
+	memcpy(k + 16, k16, 8);
+	cipher(EVP_des_ede3_cbc(), k, enc, zero, in, len, out);
+}
+
+static void des_block(const uint8_t *k8, int enc, const uint8_t *in, uint8_t *out)
+{
+	uint8_t k[24];
+
+	memcpy(k, k8, 8);
+	memcpy(k + 8, k8, 8);
+	memcpy(k + 16, k8, 8);
+	cipher(EVP_des_ede3_ecb(), k, enc, NULL, in, 8, out);
+}
+
+static void cmac(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t len,
+		 uint8_t *mac)
+{
+	CMAC_CTX *ctx = CMAC_CTX_new();
+	size_t n;
+
+	if (!ctx || !CMAC_Init(ctx, key, key_len, aes_cbc(key_len), NULL) ||
+	    !CMAC_Update(ctx, msg, len) || !CMAC_Final(ctx, mac, &n))
+		memset(mac, 0, 16);
+	CMAC_CTX_free(ctx);
+}
+
+static void increment(uint8_t *counter, size_t len)
+{
+	while (len-- && !++counter[len])
+		;
+}
+
+static size_t pad(uint8_t *buf, size_t len, size_t block)
+{
+	buf[len++] = 0x80;
+	while (len % block)
+		buf[len++] = 0x00;
+
+	return len;
+}
+
+static int unpad(const uint8_t *buf, size_t *len)
+{
+	while (*len && !buf[*len - 1])
+		(*len)--;
+	if (!*len || buf[*len - 1] != 0x80)
+		return -1;
+	(*len)--;
+
+	return 0;
+}
+
+/* ISO/IEC 9797-1 MAC algorithm 3 of a padded msg */
+static void retail_mac(const uint8_t *k16, const uint8_t *icv, const uint8_t *msg, size_t len,
+		       uint8_t *mac)
+{
+	uint8_t h[8];
+	size_t i, j;
+
+	memcpy(h, icv, 8);
+	for (i = 0; i < len; i += 8) {
+		for (j = 0; j < 8; j++)
+			h[j] ^= msg[i + j];
+		des_block(k16, 1, h, h);
+	}
+	des_block(k16 + 8, 0, h, h);
+	des_block(k16, 1, h, mac);
+}
+
+/* the security domain, SCP03 or SCP02, answering the host */
+static struct {
+	int scp;
+	const csi_iso7816_scp_keys_t *keys;
+	int i;				/* SCP02 option */
+	int level;
+	int bad_rmac;			/* next R-MAC sent wrong */
+
+	uint8_t enc[32], mac[32], rmac[32];
+	uint8_t chain[16];		/* SCP03 MAC chaining value, SCP02 last C-MAC */
+	uint8_t counter[16];
+	int chained;
+	unsigned long commands;		/* unwrapped and answered */
+} card;
+
+static const uint8_t card_challenge[8] = { 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8 };
+static const uint8_t scp02_sequence[2] = { 0x00, 0x2a };
+
+/* GP Amendment D 4.1.5 */
+static void scp03_kdf(const uint8_t *key, size_t key_len, uint8_t constant, size_t bits,
+		      uint8_t *out)
+{
+	uint8_t in[32], mac[16];
+	size_t done;
+
+	memset(in, 0, 11);
+	in[11] = constant;
+	in[12] = 0x00;
+	in[13] = bits >> 8;
+	in[14] = bits;
+	memcpy(in + 16, host_challenge, 8);
+	memcpy(in + 24, card_challenge, 8);
+
+	for (done = 0, in[15] = 1; done < bits / 8; done += 16, in[15]++) {
+		cmac(key, key_len, in, sizeof(in), mac);
+		memcpy(out + done, mac, bits / 8 - done < 16 ? bits / 8 - done : 16);
+	}
+}
+
+static void scp02_key(const uint8_t *k16, uint16_t constant, uint8_t *out)
+{
+	uint8_t in[16] = { constant >> 8, constant, scp02_sequence[0], scp02_sequence[1] };
+
+	des3_cbc(k16, 1, in, sizeof(in), out);
+}
+
+/* MAC algorithm 1 with 3DES S-ENC of a, b and c */
+static void scp02_cryptogram(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len,
+			     const uint8_t *c, size_t c_len, uint8_t *cryptogram)
+{
+	uint8_t in[32], out[32];
+	size_t n;
+
+	memcpy(in, a, a_len);
+	memcpy(in + a_len, b, b_len);
+	memcpy(in + a_len + b_len, c, c_len);
+	n = pad(in, a_len + b_len + c_len, 8);
+	des3_cbc(card.enc, 1, in, n, out);
+	memcpy(cryptogram, out + n - 8, 8);
+}
+
+static int scp_initialize_update(const uint8_t *cmd, size_t len, uint8_t *resp, size_t *resp_len)
+{
+	size_t key_len = card.keys->len;
+	uint8_t *p = resp;
+
+	if (len != 5 + 8 + 1 || cmd[4] != 8 || memcmp(cmd + 5, host_challenge, 8))
+		return -1;
+
+	memset(p, 0x0d, 10);		/* diversification data */
+	p[10] = card.keys->version;
+	p[11] = card.scp;
+	if (card.scp == 0x03) {
+		p[12] = 0x70;
+		memcpy(p + 13, card_challenge, 8);
+		scp03_kdf(card.keys->enc, key_len, 0x04, key_len * 8, card.enc);
+		scp03_kdf(card.keys->mac, key_len, 0x06, key_len * 8, card.mac);
+		scp03_kdf(card.keys->mac, key_len, 0x07, key_len * 8, card.rmac);
+		scp03_kdf(card.mac, key_len, 0x00, 64, p + 21);
+		*resp_len = 29;
+	} else {
+		memcpy(p + 12, scp02_sequence, 2);
+		memcpy(p + 14, card_challenge, 6);
+		scp02_key(card.keys->enc, 0x0182, card.enc);
+		scp02_key(card.keys->mac, 0x0101, card.mac);
+		scp02_cryptogram(host_challenge, 8, scp02_sequence, 2, card_challenge, 6, p + 20);
+		*resp_len = 28;
+	}
+
+	memset(card.chain, 0, sizeof(card.chain));
+	memset(card.counter, 0, sizeof(card.counter));
+	card.chained = 0;
+	card.level = 0;
+
+	return 0;
+}
+
+/* check the C-MAC and decrypt the data of cmd in place, lc updated */
+static int scp_unwrap(uint8_t *cmd, size_t *lc)
+{
+	uint8_t in[ISO7816_SHORT_LC_MAX + 64], mac[16], icv[16], *body = cmd + 5;
+	size_t n;
+
+	if (cmd[4] < 8 || *lc != cmd[4])
+		return -1;
+	n = cmd[4] - 8;
+
+	if (card.scp == 0x03) {
+		memcpy(in, card.chain, 16);
+		memcpy(in + 16, cmd, 5 + n);
+		cmac(card.mac, card.keys->len, in, 16 + 5 + n, mac);
+		if (memcmp(mac, body + n, 8))
+			return -1;
+		memcpy(card.chain, mac, 16);
+
+		if (card.level & ISO7816_SM_C_DEC) {
+			increment(card.counter, sizeof(card.counter));
+			if (n) {
+				cipher(aes_cbc(card.keys->len), card.enc, 1, NULL, card.counter, 16,
+				       icv);
+				cipher(aes_cbc(card.keys->len), card.enc, 0, icv, body, n, in);
+				if (n % 16 || unpad(in, &n))
+					return -1;
+				memcpy(body, in, n);
+			}
+		}
+	} else {
+		if (card.level & ISO7816_SM_C_DEC && n) {
+			des3_cbc(card.enc, 0, body, n, in);
+			if (n % 8 || unpad(in, &n))
+				return -1;
+			memcpy(body, in, n);
+		}
+
+		/* over the plain command, ICV the last C-MAC, encrypted for "i" 0x55 */
+		if (card.chained && (card.i & 0x40))
+			des_block(card.mac, 1, card.chain, icv);
+		else
+			memcpy(icv, card.chained ? card.chain : zero, 8);
+		memcpy(in, cmd, 4);
+		in[4] = n + 8;
+		memcpy(in + 5, body, n);
+		retail_mac(card.mac, icv, in, pad(in, 5 + n, 8), mac);
+		if (memcmp(mac, cmd + 5 + cmd[4] - 8, 8))
+			return -1;
+		memcpy(card.chain, mac, 8);
+		card.chained = 1;
+	}
+
+	*lc = n;
+
+	return 0;
+}
+
+/* the response data, encrypted and with an R-MAC as the level asks */
+static void scp_wrap(const uint8_t *body, size_t n, uint8_t *resp, size_t *resp_len)
+{
+	uint8_t in[ISO7816_SHORT_LE_MAX + 64], icv[16], mac[16];
+
+	memcpy(resp, body, n);
+	if (card.scp == 0x03 && (card.level & ISO7816_SM_R_ENC) && n) {
+		memcpy(in, resp, n);
+		n = pad(in, n, 16);
+		memcpy(icv, card.counter, 16);
+		icv[0] = 0x80;
+		cipher(aes_cbc(card.keys->len), card.enc, 1, NULL, icv, 16, icv);
+		cipher(aes_cbc(card.keys->len), card.enc, 1, icv, in, n, resp);
+	}
+	resp[n] = 0x90;
+	resp[n + 1] = 0x00;
+
+	if (card.scp == 0x03 && (card.level & ISO7816_SM_R_MAC)) {
+		memcpy(in, card.chain, 16);
+		memcpy(in + 16, resp, n + 2);
+		cmac(card.rmac, card.keys->len, in, 16 + n + 2, mac);
+		if (card.bad_rmac) {
+			mac[0] ^= 0x01;
+			card.bad_rmac = 0;
+		}
+		memcpy(resp + n, mac, 8);
+		n += 8;
+		resp[n] = 0x90;
+		resp[n + 1] = 0x00;
+	}
+
+	*resp_len = n + 2;
+}
+
+/* a security domain echoing the data of every command once the channel is open */
+static int scp_applet(const uint8_t *cmd, size_t len, uint8_t *resp, size_t *resp_len)
+{
+	uint8_t buf[5 + ISO7816_SHORT_LC_MAX + 1];
+	uint8_t cryptogram[8];
+	size_t lc;
+
+	if (len > sizeof(buf) || len < 5)
+		return -1;
+	memcpy(buf, cmd, len);
+
+	if (buf[1] == INS_INITIALIZE_UPDATE && !(buf[0] & 0x04)) {
+		if (scp_initialize_update(buf, len, resp, resp_len))
+			goto wrong;
+		resp[*resp_len] = 0x90;
+		resp[*resp_len + 1] = 0x00;
+		*resp_len += 2;
+		return 0;
+	}
+
+	/* Le of a short command, when present, follows the data */
+	lc = buf[4];
+	if (len != 5 + lc && len != 5 + lc + 1)
+		goto wrong;
+	if (!(buf[0] & 0x04) || scp_unwrap(buf, &lc))
+		goto wrong;
+
+	if (buf[1] == INS_EXTERNAL_AUTHENTICATE) {
+		if (card.scp == 0x03)
+			scp03_kdf(card.mac, card.keys->len, 0x01, 64, cryptogram);
+		else
+			scp02_cryptogram(scp02_sequence, 2, card_challenge, 6,
+					 host_challenge, 8, cryptogram);
+		if (lc != 8 || memcmp(buf + 5, cryptogram, 8))
+			goto wrong;
+		resp[0] = 0x90;
+		resp[1] = 0x00;
+		*resp_len = 2;
+		card.level = buf[2];
+		return 0;
+	}
+
+	card.commands++;
+	scp_wrap(buf + 5, lc, resp, resp_len);
+
+	return 0;
+
+wrong:
+	resp[0] = SW_SM_WRONG >> 8;
+	resp[1] = SW_SM_WRONG & 0xff;
+	*resp_len = 2;
+
+	return 0;
+}
+
+/* the protected APDUs of D.4, the card answers the expected ones */
+static const char *const icao_d4[][4] = {
+	/* SELECT EF.COM */
+	{ "00A4020C02011E", "0CA4020C158709016375432908C044F68E08BF8B92D635FF24F800",
+	  "990290008E08FA855A5D4C50A8ED9000", "" },
+	/* READ BINARY of the first four bytes */
+	{ "00B0000004", "0CB000000D9701048E08ED6705417E96BA5500",
+	  "8709019FF0EC34F9922651990290008E08AD55CC17140B2DED9000", "60145F01" },
+	/* READ BINARY of the rest */
+	{ "00B0000412", "0CB000040D9701128E082EA28A70F3C7B53500",
+	  "871901FB9235F4E4037F2327DCC8964F1F9B8C30F42C8E2FFF224A990290008E08C8B2787EAEA07D749000",
+	  "04303130365F36063034303030305C026175" },
+};
+
+#define ICAO_D4_STEPS	(sizeof(icao_d4) / sizeof(icao_d4[0]))
+
+static size_t icao_step;
+
+static int icao_applet(const uint8_t *cmd, size_t len, uint8_t *resp, size_t *resp_len)
+{
+	uint8_t want[64];
+
+	/* past the example, the first READ BINARY response replayed */
+	if (icao_step == ICAO_D4_STEPS) {
+		*resp_len = hex(icao_d4[1][2], resp);
+		return 0;
+	}
+
+	if (hex(icao_d4[icao_step][1], want) != len || memcmp(cmd, want, len)) {
+		resp[0] = SW_SM_WRONG >> 8;
+		resp[1] = SW_SM_WRONG & 0xff;
+		*resp_len = 2;
+		return 0;
+	}
+
+	*resp_len = hex(icao_d4[icao_step][2], resp);
+	icao_step++;
+
+	return 0;
+}
+
+static void test_icao(void)
+{
+	uint8_t kseed[16], ssc[8], want[32];
+	size_t i, len, n;
+	uint16_t sw;
+
+	printf("ICAO 9303 part 11 D.4\n");
+	hex("0036D272F5C350ACAC50C3F572D23600", kseed);
+	hex("887022120C06C226", ssc);
+
+	emu->applet = icao_applet;
+	icao_step = 0;
+	CHECK(csi_iso7816_icao_sm_start(&session, 0, kseed, ssc) == 0);
+	/* 3DES is not on the engine */
+	CHECK(csi_iso7816_sm_offload(&session) == 0);
+
+	for (i = 0; i < ICAO_D4_STEPS; i++) {
+		len = hex(icao_d4[i][0], apdu);
+		CHECK(exchange(len, &n, &sw) == 0);
+		CHECK(icao_step == i + 1);
+		CHECK(sw == ISO7816_SW_OK);
+		CHECK(n == hex(icao_d4[i][3], want) && !memcmp(data, want, n));
+	}
+
+	/* a replayed response fails the MAC, the SSC moved on, and ends the SM */
+	hex("00B0000004", apdu);
+	CHECK(exchange(5, &n, &sw) == -EBADMSG);
+	CHECK(csi_iso7816_sm_offload(&session) == -ENOTCONN);
+
+	emu->applet = NULL;
+}
+
+static void test_cmac(void)
+{
+	static const char *const msgs[] = {
+		"",
+		"6bc1bee22e409f96e93d7e117393172a",
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411",
+		"6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+		"30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710",
+	};
+	static const struct {
+		const char *key;
+		const char *macs[4];
+	} vectors[] = {
+		{ "2b7e151628aed2a6abf7158809cf4f3c",
+		  { "bb1d6929e95937287fa37d129b756746", "070a16b46b4d4144f79bdd9dd04a287c",
+		    "dfa66747de9ae63030ca32611497c827", "51f0bebf7e3b9d92fc49741779363cfe" } },
+		{ "8e73b0f7da0e6452c810f32b809079e562f8ead2522c6b7b",
+		  { "d17ddf46adaacde531cac483de7a9367", "9e99a7bf31e710900662f65e617c5184",
+		    "8a1de5be2eb31aad089a82e6ee908b0e", "a1d5df0eed790f794d77589659f39a11" } },
+		{ "603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+		  { "028962f61b7bf89efc6b551f4667d983", "28a7023f452e8f82bd4bf28d8c37c35c",
+		    "aaf3d8f1de5640c232f5b169b9c911e6", "e1992190549f6ed5696a2c056c315410" } },
+	};
+	uint8_t key[32], msg[64], want[16], mac[16];
+	unsigned long calls;
+	size_t i, j, key_len, len;
+
+	printf("AES-CMAC, NIST SP 800-38B\n");
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		key_len = hex(vectors[i].key, key);
+		calls = engine_calls;
+		for (j = 0; j < 4; j++) {
+			len = hex(msgs[j], msg);
+			hex(vectors[i].macs[j], want);
+			CHECK(iso7816_sm_cmac(key, key_len, msg, len, mac) == 0);
+			CHECK(!memcmp(mac, want, sizeof(mac)));
+		}
+		/* AES-128 on the engine, the larger keys in software */
+		CHECK((engine_calls != calls) == (key_len == 16));
+	}
+
+	CHECK(iso7816_sm_cmac(key, 20, msg, 0, mac) == -EINVAL);
+}
+
+/* open SCP on the basic channel, then echo commands of growing length through it */
+static void scp_loopback(int scp, const csi_iso7816_scp_keys_t *keys, int i, int level,
+			 int offload)
+{
+	unsigned long calls = engine_calls, commands = 0;
+	size_t n, lc, len;
+	uint16_t sw;
+	int ret;
+
+	memset(&card, 0, sizeof(card));
+	card.scp = scp;
+	card.keys = keys;
+	card.i = i;
+	emu->applet = scp_applet;
+
+	if (scp == 0x03)
+		ret = csi_iso7816_scp03_open(&session, 0, keys, level, &sw);
+	else
+		ret = csi_iso7816_scp02_open(&session, 0, keys, i, level, &sw);
+	CHECK(ret == 0 && sw == ISO7816_SW_OK);
+	CHECK(card.level == level);
+	CHECK(csi_iso7816_sm_offload(&session) == offload);
+	CHECK((engine_calls != calls) == offload);
+
+	for (lc = 0; lc <= 64; lc += lc < 16 ? 1 : 16) {
+		for (n = 0; n < lc; n++)
+			apdu[5 + n] = n * 13 + lc;
+		apdu[0] = 0x80;
+		apdu[1] = 0xe2;
+		apdu[2] = 0x00;
+		apdu[3] = lc;
+		apdu[4] = lc;
+		/* Le 256 after the data, or right after the header */
+		len = lc ? 5 + lc : 4;
+		apdu[len++] = 0x00;
+		CHECK(exchange(len, &n, &sw) == 0);
+		CHECK(sw == ISO7816_SW_OK);
+		CHECK(n == lc && !memcmp(data, apdu + 5, lc));
+		commands++;
+	}
+	CHECK(card.commands == commands);
+
+	emu->applet = NULL;
+}
+
+static void test_scp(void)
+{
+	csi_iso7816_scp_keys_t keys = { .len = 16, .version = 0x30 }, other;
+	uint16_t sw;
+	size_t n;
+
+	hex("404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f", keys.enc);
+	hex("606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f", keys.mac);
+
+	printf("SCP03, AES-128 on the engine\n");
+	scp_loopback(0x03, &keys, 0, ISO7816_SM_C_MAC, 1);
+	scp_loopback(0x03, &keys, 0, ISO7816_SM_C_MAC | ISO7816_SM_C_DEC | ISO7816_SM_R_MAC |
+		     ISO7816_SM_R_ENC, 1);
+
+	/* a wrong R-MAC ends the channel */
+	card.bad_rmac = 1;
+	emu->applet = scp_applet;
+	hex("80e2000000", apdu);
+	CHECK(exchange(5, &n, &sw) == -EBADMSG);
+	CHECK(csi_iso7816_sm_offload(&session) == -ENOTCONN);
+	emu->applet = NULL;
+
+	printf("SCP03, AES-256 in software\n");
+	keys.len = 32;
+	scp_loopback(0x03, &keys, 0, ISO7816_SM_C_MAC | ISO7816_SM_C_DEC | ISO7816_SM_R_MAC |
+		     ISO7816_SM_R_ENC, 0);
+
+	/* a card of other keys, its cryptogram is refused */
+	other = keys;
+	other.mac[0] ^= 0x01;
+	memset(&card, 0, sizeof(card));
+	card.scp = 0x03;
+	card.keys = &other;
+	emu->applet = scp_applet;
+	CHECK(csi_iso7816_scp03_open(&session, 0, &keys, ISO7816_SM_C_MAC, &sw) == -EACCES);
+	CHECK(csi_iso7816_sm_offload(&session) == -ENOTCONN);
+	emu->applet = NULL;
+
+	printf("SCP02, 3DES in software\n");
+	keys.len = 16;
+	scp_loopback(0x02, &keys, 0x15, ISO7816_SM_C_MAC, 0);
+	scp_loopback(0x02, &keys, 0x55, ISO7816_SM_C_MAC | ISO7816_SM_C_DEC, 0);
+	csi_iso7816_sm_close(&session);
+}
+
+int main(int argc, char *argv[])
+{
+	emu = dlsym(RTLD_DEFAULT, "emu_config");
+	if (!emu) {
+		fprintf(stderr, "run with LD_PRELOAD=.../libdsmart_emu.so\n");
+		return 1;
+	}
+
+	if (engine_add() || !RAND_set_rand_method(&fixed_rand)) {
+		fprintf(stderr, "cannot set up the test engine\n");
+		return 1;
+	}
+
+	if (csi_iso7816_open(&session, NULL)) {
+		fprintf(stderr, "cannot open the emulated reader\n");
+		return 1;
+	}
+
+	memcpy(emu->atr, atr_t1, sizeof(atr_t1));
+	emu->atr_len = sizeof(atr_t1);
+	if (csi_iso7816_cold_reset(&session) || csi_iso7816_negotiate(&session)) {
+		fprintf(stderr, "cannot start the emulated card\n");
+		return 1;
+	}
+
+	test_icao();
+	test_cmac();
+	test_scp();
+
+	csi_iso7816_close(&session);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+
+	return failures ? 1 : 0;
+}
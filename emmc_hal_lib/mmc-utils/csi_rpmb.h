@@ -15,11 +15,16 @@ enum hal_rpmb_op_type {
 
 typedef int	hal_error_t;
 
+struct mmc_dev;
+
 typedef struct _csi_hal_rpmb_ctx {
 	char *device;
 	int dev_fd;
+	struct mmc_dev *dev;
 	enum hal_rpmb_op_type rpmb_op_type;
 	uint8_t key_mac[32];
+	uint32_t write_counter;		/* next write's counter, if valid */
+	int write_counter_valid;
 }csi_hal_rpmb_ctx_t;
 
 
@@ -0,0 +1,1363 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Modified to add field firmware update support,
+ * those modifications are Copyright (c) 2016 SanDisk Corp.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <endian.h>
+#include <linux/fs.h> /* for BLKGETSIZE */
+
+#include "mmc.h"
+#include "libmmc.h"
+#include "3rdparty/hmac_sha/hmac_sha2.h"
+
+#ifndef offsetof
+#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
+#endif
+
+#define USER_WP_PERM_PSWD_DIS	0x80
+#define USER_WP_CD_PERM_WP_DIS	0x40
+#define USER_WP_US_PERM_WP_DIS	0x10
+#define USER_WP_US_PWR_WP_DIS	0x08
+#define USER_WP_US_PERM_WP_EN	0x04
+#define USER_WP_US_PWR_WP_EN	0x01
+#define USER_WP_CLEAR (USER_WP_US_PERM_WP_DIS | USER_WP_US_PWR_WP_DIS	\
+			| USER_WP_US_PERM_WP_EN | USER_WP_US_PWR_WP_EN)
+
+#define RPMB_MULTI_CMD_MAX_CMDS 3
+
+/* RESULT of a write signed with a stale write counter */
+#define RPMB_RESULT_COUNTER_FAILURE	0x0003
+
+/*
+ * Frames kept per handle for RPMB requests. Reads are split into chunks
+ * of this size, well below the MMC_IOC_MAX_BYTES a single command of a
+ * multi-cmd may transfer, or of what the host controller takes in one
+ * request when that is less (see rpmb_max_frames()).
+ */
+#define RPMB_POOL_FRAMES	64
+
+/* a SEND_WRITE_PROT_TYPE answer: 2 bits for each of 32 groups */
+#define WP_TYPE_GROUPS	32
+#define WP_TYPE_BYTES	8
+
+enum rpmb_op_type {
+	MMC_RPMB_WRITE_KEY = 0x01,
+	MMC_RPMB_READ_CNT  = 0x02,
+	MMC_RPMB_WRITE     = 0x03,
+	MMC_RPMB_READ      = 0x04,
+
+	/* For internal usage only, do not use it directly */
+	MMC_RPMB_READ_RESP = 0x05
+};
+
+struct mmc_dev {
+	int fd;
+
+	/* EXT_CSD as last read, patched by our own SWITCHes */
+	__u8 ext_csd[512];
+	int ext_csd_valid;
+
+	/* RPMB frame pool and the HMAC keyed with the last key used */
+	struct rpmb_frame *rpmb_pool;
+	unsigned int rpmb_frames;	/* per request, <= RPMB_POOL_FRAMES */
+	__u8 rpmb_key[32];
+	int rpmb_key_valid;
+	hmac_sha256_ctx rpmb_hmac;
+};
+
+struct mmc_batch {
+	struct mmc_dev *dev;
+	struct mmc_ioc_multi_cmd *mioc;
+	int err;		/* of an early submit, reported by the next one */
+};
+
+/*
+ * Clears secrets in memory about to be freed. Stores through a volatile
+ * pointer, which the compiler may not drop as it may a memset() right
+ * before free().
+ */
+static void wipe(void *p, size_t len)
+{
+	volatile __u8 *v = p;
+
+	while (len--)
+		*v++ = 0;
+}
+
+static int mmc_ioc(struct mmc_dev *dev, unsigned long req, void *arg)
+{
+	return ioctl(dev->fd, req, arg) ? -errno : 0;
+}
+
+/*
+ * Frames one RPMB request of the device behind @device may carry: the
+ * max_hw_sectors_kb of its parent mmcblkX (a frame is one 512-byte
+ * sector), capped at RPMB_POOL_FRAMES. A node whose name does not start
+ * with mmcblkX, or whose parent has no such attribute, gets
+ * RPMB_POOL_FRAMES.
+ */
+static unsigned int rpmb_max_frames(const char *device)
+{
+	const char *name = strrchr(device, '/');
+	char path[64], buf[16];
+	unsigned long kb;
+	int fd, len;
+	ssize_t n;
+
+	name = name ? name + 1 : device;
+	if (strncmp(name, "mmcblk", 6) || !isdigit((unsigned char)name[6]))
+		return RPMB_POOL_FRAMES;
+
+	for (len = 6; isdigit((unsigned char)name[len]); len++)
+		;
+
+	snprintf(path, sizeof(path), "/sys/block/%.*s/queue/max_hw_sectors_kb",
+		 len, name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return RPMB_POOL_FRAMES;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (n <= 0)
+		return RPMB_POOL_FRAMES;
+
+	buf[n] = '\0';
+	kb = strtoul(buf, NULL, 10);
+	if (!kb || kb * 2 > RPMB_POOL_FRAMES)
+		return RPMB_POOL_FRAMES;
+
+	return kb * 2;
+}
+
+/* Opens @device (/dev/mmcblkX, /dev/mmcblkXrpmb, ...) into *@devp. */
+int mmc_open(const char *device, struct mmc_dev **devp)
+{
+	struct mmc_dev *dev;
+	int ret;
+
+	dev = calloc(1, sizeof(*dev));
+	if (!dev)
+		return -ENOMEM;
+
+	dev->fd = open(device, O_RDWR | O_CLOEXEC);
+	if (dev->fd < 0) {
+		ret = -errno;
+		free(dev);
+		return ret;
+	}
+
+	dev->rpmb_frames = rpmb_max_frames(device);
+
+	*devp = dev;
+	return 0;
+}
+
+void mmc_close(struct mmc_dev *dev)
+{
+	if (!dev)
+		return;
+
+	close(dev->fd);
+	free(dev->rpmb_pool);
+	/* do not leave the key behind in freed memory */
+	wipe(dev->rpmb_key, sizeof(dev->rpmb_key));
+	wipe(&dev->rpmb_hmac, sizeof(dev->rpmb_hmac));
+	free(dev);
+}
+
+int mmc_fd(const struct mmc_dev *dev)
+{
+	return dev->fd;
+}
+
+static int extcsd_refresh(struct mmc_dev *dev)
+{
+	struct mmc_ioc_cmd idata;
+	int ret;
+
+	memset(&idata, 0, sizeof(idata));
+	idata.write_flag = 0;
+	idata.opcode = MMC_SEND_EXT_CSD;
+	idata.arg = 0;
+	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	idata.blksz = 512;
+	idata.blocks = 1;
+	mmc_ioc_cmd_set_data(idata, dev->ext_csd);
+
+	ret = mmc_ioc(dev, MMC_IOC_CMD, &idata);
+	dev->ext_csd_valid = !ret;
+
+	return ret;
+}
+
+/*
+ * Copies a fresh EXT_CSD (CMD8) into @ext_csd and the handle cache. Use
+ * it for the fields the device updates on its own: BKOPS_STATUS, FFU
+ * progress and status, life time estimates, EXCEPTION_EVENTS_STATUS...
+ */
+int mmc_read_extcsd(struct mmc_dev *dev, __u8 *ext_csd)
+{
+	int ret;
+
+	ret = extcsd_refresh(dev);
+	if (ret) {
+		memset(ext_csd, 0, sizeof(__u8) * 512);
+		return ret;
+	}
+
+	memcpy(ext_csd, dev->ext_csd, sizeof(dev->ext_csd));
+	return 0;
+}
+
+/*
+ * Points *@ext_csd at the cached EXT_CSD, reading it only when the
+ * handle has none. Good for capabilities and the configuration we set.
+ */
+int mmc_get_extcsd(struct mmc_dev *dev, const __u8 **ext_csd)
+{
+	int ret;
+
+	if (!dev->ext_csd_valid) {
+		ret = extcsd_refresh(dev);
+		if (ret)
+			return ret;
+	}
+
+	*ext_csd = dev->ext_csd;
+	return 0;
+}
+
+/*
+ * Whether a SWITCH of @index leaves the written value readable at
+ * @index. Triggers read back as 0 or start work that changes other
+ * fields, so the cache is dropped for them instead.
+ */
+static int extcsd_patchable(__u8 index)
+{
+	switch (index) {
+	case EXT_CSD_FLUSH_CACHE:
+	case EXT_CSD_MODE_OPERATION_CODES:
+	case EXT_CSD_MODE_CONFIG:
+	case EXT_CSD_POWER_OFF_NOTIFICATION:
+	case EXT_CSD_BKOPS_START:
+	case EXT_CSD_SANITIZE_START:
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Folds a SWITCH command @idata into the cache. Only a SWITCH the card
+ * is known to have @latched, i.e. followed by a status without
+ * R1_SWITCH_ERROR, patches it; any other drops it.
+ */
+static void extcsd_switched(struct mmc_dev *dev,
+			    const struct mmc_ioc_cmd *idata, int latched)
+{
+	__u8 index = (idata->arg >> 16) & 0xff;
+
+	if (latched && extcsd_patchable(index))
+		dev->ext_csd[index] = (idata->arg >> 8) & 0xff;
+	else
+		dev->ext_csd_valid = 0;
+}
+
+static void switch_cmd(struct mmc_ioc_cmd *idata, __u8 index, __u8 value)
+{
+	memset(idata, 0, sizeof(*idata));
+	idata->write_flag = 1;
+	idata->opcode = MMC_SWITCH;
+	idata->arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
+			(index << 16) |
+			(value << 8) |
+			EXT_CSD_CMD_SET_NORMAL;
+	idata->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+}
+
+static void status_cmd(struct mmc_ioc_cmd *idata)
+{
+	memset(idata, 0, sizeof(*idata));
+	idata->opcode = MMC_SEND_STATUS;
+	idata->arg = (1 << 16);
+	idata->flags = MMC_RSP_R1 | MMC_CMD_AC;
+}
+
+/*
+ * SWITCHes EXT_CSD[@index] to @value and checks the card accepted it:
+ * -EIO when the following status reports R1_SWITCH_ERROR.
+ */
+int mmc_write_extcsd(struct mmc_dev *dev, __u8 index, __u8 value)
+{
+	struct mmc_ioc_cmd idata;
+	__u32 response;
+	int ret;
+
+	switch_cmd(&idata, index, value);
+
+	ret = mmc_ioc(dev, MMC_IOC_CMD, &idata);
+	if (!ret)
+		ret = mmc_send_status(dev, &response);
+	if (!ret && (response & R1_SWITCH_ERROR))
+		ret = -EIO;
+	extcsd_switched(dev, &idata, !ret);
+
+	return ret;
+}
+
+int mmc_send_status(struct mmc_dev *dev, __u32 *response)
+{
+	struct mmc_ioc_cmd idata;
+	int ret;
+
+	status_cmd(&idata);
+
+	ret = mmc_ioc(dev, MMC_IOC_CMD, &idata);
+	*response = idata.response[0];
+
+	return ret;
+}
+
+int mmc_get_size_in_blks(struct mmc_dev *dev, __u32 *blks)
+{
+	unsigned long size;
+	int ret;
+
+	ret = mmc_ioc(dev, BLKGETSIZE, &size);
+	if (!ret)
+		*blks = size;
+
+	return ret;
+}
+
+int mmc_batch_new(struct mmc_dev *dev, struct mmc_batch **batchp)
+{
+	struct mmc_batch *batch;
+
+	batch = calloc(1, sizeof(*batch));
+	if (!batch)
+		return -ENOMEM;
+
+	batch->mioc = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+			     MMC_IOC_MAX_CMDS * sizeof(struct mmc_ioc_cmd));
+	if (!batch->mioc) {
+		free(batch);
+		return -ENOMEM;
+	}
+
+	batch->dev = dev;
+	*batchp = batch;
+	return 0;
+}
+
+/* Drops whatever is still queued on @batch without sending it. */
+void mmc_batch_free(struct mmc_batch *batch)
+{
+	if (!batch)
+		return;
+
+	free(batch->mioc);
+	free(batch);
+}
+
+/*
+ * Sends the queued commands in one MMC_IOC_MULTI_CMD. The kernel stops
+ * at the first command that fails; a queued status check reporting a
+ * SWITCH error fails the batch with -EIO. On success the SWITCHes some
+ * status check follows are folded into the EXT_CSD cache; an unchecked
+ * SWITCH or any failure drops it.
+ *
+ * A failure of an earlier submit forced by a full batch is returned
+ * here, the commands queued after it having been discarded.
+ */
+int mmc_batch_submit(struct mmc_batch *batch)
+{
+	struct mmc_ioc_multi_cmd *mioc = batch->mioc;
+	struct mmc_dev *dev = batch->dev;
+	struct mmc_ioc_cmd *idata;
+	int i, ret, last_status = -1;
+
+	ret = batch->err;
+	batch->err = 0;
+	if (ret) {
+		mioc->num_of_cmds = 0;
+		return ret;
+	}
+
+	if (!mioc->num_of_cmds)
+		return 0;
+
+	ret = mmc_ioc(dev, MMC_IOC_MULTI_CMD, mioc);
+
+	for (i = 0; !ret && i < mioc->num_of_cmds; i++) {
+		idata = &mioc->cmds[i];
+		if (idata->opcode != MMC_SEND_STATUS)
+			continue;
+		if (idata->response[0] & R1_SWITCH_ERROR)
+			ret = -EIO;
+		last_status = i;
+	}
+
+	/* SWITCHes after the last status check are not known to be latched */
+	for (i = 0; i < mioc->num_of_cmds; i++) {
+		idata = &mioc->cmds[i];
+		if (idata->opcode == MMC_SWITCH)
+			extcsd_switched(dev, idata, !ret && i < last_status);
+	}
+
+	mioc->num_of_cmds = 0;
+	return ret;
+}
+
+/*
+ * Points *@idata at the next free slot of @batch, sending the queued
+ * commands first when it is full. Once such a send failed nothing more
+ * is queued until mmc_batch_submit() reports the error.
+ */
+static int batch_add(struct mmc_batch *batch, struct mmc_ioc_cmd **idata)
+{
+	if (batch->err)
+		return batch->err;
+
+	if (batch->mioc->num_of_cmds == MMC_IOC_MAX_CMDS) {
+		batch->err = mmc_batch_submit(batch);
+		if (batch->err)
+			return batch->err;
+	}
+
+	*idata = &batch->mioc->cmds[batch->mioc->num_of_cmds++];
+	return 0;
+}
+
+int mmc_batch_write_extcsd(struct mmc_batch *batch, __u8 index, __u8 value)
+{
+	struct mmc_ioc_cmd *idata;
+	int ret;
+
+	ret = batch_add(batch, &idata);
+	if (ret)
+		return ret;
+
+	switch_cmd(idata, index, value);
+	return 0;
+}
+
+int mmc_batch_status(struct mmc_batch *batch)
+{
+	struct mmc_ioc_cmd *idata;
+	int ret;
+
+	ret = batch_add(batch, &idata);
+	if (ret)
+		return ret;
+
+	status_cmd(idata);
+	return 0;
+}
+
+/*
+ * Write protect group size in 512-byte blocks. -EOPNOTSUPP unless the
+ * device is at least 4.41 with high-capacity erase groups enabled.
+ */
+static int wp_group_size(const __u8 *ext_csd, __u32 *blks)
+{
+	if ((ext_csd[EXT_CSD_REV] < 5) ||
+	    (ext_csd[EXT_CSD_ERASE_GROUP_DEF] == 0))
+		return -EOPNOTSUPP;
+
+	*blks = ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] *
+		ext_csd[EXT_CSD_HC_WP_GRP_SIZE] * 1024;
+	return 0;
+}
+
+int mmc_wp_group_size(struct mmc_dev *dev, __u32 *blks)
+{
+	const __u8 *ext_csd;
+	int ret;
+
+	ret = mmc_get_extcsd(dev, &ext_csd);
+	if (ret)
+		return ret;
+
+	return wp_group_size(ext_csd, blks);
+}
+
+static void wp_type_cmd(struct mmc_ioc_cmd *idata, __u32 blk_addr, __u8 *buf)
+{
+	memset(idata, 0, sizeof(*idata));
+	idata->write_flag = 0;
+	idata->opcode = MMC_SEND_WRITE_PROT_TYPE;
+	idata->blksz = WP_TYPE_BYTES;
+	idata->blocks = 1;
+	idata->arg = blk_addr;
+	idata->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	mmc_ioc_cmd_set_data((*idata), buf);
+}
+
+/*
+ * Protection types of the 32 groups starting at @blk_addr (CMD31), two
+ * bits per group with the first group in the low bits.
+ */
+int mmc_wp_type(struct mmc_dev *dev, __u32 blk_addr, __u64 *group_bits)
+{
+	struct mmc_ioc_cmd idata;
+	__u8 buf[WP_TYPE_BYTES];
+	__u64 bits = 0;
+	int x, ret;
+
+	wp_type_cmd(&idata, blk_addr, buf);
+
+	ret = mmc_ioc(dev, MMC_IOC_CMD, &idata);
+	if (ret)
+		return ret;
+
+	for (x = 0; x < sizeof(buf); x++)
+		bits |= (__u64)(buf[7 - x]) << (x * 8);
+	*group_bits = bits;
+	return 0;
+}
+
+/*
+ * Reads the protection type of every write protect group of the user
+ * area into @map, sending the CMD31s MMC_IOC_MAX_CMDS at a time. Free
+ * the map with mmc_wp_map_free().
+ */
+int mmc_wp_map_read(struct mmc_dev *dev, struct mmc_wp_map *map)
+{
+	struct mmc_ioc_cmd *idata;
+	struct mmc_batch *batch;
+	__u32 dev_blks, queries, q, n, i, k;
+	__u8 *resp;
+	int ret;
+
+	memset(map, 0, sizeof(*map));
+
+	ret = mmc_wp_group_size(dev, &map->group_blks);
+	if (ret)
+		return ret;
+
+	ret = mmc_get_size_in_blks(dev, &dev_blks);
+	if (ret)
+		return ret;
+
+	map->groups = dev_blks / map->group_blks;
+	queries = (map->groups + WP_TYPE_GROUPS - 1) / WP_TYPE_GROUPS;
+
+	/* a CMD31 answer is exactly 8 bytes of the map */
+	map->bits = calloc(queries, WP_TYPE_BYTES);
+	resp = malloc(MMC_IOC_MAX_CMDS * WP_TYPE_BYTES);
+	if (!map->bits || !resp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = mmc_batch_new(dev, &batch);
+	if (ret)
+		goto out;
+
+	for (q = 0; !ret && q < queries; q += n) {
+		n = queries - q;
+		if (n > MMC_IOC_MAX_CMDS)
+			n = MMC_IOC_MAX_CMDS;
+
+		/* at most a full batch, so nothing is sent early */
+		for (i = 0; !ret && i < n; i++) {
+			ret = batch_add(batch, &idata);
+			if (!ret)
+				wp_type_cmd(idata, (q + i) * WP_TYPE_GROUPS *
+					    map->group_blks,
+					    resp + i * WP_TYPE_BYTES);
+		}
+
+		if (!ret)
+			ret = mmc_batch_submit(batch);
+
+		/* big endian on the wire, the first group in the last byte */
+		for (i = 0; !ret && i < n; i++)
+			for (k = 0; k < WP_TYPE_BYTES; k++)
+				map->bits[(q + i) * WP_TYPE_BYTES + k] =
+					resp[(i + 1) * WP_TYPE_BYTES - 1 - k];
+	}
+
+	mmc_batch_free(batch);
+out:
+	free(resp);
+	if (ret)
+		mmc_wp_map_free(map);
+	return ret;
+}
+
+void mmc_wp_map_free(struct mmc_wp_map *map)
+{
+	free(map->bits);
+	map->bits = NULL;
+	map->groups = 0;
+}
+
+/* MMC_WP_* of @group, which must be below map->groups. */
+int mmc_wp_map_type(const struct mmc_wp_map *map, __u32 group)
+{
+	return (map->bits[group / 4] >> ((group % 4) * 2)) & 0x3;
+}
+
+/*
+ * Length in groups of the run of equally protected groups starting at
+ * @group, whose type is stored in *@type. Whole bytes of four equal
+ * groups are skipped at once.
+ */
+__u32 mmc_wp_map_run(const struct mmc_wp_map *map, __u32 group, int *type)
+{
+	__u32 end = group;
+	__u8 same;
+
+	*type = mmc_wp_map_type(map, group);
+	same = *type * 0x55;
+
+	while (end < map->groups) {
+		if (!(end % 4) && end + 4 <= map->groups &&
+		    map->bits[end / 4] == same) {
+			end += 4;
+			continue;
+		}
+		if (mmc_wp_map_type(map, end) != *type)
+			break;
+		end++;
+	}
+
+	return end - group;
+}
+
+/*
+ * Whether every group touched by the blocks [@blk_start, @blk_start +
+ * @blk_cnt) has some protection: 1 if so, 0 if not and -EINVAL for an
+ * empty range or one past the end of the map.
+ */
+int mmc_wp_map_protected(const struct mmc_wp_map *map, __u32 blk_start,
+			 __u32 blk_cnt)
+{
+	__u32 group, last;
+	int type;
+
+	if (!blk_cnt || blk_start + (__u64)blk_cnt >
+	    (__u64)map->groups * map->group_blks)
+		return -EINVAL;
+
+	group = blk_start / map->group_blks;
+	last = (blk_start + blk_cnt - 1) / map->group_blks;
+
+	while (group <= last) {
+		group += mmc_wp_map_run(map, group, &type);
+		if (type == MMC_WP_NONE)
+			return 0;
+	}
+
+	return 1;
+}
+
+static int batch_write_protect(struct mmc_batch *batch, __u32 blk_addr,
+			       int on_off)
+{
+	struct mmc_ioc_cmd *idata;
+	int ret;
+
+	ret = batch_add(batch, &idata);
+	if (ret)
+		return ret;
+
+	memset(idata, 0, sizeof(*idata));
+	idata->write_flag = 1;
+	if (on_off)
+		idata->opcode = MMC_SET_WRITE_PROT;
+	else
+		idata->opcode = MMC_CLEAR_WRITE_PROT;
+	idata->arg = blk_addr;
+	idata->flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+
+	return 0;
+}
+
+/*
+ * Applies @type (MMC_WP_*) to the user area blocks [@blk_start,
+ * @blk_start + @blk_cnt), which must be write protect group aligned.
+ * USER_WP is switched to the requested type for the duration of the
+ * CMD28s and restored afterwards, also when one of them fails.
+ *
+ * The USER_WP SWITCH goes first in a batch of its own with a status
+ * check: a rejected SWITCH would otherwise leave the following CMD28s
+ * applying temporary protection. The per group CMD28/CMD29 and the
+ * restore then go through the batch, so a range costs one ioctl per
+ * MMC_IOC_MAX_CMDS groups.
+ */
+int mmc_wp_user_set(struct mmc_dev *dev, int type, __u32 blk_start,
+		    __u32 blk_cnt)
+{
+	struct mmc_batch *batch;
+	const __u8 *ext_csd;
+	__u32 wp_blks, x;
+	__u8 user_wp, old_wp;
+	int ret;
+
+	if (type < MMC_WP_NONE || type > MMC_WP_PERM)
+		return -EINVAL;
+
+	ret = mmc_get_extcsd(dev, &ext_csd);
+	if (ret)
+		return ret;
+
+	ret = wp_group_size(ext_csd, &wp_blks);
+	if (ret)
+		return ret;
+
+	if ((blk_start % wp_blks) || (blk_cnt % wp_blks))
+		return -EINVAL;
+
+	ret = mmc_batch_new(dev, &batch);
+	if (ret)
+		return ret;
+
+	user_wp = old_wp = ext_csd[EXT_CSD_USER_WP];
+	if (type != MMC_WP_NONE) {
+		user_wp &= ~USER_WP_CLEAR;
+		if (type == MMC_WP_PWRON)
+			user_wp |= USER_WP_US_PWR_WP_EN;
+		else if (type == MMC_WP_PERM)
+			user_wp |= USER_WP_US_PERM_WP_EN;
+	}
+
+	if (user_wp != old_wp) {
+		mmc_batch_write_extcsd(batch, EXT_CSD_USER_WP, user_wp);
+		mmc_batch_status(batch);
+		ret = mmc_batch_submit(batch);
+		if (ret)
+			goto out;
+	}
+
+	for (x = 0; x < blk_cnt; x += wp_blks)
+		batch_write_protect(batch, blk_start + x, type != MMC_WP_NONE);
+
+	if (user_wp != old_wp) {
+		mmc_batch_write_extcsd(batch, EXT_CSD_USER_WP, old_wp);
+		mmc_batch_status(batch);
+	}
+
+	ret = mmc_batch_submit(batch);
+
+	/*
+	 * The kernel stops a multi-cmd at the first failing command, which
+	 * may have skipped the queued restore.
+	 */
+	if (ret && user_wp != old_wp)
+		mmc_write_extcsd(dev, EXT_CSD_USER_WP, old_wp);
+out:
+	mmc_batch_free(batch);
+
+	return ret;
+}
+
+/* Write protects the boot partitions until the next power on. */
+int mmc_wp_boot_set(struct mmc_dev *dev)
+{
+	const __u8 *ext_csd;
+	int ret;
+
+	ret = mmc_get_extcsd(dev, &ext_csd);
+	if (ret)
+		return ret;
+
+	return mmc_write_extcsd(dev, EXT_CSD_BOOT_WP,
+				ext_csd[EXT_CSD_BOOT_WP] |
+				EXT_CSD_BOOT_WP_B_PWR_WP_EN);
+}
+
+/* -EOPNOTSUPP on devices older than 4.5 or without a cache. */
+int mmc_cache_ctrl(struct mmc_dev *dev, int enable)
+{
+	const __u8 *ext_csd;
+	int ret;
+
+	ret = mmc_get_extcsd(dev, &ext_csd);
+	if (ret)
+		return ret;
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5)
+		return -EOPNOTSUPP;
+
+	/* If the cache size is zero, this device does not have a cache */
+	if (!(ext_csd[EXT_CSD_CACHE_SIZE_3] ||
+			ext_csd[EXT_CSD_CACHE_SIZE_2] ||
+			ext_csd[EXT_CSD_CACHE_SIZE_1] ||
+			ext_csd[EXT_CSD_CACHE_SIZE_0]))
+		return -EOPNOTSUPP;
+
+	return mmc_write_extcsd(dev, EXT_CSD_CACHE_CTRL, !!enable);
+}
+
+/* -EOPNOTSUPP when the device has no background operations. */
+int mmc_bkops_enable(struct mmc_dev *dev)
+{
+	const __u8 *ext_csd;
+	int ret;
+
+	ret = mmc_get_extcsd(dev, &ext_csd);
+	if (ret)
+		return ret;
+
+	if (!(ext_csd[EXT_CSD_BKOPS_SUPPORT] & 0x1))
+		return -EOPNOTSUPP;
+
+	return mmc_write_extcsd(dev, EXT_CSD_BKOPS_EN, BKOPS_ENABLE);
+}
+
+static inline void set_single_cmd(struct mmc_ioc_cmd *ioc, __u32 opcode,
+				  int write_flag, unsigned int blocks)
+{
+	ioc->opcode = opcode;
+	ioc->write_flag = write_flag;
+	ioc->arg = 0x0;
+	ioc->blksz = 512;
+	ioc->blocks = blocks;
+	ioc->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+}
+
+/* Performs RPMB operation.
+ *
+ * @dev: RPMB device on which we should perform ioctl command
+ * @frame_in: input RPMB frames, should be properly inited
+ * @in_cnt: count of input frames. Used only for authenticated data
+ *          writes, in the other cases -EINVAL will be returned.
+ * @frame_out: output (result) RPMB frame. Caller is responsible for checking
+ *             result and req_resp for output frame.
+ * @out_cnt: count of outer frames. Used only for multiple blocks reading,
+ *           in the other cases -EINVAL will be returned.
+ */
+static int rpmb_op(struct mmc_dev *dev, const struct rpmb_frame *frame_in,
+		   unsigned int in_cnt, struct rpmb_frame *frame_out,
+		   unsigned int out_cnt)
+{
+#ifndef MMC_IOC_MULTI_CMD
+	return -EOPNOTSUPP;
+#else
+	int err;
+	u_int16_t rpmb_type;
+	struct mmc_ioc_multi_cmd *mioc;
+	struct mmc_ioc_cmd *ioc;
+	struct rpmb_frame frame_status = {0};
+
+	if (!frame_in || !frame_out || !in_cnt || !out_cnt)
+		return -EINVAL;
+
+	/* prepare arguments for MMC_IOC_MULTI_CMD ioctl */
+	mioc = (struct mmc_ioc_multi_cmd *)
+		calloc(1, sizeof (struct mmc_ioc_multi_cmd) +
+		       RPMB_MULTI_CMD_MAX_CMDS * sizeof (struct mmc_ioc_cmd));
+	if (!mioc) {
+		return -ENOMEM;
+	}
+
+	rpmb_type = be16toh(frame_in->req_resp);
+
+	if (in_cnt != 1 && rpmb_type != MMC_RPMB_WRITE) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	switch(rpmb_type) {
+	case MMC_RPMB_WRITE:
+	case MMC_RPMB_WRITE_KEY:
+		if (out_cnt != 1) {
+			err = -EINVAL;
+			goto out;
+		}
+
+		mioc->num_of_cmds = 3;
+
+		/* Write request */
+		ioc = &mioc->cmds[0];
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, (1 << 31) | 1,
+			       in_cnt);
+		mmc_ioc_cmd_set_data((*ioc), frame_in);
+
+		/* Result request */
+		ioc = &mioc->cmds[1];
+		frame_status.req_resp = htobe16(MMC_RPMB_READ_RESP);
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1);
+		mmc_ioc_cmd_set_data((*ioc), &frame_status);
+
+		/* Get response */
+		ioc = &mioc->cmds[2];
+		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, 1);
+		mmc_ioc_cmd_set_data((*ioc), frame_out);
+
+		break;
+	case MMC_RPMB_READ_CNT:
+		if (out_cnt != 1) {
+			err = -EINVAL;
+			goto out;
+		}
+		/* fall through */
+
+	case MMC_RPMB_READ:
+		mioc->num_of_cmds = 2;
+
+		/* Read request */
+		ioc = &mioc->cmds[0];
+		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1);
+		mmc_ioc_cmd_set_data((*ioc), frame_in);
+
+		/* Get response */
+		ioc = &mioc->cmds[1];
+		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, out_cnt);
+		mmc_ioc_cmd_set_data((*ioc), frame_out);
+
+		break;
+	default:
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = mmc_ioc(dev, MMC_IOC_MULTI_CMD, mioc);
+
+out:
+	free(mioc);
+	return err;
+#endif /* !MMC_IOC_MULTI_CMD */
+}
+
+int mmc_rpmb_op(struct mmc_dev *dev, const struct rpmb_frame *frame_in,
+		struct rpmb_frame *frame_out, unsigned int out_cnt)
+{
+	return rpmb_op(dev, frame_in, 1, frame_out, out_cnt);
+}
+
+/* Programs the 32-byte authentication key, a one-time operation. */
+int mmc_rpmb_write_key(struct mmc_dev *dev, const __u8 *key)
+{
+	int ret;
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_WRITE_KEY)
+	}, frame_out;
+
+	memcpy(frame_in.key_mac, key, sizeof(frame_in.key_mac));
+
+	ret = mmc_rpmb_op(dev, &frame_in, &frame_out, 1);
+	if (ret)
+		return ret;
+
+	return be16toh(frame_out.result);
+}
+
+int mmc_rpmb_read_counter(struct mmc_dev *dev, __u32 *cnt)
+{
+	int ret;
+	struct rpmb_frame frame_in = {
+		.req_resp = htobe16(MMC_RPMB_READ_CNT)
+	}, frame_out;
+
+	ret = mmc_rpmb_op(dev, &frame_in, &frame_out, 1);
+	if (ret)
+		return ret;
+
+	/* Check RPMB response */
+	if (frame_out.result != 0)
+		return be16toh(frame_out.result);
+
+	*cnt = be32toh(frame_out.write_counter);
+
+	return 0;
+}
+
+static struct rpmb_frame *rpmb_pool(struct mmc_dev *dev)
+{
+	if (!dev->rpmb_pool)
+		dev->rpmb_pool = calloc(RPMB_POOL_FRAMES,
+					sizeof(*dev->rpmb_pool));
+
+	return dev->rpmb_pool;
+}
+
+/*
+ * Starts a MAC over RPMB frames in dev->rpmb_hmac. The key schedule is
+ * kept, so successive requests with the same @key only reset it.
+ */
+static void rpmb_hmac_start(struct mmc_dev *dev, const __u8 *key)
+{
+	if (dev->rpmb_key_valid &&
+	    !memcmp(dev->rpmb_key, key, sizeof(dev->rpmb_key))) {
+		hmac_sha256_reinit(&dev->rpmb_hmac);
+		return;
+	}
+
+	hmac_sha256_init(&dev->rpmb_hmac, key, sizeof(dev->rpmb_key));
+	memcpy(dev->rpmb_key, key, sizeof(dev->rpmb_key));
+	dev->rpmb_key_valid = 1;
+}
+
+/*
+ * Reads @blocks 256-byte half sectors from @addr into @data, in requests
+ * of at most RPMB_POOL_FRAMES frames, fewer when the host takes less.
+ * With a @key, the MAC of each request is checked and a mismatch gives
+ * -EBADMSG. Data is copied out as each request is verified, so on error
+ * @data holds the requests before the failing one.
+ */
+int mmc_rpmb_read(struct mmc_dev *dev, __u16 addr, unsigned int blocks,
+		  __u8 *data, const __u8 *key)
+{
+	struct rpmb_frame frame_in, *frames;
+	unsigned char mac[32];
+	unsigned int n, i;
+	int ret = 0;
+
+	/*
+	 * for reading RPMB, number of blocks is set by CMD23 only, the packet
+	 * frame field for that is set to 0. So, the type is not u16 but uint!
+	 */
+	if (!blocks)
+		return -EINVAL;
+
+	frames = rpmb_pool(dev);
+	if (!frames)
+		return -ENOMEM;
+
+	while (blocks) {
+		n = blocks < dev->rpmb_frames ? blocks : dev->rpmb_frames;
+
+		memset(&frame_in, 0, sizeof(frame_in));
+		frame_in.req_resp = htobe16(MMC_RPMB_READ);
+		frame_in.addr = htobe16(addr);
+
+		ret = rpmb_op(dev, &frame_in, 1, frames, n);
+		if (ret)
+			break;
+
+		/* Check RPMB response */
+		ret = be16toh(frames[n - 1].result);
+		if (ret)
+			break;
+
+		if (key) {
+			rpmb_hmac_start(dev, key);
+			for (i = 0; i < n; i++)
+				hmac_sha256_update(&dev->rpmb_hmac,
+						   frames[i].data,
+						   sizeof(struct rpmb_frame) -
+						   offsetof(struct rpmb_frame,
+							    data));
+			hmac_sha256_final(&dev->rpmb_hmac, mac, sizeof(mac));
+
+			/* Compare calculated MAC and MAC from last frame */
+			if (memcmp(mac, frames[n - 1].key_mac, sizeof(mac))) {
+				ret = -EBADMSG;
+				break;
+			}
+		}
+
+		for (i = 0; i < n; i++) {
+			memcpy(data, frames[i].data, sizeof(frames[i].data));
+			data += sizeof(frames[i].data);
+		}
+
+		addr += n;
+		blocks -= n;
+	}
+
+	return ret;
+}
+
+/*
+ * Frames per authenticated write: the reliable write sector count
+ * (REL_WR_SEC_C), or a single frame when EXT_CSD is not readable
+ * through this device.
+ */
+static unsigned int rpmb_write_frames(struct mmc_dev *dev)
+{
+	const __u8 *ext_csd;
+
+	if (mmc_get_extcsd(dev, &ext_csd) || !ext_csd[EXT_CSD_REL_WR_SEC_C])
+		return 1;
+
+	return ext_csd[EXT_CSD_REL_WR_SEC_C];
+}
+
+/*
+ * Writes @blocks 256-byte half sectors from @data to @addr, up to
+ * REL_WR_SEC_C frames per authenticated write. *@cnt is the write
+ * counter to sign the first write with and is advanced with every
+ * accepted write, so callers can keep it across calls instead of
+ * reading it back each time. A counter failure result re-reads the
+ * counter and retries the write once.
+ */
+int mmc_rpmb_write_counted(struct mmc_dev *dev, __u16 addr,
+			   unsigned int blocks, const __u8 *data,
+			   const __u8 *key, __u32 *cnt)
+{
+	struct rpmb_frame *frames, frame_out;
+	unsigned int max, n, i;
+	int ret = 0, resync = 1;
+
+	max = rpmb_write_frames(dev);
+	if (max > dev->rpmb_frames)
+		max = dev->rpmb_frames;
+
+	frames = rpmb_pool(dev);
+	if (!frames)
+		return -ENOMEM;
+
+	while (blocks) {
+		n = blocks < max ? blocks : max;
+
+		memset(frames, 0, n * sizeof(*frames));
+		rpmb_hmac_start(dev, key);
+		for (i = 0; i < n; i++) {
+			frames[i].req_resp = htobe16(MMC_RPMB_WRITE);
+			frames[i].block_count = htobe16(n);
+			frames[i].write_counter = htobe32(*cnt);
+			frames[i].addr = htobe16(addr);
+			memcpy(frames[i].data, data + i * sizeof(frames[i].data),
+			       sizeof(frames[i].data));
+			hmac_sha256_update(&dev->rpmb_hmac, frames[i].data,
+					   sizeof(frames[i]) -
+					   offsetof(struct rpmb_frame, data));
+		}
+		/* the MAC covers all frames and goes in the last one */
+		hmac_sha256_final(&dev->rpmb_hmac, frames[n - 1].key_mac,
+				  sizeof(frames[n - 1].key_mac));
+
+		ret = rpmb_op(dev, frames, n, &frame_out, 1);
+		if (ret)
+			break;
+
+		/* Check RPMB response */
+		ret = be16toh(frame_out.result);
+		if (ret == RPMB_RESULT_COUNTER_FAILURE && resync) {
+			resync = 0;
+			ret = mmc_rpmb_read_counter(dev, cnt);
+			if (ret)
+				break;
+			continue;
+		}
+		if (ret)
+			break;
+
+		(*cnt)++;
+		resync = 1;
+		addr += n;	/* half sectors */
+		blocks -= n;
+		data += n * sizeof(frames[0].data);
+	}
+
+	return ret;
+}
+
+/* As mmc_rpmb_write_counted(), starting from the device's counter. */
+int mmc_rpmb_write(struct mmc_dev *dev, __u16 addr, unsigned int blocks,
+		   const __u8 *data, const __u8 *key)
+{
+	__u32 cnt;
+	int ret;
+
+	ret = mmc_rpmb_read_counter(dev, &cnt);
+	if (ret)
+		return ret;
+
+	return mmc_rpmb_write_counted(dev, addr, blocks, data, key, &cnt);
+}
+
+/*
+ * Downloads the firmware image read from @img_fd. *@installed is set when
+ * the device installed it in place (FFU_FEATURES), otherwise it runs
+ * after the next power cycle. -EOPNOTSUPP when FFU is not available,
+ * -EPERM when disabled by FW_CONFIG and -EIO when the device does not
+ * accept the image.
+ */
+int mmc_ffu(struct mmc_dev *dev, int img_fd, int *installed)
+{
+#ifndef MMC_IOC_MULTI_CMD
+	return -EOPNOTSUPP;
+#else
+	int sect_done = 0, retry = 3, ret;
+	unsigned int sect_size;
+	const __u8 *ext_csd;
+	__u8 *buf = NULL;
+	__u32 arg;
+	off_t fw_size;
+	ssize_t chunk_size;
+	struct mmc_ioc_multi_cmd *multi_cmd = NULL;
+
+	*installed = 0;
+
+	ret = mmc_get_extcsd(dev, &ext_csd);
+	if (ret)
+		return ret;
+
+	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0 ||
+	    !(ext_csd[EXT_CSD_SUPPORTED_MODES] & EXT_CSD_FFU))
+		return -EOPNOTSUPP;
+
+	if (ext_csd[EXT_CSD_FW_CONFIG] & EXT_CSD_UPDATE_DISABLE)
+		return -EPERM;
+
+	fw_size = lseek(img_fd, 0, SEEK_END);
+	if (fw_size < 0)
+		return -errno;
+
+	sect_size = (ext_csd[EXT_CSD_DATA_SECTOR_SIZE] == 0) ? 512 : 4096;
+	if (fw_size == 0 || fw_size % sect_size)
+		return -EINVAL;
+
+	buf = malloc(sect_size);
+	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
+				3 * sizeof(struct mmc_ioc_cmd));
+	if (!buf || !multi_cmd) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	/* set CMD ARG */
+	arg = ext_csd[EXT_CSD_FFU_ARG_0] |
+		ext_csd[EXT_CSD_FFU_ARG_1] << 8 |
+		ext_csd[EXT_CSD_FFU_ARG_2] << 16 |
+		ext_csd[EXT_CSD_FFU_ARG_3] << 24;
+
+	/* prepare multi_cmd to be sent */
+	multi_cmd->num_of_cmds = 3;
+
+	/* put device into ffu mode */
+	multi_cmd->cmds[0].opcode = MMC_SWITCH;
+	multi_cmd->cmds[0].arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
+			(EXT_CSD_MODE_CONFIG << 16) |
+			(EXT_CSD_FFU_MODE << 8) |
+			EXT_CSD_CMD_SET_NORMAL;
+	multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	multi_cmd->cmds[0].write_flag = 1;
+
+	/* send image chunk */
+	multi_cmd->cmds[1].opcode = MMC_WRITE_BLOCK;
+	multi_cmd->cmds[1].blksz = sect_size;
+	multi_cmd->cmds[1].blocks = 1;
+	multi_cmd->cmds[1].arg = arg;
+	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	multi_cmd->cmds[1].write_flag = 1;
+	mmc_ioc_cmd_set_data(multi_cmd->cmds[1], buf);
+
+	/* return device into normal mode */
+	multi_cmd->cmds[2].opcode = MMC_SWITCH;
+	multi_cmd->cmds[2].arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
+			(EXT_CSD_MODE_CONFIG << 16) |
+			(EXT_CSD_NORMAL_MODE << 8) |
+			EXT_CSD_CMD_SET_NORMAL;
+	multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	multi_cmd->cmds[2].write_flag = 1;
+
+do_retry:
+	/* read firmware chunk */
+	lseek(img_fd, 0, SEEK_SET);
+	chunk_size = read(img_fd, buf, sect_size);
+
+	while (chunk_size > 0) {
+		/* send ioctl with multi-cmd */
+		ret = mmc_ioc(dev, MMC_IOC_MULTI_CMD, multi_cmd);
+		if (ret) {
+			/* In case multi-cmd ioctl failed before exiting from ffu mode */
+			mmc_ioc(dev, MMC_IOC_CMD, &multi_cmd->cmds[2]);
+			goto out;
+		}
+
+		/* read the next firmware chunk (if any) */
+		chunk_size = read(img_fd, buf, sect_size);
+	}
+
+	if (chunk_size < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	/*
+	 * The progress counter is checked once the image is sent rather
+	 * than after every sector, each check being a full EXT_CSD read.
+	 */
+	ret = extcsd_refresh(dev);
+	if (ret)
+		goto out;
+
+	sect_done = ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0] |
+			ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_1] << 8 |
+			ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_2] << 16 |
+			ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_3] << 24;
+	/* By spec, host should re-start download from the first sector if sect_done is 0 */
+	if ((off_t)sect_done * sect_size != fw_size) {
+		if (retry-- > 0)
+			goto do_retry;
+		ret = -EIO;
+		goto out;
+	}
+
+	/* check mode operation for ffu install*/
+	if (!ext_csd[EXT_CSD_FFU_FEATURES])
+		goto out;
+
+	/* Re-enter ffu mode and install the firmware */
+	multi_cmd->num_of_cmds = 2;
+
+	/* set ext_csd to install mode */
+	multi_cmd->cmds[1].opcode = MMC_SWITCH;
+	multi_cmd->cmds[1].blksz = 0;
+	multi_cmd->cmds[1].blocks = 0;
+	multi_cmd->cmds[1].arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
+			(EXT_CSD_MODE_OPERATION_CODES << 16) |
+			(EXT_CSD_FFU_INSTALL << 8) |
+			EXT_CSD_CMD_SET_NORMAL;
+	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	multi_cmd->cmds[1].write_flag = 1;
+
+	/* send ioctl with multi-cmd */
+	ret = mmc_ioc(dev, MMC_IOC_MULTI_CMD, multi_cmd);
+	if (ret) {
+		/* In case multi-cmd ioctl failed before exiting from ffu mode */
+		mmc_ioc(dev, MMC_IOC_CMD, &multi_cmd->cmds[2]);
+		goto out;
+	}
+
+	ret = extcsd_refresh(dev);
+	if (ret)
+		goto out;
+
+	/* return status */
+	if (ext_csd[EXT_CSD_FFU_STATUS]) {
+		ret = -EIO;
+		goto out;
+	}
+
+	*installed = 1;
+
+out:
+	/* the new firmware may report different contents */
+	dev->ext_csd_valid = 0;
+	free(buf);
+	free(multi_cmd);
+	return ret;
+#endif
+}
@@ -0,0 +1,126 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Device operations of mmc-utils, usable in-process. Functions never
+ * exit or print; they return 0 on success or a negative errno.
+ */
+
+#ifndef _LIBMMC_H
+#define _LIBMMC_H
+
+#include <sys/types.h>
+#include <linux/types.h>
+
+struct mmc_dev;
+
+/* user area write protection types, see mmc_wp_user_set() */
+#define MMC_WP_NONE	0	/* clear temporary protection */
+#define MMC_WP_TEMP	1
+#define MMC_WP_PWRON	2	/* until the next power on */
+#define MMC_WP_PERM	3	/* one-time programmable */
+
+struct rpmb_frame {
+	u_int8_t  stuff[196];
+	u_int8_t  key_mac[32];
+	u_int8_t  data[256];
+	u_int8_t  nonce[16];
+	u_int32_t write_counter;
+	u_int16_t addr;
+	u_int16_t block_count;
+	u_int16_t result;
+	u_int16_t req_resp;
+};
+
+/* device handle */
+int mmc_open(const char *device, struct mmc_dev **devp);
+void mmc_close(struct mmc_dev *dev);
+int mmc_fd(const struct mmc_dev *dev);
+
+/*
+ * EXT_CSD and status. mmc_read_extcsd() always issues CMD8 and refreshes
+ * the copy kept in @dev; mmc_get_extcsd() returns that copy, reading it
+ * only when a SWITCH with side effects has invalidated it. The returned
+ * pointer stays valid until mmc_close().
+ */
+int mmc_read_extcsd(struct mmc_dev *dev, __u8 *ext_csd);
+int mmc_get_extcsd(struct mmc_dev *dev, const __u8 **ext_csd);
+int mmc_write_extcsd(struct mmc_dev *dev, __u8 index, __u8 value);
+int mmc_send_status(struct mmc_dev *dev, __u32 *response);
+int mmc_get_size_in_blks(struct mmc_dev *dev, __u32 *blks);
+
+/*
+ * Batched configuration: EXT_CSD writes and status checks queued on a
+ * batch reach the device in a single MMC_IOC_MULTI_CMD when submitted.
+ * A batch holding MMC_IOC_MAX_CMDS commands is sent before queueing more.
+ * Queueing errors stick to the batch, so callers may check only the
+ * result of mmc_batch_submit().
+ */
+struct mmc_batch;
+
+int mmc_batch_new(struct mmc_dev *dev, struct mmc_batch **batchp);
+void mmc_batch_free(struct mmc_batch *batch);
+int mmc_batch_write_extcsd(struct mmc_batch *batch, __u8 index, __u8 value);
+int mmc_batch_status(struct mmc_batch *batch);
+int mmc_batch_submit(struct mmc_batch *batch);
+
+/* write protection */
+int mmc_wp_group_size(struct mmc_dev *dev, __u32 *blks);
+int mmc_wp_type(struct mmc_dev *dev, __u32 blk_addr, __u64 *group_bits);
+
+/*
+ * Protection of the whole user area, MMC_WP_* in 2 bits per write
+ * protect group, four groups per byte with the first in the low bits.
+ */
+struct mmc_wp_map {
+	__u32 group_blks;	/* 512-byte blocks per group */
+	__u32 groups;
+	__u8 *bits;
+};
+
+int mmc_wp_map_read(struct mmc_dev *dev, struct mmc_wp_map *map);
+void mmc_wp_map_free(struct mmc_wp_map *map);
+int mmc_wp_map_type(const struct mmc_wp_map *map, __u32 group);
+__u32 mmc_wp_map_run(const struct mmc_wp_map *map, __u32 group, int *type);
+int mmc_wp_map_protected(const struct mmc_wp_map *map, __u32 blk_start,
+			 __u32 blk_cnt);
+
+int mmc_wp_user_set(struct mmc_dev *dev, int type, __u32 blk_start,
+		    __u32 blk_cnt);
+int mmc_wp_boot_set(struct mmc_dev *dev);
+
+/* cache and background operations */
+int mmc_cache_ctrl(struct mmc_dev *dev, int enable);
+int mmc_bkops_enable(struct mmc_dev *dev);
+
+/*
+ * RPMB. Besides negative errnos these return the positive RESULT field
+ * of the response frame when the device rejects an operation.
+ */
+int mmc_rpmb_op(struct mmc_dev *dev, const struct rpmb_frame *frame_in,
+		struct rpmb_frame *frame_out, unsigned int out_cnt);
+int mmc_rpmb_write_key(struct mmc_dev *dev, const __u8 *key);
+int mmc_rpmb_read_counter(struct mmc_dev *dev, __u32 *cnt);
+int mmc_rpmb_read(struct mmc_dev *dev, __u16 addr, unsigned int blocks,
+		  __u8 *data, const __u8 *key);
+int mmc_rpmb_write(struct mmc_dev *dev, __u16 addr, unsigned int blocks,
+		   const __u8 *data, const __u8 *key);
+int mmc_rpmb_write_counted(struct mmc_dev *dev, __u16 addr,
+			   unsigned int blocks, const __u8 *data,
+			   const __u8 *key, __u32 *cnt);
+
+/* field firmware update */
+int mmc_ffu(struct mmc_dev *dev, int img_fd, int *installed);
+
+#endif /* _LIBMMC_H */
@@ -78,8 +78,8 @@ static struct Command commands[] = {
 	  NULL
 	},
 	{ do_writeprotect_user_get, -1,
-	  "writeprotect user get", "<device>\n"
-		"Print the user areas write protect configuration for <device>.",
+	  "writeprotect user get", "[-r|-j] <device>\n"
+		"Print the user areas write protect configuration for <device>.\n-r lists runs of equally protected groups as \"<first group> <groups> <type>\",\n-j prints the same runs as JSON.",
 	  NULL
 	},
 	{ do_disable_512B_emulation, -1,
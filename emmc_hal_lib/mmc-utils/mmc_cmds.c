@@ -20,161 +20,95 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdint.h>
-#include <assert.h>
-#include <linux/fs.h> /* for BLKGETSIZE */
 
 #include "mmc.h"
 #include "mmc_cmds.h"
-#include "3rdparty/hmac_sha/hmac_sha2.h"
+#include "libmmc.h"
 
-#ifndef offsetof
-#define offsetof(TYPE, MEMBER) ((size_t) &((TYPE *)0)->MEMBER)
-#endif
-
-#define WP_BLKS_PER_QUERY 32
+/*
+ * The commands below only parse arguments and report; the device work
+ * is done by libmmc. They return the exit status of the mmc program.
+ */
 
-#define USER_WP_PERM_PSWD_DIS	0x80
-#define USER_WP_CD_PERM_WP_DIS	0x40
-#define USER_WP_US_PERM_WP_DIS	0x10
-#define USER_WP_US_PWR_WP_DIS	0x08
-#define USER_WP_US_PERM_WP_EN	0x04
-#define USER_WP_US_PWR_WP_EN	0x01
-#define USER_WP_CLEAR (USER_WP_US_PERM_WP_DIS | USER_WP_US_PWR_WP_DIS	\
-			| USER_WP_US_PERM_WP_EN | USER_WP_US_PWR_WP_EN)
+static struct mmc_dev *open_dev(const char *device)
+{
+	struct mmc_dev *dev;
+	int ret;
 
-#define WPTYPE_NONE 0
-#define WPTYPE_TEMP 1
-#define WPTYPE_PWRON 2
-#define WPTYPE_PERM 3
+	ret = mmc_open(device, &dev);
+	if (ret) {
+		fprintf(stderr, "open %s: %s\n", device, strerror(-ret));
+		return NULL;
+	}
 
+	return dev;
+}
 
-int read_extcsd(int fd, __u8 *ext_csd)
+/* Opens @device and reads its EXT_CSD. */
+static struct mmc_dev *open_dev_extcsd(const char *device, __u8 *ext_csd)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-	memset(&idata, 0, sizeof(idata));
-	memset(ext_csd, 0, sizeof(__u8) * 512);
-	idata.write_flag = 0;
-	idata.opcode = MMC_SEND_EXT_CSD;
-	idata.arg = 0;
-	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	idata.blksz = 512;
-	idata.blocks = 1;
-	mmc_ioc_cmd_set_data(idata, ext_csd);
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
+	struct mmc_dev *dev;
+	int ret;
 
-	return ret;
-}
+	dev = open_dev(device);
+	if (!dev)
+		return NULL;
 
-int write_extcsd_value(int fd, __u8 index, __u8 value)
-{
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 1;
-	idata.opcode = MMC_SWITCH;
-	idata.arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
-			(index << 16) |
-			(value << 8) |
-			EXT_CSD_CMD_SET_NORMAL;
-	idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
+	ret = mmc_read_extcsd(dev, ext_csd);
+	if (ret) {
+		fprintf(stderr, "Could not read EXT_CSD from %s: %s\n",
+			device, strerror(-ret));
+		mmc_close(dev);
+		return NULL;
+	}
 
-	return ret;
+	return dev;
 }
 
-int send_status(int fd, __u32 *response)
+static int write_extcsd_value(struct mmc_dev *dev, const char *device,
+			      __u8 index, __u8 value)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.opcode = MMC_SEND_STATUS;
-	idata.arg = (1 << 16);
-	idata.flags = MMC_RSP_R1 | MMC_CMD_AC;
+	int ret;
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	ret = mmc_write_extcsd(dev, index, value);
 	if (ret)
-	perror("ioctl");
-
-	*response = idata.response[0];
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s: %s\n",
+			value, index, device, strerror(-ret));
 
 	return ret;
 }
 
-static __u32 get_size_in_blks(int fd)
+static struct mmc_batch *new_batch(struct mmc_dev *dev, const char *device)
 {
-	int res;
-	int size;
+	struct mmc_batch *batch;
+	int ret;
 
-	res = ioctl(fd, BLKGETSIZE, &size);
-	if (res) {
-		fprintf(stderr, "Error getting device size, errno: %d\n",
-			errno);
-		perror("");
-		return -1;
+	ret = mmc_batch_new(dev, &batch);
+	if (ret) {
+		fprintf(stderr, "%s: %s\n", device, strerror(-ret));
+		return NULL;
 	}
-	return size;
+
+	return batch;
 }
 
-static int set_write_protect(int fd, __u32 blk_addr, int on_off)
+/* Sends the EXT_CSD writes queued on @batch and frees it. */
+static int submit_batch(struct mmc_batch *batch, const char *device)
 {
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 1;
-	if (on_off)
-		idata.opcode = MMC_SET_WRITE_PROT;
-	else
-		idata.opcode = MMC_CLEAR_WRITE_PROT;
-	idata.arg = blk_addr;
-	idata.flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
+	int ret;
 
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
+	ret = mmc_batch_submit(batch);
 	if (ret)
-		perror("ioctl");
-
-	return ret;
-}
+		fprintf(stderr, "Could not write EXT_CSD settings to %s: %s\n",
+			device, strerror(-ret));
 
-static int send_write_protect_type(int fd, __u32 blk_addr, __u64 *group_bits)
-{
-	int ret = 0;
-	struct mmc_ioc_cmd idata;
-	__u8 buf[8];
-	__u64 bits = 0;
-	int x;
-
-	memset(&idata, 0, sizeof(idata));
-	idata.write_flag = 0;
-	idata.opcode = MMC_SEND_WRITE_PROT_TYPE;
-	idata.blksz      = 8,
-	idata.blocks     = 1,
-	idata.arg = blk_addr;
-	idata.flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	mmc_ioc_cmd_set_data(idata, buf);
-
-	ret = ioctl(fd, MMC_IOC_CMD, &idata);
-	if (ret)
-		perror("ioctl");
-	for (x = 0; x < sizeof(buf); x++)
-		bits |= (__u64)(buf[7 - x]) << (x * 8);
-	*group_bits = bits;
+	mmc_batch_free(batch);
 	return ret;
 }
 
@@ -212,85 +146,50 @@ static void print_writeprotect_boot_status(__u8 *ext_csd)
 	}
 }
 
-static int get_wp_group_size_in_blks(__u8 *ext_csd, __u32 *size)
-{
-	__u8 ext_csd_rev = ext_csd[EXT_CSD_REV];
-
-	if ((ext_csd_rev < 5) || (ext_csd[EXT_CSD_ERASE_GROUP_DEF] == 0))
-		return 1;
-
-	*size = ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] *
-		ext_csd[EXT_CSD_HC_WP_GRP_SIZE] * 1024;
-	return 0;
-}
-
-
 int do_writeprotect_boot_get(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
-	char *device;
+	struct mmc_dev *dev;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc writeprotect boot get </path/to/mmcblkX>\n");
-		exit(1);
-	}
-
-	device = argv[1];
-
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
+		return 1;
 	}
 
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(argv[1], ext_csd);
+	if (!dev)
+		return 1;
 
 	print_writeprotect_boot_status(ext_csd);
 
-	return ret;
+	mmc_close(dev);
+	return 0;
 }
 
 int do_writeprotect_boot_set(int nargs, char **argv)
 {
-	__u8 ext_csd[512], value;
-	int fd, ret;
+	struct mmc_dev *dev;
 	char *device;
+	int ret;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc writeprotect boot set </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 
-	value = ext_csd[EXT_CSD_BOOT_WP] |
-		EXT_CSD_BOOT_WP_B_PWR_WP_EN;
-	ret = write_extcsd_value(fd, EXT_CSD_BOOT_WP, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_BOOT_WP, device);
-		exit(1);
-	}
+	ret = mmc_wp_boot_set(dev);
+	if (ret)
+		fprintf(stderr, "Could not set EXT_CSD[%d] in %s: %s\n",
+			EXT_CSD_BOOT_WP, device, strerror(-ret));
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
 static char *prot_desc[] = {
@@ -300,6 +199,14 @@ static char *prot_desc[] = {
 	"Permanent"
 };
 
+/* protection types in the -r and -j listings */
+static const char *prot_name[] = {
+	"none",
+	"temporary",
+	"power-on",
+	"permanent"
+};
+
 static void print_wp_status(__u32 wp_sizeblks, __u32 start_group,
 			__u32 end_group, int rptype)
 {
@@ -312,118 +219,101 @@ static void print_wp_status(__u32 wp_sizeblks, __u32 start_group,
 
 int do_writeprotect_user_get(int nargs, char **argv)
 {
-	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_wp_map map;
+	struct mmc_dev *dev;
 	char *device;
-	int x;
-	int y = 0;
-	__u32 wp_sizeblks;
-	__u32 dev_sizeblks;
-	__u32 cnt;
-	__u64 bits;
-	__u32 wpblk;
-	__u32 last_wpblk = 0;
-	__u32 prot;
-	__u32 last_prot = -1;
-	int remain;
-
-	if (nargs != 2) {
-		fprintf(stderr, "Usage: mmc writeprotect user get </path/to/mmcblkX>\n");
-		exit(1);
+	const char *fmt = "";
+	__u32 group, run;
+	int type, ret;
+
+	if (nargs == 3 && (!strcmp(argv[1], "-r") || !strcmp(argv[1], "-j"))) {
+		fmt = argv[1];
+		device = argv[2];
+	} else if (nargs == 2) {
+		device = argv[1];
+	} else {
+		fprintf(stderr, "Usage: mmc writeprotect user get [-r|-j] </path/to/mmcblkX>\n");
+		return 1;
 	}
 
-	device = argv[1];
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
+	ret = mmc_wp_map_read(dev, &map);
+	mmc_close(dev);
+	if (ret == -EOPNOTSUPP) {
+		fprintf(stderr, "Could not get the Write Protect Group size of %s: %s\n",
+			device, strerror(-ret));
+		return 1;
+	} else if (ret) {
+		fprintf(stderr, "Could not read the write protect map of %s: %s\n",
+			device, strerror(-ret));
+		return 1;
 	}
 
-	ret = get_wp_group_size_in_blks(ext_csd, &wp_sizeblks);
-	if (ret)
-		exit(1);
-	printf("Write Protect Group size in blocks/bytes: %d/%d\n",
-		wp_sizeblks, wp_sizeblks * 512);
-	dev_sizeblks = get_size_in_blks(fd);
-	cnt = dev_sizeblks / wp_sizeblks;
-	for (x = 0; x < cnt; x += WP_BLKS_PER_QUERY) {
-		ret = send_write_protect_type(fd, x * wp_sizeblks, &bits);
-		if (ret)
-			break;
-		remain = cnt - x;
-		if (remain > WP_BLKS_PER_QUERY)
-			remain = WP_BLKS_PER_QUERY;
-		for (y = 0; y < remain; y++) {
-			prot = (bits >> (y * 2)) & 0x3;
-			if (prot != last_prot) {
-				/* not first time */
-				if (last_prot != -1) {
-					wpblk = x + y;
-					print_wp_status(wp_sizeblks,
-							last_wpblk,
-							wpblk - 1,
-							last_prot);
-					last_wpblk = wpblk;
-				}
-				last_prot = prot;
-			}
-		}
+	if (!strcmp(fmt, "-j"))
+		printf("{\"group_blocks\": %u, \"groups\": %u, \"runs\": [",
+		       map.group_blks, map.groups);
+	else if (!strcmp(fmt, "-r"))
+		printf("group_blocks %u\n", map.group_blks);
+	else
+		printf("Write Protect Group size in blocks/bytes: %d/%d\n",
+		       map.group_blks, map.group_blks * 512);
+
+	for (group = 0; group < map.groups; group += run) {
+		run = mmc_wp_map_run(&map, group, &type);
+		if (!strcmp(fmt, "-j"))
+			printf("%s\n  {\"group\": %u, \"count\": %u, \"type\": \"%s\"}",
+			       group ? "," : "", group, run, prot_name[type]);
+		else if (!strcmp(fmt, "-r"))
+			printf("%u %u %s\n", group, run, prot_name[type]);
+		else
+			print_wp_status(map.group_blks, group, group + run - 1,
+					type);
 	}
-	if (last_wpblk != (x + y - 1))
-		print_wp_status(wp_sizeblks, last_wpblk, cnt - 1, last_prot);
 
-	return ret;
+	if (!strcmp(fmt, "-j"))
+		printf("\n]}\n");
+
+	mmc_wp_map_free(&map);
+	return 0;
 }
 
 int do_writeprotect_user_set(int nargs, char **argv)
 {
-	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
 	char *device;
 	int blk_start;
 	int blk_cnt;
 	__u32 wp_blks;
-	__u8 user_wp;
-	int x;
 	int wptype;
+	int ret;
 
 	if (nargs != 5)
 		goto usage;
 	device = argv[4];
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
 	if (!strcmp(argv[1], "none")) {
-		wptype = WPTYPE_NONE;
+		wptype = MMC_WP_NONE;
 	} else if (!strcmp(argv[1], "temp")) {
-		wptype = WPTYPE_TEMP;
+		wptype = MMC_WP_TEMP;
 	} else if (!strcmp(argv[1], "pwron")) {
-		wptype = WPTYPE_PWRON;
+		wptype = MMC_WP_PWRON;
 #ifdef DANGEROUS_COMMANDS_ENABLED
 	} else if (!strcmp(argv[1], "perm")) {
-		wptype = WPTYPE_PERM;
+		wptype = MMC_WP_PERM;
 #endif /* DANGEROUS_COMMANDS_ENABLED */
 	} else {
 		fprintf(stderr, "Error, invalid \"type\"\n");
 		goto usage;
 	}
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
-	ret = get_wp_group_size_in_blks(ext_csd, &wp_blks);
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
+	ret = mmc_wp_group_size(dev, &wp_blks);
 	if (ret) {
 		fprintf(stderr, "Operation not supported for this device\n");
-		exit(1);
+		goto out;
 	}
 	blk_start = strtol(argv[2], NULL, 0);
 	blk_cnt = strtol(argv[3], NULL, 0);
@@ -431,78 +321,41 @@ int do_writeprotect_user_set(int nargs, char **argv)
 		fprintf(stderr, "<start block> and <blocks> must be a ");
 		fprintf(stderr, "multiple of the Write Protect Group (%d)\n",
 			wp_blks);
-		exit(1);
-	}
-	if (wptype != WPTYPE_NONE) {
-		user_wp = ext_csd[EXT_CSD_USER_WP];
-		user_wp &= ~USER_WP_CLEAR;
-		switch (wptype) {
-		case WPTYPE_TEMP:
-			break;
-		case WPTYPE_PWRON:
-			user_wp |= USER_WP_US_PWR_WP_EN;
-			break;
-		case WPTYPE_PERM:
-			user_wp |= USER_WP_US_PERM_WP_EN;
-			break;
-		}
-		if (user_wp != ext_csd[EXT_CSD_USER_WP]) {
-			ret = write_extcsd_value(fd, EXT_CSD_USER_WP, user_wp);
-			if (ret) {
-				fprintf(stderr, "Error setting EXT_CSD\n");
-				exit(1);
-			}
-		}
-	}
-	for (x = 0; x < blk_cnt; x += wp_blks) {
-		ret = set_write_protect(fd, blk_start + x,
-					wptype != WPTYPE_NONE);
-		if (ret) {
-			fprintf(stderr,
-				"Could not set write protect for %s\n", device);
-			exit(1);
-		}
-	}
-	if (wptype != WPTYPE_NONE) {
-		ret = write_extcsd_value(fd, EXT_CSD_USER_WP,
-					ext_csd[EXT_CSD_USER_WP]);
-		if (ret) {
-			fprintf(stderr, "Error restoring EXT_CSD\n");
-			exit(1);
-		}
+		ret = -EINVAL;
+		goto out;
 	}
-	return ret;
+	ret = mmc_wp_user_set(dev, wptype, blk_start, blk_cnt);
+	if (ret)
+		fprintf(stderr, "Could not set write protect for %s: %s\n",
+			device, strerror(-ret));
+
+out:
+	mmc_close(dev);
+	return !!ret;
 
 usage:
 	fprintf(stderr,
 		"Usage: mmc writeprotect user set <type><start block><blocks><device>\n");
-	exit(1);
+	return 1;
 }
 
 int do_disable_512B_emulation(int nargs, char **argv)
 {
 	__u8 ext_csd[512], native_sector_size, data_sector_size, wr_rel_param;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret = 0;
 	char *device;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc disable 512B emulation </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
 	wr_rel_param = ext_csd[EXT_CSD_WR_REL_PARAM];
 	native_sector_size = ext_csd[EXT_CSD_NATIVE_SECTOR_SIZE];
@@ -510,34 +363,32 @@ int do_disable_512B_emulation(int nargs, char **argv)
 
 	if (native_sector_size && !data_sector_size &&
 	   (wr_rel_param & EN_REL_WR)) {
-		ret = write_extcsd_value(fd, EXT_CSD_USE_NATIVE_SECTOR, 1);
-
-		if (ret) {
-			fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-					1, EXT_CSD_NATIVE_SECTOR_SIZE, device);
-			exit(1);
-		}
-		printf("MMC disable 512B emulation successful.  Now reset the device to switch to 4KB native sector mode.\n");
+		ret = write_extcsd_value(dev, device,
+					 EXT_CSD_USE_NATIVE_SECTOR, 1);
+		if (!ret)
+			printf("MMC disable 512B emulation successful.  Now reset the device to switch to 4KB native sector mode.\n");
 	} else if (native_sector_size && data_sector_size) {
 		printf("MMC 512B emulation mode is already disabled; doing nothing.\n");
 	} else {
 		printf("MMC does not support disabling 512B emulation mode.\n");
 	}
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_write_boot_en(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
 	__u8 value = 0;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret = 1;
 	char *device;
 	int boot_area, send_ack;
 
 	if (nargs != 4) {
 		fprintf(stderr, "Usage: mmc bootpart enable <partition_number> <send_ack> </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	/*
@@ -549,17 +400,9 @@ int do_write_boot_en(int nargs, char **argv)
 	send_ack = strtol(argv[2], NULL, 10);
 	device = argv[3];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
 	value = ext_csd[EXT_CSD_PART_CONFIG];
 
@@ -581,33 +424,31 @@ int do_write_boot_en(int nargs, char **argv)
 		break;
 	default:
 		fprintf(stderr, "Cannot enable the boot area\n");
-		exit(1);
+		goto out;
 	}
 	if (send_ack)
 		value |= EXT_CSD_PART_CONFIG_ACC_ACK;
 	else
 		value &= ~EXT_CSD_PART_CONFIG_ACC_ACK;
 
-	ret = write_extcsd_value(fd, EXT_CSD_PART_CONFIG, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_PART_CONFIG, device);
-		exit(1);
-	}
-	return ret;
+	ret = write_extcsd_value(dev, device, EXT_CSD_PART_CONFIG, value);
+
+out:
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_boot_bus_conditions_set(int nargs, char **argv)
 {
 	__u8 ext_csd[512];
 	__u8 value = 0;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 5) {
 		fprintf(stderr, "Usage: mmc: bootbus set <boot_mode> <reset_boot_bus_conditions> <boot_bus_width> <device>\n");
-		exit(1);
+		return 1;
 	}
 
 	if (strcmp(argv[1], "single_backward") == 0)
@@ -618,7 +459,7 @@ int do_boot_bus_conditions_set(int nargs, char **argv)
 		value |= 0x10;
 	else {
 		fprintf(stderr, "illegal <boot_mode> specified\n");
-		exit(1);
+		return 1;
 	}
 
 	if (strcmp(argv[2], "x1") == 0)
@@ -628,7 +469,7 @@ int do_boot_bus_conditions_set(int nargs, char **argv)
 	else {
 		fprintf(stderr,
 			"illegal <reset_boot_bus_conditions> specified\n");
-		exit(1);
+		return 1;
 	}
 
 	if (strcmp(argv[3], "x1") == 0)
@@ -639,84 +480,60 @@ int do_boot_bus_conditions_set(int nargs, char **argv)
 		value |= 0x2;
 	else {
 		fprintf(stderr,	"illegal <boot_bus_width> specified\n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[4];
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
 	printf("Changing ext_csd[BOOT_BUS_CONDITIONS] from 0x%02x to 0x%02x\n",
 		ext_csd[EXT_CSD_BOOT_BUS_CONDITIONS], value);
 
-	ret = write_extcsd_value(fd, EXT_CSD_BOOT_BUS_CONDITIONS, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_BOOT_BUS_CONDITIONS, device);
-		exit(1);
-	}
-	close(fd);
-	return ret;
+	ret = write_extcsd_value(dev, device, EXT_CSD_BOOT_BUS_CONDITIONS, value);
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_hwreset(int value, int nargs, char **argv)
 {
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret = 1;
 	char *device;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc hwreset enable </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
 	if ((ext_csd[EXT_CSD_RST_N_FUNCTION] & EXT_CSD_RST_N_EN_MASK) ==
 	    EXT_CSD_HW_RESET_EN) {
 		fprintf(stderr,
 			"H/W Reset is already permanently enabled on %s\n",
 			device);
-		exit(1);
+		goto out;
 	}
 	if ((ext_csd[EXT_CSD_RST_N_FUNCTION] & EXT_CSD_RST_N_EN_MASK) ==
 	    EXT_CSD_HW_RESET_DIS) {
 		fprintf(stderr,
 			"H/W Reset is already permanently disabled on %s\n",
 			device);
-		exit(1);
+		goto out;
 	}
 
-	ret = write_extcsd_value(fd, EXT_CSD_RST_N_FUNCTION, value);
-	if (ret) {
-		fprintf(stderr,
-			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_RST_N_FUNCTION, device);
-		exit(1);
-	}
+	ret = write_extcsd_value(dev, device, EXT_CSD_RST_N_FUNCTION, value);
 
-	return ret;
+out:
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_hwreset_en(int nargs, char **argv)
@@ -731,75 +548,62 @@ int do_hwreset_dis(int nargs, char **argv)
 
 int do_write_bkops_en(int nargs, char **argv)
 {
-	__u8 ext_csd[512], value = 0;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
 	       fprintf(stderr, "Usage: mmc bkops enable </path/to/mmcblkX>\n");
-	       exit(1);
+	       return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 
-	if (!(ext_csd[EXT_CSD_BKOPS_SUPPORT] & 0x1)) {
+	ret = mmc_bkops_enable(dev);
+	if (ret == -EOPNOTSUPP)
 		fprintf(stderr, "%s doesn't support BKOPS\n", device);
-		exit(1);
-	}
-
-	ret = write_extcsd_value(fd, EXT_CSD_BKOPS_EN, BKOPS_ENABLE);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_BKOPS_EN, device);
-		exit(1);
-	}
+	else if (ret)
+		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s: %s\n",
+			BKOPS_ENABLE, EXT_CSD_BKOPS_EN, device, strerror(-ret));
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_status_get(int nargs, char **argv)
 {
 	__u32 response;
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc status get </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = send_status(fd, &response);
-	if (ret) {
-		fprintf(stderr, "Could not read response to SEND_STATUS from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 
-	printf("SEND_STATUS response: 0x%08x\n", response);
+	ret = mmc_send_status(dev, &response);
+	if (ret)
+		fprintf(stderr, "Could not read response to SEND_STATUS from %s: %s\n",
+			device, strerror(-ret));
+	else
+		printf("SEND_STATUS response: 0x%08x\n", response);
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
-unsigned int get_sector_count(__u8 *ext_csd)
+unsigned int get_sector_count(const __u8 *ext_csd)
 {
 	return (ext_csd[EXT_CSD_SEC_COUNT_3] << 24) |
 	(ext_csd[EXT_CSD_SEC_COUNT_2] << 16) |
@@ -807,7 +611,7 @@ unsigned int get_sector_count(__u8 *ext_csd)
 	ext_csd[EXT_CSD_SEC_COUNT_0];
 }
 
-int is_blockaddresed(__u8 *ext_csd)
+int is_blockaddresed(const __u8 *ext_csd)
 {
 	unsigned int sectors = get_sector_count(ext_csd);
 
@@ -815,19 +619,20 @@ int is_blockaddresed(__u8 *ext_csd)
 	return (sectors > (2u * 1024 * 1024 * 1024) / 512);
 }
 
-unsigned int get_hc_wp_grp_size(__u8 *ext_csd)
+unsigned int get_hc_wp_grp_size(const __u8 *ext_csd)
 {
 	return ext_csd[221];
 }
 
-unsigned int get_hc_erase_grp_size(__u8 *ext_csd)
+unsigned int get_hc_erase_grp_size(const __u8 *ext_csd)
 {
 	return ext_csd[224];
 }
 
 int set_partitioning_setting_completed(int dry_run, const char * const device,
-		int fd)
+		struct mmc_dev *dev)
 {
+	struct mmc_batch *batch;
 	int ret;
 
 	if (dry_run == 1) {
@@ -842,25 +647,18 @@ int set_partitioning_setting_completed(int dry_run, const char * const device,
 	}
 
 	fprintf(stderr, "setting OTP PARTITION_SETTING_COMPLETED!\n");
-	ret = write_extcsd_value(fd, EXT_CSD_PARTITION_SETTING_COMPLETED, 0x1);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x1 to "
-			"EXT_CSD[%d] in %s\n",
-			EXT_CSD_PARTITION_SETTING_COMPLETED, device);
+	batch = new_batch(dev, device);
+	if (!batch)
 		return 1;
-	}
 
-	__u32 response;
-	ret = send_status(fd, &response);
+	/* the status check fails the batch on a SWITCH error */
+	mmc_batch_write_extcsd(batch, EXT_CSD_PARTITION_SETTING_COMPLETED, 0x1);
+	mmc_batch_status(batch);
+	ret = mmc_batch_submit(batch);
+	mmc_batch_free(batch);
 	if (ret) {
-		fprintf(stderr, "Could not get response to SEND_STATUS "
-			"from %s\n", device);
-		return 1;
-	}
-
-	if (response & R1_SWITCH_ERROR) {
 		fprintf(stderr, "Setting OTP PARTITION_SETTING_COMPLETED "
-			"failed on %s\n", device);
+			"failed on %s: %s\n", device, strerror(-ret));
 		return 1;
 	}
 
@@ -874,7 +672,8 @@ int set_partitioning_setting_completed(int dry_run, const char * const device,
 	return 0;
 }
 
-int check_enhanced_area_total_limit(const char * const device, int fd)
+int check_enhanced_area_total_limit(const char * const device,
+		struct mmc_dev *dev)
 {
 	__u8 ext_csd[512];
 	__u32 regl;
@@ -884,10 +683,12 @@ int check_enhanced_area_total_limit(const char * const device, int fd)
 	unsigned int wp_sz, erase_sz;
 	int ret;
 
-	ret = read_extcsd(fd, ext_csd);
+	/* what the device latched, not what we asked for */
+	ret = mmc_read_extcsd(dev, ext_csd);
 	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
+		fprintf(stderr, "Could not read EXT_CSD from %s: %s\n",
+			device, strerror(-ret));
+		return 1;
 	}
 	wp_sz = get_hc_wp_grp_size(ext_csd);
 	erase_sz = get_hc_erase_grp_size(ext_csd);
@@ -972,7 +773,9 @@ int do_create_gp_partition(int nargs, char **argv)
 	__u8 value;
 	__u8 ext_csd[512];
 	__u8 address;
-	int fd, ret;
+	struct mmc_dev *dev;
+	struct mmc_batch *batch;
+	int ret = 1;
 	char *device;
 	int dry_run = 1;
 	int partition, enh_attr, ext_attr;
@@ -981,7 +784,7 @@ int do_create_gp_partition(int nargs, char **argv)
 
 	if (nargs != 7) {
 		fprintf(stderr, "Usage: mmc gp create <-y|-n|-c> <length KiB> <partition> <enh_attr> <ext_attr> </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	if (!strcmp("-y", argv[1])) {
@@ -998,67 +801,43 @@ int do_create_gp_partition(int nargs, char **argv)
 
 	if (partition < 1 || partition > 4) {
 		printf("Invalid gp partition number; valid range [1-4].\n");
-		exit(1);
+		return 1;
 	}
 
 	if (enh_attr && ext_attr) {
 		printf("Not allowed to set both enhanced attribute and extended attribute\n");
-		exit(1);
-	}
-
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
+		return 1;
 	}
 
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
 	/* assert not PARTITION_SETTING_COMPLETED */
 	if (ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED]) {
 		printf(" Device is already partitioned\n");
-		exit(1);
+		goto out;
 	}
 
 	align = 512l * get_hc_wp_grp_size(ext_csd) * get_hc_erase_grp_size(ext_csd);
 	gp_size_mult = (length_kib + align/2l) / align;
 
+	batch = new_batch(dev, device);
+	if (!batch)
+		goto out;
+
 	/* set EXT_CSD_ERASE_GROUP_DEF bit 0 */
-	ret = write_extcsd_value(fd, EXT_CSD_ERASE_GROUP_DEF, 0x1);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x1 to EXT_CSD[%d] in %s\n",
-			EXT_CSD_ERASE_GROUP_DEF, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ERASE_GROUP_DEF, 0x1);
 
 	value = (gp_size_mult >> 16) & 0xff;
 	address = EXT_CSD_GP_SIZE_MULT_1_2 + (partition - 1) * 3;
-	ret = write_extcsd_value(fd, address, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, address, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, address, value);
 	value = (gp_size_mult >> 8) & 0xff;
 	address = EXT_CSD_GP_SIZE_MULT_1_1 + (partition - 1) * 3;
-	ret = write_extcsd_value(fd, address, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, address, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, address, value);
 	value = gp_size_mult & 0xff;
 	address = EXT_CSD_GP_SIZE_MULT_1_0 + (partition - 1) * 3;
-	ret = write_extcsd_value(fd, address, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, address, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, address, value);
 
 	value = ext_csd[EXT_CSD_PARTITIONS_ATTRIBUTE];
 	if (enh_attr)
@@ -1066,12 +845,7 @@ int do_create_gp_partition(int nargs, char **argv)
 	else
 		value &= ~(1 << partition);
 
-	ret = write_extcsd_value(fd, EXT_CSD_PARTITIONS_ATTRIBUTE, value);
-	if (ret) {
-		fprintf(stderr, "Could not write EXT_CSD_ENH_%x to EXT_CSD[%d] in %s\n",
-			partition, EXT_CSD_PARTITIONS_ATTRIBUTE, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_PARTITIONS_ATTRIBUTE, value);
 
 	address = EXT_CSD_EXT_PARTITIONS_ATTRIBUTE_0 + (partition - 1) / 2;
 	value = ext_csd[address];
@@ -1080,28 +854,30 @@ int do_create_gp_partition(int nargs, char **argv)
 	else
 		value &= (0xF << (4 * ((partition % 2))));
 
-	ret = write_extcsd_value(fd, address, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%x to EXT_CSD[%d] in %s\n",
-			value, address, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, address, value);
 
-	ret = check_enhanced_area_total_limit(device, fd);
-	if (ret)
-		exit(1);
+	/* R1_SWITCH_ERROR is sticky until read, one check covers them all */
+	mmc_batch_status(batch);
+	if (submit_batch(batch, device))
+		goto out;
 
-	if (set_partitioning_setting_completed(dry_run, device, fd))
-		exit(1);
+	if (check_enhanced_area_total_limit(device, dev))
+		goto out;
 
-	return 0;
+	ret = set_partitioning_setting_completed(dry_run, device, dev);
+
+out:
+	mmc_close(dev);
+	return ret;
 }
 
 int do_enh_area_set(int nargs, char **argv)
 {
 	__u8 value;
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	struct mmc_batch *batch;
+	int ret = 1;
 	char *device;
 	int dry_run = 1;
 	unsigned int start_kib, length_kib, enh_start_addr, enh_size_mult;
@@ -1109,7 +885,7 @@ int do_enh_area_set(int nargs, char **argv)
 
 	if (nargs != 5) {
 		fprintf(stderr, "Usage: mmc enh_area set <-y|-n|-c> <start KiB> <length KiB> </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	if (!strcmp("-y", argv[1])) {
@@ -1122,30 +898,22 @@ int do_enh_area_set(int nargs, char **argv)
 	length_kib = strtol(argv[3], NULL, 10);
 	device = argv[4];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
 	/* assert ENH_ATTRIBUTE_EN */
 	if (!(ext_csd[EXT_CSD_PARTITIONING_SUPPORT] & EXT_CSD_ENH_ATTRIBUTE_EN))
 	{
 		printf(" Device cannot have enhanced tech.\n");
-		exit(1);
+		goto out;
 	}
 
 	/* assert not PARTITION_SETTING_COMPLETED */
 	if (ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED])
 	{
 		printf(" Device is already partitioned\n");
-		exit(1);
+		goto out;
 	}
 
 	align = 512l * get_hc_wp_grp_size(ext_csd) * get_hc_erase_grp_size(ext_csd);
@@ -1156,99 +924,55 @@ int do_enh_area_set(int nargs, char **argv)
 	enh_start_addr /= align;
 	enh_start_addr *= align;
 
+	batch = new_batch(dev, device);
+	if (!batch)
+		goto out;
+
 	/* set EXT_CSD_ERASE_GROUP_DEF bit 0 */
-	ret = write_extcsd_value(fd, EXT_CSD_ERASE_GROUP_DEF, 0x1);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x1 to "
-			"EXT_CSD[%d] in %s\n",
-			EXT_CSD_ERASE_GROUP_DEF, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ERASE_GROUP_DEF, 0x1);
 
 	/* write to ENH_START_ADDR and ENH_SIZE_MULT and PARTITIONS_ATTRIBUTE's ENH_USR bit */
 	value = (enh_start_addr >> 24) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_3, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_START_ADDR_3, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_START_ADDR_3, value);
 	value = (enh_start_addr >> 16) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_2, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_START_ADDR_2, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_START_ADDR_2, value);
 	value = (enh_start_addr >> 8) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_1, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_START_ADDR_1, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_START_ADDR_1, value);
 	value = enh_start_addr & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_START_ADDR_0, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_START_ADDR_0, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_START_ADDR_0, value);
 
 	value = (enh_size_mult >> 16) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_SIZE_MULT_2, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_SIZE_MULT_2, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_SIZE_MULT_2, value);
 	value = (enh_size_mult >> 8) & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_SIZE_MULT_1, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_SIZE_MULT_1, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_SIZE_MULT_1, value);
 	value = enh_size_mult & 0xff;
-	ret = write_extcsd_value(fd, EXT_CSD_ENH_SIZE_MULT_0, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to "
-			"EXT_CSD[%d] in %s\n", value,
-			EXT_CSD_ENH_SIZE_MULT_0, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_ENH_SIZE_MULT_0, value);
 	value = ext_csd[EXT_CSD_PARTITIONS_ATTRIBUTE] | EXT_CSD_ENH_USR;
-	ret = write_extcsd_value(fd, EXT_CSD_PARTITIONS_ATTRIBUTE, value);
-	if (ret) {
-		fprintf(stderr, "Could not write EXT_CSD_ENH_USR to "
-			"EXT_CSD[%d] in %s\n",
-			EXT_CSD_PARTITIONS_ATTRIBUTE, device);
-		exit(1);
-	}
+	mmc_batch_write_extcsd(batch, EXT_CSD_PARTITIONS_ATTRIBUTE, value);
 
-	ret = check_enhanced_area_total_limit(device, fd);
-	if (ret)
-		exit(1);
+	/* R1_SWITCH_ERROR is sticky until read, one check covers them all */
+	mmc_batch_status(batch);
+	if (submit_batch(batch, device))
+		goto out;
+
+	if (check_enhanced_area_total_limit(device, dev))
+		goto out;
 
 	printf("Done setting ENH_USR area on %s\n", device);
 
-	if (set_partitioning_setting_completed(dry_run, device, fd))
-		exit(1);
+	ret = set_partitioning_setting_completed(dry_run, device, dev);
 
-	return 0;
+out:
+	mmc_close(dev);
+	return ret;
 }
 
 int do_write_reliability_set(int nargs, char **argv)
 {
 	__u8 value;
 	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret = 1;
 
 	int dry_run = 1;
 	int partition;
@@ -1256,7 +980,7 @@ int do_write_reliability_set(int nargs, char **argv)
 
 	if (nargs != 4) {
 		fprintf(stderr,"Usage: mmc write_reliability set <-y|-n|-c> <partition> </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	if (!strcmp("-y", argv[1])) {
@@ -1268,75 +992,53 @@ int do_write_reliability_set(int nargs, char **argv)
 	partition = strtol(argv[2], NULL, 10);
 	device = argv[3];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(device, ext_csd);
+	if (!dev)
+		return 1;
 
 	/* assert not PARTITION_SETTING_COMPLETED */
 	if (ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED])
 	{
 		printf(" Device is already partitioned\n");
-		exit(1);
+		goto out;
 	}
 
 	/* assert HS_CTRL_REL */
 	if (!(ext_csd[EXT_CSD_WR_REL_PARAM] & HS_CTRL_REL)) {
 		printf("Cannot set write reliability parameters, WR_REL_SET is "
 				"read-only\n");
-		exit(1);
+		goto out;
 	}
 
 	value = ext_csd[EXT_CSD_WR_REL_SET] | (1<<partition);
-	ret = write_extcsd_value(fd, EXT_CSD_WR_REL_SET, value);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-				value, EXT_CSD_WR_REL_SET, device);
-		exit(1);
-	}
+	if (write_extcsd_value(dev, device, EXT_CSD_WR_REL_SET, value))
+		goto out;
 
 	printf("Done setting EXT_CSD_WR_REL_SET to 0x%02x on %s\n",
 		value, device);
 
-	if (set_partitioning_setting_completed(dry_run, device, fd))
-		exit(1);
+	ret = set_partitioning_setting_completed(dry_run, device, dev);
 
-	return 0;
+out:
+	mmc_close(dev);
+	return ret;
 }
 
 int do_read_extcsd(int nargs, char **argv)
 {
 	__u8 ext_csd[512], ext_csd_rev, reg;
 	__u32 regl;
-	int fd, ret;
-	char *device;
+	struct mmc_dev *dev;
 	const char *str;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc extcsd read </path/to/mmcblkX>\n");
-		exit(1);
-	}
-
-	device = argv[1];
-
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
+		return 1;
 	}
 
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev_extcsd(argv[1], ext_csd);
+	if (!dev)
+		return 1;
 
 	ext_csd_rev = ext_csd[EXT_CSD_REV];
 
@@ -1809,35 +1511,31 @@ int do_read_extcsd(int nargs, char **argv)
 		       ext_csd[EXT_CSD_CMDQ_MODE_EN]);
 	}
 out_free:
-	return ret;
+	mmc_close(dev);
+	return 0;
 }
 
 int do_sanitize(int nargs, char **argv)
 {
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc sanitize </path/to/mmcblkX>\n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 
-	ret = write_extcsd_value(fd, EXT_CSD_SANITIZE_START, 1);
-	if (ret) {
-		fprintf(stderr, "Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			1, EXT_CSD_SANITIZE_START, device);
-		exit(1);
-	}
+	ret = write_extcsd_value(dev, device, EXT_CSD_SANITIZE_START, 1);
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 
 }
 
@@ -1857,258 +1555,102 @@ int do_sanitize(int nargs, char **argv)
 		ret;										\
 	})
 
-#define RPMB_MULTI_CMD_MAX_CMDS 3
-
-enum rpmb_op_type {
-	MMC_RPMB_WRITE_KEY = 0x01,
-	MMC_RPMB_READ_CNT  = 0x02,
-	MMC_RPMB_WRITE     = 0x03,
-	MMC_RPMB_READ      = 0x04,
-
-	/* For internal usage only, do not use it directly */
-	MMC_RPMB_READ_RESP = 0x05
-};
-
-struct rpmb_frame {
-	u_int8_t  stuff[196];
-	u_int8_t  key_mac[32];
-	u_int8_t  data[256];
-	u_int8_t  nonce[16];
-	u_int32_t write_counter;
-	u_int16_t addr;
-	u_int16_t block_count;
-	u_int16_t result;
-	u_int16_t req_resp;
-};
-
-static inline void set_single_cmd(struct mmc_ioc_cmd *ioc, __u32 opcode,
-				  int write_flag, unsigned int blocks)
+/* Reports a libmmc RPMB failure: negative errno or device RESULT. */
+static void print_rpmb_error(int ret)
 {
-	ioc->opcode = opcode;
-	ioc->write_flag = write_flag;
-	ioc->arg = 0x0;
-	ioc->blksz = 512;
-	ioc->blocks = blocks;
-	ioc->flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
+	if (ret == -EBADMSG)
+		printf("RPMB MAC missmatch\n");
+	else if (ret < 0)
+		fprintf(stderr, "RPMB ioctl failed: %s\n", strerror(-ret));
+	else
+		printf("RPMB operation failed, retcode 0x%04x\n", ret);
 }
 
-/* Performs RPMB operation.
- *
- * @fd: RPMB device on which we should perform ioctl command
- * @frame_in: input RPMB frame, should be properly inited
- * @frame_out: output (result) RPMB frame. Caller is responsible for checking
- *             result and req_resp for output frame.
- * @out_cnt: count of outer frames. Used only for multiple blocks reading,
- *           in the other cases -EINVAL will be returned.
- */
-int do_rpmb_op(int fd,
-					  const struct rpmb_frame *frame_in,
-					  struct rpmb_frame *frame_out,
-					  unsigned int out_cnt)
+/* Reads exactly @len bytes of @what from @path, "-" being stdin. */
+static int read_file(const char *path, const char *what, void *buf, int len)
 {
-#ifndef MMC_IOC_MULTI_CMD
-	fprintf(stderr, "mmc-utils has been compiled without MMC_IOC_MULTI_CMD"
-		" support, needed by RPMB operation.\n");
-	exit(1);
-#else
-	int err;
-	u_int16_t rpmb_type;
-	struct mmc_ioc_multi_cmd *mioc;
-	struct mmc_ioc_cmd *ioc;
-	struct rpmb_frame frame_status = {0};
-
-	if (!frame_in || !frame_out || !out_cnt)
-		return -EINVAL;
-
-	/* prepare arguments for MMC_IOC_MULTI_CMD ioctl */
-	mioc = (struct mmc_ioc_multi_cmd *)
-		malloc(sizeof (struct mmc_ioc_multi_cmd) +
-		       RPMB_MULTI_CMD_MAX_CMDS * sizeof (struct mmc_ioc_cmd));
-	if (!mioc) {
-		return -ENOMEM;
-	}
-
-	rpmb_type = be16toh(frame_in->req_resp);
-
-	switch(rpmb_type) {
-	case MMC_RPMB_WRITE:
-	case MMC_RPMB_WRITE_KEY:
-		if (out_cnt != 1) {
-			err = -EINVAL;
-			goto out;
-		}
-
-		mioc->num_of_cmds = 3;
-
-		/* Write request */
-		ioc = &mioc->cmds[0];
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, (1 << 31) | 1, 1);
-		mmc_ioc_cmd_set_data((*ioc), frame_in);
-
-		/* Result request */
-		ioc = &mioc->cmds[1];
-		frame_status.req_resp = htobe16(MMC_RPMB_READ_RESP);
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1);
-		mmc_ioc_cmd_set_data((*ioc), &frame_status);
-
-		/* Get response */
-		ioc = &mioc->cmds[2];
-		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, 1);
-		mmc_ioc_cmd_set_data((*ioc), frame_out);
+	int fd, ret;
 
-		break;
-	case MMC_RPMB_READ_CNT:
-		if (out_cnt != 1) {
-			err = -EINVAL;
-			goto out;
+	if (0 == strcmp(path, "-"))
+		fd = STDIN_FILENO;
+	else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "can't open %s file: %s\n", what,
+				strerror(errno));
+			return -1;
 		}
-		/* fall through */
-
-	case MMC_RPMB_READ:
-		mioc->num_of_cmds = 2;
-
-		/* Read request */
-		ioc = &mioc->cmds[0];
-		set_single_cmd(ioc, MMC_WRITE_MULTIPLE_BLOCK, 1, 1);
-		mmc_ioc_cmd_set_data((*ioc), frame_in);
-
-		/* Get response */
-		ioc = &mioc->cmds[1];
-		set_single_cmd(ioc, MMC_READ_MULTIPLE_BLOCK, 0, out_cnt);
-		mmc_ioc_cmd_set_data((*ioc), frame_out);
-
-		break;
-	default:
-		err = -EINVAL;
-		goto out;
 	}
 
-	err = ioctl(fd, MMC_IOC_MULTI_CMD, mioc);
+	ret = DO_IO(read, fd, buf, len);
+	if (ret < 0)
+		fprintf(stderr, "read the %s: %s\n", what, strerror(errno));
+	else if (ret != len)
+		printf("%s must be %d bytes length, but we read only %d, exit\n",
+			   what, len, ret);
 
-out:
-	free(mioc);
-	return err;
-#endif /* !MMC_IOC_MULTI_CMD */
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	return ret == len ? 0 : -1;
 }
 
 int do_rpmb_write_key(int nargs, char **argv)
 {
-	int ret, dev_fd, key_fd;
-	struct rpmb_frame frame_in = {
-		.req_resp = htobe16(MMC_RPMB_WRITE_KEY)
-	}, frame_out;
+	struct mmc_dev *dev;
+	__u8 key[32];
+	int ret;
 
 	if (nargs != 3) {
 		fprintf(stderr, "Usage: mmc rpmb write-key </path/to/mmcblkXrpmb> </path/to/key>\n");
-		exit(1);
-	}
-
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
-
-	if (0 == strcmp(argv[2], "-"))
-		key_fd = STDIN_FILENO;
-	else {
-		key_fd = open(argv[2], O_RDONLY);
-		if (key_fd < 0) {
-			perror("can't open key file");
-			exit(1);
-		}
+		return 1;
 	}
 
 	/* Read the auth key */
-	ret = DO_IO(read, key_fd, frame_in.key_mac, sizeof(frame_in.key_mac));
-	if (ret < 0) {
-		perror("read the key");
-		exit(1);
-	} else if (ret != sizeof(frame_in.key_mac)) {
-		printf("Auth key must be %lu bytes length, but we read only %d, exit\n",
-			   (unsigned long)sizeof(frame_in.key_mac),
-			   ret);
-		exit(1);
-	}
-
-	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, &frame_out, 1);
-	if (ret != 0) {
-		perror("RPMB ioctl failed");
-		exit(1);
-	}
-
-	/* Check RPMB response */
-	if (frame_out.result != 0) {
-		printf("RPMB operation failed, retcode 0x%04x\n",
-			   be16toh(frame_out.result));
-		exit(1);
-	}
-
-	close(dev_fd);
-	if (key_fd != STDIN_FILENO)
-		close(key_fd);
-
-	return ret;
-}
-
-int rpmb_read_counter(int dev_fd, unsigned int *cnt)
-{
-	int ret;
-	struct rpmb_frame frame_in = {
-		.req_resp = htobe16(MMC_RPMB_READ_CNT)
-	}, frame_out;
-
-	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, &frame_out, 1);
-	if (ret != 0) {
-		perror("RPMB ioctl failed");
-		exit(1);
-	}
+	if (read_file(argv[2], "key", key, sizeof(key)))
+		return 1;
 
-	/* Check RPMB response */
-	if (frame_out.result != 0)
-		return be16toh(frame_out.result);
+	dev = open_dev(argv[1]);
+	if (!dev)
+		return 1;
 
-	*cnt = be32toh(frame_out.write_counter);
+	ret = mmc_rpmb_write_key(dev, key);
+	if (ret)
+		print_rpmb_error(ret);
 
-	return 0;
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_rpmb_read_counter(int nargs, char **argv)
 {
-	int ret, dev_fd;
-	unsigned int cnt;
+	struct mmc_dev *dev;
+	__u32 cnt;
+	int ret;
 
 	if (nargs != 2) {
 		fprintf(stderr, "Usage: mmc rpmb read-counter </path/to/mmcblkXrpmb>\n");
-		exit(1);
-	}
-
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
-
-	ret = rpmb_read_counter(dev_fd, &cnt);
-
-	/* Check RPMB response */
-	if (ret != 0) {
-		printf("RPMB operation failed, retcode 0x%04x\n", ret);
-		exit(1);
+		return 1;
 	}
 
-	close(dev_fd);
+	dev = open_dev(argv[1]);
+	if (!dev)
+		return 1;
 
-	printf("Counter value: 0x%08x\n", cnt);
+	ret = mmc_rpmb_read_counter(dev, &cnt);
+	if (ret)
+		print_rpmb_error(ret);
+	else
+		printf("Counter value: 0x%08x\n", cnt);
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_rpmb_read_block(int nargs, char **argv)
 {
-	int i, ret, dev_fd, data_fd, key_fd = -1;
+	int i, ret = 1, data_fd;
+	struct mmc_dev *dev;
 	uint16_t addr;
 	/*
 	 * for reading RPMB, number of blocks is set by CMD23 only, the packet
@@ -2116,19 +1658,11 @@ int do_rpmb_read_block(int nargs, char **argv)
 	 */
 	unsigned int blocks_cnt;
 	unsigned char key[32];
-	struct rpmb_frame frame_in = {
-		.req_resp    = htobe16(MMC_RPMB_READ),
-	}, *frame_out_p;
+	__u8 *data;
 
 	if (nargs != 5 && nargs != 6) {
 		fprintf(stderr, "Usage: mmc rpmb read-block </path/to/mmcblkXrpmb> <address> <blocks count> </path/to/output_file> [/path/to/key]\n");
-		exit(1);
-	}
-
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
+		return 1;
 	}
 
 	/* Get block address */
@@ -2136,27 +1670,42 @@ int do_rpmb_read_block(int nargs, char **argv)
 	addr = strtol(argv[2], NULL, 0);
 	if (errno) {
 		perror("incorrect address");
-		exit(1);
+		return 1;
 	}
-	frame_in.addr = htobe16(addr);
 
 	/* Get blocks count */
 	errno = 0;
 	blocks_cnt = strtol(argv[3], NULL, 0);
 	if (errno) {
 		perror("incorrect blocks count");
-		exit(1);
+		return 1;
 	}
 
 	if (!blocks_cnt) {
 		printf("please, specify valid blocks count number\n");
-		exit(1);
+		return 1;
 	}
 
-	frame_out_p = calloc(sizeof(*frame_out_p), blocks_cnt);
-	if (!frame_out_p) {
-		printf("can't allocate memory for RPMB outer frames\n");
-		exit(1);
+	/* Key is specified */
+	if (nargs == 6 && read_file(argv[5], "key", key, sizeof(key)))
+		return 1;
+
+	data = malloc(blocks_cnt * 256);
+	if (!data) {
+		printf("can't allocate memory for RPMB data\n");
+		return 1;
+	}
+
+	dev = open_dev(argv[1]);
+	if (!dev)
+		goto out_free;
+
+	ret = mmc_rpmb_read(dev, addr, blocks_cnt, data,
+			    nargs == 6 ? key : NULL);
+	mmc_close(dev);
+	if (ret) {
+		print_rpmb_error(ret);
+		goto out_free;
 	}
 
 	/* Write 256b data */
@@ -2167,262 +1716,101 @@ int do_rpmb_read_block(int nargs, char **argv)
 					   S_IRUSR | S_IWUSR);
 		if (data_fd < 0) {
 			perror("can't open output file");
-			exit(1);
-		}
-	}
-
-	/* Key is specified */
-	if (nargs == 6) {
-		if (0 == strcmp(argv[5], "-"))
-			key_fd = STDIN_FILENO;
-		else {
-			key_fd = open(argv[5], O_RDONLY);
-			if (key_fd < 0) {
-				perror("can't open input key file");
-				exit(1);
-			}
-		}
-
-		ret = DO_IO(read, key_fd, key, sizeof(key));
-		if (ret < 0) {
-			perror("read the key data");
-			exit(1);
-		} else if (ret != sizeof(key)) {
-			printf("Data must be %lu bytes length, but we read only %d, exit\n",
-				   (unsigned long)sizeof(key),
-				   ret);
-			exit(1);
-		}
-	}
-
-	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, frame_out_p, blocks_cnt);
-	if (ret != 0) {
-		perror("RPMB ioctl failed");
-		exit(1);
-	}
-
-	/* Check RPMB response */
-	if (frame_out_p[blocks_cnt - 1].result != 0) {
-		printf("RPMB operation failed, retcode 0x%04x\n",
-			   be16toh(frame_out_p[blocks_cnt - 1].result));
-		exit(1);
-	}
-
-	/* Do we have to verify data against key? */
-	if (nargs == 6) {
-		unsigned char mac[32];
-		hmac_sha256_ctx ctx;
-		struct rpmb_frame *frame_out = NULL;
-
-		hmac_sha256_init(&ctx, key, sizeof(key));
-		for (i = 0; i < blocks_cnt; i++) {
-			frame_out = &frame_out_p[i];
-			hmac_sha256_update(&ctx, frame_out->data,
-							   sizeof(*frame_out) -
-								   offsetof(struct rpmb_frame, data));
-		}
-
-		hmac_sha256_final(&ctx, mac, sizeof(mac));
-
-		/* Impossible */
-		assert(frame_out);
-
-		/* Compare calculated MAC and MAC from last frame */
-		if (memcmp(mac, frame_out->key_mac, sizeof(mac))) {
-			printf("RPMB MAC missmatch\n");
-			exit(1);
+			ret = 1;
+			goto out_free;
 		}
 	}
 
-	/* Write data */
 	for (i = 0; i < blocks_cnt; i++) {
-		struct rpmb_frame *frame_out = &frame_out_p[i];
-		ret = DO_IO(write, data_fd, frame_out->data, sizeof(frame_out->data));
+		ret = DO_IO(write, data_fd, data + i * 256, 256);
 		if (ret < 0) {
 			perror("write the data");
-			exit(1);
-		} else if (ret != sizeof(frame_out->data)) {
-			printf("Data must be %lu bytes length, but we wrote only %d, exit\n",
-				   (unsigned long)sizeof(frame_out->data),
-				   ret);
-			exit(1);
+			break;
+		} else if (ret != 256) {
+			printf("Data must be %d bytes length, but we wrote only %d, exit\n",
+				   256, ret);
+			break;
 		}
 	}
+	ret = i != blocks_cnt;
 
-	free(frame_out_p);
-	close(dev_fd);
 	if (data_fd != STDOUT_FILENO)
 		close(data_fd);
-	if (key_fd != -1 && key_fd != STDIN_FILENO)
-		close(key_fd);
-
-	return ret;
+out_free:
+	free(data);
+	return !!ret;
 }
 
 int do_rpmb_write_block(int nargs, char **argv)
 {
-	int ret, dev_fd, key_fd, data_fd;
+	struct mmc_dev *dev;
 	unsigned char key[32];
+	unsigned char data[256];
 	uint16_t addr;
-	unsigned int cnt;
-	struct rpmb_frame frame_in = {
-		.req_resp    = htobe16(MMC_RPMB_WRITE),
-		.block_count = htobe16(1)
-	}, frame_out;
+	int ret;
 
 	if (nargs != 5) {
 		fprintf(stderr, "Usage: mmc rpmb write-block </path/to/mmcblkXrpmb> <address> </path/to/input_file> </path/to/key>\n");
-		exit(1);
-	}
-
-	dev_fd = open(argv[1], O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open");
-		exit(1);
-	}
-
-	ret = rpmb_read_counter(dev_fd, &cnt);
-	/* Check RPMB response */
-	if (ret != 0) {
-		printf("RPMB read counter operation failed, retcode 0x%04x\n", ret);
-		exit(1);
+		return 1;
 	}
-	frame_in.write_counter = htobe32(cnt);
 
 	/* Get block address */
 	errno = 0;
 	addr = strtol(argv[2], NULL, 0);
 	if (errno) {
 		perror("incorrect address");
-		exit(1);
+		return 1;
 	}
-	frame_in.addr = htobe16(addr);
 
 	/* Read 256b data */
-	if (0 == strcmp(argv[3], "-"))
-		data_fd = STDIN_FILENO;
-	else {
-		data_fd = open(argv[3], O_RDONLY);
-		if (data_fd < 0) {
-			perror("can't open input file");
-			exit(1);
-		}
-	}
-
-	ret = DO_IO(read, data_fd, frame_in.data, sizeof(frame_in.data));
-	if (ret < 0) {
-		perror("read the data");
-		exit(1);
-	} else if (ret != sizeof(frame_in.data)) {
-		printf("Data must be %lu bytes length, but we read only %d, exit\n",
-			   (unsigned long)sizeof(frame_in.data),
-			   ret);
-		exit(1);
-	}
+	if (read_file(argv[3], "data", data, sizeof(data)))
+		return 1;
 
 	/* Read the auth key */
-	if (0 == strcmp(argv[4], "-"))
-		key_fd = STDIN_FILENO;
-	else {
-		key_fd = open(argv[4], O_RDONLY);
-		if (key_fd < 0) {
-			perror("can't open key file");
-			exit(1);
-		}
-	}
-
-	ret = DO_IO(read, key_fd, key, sizeof(key));
-	if (ret < 0) {
-		perror("read the key");
-		exit(1);
-	} else if (ret != sizeof(key)) {
-		printf("Auth key must be %lu bytes length, but we read only %d, exit\n",
-			   (unsigned long)sizeof(key),
-			   ret);
-		exit(1);
-	}
-
-	/* Calculate HMAC SHA256 */
-	hmac_sha256(
-		key, sizeof(key),
-		frame_in.data, sizeof(frame_in) - offsetof(struct rpmb_frame, data),
-		frame_in.key_mac, sizeof(frame_in.key_mac));
-
-	/* Execute RPMB op */
-	ret = do_rpmb_op(dev_fd, &frame_in, &frame_out, 1);
-	if (ret != 0) {
-		perror("RPMB ioctl failed");
-		exit(1);
-	}
+	if (read_file(argv[4], "key", key, sizeof(key)))
+		return 1;
 
-	/* Check RPMB response */
-	if (frame_out.result != 0) {
-		printf("RPMB operation failed, retcode 0x%04x\n",
-			   be16toh(frame_out.result));
-		exit(1);
-	}
+	dev = open_dev(argv[1]);
+	if (!dev)
+		return 1;
 
-	close(dev_fd);
-	if (data_fd != STDIN_FILENO)
-		close(data_fd);
-	if (key_fd != STDIN_FILENO)
-		close(key_fd);
+	ret = mmc_rpmb_write(dev, addr, 1, data, key);
+	if (ret)
+		print_rpmb_error(ret);
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_cache_ctrl(int value, int nargs, char **argv)
 {
-	__u8 ext_csd[512];
-	int fd, ret;
+	struct mmc_dev *dev;
+	int ret;
 	char *device;
 
 	if (nargs != 2) {
 	       fprintf(stderr, "Usage: mmc cache enable </path/to/mmcblkX>\n");
-	       exit(1);
+	       return 1;
 	}
 
 	device = argv[1];
 
-	fd = open(device, O_RDWR);
-	if (fd < 0) {
-		perror("open");
-		exit(1);
-	}
-
-	ret = read_extcsd(fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		exit(1);
-	}
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 
-	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V4_5) {
+	ret = mmc_cache_ctrl(dev, value);
+	if (ret == -EOPNOTSUPP)
 		fprintf(stderr,
 			"The CACHE option is only availabe on devices >= "
-			"MMC 4.5 %s\n", device);
-		exit(1);
-	}
-
-	/* If the cache size is zero, this device does not have a cache */
-	if (!(ext_csd[EXT_CSD_CACHE_SIZE_3] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_2] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_1] ||
-			ext_csd[EXT_CSD_CACHE_SIZE_0])) {
+			"MMC 4.5 with a cache, not on %s\n", device);
+	else if (ret)
 		fprintf(stderr,
-			"The CACHE option is not available on %s\n",
-			device);
-		exit(1);
-	}
-	ret = write_extcsd_value(fd, EXT_CSD_CACHE_CTRL, value);
-	if (ret) {
-		fprintf(stderr,
-			"Could not write 0x%02x to EXT_CSD[%d] in %s\n",
-			value, EXT_CSD_CACHE_CTRL, device);
-		exit(1);
-	}
+			"Could not write 0x%02x to EXT_CSD[%d] in %s: %s\n",
+			value, EXT_CSD_CACHE_CTRL, device, strerror(-ret));
 
-	return ret;
+	mmc_close(dev);
+	return !!ret;
 }
 
 int do_cache_en(int nargs, char **argv)
@@ -2437,223 +1825,49 @@ int do_cache_dis(int nargs, char **argv)
 
 int do_ffu(int nargs, char **argv)
 {
-#ifndef MMC_IOC_MULTI_CMD
-	fprintf(stderr, "mmc-utils has been compiled without MMC_IOC_MULTI_CMD"
-			" support, needed by FFU.\n");
-	exit(1);
-#else
-	int dev_fd, img_fd;
-	int sect_done = 0, retry = 3, ret = -EINVAL;
-	unsigned int sect_size;
-	__u8 ext_csd[512];
-	__u8 *buf;
-	__u32 arg;
-	off_t fw_size;
-	ssize_t chunk_size;
+	struct mmc_dev *dev;
+	int img_fd, installed, ret;
 	char *device;
-	struct mmc_ioc_multi_cmd *multi_cmd;
 
 	if (nargs != 3) {
 		fprintf(stderr, "Usage: ffu <image name> </path/to/mmcblkX> \n");
-		exit(1);
+		return 1;
 	}
 
 	device = argv[2];
-	dev_fd = open(device, O_RDWR);
-	if (dev_fd < 0) {
-		perror("device open failed");
-		exit(1);
-	}
+	dev = open_dev(device);
+	if (!dev)
+		return 1;
 	img_fd = open(argv[1], O_RDONLY);
 	if (img_fd < 0) {
 		perror("image open failed");
-		close(dev_fd);
-		exit(1);
-	}
-
-	buf = malloc(512);
-	multi_cmd = calloc(1, sizeof(struct mmc_ioc_multi_cmd) +
-				3 * sizeof(struct mmc_ioc_cmd));
-	if (!buf || !multi_cmd) {
-		perror("failed to allocate memory");
-		goto out;
-	}
-
-	ret = read_extcsd(dev_fd, ext_csd);
-	if (ret) {
-		fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-		goto out;
-	}
-
-	if (ext_csd[EXT_CSD_REV] < EXT_CSD_REV_V5_0) {
-		fprintf(stderr,
-			"The FFU feature is only available on devices >= "
-			"MMC 5.0, not supported in %s\n", device);
-		goto out;
+		mmc_close(dev);
+		return 1;
 	}
 
-	if (!(ext_csd[EXT_CSD_SUPPORTED_MODES] & EXT_CSD_FFU)) {
+	ret = mmc_ffu(dev, img_fd, &installed);
+	switch (ret) {
+	case 0:
+		if (installed)
+			fprintf(stderr, "FFU finished successfully\n");
+		else
+			fprintf(stderr, "Please reboot to complete firmware installation on %s\n", device);
+		break;
+	case -EOPNOTSUPP:
 		fprintf(stderr, "FFU is not supported in %s\n", device);
-		goto out;
-	}
-
-	if (ext_csd[EXT_CSD_FW_CONFIG] & EXT_CSD_UPDATE_DISABLE) {
+		break;
+	case -EPERM:
 		fprintf(stderr, "Firmware update was disabled in %s\n", device);
-		goto out;
-	}
-
-	fw_size = lseek(img_fd, 0, SEEK_END);
-
-	if (fw_size == 0) {
-		fprintf(stderr, "Firmware image is empty");
-		goto out;
-	}
-
-	sect_size = (ext_csd[EXT_CSD_DATA_SECTOR_SIZE] == 0) ? 512 : 4096;
-	if (fw_size % sect_size) {
-		fprintf(stderr, "Firmware data size (%jd) is not aligned!\n", (intmax_t)fw_size);
-		goto out;
-	}
-
-	/* set CMD ARG */
-	arg = ext_csd[EXT_CSD_FFU_ARG_0] |
-		ext_csd[EXT_CSD_FFU_ARG_1] << 8 |
-		ext_csd[EXT_CSD_FFU_ARG_2] << 16 |
-		ext_csd[EXT_CSD_FFU_ARG_3] << 24;
-
-	/* prepare multi_cmd to be sent */
-	multi_cmd->num_of_cmds = 3;
-
-	/* put device into ffu mode */
-	multi_cmd->cmds[0].opcode = MMC_SWITCH;
-	multi_cmd->cmds[0].arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
-			(EXT_CSD_MODE_CONFIG << 16) |
-			(EXT_CSD_FFU_MODE << 8) |
-			EXT_CSD_CMD_SET_NORMAL;
-	multi_cmd->cmds[0].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-	multi_cmd->cmds[0].write_flag = 1;
-
-	/* send image chunk */
-	multi_cmd->cmds[1].opcode = MMC_WRITE_BLOCK;
-	multi_cmd->cmds[1].blksz = sect_size;
-	multi_cmd->cmds[1].blocks = 1;
-	multi_cmd->cmds[1].arg = arg;
-	multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1 | MMC_RSP_R1 | MMC_CMD_ADTC;
-	multi_cmd->cmds[1].write_flag = 1;
-	mmc_ioc_cmd_set_data(multi_cmd->cmds[1], buf);
-
-	/* return device into normal mode */
-	multi_cmd->cmds[2].opcode = MMC_SWITCH;
-	multi_cmd->cmds[2].arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
-			(EXT_CSD_MODE_CONFIG << 16) |
-			(EXT_CSD_NORMAL_MODE << 8) |
-			EXT_CSD_CMD_SET_NORMAL;
-	multi_cmd->cmds[2].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-	multi_cmd->cmds[2].write_flag = 1;
-
-do_retry:
-	/* read firmware chunk */
-	lseek(img_fd, 0, SEEK_SET);
-	chunk_size = read(img_fd, buf, 512);
-
-	while (chunk_size > 0) {
-		/* send ioctl with multi-cmd */
-		ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
-
-		if (ret) {
-			perror("Multi-cmd ioctl");
-			/* In case multi-cmd ioctl failed before exiting from ffu mode */
-			ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[2]);
-			goto out;
-		}
-
-		ret = read_extcsd(dev_fd, ext_csd);
-		if (ret) {
-			fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-			goto out;
-		}
-
-		/* Test if we need to restart the download */
-		sect_done = ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_0] |
-				ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_1] << 8 |
-				ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_2] << 16 |
-				ext_csd[EXT_CSD_NUM_OF_FW_SEC_PROG_3] << 24;
-		/* By spec, host should re-start download from the first sector if sect_done is 0 */
-		if (sect_done == 0) {
-			if (retry > 0) {
-				retry--;
-				fprintf(stderr, "Programming failed. Retrying... (%d)\n", retry);
-				goto do_retry;
-			}
-			fprintf(stderr, "Programming failed! Aborting...\n");
-			goto out;
-		} else {
-			fprintf(stderr, "Programmed %d/%jd bytes\r", sect_done * sect_size, (intmax_t)fw_size);
-		}
-
-		/* read the next firmware chunk (if any) */
-		chunk_size = read(img_fd, buf, 512);
-	}
-
-	if ((sect_done * sect_size) == fw_size) {
-		fprintf(stderr, "Programmed %jd/%jd bytes\n", (intmax_t)fw_size, (intmax_t)fw_size);
-		fprintf(stderr, "Programming finished with status %d \n", ret);
-	}
-	else {
-		fprintf(stderr, "FW size and number of sectors written mismatch. Status return %d\n", ret);
-		goto out;
-	}
-
-	/* check mode operation for ffu install*/
-	if (!ext_csd[EXT_CSD_FFU_FEATURES]) {
-		fprintf(stderr, "Please reboot to complete firmware installation on %s\n", device);
-	} else {
-		fprintf(stderr, "Installing firmware on %s...\n", device);
-		/* Re-enter ffu mode and install the firmware */
-		multi_cmd->num_of_cmds = 2;
-
-		/* set ext_csd to install mode */
-		multi_cmd->cmds[1].opcode = MMC_SWITCH;
-		multi_cmd->cmds[1].blksz = 0;
-		multi_cmd->cmds[1].blocks = 0;
-		multi_cmd->cmds[1].arg = (MMC_SWITCH_MODE_WRITE_BYTE << 24) |
-				(EXT_CSD_MODE_OPERATION_CODES << 16) |
-				(EXT_CSD_FFU_INSTALL << 8) |
-				EXT_CSD_CMD_SET_NORMAL;
-		multi_cmd->cmds[1].flags = MMC_RSP_SPI_R1B | MMC_RSP_R1B | MMC_CMD_AC;
-		multi_cmd->cmds[1].write_flag = 1;
-
-		/* send ioctl with multi-cmd */
-		ret = ioctl(dev_fd, MMC_IOC_MULTI_CMD, multi_cmd);
-
-		if (ret) {
-			perror("Multi-cmd ioctl failed setting install mode");
-			/* In case multi-cmd ioctl failed before exiting from ffu mode */
-			ioctl(dev_fd, MMC_IOC_CMD, &multi_cmd->cmds[2]);
-			goto out;
-		}
-
-		ret = read_extcsd(dev_fd, ext_csd);
-		if (ret) {
-			fprintf(stderr, "Could not read EXT_CSD from %s\n", device);
-			goto out;
-		}
-
-		/* return status */
-		ret = ext_csd[EXT_CSD_FFU_STATUS];
-		if (ret) {
-			fprintf(stderr, "%s: error %d during FFU install:\n", device, ret);
-			goto out;
-		} else {
-			fprintf(stderr, "FFU finished successfully\n");
-		}
+		break;
+	case -EINVAL:
+		fprintf(stderr, "Firmware image is empty or not sector aligned\n");
+		break;
+	default:
+		fprintf(stderr, "%s: FFU failed: %s\n", device, strerror(-ret));
+		break;
 	}
 
-out:
-	free(buf);
-	free(multi_cmd);
 	close(img_fd);
-	close(dev_fd);
-	return ret;
-#endif
+	mmc_close(dev);
+	return !!ret;
 }
@@ -0,0 +1,736 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public
+ * License v2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public
+ * License along with this program; if not, write to the
+ * Free Software Foundation, Inc., 59 Temple Place - Suite 330,
+ * Boston, MA 021110-1307, USA.
+ *
+ * Off-target test of libmmc against a fake eMMC.
+ *
+ * ioctl() is interposed: BLKGETSIZE, MMC_IOC_CMD and MMC_IOC_MULTI_CMD
+ * are counted and fed to a small model of the card (EXT_CSD with SWITCH
+ * and a sticky R1_SWITCH_ERROR, per group write protection, RPMB with
+ * its key, write counter and MACs). A multi-cmd stops at the first
+ * failing command, as the kernel does. The device node is a temporary
+ * regular file. open() is interposed too, so /dev/mmcblk7rpmb and the
+ * max_hw_sectors_kb of its parent resolve to temporary files.
+ */
+#include <errno.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+
+#include "mmc.h"
+#include "mmc_cmds.h"
+#include "libmmc.h"
+#include "3rdparty/hmac_sha/hmac_sha2.h"
+
+#define FAKE_BLKS	(128 * 1024 * 1024)	/* 64 GiB */
+#define FAKE_WP_BLKS	(8 * 1024)		/* 4 MiB groups */
+#define FAKE_GROUPS	(FAKE_BLKS / FAKE_WP_BLKS)
+#define FAKE_RPMB_BLKS	1024
+#define FAKE_REL_WR	8
+
+static __u8 fake_ext_csd[512];
+static __u8 fake_wp[FAKE_GROUPS];
+static __u8 fake_key[32];
+static int fake_key_set;
+static __u32 fake_wcnt;
+static __u8 fake_rpmb[FAKE_RPMB_BLKS * 256];
+static struct rpmb_frame fake_req;
+static int fake_req_type;
+
+static int fake_switch_reject = -1;	/* EXT_CSD index whose SWITCH fails */
+static int fake_switch_error;		/* R1_SWITCH_ERROR until read */
+static int fake_fail_opcode = -1;	/* opcode failing ... */
+static int fake_fail_after;		/* ... after this many successes */
+
+static int fake_ioctls, fake_multi;
+static int fake_cmds[64];
+
+static char fake_dev[] = "/tmp/libmmc-test-XXXXXX";
+static char fake_hw_kb[] = "/tmp/libmmc-test-kb-XXXXXX";
+static const char fake_rpmb_dev[] = "/dev/mmcblk7rpmb";
+static const char fake_hw_kb_attr[] = "/sys/block/mmcblk7/queue/max_hw_sectors_kb";
+static const __u8 test_key[32] = "0123456789abcdef0123456789abcde";
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++;					\
+		}							\
+	} while (0)
+
+static void fake_mac(const struct rpmb_frame *frames, unsigned int n,
+		     __u8 *mac)
+{
+	hmac_sha256_ctx ctx;
+	unsigned int i;
+
+	hmac_sha256_init(&ctx, fake_key, sizeof(fake_key));
+	for (i = 0; i < n; i++)
+		hmac_sha256_update(&ctx, frames[i].data,
+				   sizeof(frames[i]) -
+				   offsetof(struct rpmb_frame, data));
+	hmac_sha256_final(&ctx, mac, 32);
+}
+
+/* CMD25 to the RPMB partition: a request, or the result read request */
+static int fake_rpmb_write(struct mmc_ioc_cmd *ic)
+{
+	struct rpmb_frame *f = (void *)(unsigned long)ic->data_ptr;
+	unsigned int n = ic->blocks, i, addr;
+	__u16 result = 0;
+	__u8 mac[32];
+
+	if (be16toh(f->req_resp) == 0x0005)
+		return 0;
+
+	memcpy(&fake_req, f, sizeof(fake_req));
+	fake_req_type = be16toh(f->req_resp);
+
+	switch (fake_req_type) {
+	case 0x0001:
+		if (fake_key_set) {
+			result = 0x0007;
+			break;
+		}
+		memcpy(fake_key, f->key_mac, sizeof(fake_key));
+		fake_key_set = 1;
+		break;
+	case 0x0003:
+		addr = be16toh(f->addr);
+		fake_mac(f, n, mac);
+		if (memcmp(mac, f[n - 1].key_mac, sizeof(mac)))
+			result = 0x0002;
+		else if (be32toh(f->write_counter) != fake_wcnt)
+			result = 0x0003;
+		else if (be16toh(f->block_count) != n || n > FAKE_REL_WR ||
+			 addr + n > FAKE_RPMB_BLKS)
+			result = 0x0001;
+		else {
+			for (i = 0; i < n; i++)
+				memcpy(fake_rpmb + (addr + i) * 256, f[i].data, 256);
+			fake_wcnt++;
+		}
+		break;
+	}
+
+	fake_req.result = htobe16(result);
+	return 0;
+}
+
+/* CMD18 from the RPMB partition: the response to the last request */
+static int fake_rpmb_read(struct mmc_ioc_cmd *ic)
+{
+	struct rpmb_frame *o = (void *)(unsigned long)ic->data_ptr;
+	unsigned int n = ic->blocks, i, addr = be16toh(fake_req.addr);
+
+	memset(o, 0, n * sizeof(*o));
+	switch (fake_req_type) {
+	case 0x0001:
+	case 0x0003:
+		o->req_resp = htobe16(fake_req_type << 8);
+		o->result = fake_req.result;
+		o->write_counter = htobe32(fake_wcnt);
+		break;
+	case 0x0002:
+		o->req_resp = htobe16(0x0200);
+		o->write_counter = htobe32(fake_wcnt);
+		fake_mac(o, 1, o->key_mac);
+		break;
+	case 0x0004:
+		if (addr + n > FAKE_RPMB_BLKS) {
+			o[n - 1].result = htobe16(0x0004);
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			o[i].req_resp = htobe16(0x0400);
+			o[i].addr = fake_req.addr;
+			memcpy(o[i].data, fake_rpmb + (addr + i) * 256, 256);
+		}
+		fake_mac(o, n, o[n - 1].key_mac);
+		break;
+	default:
+		return -EIO;
+	}
+
+	return 0;
+}
+
+static int fake_cmd(struct mmc_ioc_cmd *ic)
+{
+	__u8 *buf = (void *)(unsigned long)ic->data_ptr;
+	unsigned int index, value, group, i;
+
+	fake_cmds[ic->opcode & 63]++;
+	if ((int)ic->opcode == fake_fail_opcode && fake_fail_after-- == 0)
+		return -EIO;
+
+	switch (ic->opcode) {
+	case MMC_SEND_EXT_CSD:
+		memcpy(buf, fake_ext_csd, sizeof(fake_ext_csd));
+		return 0;
+	case MMC_SWITCH:
+		index = (ic->arg >> 16) & 0xff;
+		value = (ic->arg >> 8) & 0xff;
+		if (index == fake_switch_reject)
+			fake_switch_error = 1;
+		else
+			fake_ext_csd[index] = value;
+		return 0;
+	case MMC_SEND_STATUS:
+		ic->response[0] = 0x900 | (fake_switch_error ? R1_SWITCH_ERROR : 0);
+		fake_switch_error = 0;
+		return 0;
+	case MMC_SET_WRITE_PROT:
+	case MMC_CLEAR_WRITE_PROT:
+		group = ic->arg / FAKE_WP_BLKS;
+		if (group >= FAKE_GROUPS)
+			return -EINVAL;
+		if (ic->opcode == MMC_CLEAR_WRITE_PROT)
+			fake_wp[group] = MMC_WP_NONE;
+		else if (fake_ext_csd[EXT_CSD_USER_WP] & 0x04)
+			fake_wp[group] = MMC_WP_PERM;
+		else if (fake_ext_csd[EXT_CSD_USER_WP] & 0x01)
+			fake_wp[group] = MMC_WP_PWRON;
+		else
+			fake_wp[group] = MMC_WP_TEMP;
+		return 0;
+	case MMC_SEND_WRITE_PROT_TYPE:
+		group = ic->arg / FAKE_WP_BLKS;
+		memset(buf, 0, 8);
+		for (i = 0; i < 32 && group + i < FAKE_GROUPS; i++)
+			buf[7 - i / 4] |= fake_wp[group + i] << ((i % 4) * 2);
+		return 0;
+	case MMC_WRITE_MULTIPLE_BLOCK:
+		return fake_rpmb_write(ic);
+	case MMC_READ_MULTIPLE_BLOCK:
+		return fake_rpmb_read(ic);
+	}
+
+	return -EINVAL;
+}
+
+int ioctl(int fd, unsigned long req, ...)
+{
+	struct mmc_ioc_multi_cmd *mioc;
+	unsigned int i;
+	va_list ap;
+	void *arg;
+	int ret = 0;
+
+	va_start(ap, req);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+
+	fake_ioctls++;
+	if (req == BLKGETSIZE) {
+		*(unsigned long *)arg = FAKE_BLKS;
+	} else if (req == MMC_IOC_CMD) {
+		ret = fake_cmd(arg);
+	} else if (req == MMC_IOC_MULTI_CMD) {
+		mioc = arg;
+		fake_multi++;
+		if (mioc->num_of_cmds > MMC_IOC_MAX_CMDS)
+			ret = -EINVAL;
+		for (i = 0; !ret && i < mioc->num_of_cmds; i++)
+			ret = fake_cmd(&mioc->cmds[i]);
+	} else {
+		ret = -ENOTTY;
+	}
+
+	if (ret) {
+		errno = -ret;
+		return -1;
+	}
+	return 0;
+}
+
+int open(const char *path, int flags, ...)
+{
+	mode_t mode = 0;
+	va_list ap;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+
+	if (!strcmp(path, fake_rpmb_dev))
+		path = fake_dev;
+	else if (!strcmp(path, fake_hw_kb_attr))
+		path = fake_hw_kb;
+
+	return syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+}
+
+/* what the host reports as max_hw_sectors_kb, "" for no attribute */
+static void fake_set_hw_kb(const char *kb)
+{
+	FILE *f = fopen(fake_hw_kb, "w");
+
+	if (f) {
+		fputs(kb, f);
+		fclose(f);
+	}
+}
+
+static void fake_count_reset(void)
+{
+	fake_ioctls = 0;
+	fake_multi = 0;
+	memset(fake_cmds, 0, sizeof(fake_cmds));
+}
+
+static void fake_reset(void)
+{
+	memset(fake_ext_csd, 0, sizeof(fake_ext_csd));
+	fake_ext_csd[EXT_CSD_REV] = 8;
+	fake_ext_csd[EXT_CSD_ERASE_GROUP_DEF] = 1;
+	fake_ext_csd[EXT_CSD_HC_ERASE_GRP_SIZE] = 4;
+	fake_ext_csd[EXT_CSD_HC_WP_GRP_SIZE] = 2;
+	fake_ext_csd[EXT_CSD_REL_WR_SEC_C] = FAKE_REL_WR;
+	fake_ext_csd[EXT_CSD_SEC_COUNT_0] = FAKE_BLKS & 0xff;
+	fake_ext_csd[EXT_CSD_SEC_COUNT_1] = (FAKE_BLKS >> 8) & 0xff;
+	fake_ext_csd[EXT_CSD_SEC_COUNT_2] = (FAKE_BLKS >> 16) & 0xff;
+	fake_ext_csd[EXT_CSD_SEC_COUNT_3] = (FAKE_BLKS >> 24) & 0xff;
+	memset(fake_wp, 0, sizeof(fake_wp));
+	memcpy(fake_key, test_key, sizeof(fake_key));
+	fake_key_set = 1;
+	fake_wcnt = 0;
+	memset(fake_rpmb, 0, sizeof(fake_rpmb));
+	fake_req_type = 0;
+	fake_switch_reject = -1;
+	fake_switch_error = 0;
+	fake_fail_opcode = -1;
+	fake_count_reset();
+}
+
+static struct mmc_dev *test_open(void)
+{
+	struct mmc_dev *dev = NULL;
+
+	CHECK(mmc_open(fake_dev, &dev) == 0);
+	return dev;
+}
+
+static void test_wp_user_set(void)
+{
+	struct mmc_dev *dev;
+	__u32 g;
+
+	printf("user area write protection\n");
+	fake_reset();
+	dev = test_open();
+
+	/* USER_WP already allows temporary protection: no SWITCH */
+	CHECK(mmc_wp_user_set(dev, MMC_WP_TEMP, 700 * FAKE_WP_BLKS,
+			      2 * FAKE_WP_BLKS) == 0);
+	CHECK(fake_ioctls == 2);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 1);
+	CHECK(fake_cmds[MMC_SWITCH] == 0);
+	CHECK(fake_wp[699] == MMC_WP_NONE);
+	CHECK(fake_wp[700] == MMC_WP_TEMP && fake_wp[701] == MMC_WP_TEMP);
+	CHECK(fake_wp[702] == MMC_WP_NONE);
+
+	/*
+	 * 600 groups on a fresh handle: EXT_CSD, the checked USER_WP SWITCH,
+	 * then 600 CMD28, the restore and its check in three multi-cmds
+	 * (one ioctl per command would be 603)
+	 */
+	mmc_close(dev);
+	dev = test_open();
+	fake_count_reset();
+	CHECK(mmc_wp_user_set(dev, MMC_WP_PWRON, 0, 600 * FAKE_WP_BLKS) == 0);
+	CHECK(fake_ioctls == 5);
+	CHECK(fake_multi == 4);
+	CHECK(fake_cmds[MMC_SET_WRITE_PROT] == 600);
+	CHECK(fake_cmds[MMC_SWITCH] == 2);
+	CHECK(fake_cmds[MMC_SEND_STATUS] == 2);
+	CHECK(fake_ext_csd[EXT_CSD_USER_WP] == 0);
+	for (g = 0; g < 600; g++)
+		CHECK(fake_wp[g] == MMC_WP_PWRON);
+	CHECK(fake_wp[600] == MMC_WP_NONE);
+
+	fake_count_reset();
+	CHECK(mmc_wp_user_set(dev, MMC_WP_PERM, 600 * FAKE_WP_BLKS,
+			      FAKE_WP_BLKS) == 0);
+	CHECK(fake_wp[600] == MMC_WP_PERM);
+	CHECK(fake_ext_csd[EXT_CSD_USER_WP] == 0);
+
+	fake_count_reset();
+	CHECK(mmc_wp_user_set(dev, MMC_WP_NONE, 700 * FAKE_WP_BLKS,
+			      FAKE_WP_BLKS) == 0);
+	CHECK(fake_wp[700] == MMC_WP_NONE && fake_wp[701] == MMC_WP_TEMP);
+	CHECK(fake_cmds[MMC_CLEAR_WRITE_PROT] == 1);
+
+	fake_count_reset();
+	CHECK(mmc_wp_user_set(dev, MMC_WP_TEMP, 1, FAKE_WP_BLKS) == -EINVAL);
+	CHECK(mmc_wp_user_set(dev, 4, 0, FAKE_WP_BLKS) == -EINVAL);
+	CHECK(fake_cmds[MMC_SET_WRITE_PROT] == 0);
+
+	mmc_close(dev);
+}
+
+static void test_wp_user_set_failure(void)
+{
+	const __u8 *ext_csd;
+	struct mmc_dev *dev;
+
+	printf("user area write protection failure\n");
+	fake_reset();
+	dev = test_open();
+
+	/* a rejected USER_WP SWITCH: no CMD28 may apply the wrong type */
+	fake_switch_reject = EXT_CSD_USER_WP;
+	CHECK(mmc_wp_user_set(dev, MMC_WP_PERM, 0, 2 * FAKE_WP_BLKS) == -EIO);
+	CHECK(fake_cmds[MMC_SWITCH] == 1);
+	CHECK(fake_cmds[MMC_SET_WRITE_PROT] == 0);
+	CHECK(fake_wp[0] == MMC_WP_NONE && fake_wp[1] == MMC_WP_NONE);
+	CHECK(fake_ext_csd[EXT_CSD_USER_WP] == 0);
+
+	/* the second multi-cmd stops at the 101st CMD28, past its restore */
+	fake_reset();
+	fake_fail_opcode = MMC_SET_WRITE_PROT;
+	fake_fail_after = 100;
+	CHECK(mmc_wp_user_set(dev, MMC_WP_PWRON, 0, 300 * FAKE_WP_BLKS) == -EIO);
+	CHECK(fake_multi == 2);
+	CHECK(fake_cmds[MMC_SET_WRITE_PROT] == 101);
+	CHECK(fake_cmds[MMC_SWITCH] == 2);
+	CHECK(fake_ext_csd[EXT_CSD_USER_WP] == 0);
+	CHECK(fake_wp[99] == MMC_WP_PWRON && fake_wp[100] == MMC_WP_NONE);
+
+	/* and the handle does not believe the temporary USER_WP */
+	fake_count_reset();
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(ext_csd[EXT_CSD_USER_WP] == 0);
+
+	/* a failing restore is reported too */
+	fake_reset();
+	fake_fail_opcode = MMC_SWITCH;
+	fake_fail_after = 1;
+	CHECK(mmc_wp_user_set(dev, MMC_WP_PWRON, 0, FAKE_WP_BLKS) == -EIO);
+	CHECK(fake_ext_csd[EXT_CSD_USER_WP] == 0);
+
+	mmc_close(dev);
+}
+
+static void test_switch_checks(void)
+{
+	struct mmc_batch *batch;
+	const __u8 *ext_csd;
+	struct mmc_dev *dev;
+
+	printf("EXT_CSD SWITCH checks\n");
+	fake_reset();
+	dev = test_open();
+
+	/* EXT_CSD is read once per handle */
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 1);
+	CHECK(mmc_write_extcsd(dev, EXT_CSD_CACHE_CTRL, 1) == 0);
+	fake_count_reset();
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(ext_csd[EXT_CSD_CACHE_CTRL] == 1);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 0);
+
+	/* a rejected SWITCH is an error and is not patched into the cache */
+	fake_switch_reject = EXT_CSD_CACHE_CTRL;
+	CHECK(mmc_write_extcsd(dev, EXT_CSD_CACHE_CTRL, 0) == -EIO);
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 1);
+	CHECK(ext_csd[EXT_CSD_CACHE_CTRL] == 1);
+
+	/* one status check behind several SWITCHes catches any of them */
+	fake_switch_reject = EXT_CSD_GP_SIZE_MULT_1_1;
+	CHECK(mmc_batch_new(dev, &batch) == 0);
+	mmc_batch_write_extcsd(batch, EXT_CSD_GP_SIZE_MULT_1_2, 0);
+	mmc_batch_write_extcsd(batch, EXT_CSD_GP_SIZE_MULT_1_1, 1);
+	mmc_batch_write_extcsd(batch, EXT_CSD_GP_SIZE_MULT_1_0, 2);
+	mmc_batch_status(batch);
+	fake_count_reset();
+	CHECK(mmc_batch_submit(batch) == -EIO);
+	CHECK(fake_ioctls == 1);
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 1);
+	CHECK(ext_csd[EXT_CSD_GP_SIZE_MULT_1_1] == 0);
+
+	/* checked SWITCHes are patched, unchecked ones drop the cache */
+	fake_switch_reject = -1;
+	mmc_batch_write_extcsd(batch, EXT_CSD_GP_SIZE_MULT_1_0, 3);
+	mmc_batch_status(batch);
+	CHECK(mmc_batch_submit(batch) == 0);
+	fake_count_reset();
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 0);
+	CHECK(ext_csd[EXT_CSD_GP_SIZE_MULT_1_0] == 3);
+
+	mmc_batch_write_extcsd(batch, EXT_CSD_GP_SIZE_MULT_1_0, 4);
+	CHECK(mmc_batch_submit(batch) == 0);
+	CHECK(mmc_get_extcsd(dev, &ext_csd) == 0);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 1);
+	CHECK(ext_csd[EXT_CSD_GP_SIZE_MULT_1_0] == 4);
+	mmc_batch_free(batch);
+
+	mmc_close(dev);
+}
+
+static void test_gp_create(void)
+{
+	char *argv[] = { "gp create", "-y", "8192", "1", "0", "0", fake_dev };
+
+	printf("gp create\n");
+
+	/* a rejected size SWITCH stops before PARTITION_SETTING_COMPLETED */
+	fake_reset();
+	fake_switch_reject = EXT_CSD_GP_SIZE_MULT_1_1;
+	CHECK(do_create_gp_partition(7, argv) != 0);
+	CHECK(fake_ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED] == 0);
+	CHECK(fake_cmds[MMC_SEND_STATUS] == 1);
+
+	fake_reset();
+	CHECK(do_create_gp_partition(7, argv) == 0);
+	CHECK(fake_ext_csd[EXT_CSD_PARTITION_SETTING_COMPLETED] == 1);
+	CHECK(fake_ext_csd[EXT_CSD_GP_SIZE_MULT_1_0] == 2);
+	/*
+	 * EXT_CSD, the checked settings batch, EXT_CSD again before the OTP
+	 * write and the OTP batch
+	 */
+	CHECK(fake_ioctls == 4);
+	CHECK(fake_multi == 2);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 2);
+}
+
+static void test_wp_map(void)
+{
+	struct mmc_wp_map map;
+	struct mmc_dev *dev;
+	__u32 g;
+	int type;
+
+	printf("write protect map\n");
+	fake_reset();
+	for (g = 0; g < 37; g++)
+		fake_wp[g] = MMC_WP_PWRON;
+	for (g = 40; g < 43; g++)
+		fake_wp[g] = MMC_WP_TEMP;
+	fake_wp[FAKE_GROUPS - 1] = MMC_WP_PERM;
+	dev = test_open();
+
+	CHECK(mmc_wp_map_read(dev, &map) == 0);
+	/*
+	 * EXT_CSD, BLKGETSIZE and 512 CMD31 in three multi-cmds (one ioctl
+	 * per CMD31 would be 512)
+	 */
+	CHECK(fake_ioctls == 5);
+	CHECK(fake_multi == 3);
+	CHECK(fake_cmds[MMC_SEND_WRITE_PROT_TYPE] == FAKE_GROUPS / 32);
+	CHECK(map.group_blks == FAKE_WP_BLKS);
+	CHECK(map.groups == FAKE_GROUPS);
+	for (g = 0; g < FAKE_GROUPS; g++)
+		CHECK(mmc_wp_map_type(&map, g) == fake_wp[g]);
+
+	CHECK(mmc_wp_map_run(&map, 0, &type) == 37 && type == MMC_WP_PWRON);
+	CHECK(mmc_wp_map_run(&map, 37, &type) == 3 && type == MMC_WP_NONE);
+	CHECK(mmc_wp_map_run(&map, 40, &type) == 3 && type == MMC_WP_TEMP);
+	CHECK(mmc_wp_map_run(&map, 43, &type) == FAKE_GROUPS - 44);
+	CHECK(mmc_wp_map_run(&map, FAKE_GROUPS - 1, &type) == 1 &&
+	      type == MMC_WP_PERM);
+
+	CHECK(mmc_wp_map_protected(&map, 0, 37 * FAKE_WP_BLKS) == 1);
+	CHECK(mmc_wp_map_protected(&map, 0, 37 * FAKE_WP_BLKS + 1) == 0);
+	CHECK(mmc_wp_map_protected(&map, 40 * FAKE_WP_BLKS + 5, 100) == 1);
+	CHECK(mmc_wp_map_protected(&map, 0, 0) == -EINVAL);
+	CHECK(mmc_wp_map_protected(&map, (FAKE_GROUPS - 1) * FAKE_WP_BLKS,
+				   FAKE_WP_BLKS + 1) == -EINVAL);
+
+	mmc_wp_map_free(&map);
+	mmc_close(dev);
+}
+
+static void test_rpmb(void)
+{
+	static __u8 wdata[256 * 16], rdata[256 * 16];
+	struct mmc_dev *dev;
+	__u8 bad_key[32];
+	__u32 cnt;
+	int i;
+
+	printf("rpmb\n");
+	fake_reset();
+	for (i = 0; i < sizeof(wdata); i++)
+		wdata[i] = i * 7;
+	dev = test_open();
+
+	/*
+	 * counter, EXT_CSD, then REL_WR_SEC_C frames per authenticated
+	 * write (one frame per write, each followed by a counter read
+	 * back, would be 33)
+	 */
+	CHECK(mmc_rpmb_write(dev, 3, 16, wdata, test_key) == 0);
+	CHECK(fake_ioctls == 4);
+	CHECK(fake_cmds[MMC_SEND_EXT_CSD] == 1);
+	CHECK(fake_wcnt == 2);
+	CHECK(!memcmp(fake_rpmb + 3 * 256, wdata, 16 * 256));
+
+	fake_count_reset();
+	CHECK(mmc_rpmb_read(dev, 3, 16, rdata, test_key) == 0);
+	CHECK(fake_ioctls == 1);
+	CHECK(!memcmp(rdata, wdata, 16 * 256));
+
+	/* the counter is tracked by the caller, no read back */
+	cnt = fake_wcnt;
+	fake_count_reset();
+	CHECK(mmc_rpmb_write_counted(dev, 20, 16, wdata, test_key, &cnt) == 0);
+	CHECK(fake_ioctls == 2);
+	CHECK(cnt == 4 && fake_wcnt == 4);
+
+	memset(bad_key, 'x', sizeof(bad_key));
+	CHECK(mmc_rpmb_read(dev, 3, 16, rdata, bad_key) == -EBADMSG);
+	CHECK(mmc_rpmb_write(dev, 3, 1, wdata, bad_key) == 0x0002);
+
+	/* a stale counter is resynced once */
+	cnt = 0;
+	CHECK(mmc_rpmb_write_counted(dev, 500, 8, wdata, test_key, &cnt) == 0);
+	CHECK(cnt == fake_wcnt);
+	CHECK(!memcmp(fake_rpmb + 500 * 256, wdata, 8 * 256));
+
+	mmc_close(dev);
+}
+
+static void test_rpmb_chunked(void)
+{
+	static __u8 wdata[256 * 100], rdata[256 * 100];
+	struct mmc_dev *dev;
+	int i;
+
+	printf("rpmb chunked read\n");
+	fake_reset();
+	for (i = 0; i < sizeof(wdata); i++)
+		wdata[i] = i * 13;
+	dev = test_open();
+
+	/* long reads are split, each chunk with its own MAC */
+	CHECK(mmc_rpmb_write(dev, 200, 100, wdata, test_key) == 0);
+	fake_count_reset();
+	CHECK(mmc_rpmb_read(dev, 200, 100, rdata, test_key) == 0);
+	CHECK(fake_ioctls == 2);
+	CHECK(fake_cmds[MMC_READ_MULTIPLE_BLOCK] == 2);
+	CHECK(!memcmp(rdata, wdata, sizeof(wdata)));
+
+	/* the second chunk runs past the end: the first one is kept */
+	fake_count_reset();
+	memset(rdata, 0, sizeof(rdata));
+	memcpy(fake_rpmb + (FAKE_RPMB_BLKS - 80) * 256, wdata, 80 * 256);
+	CHECK(mmc_rpmb_read(dev, FAKE_RPMB_BLKS - 80, 100, rdata, test_key) == 0x0004);
+	CHECK(fake_cmds[MMC_READ_MULTIPLE_BLOCK] == 2);
+	CHECK(!memcmp(rdata, wdata, 64 * 256));
+
+	mmc_close(dev);
+}
+
+static void test_rpmb_host_limit(void)
+{
+	static __u8 wdata[256 * 100], rdata[256 * 100];
+	struct mmc_dev *dev = NULL;
+	int i;
+
+	printf("rpmb host transfer limit\n");
+	for (i = 0; i < sizeof(wdata); i++)
+		wdata[i] = i * 5;
+
+	/* 16 KiB per request: 32 frames */
+	fake_reset();
+	fake_set_hw_kb("16\n");
+	CHECK(mmc_open(fake_rpmb_dev, &dev) == 0);
+	CHECK(mmc_rpmb_write(dev, 0, 100, wdata, test_key) == 0);
+	fake_count_reset();
+	CHECK(mmc_rpmb_read(dev, 0, 100, rdata, test_key) == 0);
+	CHECK(fake_cmds[MMC_READ_MULTIPLE_BLOCK] == 4);
+	CHECK(!memcmp(rdata, wdata, sizeof(wdata)));
+	mmc_close(dev);
+
+	/* 2 KiB: 4 frames, below REL_WR_SEC_C for writes too */
+	fake_reset();
+	fake_set_hw_kb("2\n");
+	CHECK(mmc_open(fake_rpmb_dev, &dev) == 0);
+	CHECK(mmc_rpmb_write(dev, 0, 16, wdata, test_key) == 0);
+	CHECK(fake_wcnt == 4);
+	fake_count_reset();
+	CHECK(mmc_rpmb_read(dev, 0, 16, rdata, test_key) == 0);
+	CHECK(fake_cmds[MMC_READ_MULTIPLE_BLOCK] == 4);
+	mmc_close(dev);
+
+	/* more than the pool, or unreadable: RPMB_POOL_FRAMES */
+	fake_reset();
+	fake_set_hw_kb("512\n");
+	CHECK(mmc_open(fake_rpmb_dev, &dev) == 0);
+	CHECK(mmc_rpmb_write(dev, 0, 100, wdata, test_key) == 0);
+	fake_count_reset();
+	CHECK(mmc_rpmb_read(dev, 0, 100, rdata, test_key) == 0);
+	CHECK(fake_cmds[MMC_READ_MULTIPLE_BLOCK] == 2);
+	mmc_close(dev);
+
+	fake_set_hw_kb("");
+	CHECK(mmc_open(fake_rpmb_dev, &dev) == 0);
+	fake_count_reset();
+	CHECK(mmc_rpmb_read(dev, 0, 100, rdata, test_key) == 0);
+	CHECK(fake_cmds[MMC_READ_MULTIPLE_BLOCK] == 2);
+	mmc_close(dev);
+}
+
+int main(int argc, char *argv[])
+{
+	int fd;
+
+	fd = mkstemp(fake_dev);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+	fd = mkstemp(fake_hw_kb);
+	if (fd < 0) {
+		perror("mkstemp");
+		exit(1);
+	}
+	close(fd);
+
+	test_wp_user_set();
+	test_wp_user_set_failure();
+	test_switch_checks();
+	test_gp_create();
+	test_wp_map();
+	test_rpmb();
+	test_rpmb_chunked();
+	test_rpmb_host_limit();
+
+	unlink(fake_dev);
+	unlink(fake_hw_kb);
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+
+	return failures ? 1 : 0;
+}
@@ -6,19 +6,191 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/file.h>
 #include <sys/types.h>
 #include "light-iopmp.h"
 
-static const char *light_iopmp_tap = "/sys/devices/platform/iopmp/light_iopmp_tap";
-static const char *light_iopmp_start_addr = "/sys/devices/platform/iopmp/light_iopmp_start_addr";
-static const char *light_iopmp_end_addr = "/sys/devices/platform/iopmp/light_iopmp_end_addr";
-static const char *light_iopmp_attr = "/sys/devices/platform/iopmp/light_iopmp_attr";
-static const char *light_iopmp_lock = "/sys/devices/platform/iopmp/light_iopmp_lock";
-static const char *light_iopmp_set = "/sys/devices/platform/iopmp/light_iopmp_set";
+static const char *light_iopmp_root = "/sys/devices/platform/iopmp";
+static const char *light_iopmp_tap = "light_iopmp_tap";
+static const char *light_iopmp_start_addr = "light_iopmp_start_addr";
+static const char *light_iopmp_end_addr = "light_iopmp_end_addr";
+static const char *light_iopmp_attr = "light_iopmp_attr";
+static const char *light_iopmp_lock = "light_iopmp_lock";
+static const char *light_iopmp_set = "light_iopmp_set";
+static const char *light_iopmp_commit = "light_iopmp_commit";
+static const char *light_iopmp_lockdir = "/var/lock";
+static const char *light_iopmp_lockfile = "light-iopmp.lock";
+
+/* set by csi_iopmp_set_sysfs_root(), takes precedence over LIGHT_IOPMP_SYSFS_ROOT */
+static char light_iopmp_root_override[PATH_MAX];
+
+#define IOPMP_PAGE_SHIFT		12
+
+#define IOPMP_SNAPSHOT_MAGIC		0x504d4f49	/* "IOMP" */
+#define IOPMP_SNAPSHOT_VERSION		1
+#define IOPMP_SNAPSHOT_HDR_SIZE		12
+#define IOPMP_SNAPSHOT_ENT_SIZE		12
+
+struct iopmp_region {
+	int type;
+	int valid;
+	u_int32_t start;	/* address >> IOPMP_PAGE_SHIFT */
+	u_int32_t end;		/* address >> IOPMP_PAGE_SHIFT */
+	u_int16_t attr;
+};
+
+static const char *iopmp_root(void)
+{
+	const char *root;
+
+	if (light_iopmp_root_override[0])
+		return light_iopmp_root_override;
+
+	root = getenv("LIGHT_IOPMP_SYSFS_ROOT");
+	if (root && root[0])
+		return root;
+
+	return light_iopmp_root;
+}
+
+static int iopmp_open(const char *name, int flags)
+{
+	char path[PATH_MAX];
+
+	if (snprintf(path, sizeof(path), "%s/%s", iopmp_root(), name) >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return open(path, flags);
+}
+
+/**
+ * @brief  Use another directory than /sys/devices/platform/iopmp.
+ *
+ * The lockfile is then created in that directory instead of /var/lock.
+ *
+ * @param root  Directory holding the light_iopmp_* attributes, NULL to
+ *              restore LIGHT_IOPMP_SYSFS_ROOT or the default
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_set_sysfs_root(const char *root)
+{
+	if (!root) {
+		light_iopmp_root_override[0] = '\0';
+		return 0;
+	}
+
+	if (strlen(root) >= sizeof(light_iopmp_root_override))
+		return -ENAMETOOLONG;
+
+	strcpy(light_iopmp_root_override, root);
+
+	return 0;
+}
+
+/*
+ * The tap attribute selects the master for every following write, so the
+ * multi-write sequence must not interleave with another process. With
+ * another sysfs root the lockfile lives in that directory: processes
+ * driving the same copy serialize, and nothing is created on the host.
+ * Returns the lockfile descriptor or negative errno.
+ */
+static int iopmp_lockfile_open(void)
+{
+	const char *root = iopmp_root();
+	char path[PATH_MAX];
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s",
+		     root == light_iopmp_root ? light_iopmp_lockdir : root,
+		     light_iopmp_lockfile) >= sizeof(path))
+		return -ENAMETOOLONG;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fd = -errno;
+		perror("open iopmp lockfile");
+	}
+
+	return fd;
+}
+
+static void iopmp_lockfile_lock(int fd)
+{
+	if (fd < 0)
+		return;
+
+	while (flock(fd, LOCK_EX) < 0 && errno == EINTR)
+		;
+}
+
+static void iopmp_lockfile_unlock(int fd)
+{
+	if (fd >= 0)
+		flock(fd, LOCK_UN);
+}
+
+/*
+ * Every value is written, even one equal to the last write: the driver
+ * stages start/end/attr/lock per master, so what was written for the
+ * previously tapped master says nothing about the one tapped now.
+ */
+static int iopmp_write_long(int fd, long value)
+{
+	char string[24];
+	ssize_t ret;
+	int len;
+
+	len = snprintf(string, sizeof(string), "%ld\n", value);
+	ret = pwrite(fd, string, len, 0);
+	if (ret < 0)
+		return -errno;
+
+	/* a short store means the driver did not take the value */
+	return ret == len ? 0 : -EIO;
+
+	return 0;
+}
+
+/* one attribute of the legacy sequence, opened for this write only */
+static int iopmp_legacy_write(const char *name, int flags, long value)
+{
+	int fd, ret;
+
+	fd = iopmp_open(name, flags);
+	if (fd < 0) {
+		ret = -errno;
+		fprintf(stderr, "open %s: %s\n", name, strerror(-ret));
+		return ret;
+	}
+
+	ret = iopmp_write_long(fd, value);
+	if (ret)
+		fprintf(stderr, "write(%s): %s\n", name, strerror(-ret));
+	close(fd);
+
+	return ret;
+}
+
+static int iopmp_commit(int fd, int type, u_int32_t start, u_int32_t end, int attr)
+{
+	char string[64];
+	ssize_t ret;
+	int len;
+
+	len = snprintf(string, sizeof(string), "%d %u %u %d\n", type, start, end, attr);
+	ret = pwrite(fd, string, len, 0);
+	if (ret < 0)
+		return -errno;
+
+	return ret == len ? 0 : -EIO;
+}
 
 /**
  * @brief Light iopmp region permission setting.
@@ -30,78 +202,41 @@ static const char *light_iopmp_set = "/sys/devices/platform/iopmp/light_iopmp_se
 int csi_iopmp_set_attr(int type, u_int8_t *start_addr, u_int8_t *end_addr, csi_iopmp_attr_t attr)
 {
 	int ret = 0;
-	int light_iopmp_tap_fd, light_iopmp_start_addr_fd, light_iopmp_end_addr_fd;
-	int light_iopmp_attr_fd, light_iopmp_lock_fd, light_iopmp_set_fd;
-
-	light_iopmp_tap_fd = open(light_iopmp_tap, O_RDWR);
-	if (light_iopmp_tap_fd < 0) {
-		perror("open tap");
-		exit(1);
-	} else {
-		char string[5];
-		sprintf(string, "%d\n", type);
-		if (write(light_iopmp_tap_fd, string, 5) != 5)
-			perror("write(tap)");
-		close(light_iopmp_tap_fd);
-	}
+	int light_iopmp_commit_fd, light_iopmp_lockfile_fd;
 
-	light_iopmp_start_addr_fd = open(light_iopmp_start_addr, O_RDWR);
-	if (light_iopmp_start_addr_fd < 0) {
-		perror("open start_addr");
-		exit(1);
-	} else {
-		char string[20];
-		int start = (int)((int64_t)start_addr >> 12);
-		sprintf(string, "%d\n", start);
-		if (write(light_iopmp_start_addr_fd, string, 20) != 20)
-			perror("write(start_addr)");
-		close(light_iopmp_start_addr_fd);
+	light_iopmp_commit_fd = iopmp_open(light_iopmp_commit, O_WRONLY);
+	if (light_iopmp_commit_fd >= 0) {
+		ret = iopmp_commit(light_iopmp_commit_fd, type,
+				   (int64_t)start_addr >> IOPMP_PAGE_SHIFT,
+				   (int64_t)end_addr >> IOPMP_PAGE_SHIFT, attr);
+		close(light_iopmp_commit_fd);
+		if (ret)
+			fprintf(stderr, "write(commit): %s\n", strerror(-ret));
+		return ret;
 	}
 
-	light_iopmp_end_addr_fd = open(light_iopmp_end_addr, O_RDWR);
-	if (light_iopmp_end_addr_fd < 0) {
-		perror("open end_addr");
-		exit(1);
-	} else {
-		int end = (int)((int64_t)end_addr >> 12);
-		char string[20];
-		sprintf(string, "%d\n", end);
-		if (write(light_iopmp_end_addr_fd, string, 20) != 20)
-			perror("write(end_addr)");
-		close(light_iopmp_end_addr_fd);
-	}
+	light_iopmp_lockfile_fd = iopmp_lockfile_open();
+	if (light_iopmp_lockfile_fd < 0)
+		return light_iopmp_lockfile_fd;
 
-	light_iopmp_attr_fd = open(light_iopmp_attr, O_RDWR);
-	if (light_iopmp_attr_fd < 0) {
-		perror("open attr");
-		exit(1);
-	} else {
-		char string[20];
-		sprintf(string, "%d\n", attr);
-		if (write(light_iopmp_attr_fd, string, 20) != 20)
-			perror("write(attr)");
-		close(light_iopmp_attr_fd);
-	}
+	iopmp_lockfile_lock(light_iopmp_lockfile_fd);
 
-	light_iopmp_lock_fd = open(light_iopmp_lock, O_RDWR);
-	if (light_iopmp_lock_fd < 0) {
-		perror("open lock");
-		exit(1);
-	} else {
-		if (write(light_iopmp_lock_fd, "1\n", 2) != 2)
-			perror("write(lock)");
-		close(light_iopmp_lock_fd);
-	}
+	ret = iopmp_legacy_write(light_iopmp_tap, O_RDWR, type);
+	if (!ret)
+		ret = iopmp_legacy_write(light_iopmp_start_addr, O_RDWR,
+					 (int)((int64_t)start_addr >> IOPMP_PAGE_SHIFT));
+	if (!ret)
+		ret = iopmp_legacy_write(light_iopmp_end_addr, O_RDWR,
+					 (int)((int64_t)end_addr >> IOPMP_PAGE_SHIFT));
+	if (!ret)
+		ret = iopmp_legacy_write(light_iopmp_attr, O_RDWR, attr);
+	if (!ret)
+		ret = iopmp_legacy_write(light_iopmp_lock, O_RDWR, 1);
+	if (!ret)
+		ret = iopmp_legacy_write(light_iopmp_set, O_WRONLY, 1);
 
-	light_iopmp_set_fd = open(light_iopmp_set, O_WRONLY);
-	if (light_iopmp_set_fd < 0) {
-		perror("open set");
-		exit(1);
-	} else {
-		if (write(light_iopmp_set_fd, "1\n", 2) != 2)
-			perror("write(set)");
-		close(light_iopmp_set_fd);
-	}
+	iopmp_lockfile_unlock(light_iopmp_lockfile_fd);
+	close(light_iopmp_lockfile_fd);
 
 	return ret;
 }
@@ -117,6 +252,354 @@ int csi_iopmp_lock(void)
 	return 0;
 }
 
+static int iopmp_read_long(int fd, long *value)
+{
+	char string[24];
+	ssize_t len;
+
+	len = pread(fd, string, sizeof(string) - 1, 0);
+	if (len <= 0)
+		return len < 0 ? -errno : -EIO;
+
+	string[len] = '\0';
+	*value = strtol(string, NULL, 0);
+
+	return 0;
+}
+
+/* caller holds the lockfile unless ctx->commit_fd is used */
+static int iopmp_program(csi_iopmp_ctx_t *ctx, const struct iopmp_region *region)
+{
+	int ret;
+
+	if (ctx->commit_fd >= 0)
+		return iopmp_commit(ctx->commit_fd, region->type, region->start,
+				    region->end, region->attr);
+
+	ret = iopmp_write_long(ctx->tap_fd, region->type);
+	if (!ret)
+		ret = iopmp_write_long(ctx->start_fd, region->start);
+	if (!ret)
+		ret = iopmp_write_long(ctx->end_fd, region->end);
+	if (!ret)
+		ret = iopmp_write_long(ctx->attr_fd, region->attr);
+	if (!ret)
+		ret = iopmp_write_long(ctx->lock_fd, 1);
+	if (!ret)
+		ret = iopmp_write_long(ctx->set_fd, 1);
+
+	return ret;
+}
+
+/**
+ * @brief  Open the iopmp sysfs attributes once for repeated programming.
+ *
+ * @param ctx  Context to initialize
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_init(csi_iopmp_ctx_t *ctx)
+{
+	assert(ctx != NULL);
+
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->commit_fd = iopmp_open(light_iopmp_commit, O_WRONLY);
+	ctx->lockfile_fd = iopmp_lockfile_open();
+	if (ctx->lockfile_fd < 0) {
+		int ret = ctx->lockfile_fd;
+
+		ctx->lockfile_fd = -1;
+		if (ctx->commit_fd >= 0)
+			close(ctx->commit_fd);
+		ctx->commit_fd = -1;
+		return ret;
+	}
+	ctx->tap_fd = iopmp_open(light_iopmp_tap, O_RDWR);
+	ctx->start_fd = iopmp_open(light_iopmp_start_addr, O_RDWR);
+	ctx->end_fd = iopmp_open(light_iopmp_end_addr, O_RDWR);
+	ctx->attr_fd = iopmp_open(light_iopmp_attr, O_RDWR);
+	ctx->lock_fd = iopmp_open(light_iopmp_lock, O_RDWR);
+	ctx->set_fd = iopmp_open(light_iopmp_set, O_WRONLY);
+
+	if (ctx->tap_fd < 0 || ctx->start_fd < 0 || ctx->end_fd < 0 ||
+	    ctx->attr_fd < 0 || ctx->lock_fd < 0 || ctx->set_fd < 0) {
+		int ret = -errno;
+
+		perror("open iopmp");
+		csi_iopmp_uninit(ctx);
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief  Close the iopmp sysfs attributes held by the context.
+ *
+ * @param ctx  Context to release
+ */
+void csi_iopmp_uninit(csi_iopmp_ctx_t *ctx)
+{
+	int *fds[] = { &ctx->commit_fd, &ctx->lockfile_fd, &ctx->tap_fd, &ctx->start_fd, &ctx->end_fd,
+		       &ctx->attr_fd, &ctx->lock_fd, &ctx->set_fd };
+	int i;
+
+	for (i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+		if (*fds[i] >= 0)
+			close(*fds[i]);
+		*fds[i] = -1;
+	}
+}
+
+/**
+ * @brief Light iopmp region permission setting through an opened context.
+ *
+ * @param ctx  Context from csi_iopmp_init()
+ * @param type
+ * @param attr
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_ctx_set_attr(csi_iopmp_ctx_t *ctx, int type, u_int8_t *start_addr,
+			   u_int8_t *end_addr, csi_iopmp_attr_t attr)
+{
+	struct iopmp_region region = {
+		.type	= type,
+		.valid	= 1,
+		.start	= (int64_t)start_addr >> IOPMP_PAGE_SHIFT,
+		.end	= (int64_t)end_addr >> IOPMP_PAGE_SHIFT,
+		.attr	= attr,
+	};
+	int ret;
+
+	assert(ctx != NULL);
+
+	if (type < 0 || type >= IOPMP_NUM)
+		return -EINVAL;
+
+	if (ctx->commit_fd >= 0)
+		return iopmp_program(ctx, &region);
+
+	iopmp_lockfile_lock(ctx->lockfile_fd);
+	ret = iopmp_program(ctx, &region);
+	iopmp_lockfile_unlock(ctx->lockfile_fd);
+
+	return ret;
+}
+
+static void put_le16(u_int8_t *p, u_int16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(u_int8_t *p, u_int32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static u_int16_t get_le16(const u_int8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static u_int32_t get_le32(const u_int8_t *p)
+{
+	return get_le16(p) | ((u_int32_t)get_le16(p + 2) << 16);
+}
+
+static u_int32_t iopmp_crc32(const u_int8_t *data, size_t len)
+{
+	u_int32_t crc = 0xffffffff;
+	int i;
+
+	while (len--) {
+		crc ^= *data++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+
+	return ~crc;
+}
+
+/* what the tapped master holds, caller holds the lockfile */
+static int iopmp_read_region(csi_iopmp_ctx_t *ctx, int type, struct iopmp_region *region)
+{
+	long start, end, attr;
+	int ret;
+
+	ret = iopmp_write_long(ctx->tap_fd, type);
+	if (!ret)
+		ret = iopmp_read_long(ctx->start_fd, &start);
+	if (!ret)
+		ret = iopmp_read_long(ctx->end_fd, &end);
+	if (!ret)
+		ret = iopmp_read_long(ctx->attr_fd, &attr);
+	if (ret)
+		return ret;
+
+	region->type = type;
+	/* a master never programmed reads back all zero */
+	region->valid = start || end || attr;
+	region->start = start;
+	region->end = end;
+	region->attr = attr;
+
+	return 0;
+}
+
+static int iopmp_verify(csi_iopmp_ctx_t *ctx, const struct iopmp_region *region)
+{
+	struct iopmp_region hw;
+	int ret;
+
+	ret = iopmp_read_region(ctx, region->type, &hw);
+	if (ret)
+		return ret;
+
+	if (hw.start != region->start || hw.end != region->end || hw.attr != region->attr) {
+		fprintf(stderr, "iopmp %d: read back %u-%u attr %u, expect %u-%u attr %u\n",
+			region->type, hw.start, hw.end, hw.attr,
+			region->start, region->end, region->attr);
+		return -EIO;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief  Export the regions programmed in the hardware as a binary blob.
+ *
+ * Every master is read back through the tap, so the blob holds what the
+ * iopmp enforces, whoever programmed it. Masters reading back all zero
+ * were never programmed and are left out.
+ *
+ * Layout, little endian: magic(4) version(2) count(2) crc32(4), then per
+ * region: type(1) reserved(1) attr(2) start(4) end(4), start and end in
+ * 4KiB pages.
+ *
+ * @param blob  Buffer of at least CSI_IOPMP_SNAPSHOT_MAX_SIZE bytes
+ * @param len   In: size of blob. Out: number of bytes used
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_snapshot_export(void *blob, size_t *len)
+{
+	struct iopmp_region regions[IOPMP_NUM];
+	u_int8_t *p = blob, *ent;
+	csi_iopmp_ctx_t ctx;
+	int i, count = 0, ret;
+
+	assert(blob != NULL && len != NULL);
+
+	if (*len < IOPMP_SNAPSHOT_HDR_SIZE)
+		return -ENOSPC;
+
+	ret = csi_iopmp_init(&ctx);
+	if (ret)
+		return ret;
+
+	iopmp_lockfile_lock(ctx.lockfile_fd);
+	for (i = 0; i < IOPMP_NUM && !ret; i++)
+		ret = iopmp_read_region(&ctx, i, &regions[i]);
+	iopmp_lockfile_unlock(ctx.lockfile_fd);
+	csi_iopmp_uninit(&ctx);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < IOPMP_NUM; i++)
+		count += regions[i].valid;
+
+	if (*len < IOPMP_SNAPSHOT_HDR_SIZE + count * IOPMP_SNAPSHOT_ENT_SIZE)
+		return -ENOSPC;
+
+	ent = p + IOPMP_SNAPSHOT_HDR_SIZE;
+	for (i = 0; i < IOPMP_NUM; i++) {
+		if (!regions[i].valid)
+			continue;
+
+		ent[0] = i;
+		ent[1] = 0;
+		put_le16(ent + 2, regions[i].attr);
+		put_le32(ent + 4, regions[i].start);
+		put_le32(ent + 8, regions[i].end);
+		ent += IOPMP_SNAPSHOT_ENT_SIZE;
+	}
+
+	put_le32(p, IOPMP_SNAPSHOT_MAGIC);
+	put_le16(p + 4, IOPMP_SNAPSHOT_VERSION);
+	put_le16(p + 6, count);
+	put_le32(p + 8, iopmp_crc32(p + IOPMP_SNAPSHOT_HDR_SIZE,
+				    count * IOPMP_SNAPSHOT_ENT_SIZE));
+	*len = ent - p;
+
+	return 0;
+}
+
+/**
+ * @brief  Program every region of a snapshot in one batch and read it back.
+ *
+ * The regions are programmed through the attributes opened by the
+ * context under a single hold of the lockfile. Every master absent from
+ * the blob (never programmed when it was exported) is cleared to the
+ * all-zero window, so after a successful replay the iopmp holds exactly
+ * the snapshot. A master the hardware keeps locked with another window
+ * fails the read back with -EIO.
+ *
+ * @param ctx   Context from csi_iopmp_init()
+ * @param blob  Blob from csi_iopmp_snapshot_export()
+ * @param len   Size of blob
+ * @return 0 on success, -EBADMSG on a corrupt blob, -EIO if the read back
+ *         state does not match the snapshot, or negative errno on failure
+ */
+int csi_iopmp_snapshot_replay(csi_iopmp_ctx_t *ctx, const void *blob, size_t len)
+{
+	struct iopmp_region regions[IOPMP_NUM];
+	const u_int8_t *p = blob, *ent;
+	int i, count, ret;
+
+	assert(ctx != NULL && blob != NULL);
+
+	if (len < IOPMP_SNAPSHOT_HDR_SIZE ||
+	    get_le32(p) != IOPMP_SNAPSHOT_MAGIC ||
+	    get_le16(p + 4) != IOPMP_SNAPSHOT_VERSION)
+		return -EBADMSG;
+
+	count = get_le16(p + 6);
+	if (count > IOPMP_NUM ||
+	    len != IOPMP_SNAPSHOT_HDR_SIZE + count * IOPMP_SNAPSHOT_ENT_SIZE ||
+	    get_le32(p + 8) != iopmp_crc32(p + IOPMP_SNAPSHOT_HDR_SIZE,
+					   count * IOPMP_SNAPSHOT_ENT_SIZE))
+		return -EBADMSG;
+
+	/* masters left out of the blob are cleared */
+	memset(regions, 0, sizeof(regions));
+	for (i = 0; i < IOPMP_NUM; i++)
+		regions[i].type = i;
+
+	ent = p + IOPMP_SNAPSHOT_HDR_SIZE;
+	for (i = 0; i < count; i++, ent += IOPMP_SNAPSHOT_ENT_SIZE) {
+		if (ent[0] >= IOPMP_NUM || regions[ent[0]].valid)
+			return -EBADMSG;
+
+		regions[ent[0]].valid = 1;
+		regions[ent[0]].attr = get_le16(ent + 2);
+		regions[ent[0]].start = get_le32(ent + 4);
+		regions[ent[0]].end = get_le32(ent + 8);
+	}
+
+	/* read back goes through the tap even when the commit attribute exists */
+	iopmp_lockfile_lock(ctx->lockfile_fd);
+
+	for (i = 0, ret = 0; i < IOPMP_NUM && !ret; i++)
+		ret = iopmp_program(ctx, &regions[i]);
+
+	for (i = 0; i < IOPMP_NUM && !ret; i++)
+		ret = iopmp_verify(ctx, &regions[i]);
+
+	iopmp_lockfile_unlock(ctx->lockfile_fd);
+
+	return ret;
+}
+
 #if 0 /* demo */
 int main(int argc, char *argv[])
 {
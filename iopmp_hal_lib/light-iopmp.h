@@ -6,6 +6,9 @@
 #ifndef _LIGHT_IOPMP_API_H
 #define _LIGHT_IOPMP_API_H
 
+#include <stddef.h>
+#include <sys/types.h>
+
 #define IOPMP_EMMC      0
 #define IOPMP_SDIO0     1
 #define IOPMP_SDIO1     2
@@ -34,12 +37,27 @@
 #define IOPMP_TEE_DMAC  25
 #define IOPMP_DSP0	26
 #define IOPMP_DSP1	27
+#define IOPMP_NUM	28
 
 typedef enum {
 	CSI_ATTR_R	= 1,
 	CSI_ATTR_W	= 2,
 } csi_iopmp_attr_t;
 
+typedef struct _csi_iopmp_ctx {
+	int commit_fd;		/* combined "type start end attr" attribute, -1 if absent */
+	int lockfile_fd;	/* serializes the tap sequence between processes */
+	int tap_fd;
+	int start_fd;
+	int end_fd;
+	int attr_fd;
+	int lock_fd;
+	int set_fd;
+} csi_iopmp_ctx_t;
+
+/* snapshot blob: 12 bytes header + 12 bytes per programmed master */
+#define CSI_IOPMP_SNAPSHOT_MAX_SIZE	(12 + IOPMP_NUM * 12)
+
 /**
  * @brief Light iopmp region permission setting.
  *
@@ -56,4 +74,69 @@ int csi_iopmp_set_attr(int type, u_int8_t *start_addr, u_int8_t *end_addr, csi_i
  */
 int csi_iopmp_lock(void);
 
+/**
+ * @brief  Use another directory than /sys/devices/platform/iopmp.
+ *
+ * The LIGHT_IOPMP_SYSFS_ROOT environment variable has the same effect for
+ * programs which do not call this function. The lockfile serializing the
+ * tap sequence is then created in that directory instead of /var/lock.
+ *
+ * @param root  Directory holding the light_iopmp_* attributes, NULL to
+ *              restore LIGHT_IOPMP_SYSFS_ROOT or the default
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_set_sysfs_root(const char *root);
+
+/**
+ * @brief  Open the iopmp sysfs attributes once for repeated programming.
+ *
+ * @param ctx  Context to initialize
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_init(csi_iopmp_ctx_t *ctx);
+
+/**
+ * @brief  Close the iopmp sysfs attributes held by the context.
+ *
+ * @param ctx  Context to release
+ */
+void csi_iopmp_uninit(csi_iopmp_ctx_t *ctx);
+
+/**
+ * @brief Light iopmp region permission setting through an opened context.
+ *
+ * @param ctx  Context from csi_iopmp_init()
+ * @param type
+ * @param attr
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_ctx_set_attr(csi_iopmp_ctx_t *ctx, int type, u_int8_t *start_addr,
+			   u_int8_t *end_addr, csi_iopmp_attr_t attr);
+
+/**
+ * @brief  Export the regions programmed in the hardware as a binary blob.
+ *
+ * Every master is read back through the tap, masters never programmed
+ * are left out.
+ *
+ * @param blob  Buffer of at least CSI_IOPMP_SNAPSHOT_MAX_SIZE bytes
+ * @param len   In: size of blob. Out: number of bytes used
+ * @return 0 on success or negative errno on failure
+ */
+int csi_iopmp_snapshot_export(void *blob, size_t *len);
+
+/**
+ * @brief  Program every region of a snapshot in one batch and read it back.
+ *
+ * Masters absent from the blob are cleared, so the iopmp ends up holding
+ * exactly the snapshot.
+ *
+ * @param ctx   Context from csi_iopmp_init()
+ * @param blob  Blob from csi_iopmp_snapshot_export()
+ * @param len   Size of blob
+ * @return 0 on success, -EBADMSG on a corrupt blob, -EIO if the read back
+ *         state does not match the snapshot, or negative errno on failure
+ */
+int csi_iopmp_snapshot_replay(csi_iopmp_ctx_t *ctx, const void *blob, size_t len);
+
 #endif
@@ -0,0 +1,153 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Time per region of the iopmp programming paths: the legacy call (over the
+ * commit attribute when the driver provides it, else over the locked
+ * sequence), the context (both ways) and the snapshot batch.
+ * Set LIGHT_IOPMP_SYSFS_ROOT to run against a copy of the sysfs directory.
+ *
+ * NOTE: every master is really programmed with the given window, the default
+ * one (0x0 - 0x200000000, attr 0xffff) grants full access like the demo in
+ * light-iopmp-hal.c.
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include "light-iopmp.h"
+
+static unsigned long start_addr = 0x0;
+static unsigned long end_addr = 0x200000000;
+static int attr = 0xffff;
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static void report(const char *name, double us, int loops)
+{
+	printf("%-16s %8d regions %10.1f us/region\n",
+	       name, loops * IOPMP_NUM, us / (loops * IOPMP_NUM));
+}
+
+static int bench_legacy(const char *name, int loops)
+{
+	double t0 = now_us();
+	int i, type, ret;
+
+	for (i = 0; i < loops; i++) {
+		for (type = 0; type < IOPMP_NUM; type++) {
+			ret = csi_iopmp_set_attr(type, (u_int8_t *)start_addr,
+						 (u_int8_t *)end_addr, attr);
+			if (ret)
+				return ret;
+		}
+	}
+
+	report(name, now_us() - t0, loops);
+	return 0;
+}
+
+static int bench_ctx(const char *name, csi_iopmp_ctx_t *ctx, int loops)
+{
+	double t0 = now_us();
+	int i, type, ret;
+
+	for (i = 0; i < loops; i++) {
+		for (type = 0; type < IOPMP_NUM; type++) {
+			ret = csi_iopmp_ctx_set_attr(ctx, type, (u_int8_t *)start_addr,
+						     (u_int8_t *)end_addr, attr);
+			if (ret)
+				return ret;
+		}
+	}
+
+	report(name, now_us() - t0, loops);
+	return 0;
+}
+
+static int bench_batch(csi_iopmp_ctx_t *ctx, int loops)
+{
+	u_int8_t blob[CSI_IOPMP_SNAPSHOT_MAX_SIZE];
+	size_t len = sizeof(blob);
+	double t0;
+	int i, ret;
+
+	/* the previous paths programmed every master */
+	ret = csi_iopmp_snapshot_export(blob, &len);
+	if (ret)
+		return ret;
+
+	t0 = now_us();
+	for (i = 0; i < loops; i++) {
+		ret = csi_iopmp_snapshot_replay(ctx, blob, len);
+		if (ret)
+			return ret;
+	}
+
+	report("batch replay", now_us() - t0, loops);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	csi_iopmp_ctx_t ctx;
+	int loops = 100, ret;
+
+	if (argc > 1)
+		loops = strtol(argv[1], NULL, 0);
+	if (argc > 4) {
+		start_addr = strtoul(argv[2], NULL, 0);
+		end_addr = strtoul(argv[3], NULL, 0);
+		attr = strtol(argv[4], NULL, 0);
+	}
+	if (loops <= 0) {
+		fprintf(stderr, "Usage: %s [loops [start end attr]]\n", argv[0]);
+		exit(1);
+	}
+
+	ret = csi_iopmp_init(&ctx);
+	if (ret)
+		goto err;
+
+	/* csi_iopmp_set_attr() takes the commit attribute whenever it exists */
+	ret = bench_legacy(ctx.commit_fd >= 0 ? "legacy commit" : "legacy sequence", loops);
+	if (ret)
+		goto err_ctx;
+
+	if (ctx.commit_fd >= 0) {
+		ret = bench_ctx("ctx commit", &ctx, loops);
+		if (ret)
+			goto err_ctx;
+
+		/* force the locked multi-write sequence */
+		close(ctx.commit_fd);
+		ctx.commit_fd = -1;
+	} else {
+		printf("%-16s not provided by the driver\n", "ctx commit");
+	}
+
+	ret = bench_ctx("ctx sequence", &ctx, loops);
+	if (ret)
+		goto err_ctx;
+
+	ret = bench_batch(&ctx, loops);
+
+err_ctx:
+	csi_iopmp_uninit(&ctx);
+err:
+	if (ret) {
+		fprintf(stderr, "iopmp programming failed: %s\n", strerror(-ret));
+		return 1;
+	}
+
+	return 0;
+}
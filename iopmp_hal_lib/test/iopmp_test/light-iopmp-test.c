@@ -0,0 +1,559 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2021 Alibaba Group Holding Limited.
+ *
+ * Off-target test of libiopmp against a fake sysfs directory.
+ *
+ * open/close/write/pwrite/pread are interposed: accesses to the files of the
+ * fake directory are recorded and fed to a small model of the iopmp driver
+ * (the tap selects the master, start/end/attr/lock are staged per master
+ * and latched by set, the start/end/attr attributes read back what the
+ * tapped master latched). Everything else goes straight to the kernel.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include "light-iopmp.h"
+
+enum fake_attr {
+	FAKE_NONE = 0,
+	FAKE_TAP,
+	FAKE_START,
+	FAKE_END,
+	FAKE_ATTR,
+	FAKE_LOCK,
+	FAKE_SET,
+	FAKE_COMMIT,
+	FAKE_ATTR_NUM,
+};
+
+static const char *fake_names[FAKE_ATTR_NUM] = {
+	[FAKE_TAP]	= "light_iopmp_tap",
+	[FAKE_START]	= "light_iopmp_start_addr",
+	[FAKE_END]	= "light_iopmp_end_addr",
+	[FAKE_ATTR]	= "light_iopmp_attr",
+	[FAKE_LOCK]	= "light_iopmp_lock",
+	[FAKE_SET]	= "light_iopmp_set",
+	[FAKE_COMMIT]	= "light_iopmp_commit",
+};
+
+struct fake_master {
+	long start, end, attr, lock;
+};
+
+struct fake_write {
+	enum fake_attr attr;
+	long value;
+};
+
+#define FAKE_MAX_FD	1024
+#define FAKE_MAX_LOG	4096
+
+static char fake_root[64];
+static enum fake_attr fake_fd[FAKE_MAX_FD];
+static long fake_reg[FAKE_ATTR_NUM];
+static struct fake_master fake_master[IOPMP_NUM];
+static struct fake_master fake_staged[IOPMP_NUM];
+static struct fake_write fake_log[FAKE_MAX_LOG];
+static int fake_log_len;
+static int fake_drop_set = -1;		/* master whose set is ignored */
+static enum fake_attr fake_short;	/* attribute storing one byte less */
+
+static int failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			printf("  FAIL %s:%d: %s\n", __FILE__, __LINE__, #cond); \
+			failures++;					\
+		}							\
+	} while (0)
+
+static void fake_write_attr(enum fake_attr attr, const char *buf, size_t len)
+{
+	char string[64];
+	long t = -1, s, e, a;
+
+	if (len >= sizeof(string))
+		len = sizeof(string) - 1;
+	memcpy(string, buf, len);
+	string[len] = '\0';
+
+	if (attr == FAKE_COMMIT) {
+		if (sscanf(string, "%ld %ld %ld %ld", &t, &s, &e, &a) == 4 &&
+		    t >= 0 && t < IOPMP_NUM) {
+			fake_master[t].start = s;
+			fake_master[t].end = e;
+			fake_master[t].attr = a;
+			fake_master[t].lock = 1;
+		}
+		fake_reg[FAKE_TAP] = t;
+	} else {
+		fake_reg[attr] = strtol(string, NULL, 0);
+	}
+
+	t = fake_reg[FAKE_TAP];
+	if (attr != FAKE_COMMIT && t >= 0 && t < IOPMP_NUM) {
+		if (attr == FAKE_START)
+			fake_staged[t].start = fake_reg[attr];
+		else if (attr == FAKE_END)
+			fake_staged[t].end = fake_reg[attr];
+		else if (attr == FAKE_ATTR)
+			fake_staged[t].attr = fake_reg[attr];
+		else if (attr == FAKE_LOCK)
+			fake_staged[t].lock = fake_reg[attr];
+		else if (attr == FAKE_SET && t != fake_drop_set)
+			fake_master[t] = fake_staged[t];
+	}
+
+	if (fake_log_len < FAKE_MAX_LOG) {
+		fake_log[fake_log_len].attr = attr;
+		fake_log[fake_log_len].value = attr == FAKE_COMMIT ? t : fake_reg[attr];
+		fake_log_len++;
+	}
+}
+
+static ssize_t fake_read_attr(enum fake_attr attr, char *buf, size_t len)
+{
+	struct fake_master *m;
+	char string[24];
+	long value;
+	int n;
+
+	if (attr == FAKE_TAP) {
+		value = fake_reg[FAKE_TAP];
+	} else {
+		if (fake_reg[FAKE_TAP] < 0 || fake_reg[FAKE_TAP] >= IOPMP_NUM) {
+			errno = EINVAL;
+			return -1;
+		}
+		m = &fake_master[fake_reg[FAKE_TAP]];
+		if (attr == FAKE_START)
+			value = m->start;
+		else if (attr == FAKE_END)
+			value = m->end;
+		else if (attr == FAKE_ATTR)
+			value = m->attr;
+		else {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	n = snprintf(string, sizeof(string), "%ld\n", value);
+	if (n > len)
+		n = len;
+	memcpy(buf, string, n);
+
+	return n;
+}
+
+int open(const char *path, int flags, ...)
+{
+	size_t root_len = strlen(fake_root);
+	mode_t mode = 0;
+	va_list ap;
+	int fd, i;
+
+	if (flags & O_CREAT) {
+		va_start(ap, flags);
+		mode = va_arg(ap, int);
+		va_end(ap);
+	}
+
+	fd = syscall(SYS_openat, AT_FDCWD, path, flags, mode);
+	if (fd < 0 || fd >= FAKE_MAX_FD || !root_len ||
+	    strncmp(path, fake_root, root_len) || path[root_len] != '/')
+		return fd;
+
+	for (i = FAKE_TAP; i < FAKE_ATTR_NUM; i++)
+		if (!strcmp(path + root_len + 1, fake_names[i]))
+			fake_fd[fd] = i;
+
+	return fd;
+}
+
+int close(int fd)
+{
+	if (fd >= 0 && fd < FAKE_MAX_FD)
+		fake_fd[fd] = FAKE_NONE;
+
+	return syscall(SYS_close, fd);
+}
+
+ssize_t write(int fd, const void *buf, size_t len)
+{
+	if (fd >= 0 && fd < FAKE_MAX_FD && fake_fd[fd]) {
+		if (fake_fd[fd] == fake_short)
+			return len - 1;
+		fake_write_attr(fake_fd[fd], buf, len);
+		return len;
+	}
+
+	return syscall(SYS_write, fd, buf, len);
+}
+
+ssize_t pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+	if (fd >= 0 && fd < FAKE_MAX_FD && fake_fd[fd]) {
+		if (fake_fd[fd] == fake_short)
+			return len - 1;
+		fake_write_attr(fake_fd[fd], buf, len);
+		return len;
+	}
+
+	return syscall(SYS_pwrite64, fd, buf, len, offset);
+}
+
+ssize_t pread(int fd, void *buf, size_t len, off_t offset)
+{
+	if (fd >= 0 && fd < FAKE_MAX_FD && fake_fd[fd])
+		return fake_read_attr(fake_fd[fd], buf, len);
+
+	return syscall(SYS_pread64, fd, buf, len, offset);
+}
+
+static void fake_reset(void)
+{
+	int i;
+
+	for (i = 0; i < FAKE_ATTR_NUM; i++)
+		fake_reg[i] = -1;
+	memset(fake_master, 0, sizeof(fake_master));
+	memset(fake_staged, 0, sizeof(fake_staged));
+	fake_log_len = 0;
+	fake_drop_set = -1;
+	fake_short = FAKE_NONE;
+}
+
+static int fake_count(enum fake_attr attr)
+{
+	int i, n = 0;
+
+	for (i = 0; i < fake_log_len; i++)
+		n += fake_log[i].attr == attr;
+
+	return n;
+}
+
+static void fake_touch(enum fake_attr attr)
+{
+	char path[128];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/%s", fake_root, fake_names[attr]);
+	fd = syscall(SYS_openat, AT_FDCWD, path, O_CREAT | O_WRONLY, 0644);
+	if (fd >= 0)
+		syscall(SYS_close, fd);
+}
+
+static void fake_lockfile_path(char *path, size_t len)
+{
+	snprintf(path, len, "%s/light-iopmp.lock", fake_root);
+}
+
+static int fake_lockfile_exists(void)
+{
+	char path[128];
+
+	fake_lockfile_path(path, sizeof(path));
+
+	return access(path, F_OK) == 0;
+}
+
+/* nobody holds the lockfile: a failed sequence must release it */
+static int fake_lockfile_free(void)
+{
+	char path[128];
+	int fd, ret;
+
+	fake_lockfile_path(path, sizeof(path));
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		return 0;
+
+	ret = flock(fd, LOCK_EX | LOCK_NB) == 0;
+	close(fd);
+
+	return ret;
+}
+
+static void fake_remove(void)
+{
+	char path[128];
+	int i;
+
+	for (i = FAKE_TAP; i < FAKE_ATTR_NUM; i++) {
+		snprintf(path, sizeof(path), "%s/%s", fake_root, fake_names[i]);
+		unlink(path);
+	}
+	fake_lockfile_path(path, sizeof(path));
+	unlink(path);
+	rmdir(fake_root);
+}
+
+/* recompute the crc32 of a blob patched by a test */
+static void put_crc(u_int8_t *blob, size_t len)
+{
+	u_int32_t crc = 0xffffffff;
+	size_t n;
+	int i;
+
+	for (n = 12; n < len; n++) {
+		crc ^= blob[n];
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+	}
+	crc = ~crc;
+
+	for (i = 0; i < 4; i++)
+		blob[8 + i] = crc >> (8 * i);
+}
+
+static void test_legacy_sequence(void)
+{
+	static const struct fake_write expect[] = {
+		{ FAKE_TAP, IOPMP_EMMC },
+		{ FAKE_START, 0x1 },
+		{ FAKE_END, 0x5 },
+		{ FAKE_ATTR, CSI_ATTR_R | CSI_ATTR_W },
+		{ FAKE_LOCK, 1 },
+		{ FAKE_SET, 1 },
+	};
+	int i;
+
+	printf("legacy sequence\n");
+	fake_reset();
+
+	CHECK(csi_iopmp_set_attr(IOPMP_EMMC, (u_int8_t *)0x1000, (u_int8_t *)0x5000,
+				 CSI_ATTR_R | CSI_ATTR_W) == 0);
+	CHECK(fake_log_len == 6);
+	for (i = 0; i < 6 && i < fake_log_len; i++) {
+		CHECK(fake_log[i].attr == expect[i].attr);
+		CHECK(fake_log[i].value == expect[i].value);
+	}
+	CHECK(fake_master[IOPMP_EMMC].start == 0x1);
+	CHECK(fake_master[IOPMP_EMMC].end == 0x5);
+	/* the lockfile follows the sysfs root, nothing lands in /var/lock */
+	CHECK(fake_lockfile_exists());
+}
+
+static void test_legacy_errors(void)
+{
+	char path[128], lockfile[128];
+	csi_iopmp_ctx_t ctx;
+
+	printf("legacy errors\n");
+	fake_reset();
+
+	/* an attribute missing halfway: the error comes back, the lock is released */
+	snprintf(path, sizeof(path), "%s/%s", fake_root, fake_names[FAKE_LOCK]);
+	unlink(path);
+	CHECK(csi_iopmp_set_attr(IOPMP_SDIO0, (u_int8_t *)0x1000, (u_int8_t *)0x5000,
+				 CSI_ATTR_R) == -ENOENT);
+	CHECK(fake_log_len == 4);
+	CHECK(fake_count(FAKE_SET) == 0);
+	CHECK(fake_lockfile_free());
+	fake_touch(FAKE_LOCK);
+
+	/* a short store is an error too */
+	fake_reset();
+	fake_short = FAKE_END;
+	CHECK(csi_iopmp_set_attr(IOPMP_SDIO0, (u_int8_t *)0x1000, (u_int8_t *)0x5000,
+				 CSI_ATTR_R) == -EIO);
+	CHECK(fake_log_len == 2);
+	CHECK(fake_lockfile_free());
+
+	/* no lockfile, no unserialized sequence */
+	fake_reset();
+	fake_lockfile_path(lockfile, sizeof(lockfile));
+	unlink(lockfile);
+	mkdir(lockfile, 0755);
+	CHECK(csi_iopmp_set_attr(IOPMP_SDIO0, (u_int8_t *)0x1000, (u_int8_t *)0x5000,
+				 CSI_ATTR_R) == -EISDIR);
+	CHECK(fake_log_len == 0);
+	CHECK(csi_iopmp_init(&ctx) == -EISDIR);
+	CHECK(ctx.commit_fd < 0 && ctx.lockfile_fd < 0);
+	rmdir(lockfile);
+}
+
+static void test_ctx_sequence(void)
+{
+	csi_iopmp_ctx_t ctx;
+
+	printf("context sequence\n");
+	fake_reset();
+
+	CHECK(csi_iopmp_init(&ctx) == 0);
+	CHECK(ctx.commit_fd < 0);
+	CHECK(csi_iopmp_ctx_set_attr(&ctx, IOPMP_USB0, (u_int8_t *)0x2000,
+				     (u_int8_t *)0x3000, CSI_ATTR_R) == 0);
+	/* same window again: nothing may be elided between two calls */
+	CHECK(csi_iopmp_ctx_set_attr(&ctx, IOPMP_USB0, (u_int8_t *)0x2000,
+				     (u_int8_t *)0x3000, CSI_ATTR_R) == 0);
+	CHECK(fake_log_len == 12);
+	CHECK(fake_count(FAKE_SET) == 2);
+	CHECK(fake_master[IOPMP_USB0].start == 0x2);
+	CHECK(fake_master[IOPMP_USB0].attr == CSI_ATTR_R);
+	CHECK(csi_iopmp_ctx_set_attr(&ctx, IOPMP_NUM, NULL, NULL, CSI_ATTR_R) == -EINVAL);
+	csi_iopmp_uninit(&ctx);
+}
+
+static void test_snapshot_replay(void)
+{
+	u_int8_t blob[CSI_IOPMP_SNAPSHOT_MAX_SIZE];
+	size_t len = sizeof(blob);
+	csi_iopmp_ctx_t ctx;
+	int type;
+
+	printf("snapshot replay\n");
+	fake_reset();
+
+	CHECK(csi_iopmp_init(&ctx) == 0);
+	for (type = 0; type < IOPMP_NUM; type++)
+		CHECK(csi_iopmp_ctx_set_attr(&ctx, type, (u_int8_t *)0x0,
+					     (u_int8_t *)(type == IOPMP_GPU ? 0x100000000 : 0x200000000),
+					     CSI_ATTR_R | CSI_ATTR_W) == 0);
+
+	CHECK(csi_iopmp_snapshot_export(blob, &len) == 0);
+	CHECK(len == CSI_IOPMP_SNAPSHOT_MAX_SIZE);
+
+	/* low power resume: the hardware forgot everything */
+	fake_reset();
+	CHECK(csi_iopmp_snapshot_replay(&ctx, blob, len) == 0);
+	CHECK(fake_master[IOPMP_GPU].end == 0x100000);
+	CHECK(fake_master[IOPMP_DSP1].end == 0x200000);
+	CHECK(fake_count(FAKE_SET) == IOPMP_NUM);
+	/* staged per master: equal windows are written again for each one */
+	CHECK(fake_count(FAKE_START) == IOPMP_NUM);
+	CHECK(fake_count(FAKE_END) == IOPMP_NUM);
+	CHECK(fake_count(FAKE_ATTR) == IOPMP_NUM);
+	/* and the read back taps each master once more */
+	CHECK(fake_count(FAKE_TAP) == 2 * IOPMP_NUM);
+
+	fake_reset();
+	fake_drop_set = IOPMP_VENC;
+	CHECK(csi_iopmp_snapshot_replay(&ctx, blob, len) == -EIO);
+
+	fake_reset();
+	blob[len - 1] ^= 0xff;
+	CHECK(csi_iopmp_snapshot_replay(&ctx, blob, len) == -EBADMSG);
+	CHECK(fake_log_len == 0);
+	CHECK(csi_iopmp_snapshot_replay(&ctx, blob, 4) == -EBADMSG);
+
+	len = 8;
+	CHECK(csi_iopmp_snapshot_export(blob, &len) == -ENOSPC);
+	csi_iopmp_uninit(&ctx);
+}
+
+static void test_snapshot_export(void)
+{
+	u_int8_t blob[CSI_IOPMP_SNAPSHOT_MAX_SIZE];
+	size_t len = sizeof(blob);
+	csi_iopmp_ctx_t ctx;
+
+	printf("snapshot export\n");
+	fake_reset();
+
+	CHECK(csi_iopmp_init(&ctx) == 0);
+	CHECK(csi_iopmp_ctx_set_attr(&ctx, IOPMP_EMMC, (u_int8_t *)0x1000,
+				     (u_int8_t *)0x5000, CSI_ATTR_R) == 0);
+	CHECK(csi_iopmp_ctx_set_attr(&ctx, IOPMP_USB0, (u_int8_t *)0x1000,
+				     (u_int8_t *)0x5000, CSI_ATTR_R) == 0);
+
+	/* another process programs one master, a reset clears another */
+	fake_master[IOPMP_NPU].start = 0x10;
+	fake_master[IOPMP_NPU].end = 0x20;
+	fake_master[IOPMP_NPU].attr = CSI_ATTR_W;
+	memset(&fake_master[IOPMP_USB0], 0, sizeof(fake_master[IOPMP_USB0]));
+
+	/* one tap per master, nothing programmed */
+	fake_log_len = 0;
+	CHECK(csi_iopmp_snapshot_export(blob, &len) == 0);
+	CHECK(len == 12 + 2 * 12);
+	CHECK(fake_count(FAKE_TAP) == IOPMP_NUM);
+	CHECK(fake_log_len == IOPMP_NUM);
+
+	/* masters programmed since the export are cleared by the replay */
+	fake_reset();
+	fake_master[IOPMP_AUD].start = 0x30;
+	fake_master[IOPMP_AUD].end = 0x40;
+	fake_master[IOPMP_AUD].attr = CSI_ATTR_R;
+	CHECK(csi_iopmp_snapshot_replay(&ctx, blob, len) == 0);
+	CHECK(fake_master[IOPMP_EMMC].end == 0x5);
+	CHECK(fake_master[IOPMP_NPU].start == 0x10);
+	CHECK(fake_master[IOPMP_NPU].attr == CSI_ATTR_W);
+	CHECK(fake_master[IOPMP_USB0].end == 0);
+	CHECK(fake_master[IOPMP_AUD].start == 0);
+	CHECK(fake_master[IOPMP_AUD].end == 0);
+	CHECK(fake_master[IOPMP_AUD].attr == 0);
+	CHECK(fake_count(FAKE_SET) == IOPMP_NUM);
+
+	/* the same master twice is not a snapshot */
+	memcpy(blob + 24, blob + 12, 12);
+	put_crc(blob, len);
+	CHECK(csi_iopmp_snapshot_replay(&ctx, blob, len) == -EBADMSG);
+	csi_iopmp_uninit(&ctx);
+}
+
+static void test_commit(void)
+{
+	csi_iopmp_ctx_t ctx;
+
+	printf("commit attribute\n");
+	fake_touch(FAKE_COMMIT);
+	fake_reset();
+
+	CHECK(csi_iopmp_init(&ctx) == 0);
+	CHECK(ctx.commit_fd >= 0);
+	CHECK(csi_iopmp_ctx_set_attr(&ctx, IOPMP_NPU, (u_int8_t *)0x4000,
+				     (u_int8_t *)0x8000, CSI_ATTR_W) == 0);
+	CHECK(fake_log_len == 1);
+	CHECK(fake_log[0].attr == FAKE_COMMIT);
+	CHECK(fake_master[IOPMP_NPU].start == 0x4);
+	CHECK(fake_master[IOPMP_NPU].end == 0x8);
+	CHECK(fake_master[IOPMP_NPU].attr == CSI_ATTR_W);
+	csi_iopmp_uninit(&ctx);
+
+	fake_reset();
+	CHECK(csi_iopmp_set_attr(IOPMP_VDEC, (u_int8_t *)0x4000, (u_int8_t *)0x8000,
+				 CSI_ATTR_R) == 0);
+	CHECK(fake_log_len == 1);
+	CHECK(fake_master[IOPMP_VDEC].attr == CSI_ATTR_R);
+}
+
+int main(int argc, char *argv[])
+{
+	int i;
+
+	strcpy(fake_root, "/tmp/iopmp-sysfs-XXXXXX");
+	if (!mkdtemp(fake_root)) {
+		perror("mkdtemp");
+		exit(1);
+	}
+	for (i = FAKE_TAP; i < FAKE_COMMIT; i++)
+		fake_touch(i);
+
+	csi_iopmp_set_sysfs_root(fake_root);
+
+	test_legacy_sequence();
+	test_legacy_errors();
+	test_ctx_sequence();
+	test_snapshot_replay();
+	test_snapshot_export();
+	test_commit();
+
+	fake_remove();
+
+	printf("%s\n", failures ? "FAILED" : "PASSED");
+
+	return failures ? 1 : 0;
+}